@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class BufferPool;
+
+// A heap block with an intrusive reference count. The header sits directly in
+// front of the data so a buffer is a single allocation.
+class Buffer {
+public:
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+    const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+    size_t capacity() const { return capacity_; }
+    uint32_t use_count() const { return refs_.load(std::memory_order_acquire); }
+
+private:
+    friend class BufferPool;
+    friend class BufferRef;
+
+    std::atomic<uint32_t> refs_{0};
+    uint32_t capacity_ = 0;
+    int size_class_ = -1;   // -1: oversized, freed instead of recycled
+    BufferPool* pool_ = nullptr;
+};
+
+// Shared handle to a Buffer. Copying bumps the count; when the last handle
+// goes away the buffer returns to its pool.
+class BufferRef {
+public:
+    BufferRef() = default;
+    BufferRef(const BufferRef& other) : buf_(other.buf_) { retain(); }
+    BufferRef(BufferRef&& other) noexcept : buf_(std::exchange(other.buf_, nullptr)) {}
+    ~BufferRef() { release(); }
+
+    BufferRef& operator=(BufferRef other) noexcept {
+        std::swap(buf_, other.buf_);
+        return *this;
+    }
+
+    Buffer* get() const { return buf_; }
+    Buffer* operator->() const { return buf_; }
+    explicit operator bool() const { return buf_ != nullptr; }
+
+private:
+    friend class BufferPool;
+    explicit BufferRef(Buffer* buf) : buf_(buf) { retain(); }
+
+    Buffer* buf_ = nullptr;
+
+    void retain() {
+        if (buf_) buf_->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    inline void release();
+};
+
+// A byte range inside a shared buffer. Cheap to copy; keeps the whole buffer alive.
+struct BufferSlice {
+    BufferRef buffer;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+
+    const char* data() const { return buffer->data() + offset; }
+    size_t size() const { return length; }
+    std::string_view view() const { return {data(), length}; }
+};
+
+// Recycles buffers through power-of-four size classes. Free lists are guarded
+// by a mutex per class and capped so an idle pool does not pin unbounded memory.
+// The pool must outlive every BufferRef it hands out.
+class BufferPool {
+public:
+    static constexpr size_t MIN_CLASS = 512;
+    static constexpr int NUM_CLASSES = 9;            // 512 B .. 32 MiB
+    static constexpr size_t MAX_CACHED_BYTES = 4 * 1024 * 1024;
+
+    BufferPool() = default;
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool() {
+        for (auto& cls : classes_) {
+            for (Buffer* buf : cls.free) destroy(buf);
+        }
+    }
+
+    BufferRef acquire(size_t min_capacity) {
+        int cls = class_for(min_capacity);
+        if (cls < 0) {
+            return BufferRef(create(min_capacity, -1));
+        }
+
+        auto& free_list = classes_[cls];
+        {
+            std::lock_guard<std::mutex> lock(free_list.mutex);
+            if (!free_list.free.empty()) {
+                Buffer* buf = free_list.free.back();
+                free_list.free.pop_back();
+                return BufferRef(buf);
+            }
+        }
+        return BufferRef(create(class_size(cls), cls));
+    }
+
+    // Copies `bytes` into a pooled buffer; for messages that originate locally.
+    BufferSlice copy(std::string_view bytes) {
+        BufferSlice slice{acquire(bytes.size()), 0, static_cast<uint32_t>(bytes.size())};
+        std::memcpy(slice.buffer->data(), bytes.data(), bytes.size());
+        return slice;
+    }
+
+private:
+    friend class BufferRef;
+
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<Buffer*> free;
+    };
+    std::array<SizeClass, NUM_CLASSES> classes_;
+
+    static size_t class_size(int cls) {
+        return MIN_CLASS << (2 * cls);
+    }
+
+    static int class_for(size_t size) {
+        for (int cls = 0; cls < NUM_CLASSES; ++cls) {
+            if (size <= class_size(cls)) return cls;
+        }
+        return -1;
+    }
+
+    Buffer* create(size_t capacity, int cls) {
+        void* mem = ::operator new(sizeof(Buffer) + capacity);
+        auto* buf = new (mem) Buffer();
+        buf->capacity_ = static_cast<uint32_t>(capacity);
+        buf->size_class_ = cls;
+        buf->pool_ = this;
+        return buf;
+    }
+
+    static void destroy(Buffer* buf) {
+        buf->~Buffer();
+        ::operator delete(buf);
+    }
+
+    void recycle(Buffer* buf) {
+        if (buf->size_class_ >= 0) {
+            auto& free_list = classes_[buf->size_class_];
+            size_t limit = std::max<size_t>(4, MAX_CACHED_BYTES / buf->capacity_);
+            std::lock_guard<std::mutex> lock(free_list.mutex);
+            if (free_list.free.size() < limit) {
+                free_list.free.push_back(buf);
+                return;
+            }
+        }
+        destroy(buf);
+    }
+};
+
+inline void BufferRef::release() {
+    if (buf_ && buf_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        buf_->pool_->recycle(buf_);
+    }
+    buf_ = nullptr;
+}
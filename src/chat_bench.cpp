@@ -0,0 +1,594 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <optional>
+#include <random>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "event_loop.hpp"
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "secure_link.hpp"
+
+// Load generator for relay_server and p2p_chat. Opens many simulated clients
+// against one or more endpoints, has some of them publish chat frames at a
+// fixed aggregate rate and measures delivery to everyone else. The load is
+// open-loop: sends follow the schedule whether or not earlier messages have
+// arrived, and each chat text starts with the time it was scheduled to be
+// sent, so latency includes any backlog (no coordinated omission). To find
+// peak throughput, raise --rate until latency or `skipped` climbs.
+// Endpoints must be on the same host: timestamps are CLOCK_MONOTONIC.
+// Links are keyed as p2p_chat keys them, so the cost of encryption is part
+// of what is measured; with --secret, chat through relays is sealed end to
+// end as well.
+
+struct Endpoint {
+    std::string host;
+    int port;
+};
+
+struct BenchConfig {
+    std::vector<Endpoint> endpoints;
+    size_t clients = 100;
+    size_t senders = 10;           // 0: every client sends
+    double rate = 1000;            // messages per second across all senders
+    size_t message_bytes = 128;    // chat text bytes, at least the timestamp header
+    std::chrono::seconds warmup{1};
+    std::chrono::seconds duration{10};
+    std::chrono::seconds drain{2};
+    size_t threads = 1;
+    std::string room;              // publish RoomChat to this room instead of Chat
+    std::string secret;            // the nodes' --secret, if they were given one
+    std::string json_path = "-";
+};
+
+class ChatBench {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::string_view NAME = "bench";
+    static constexpr size_t STAMP_BYTES = 24;   // scheduled send time and sequence, in hex
+    static constexpr size_t MAX_PENDING = 256 * 1024;   // per-client unsent bytes before a sender skips its turn
+    static constexpr auto TICK = std::chrono::milliseconds(1);
+
+    struct Client {
+        int fd = -1;
+        uint64_t id = 0;
+        bool sender = false;
+        bool closed = false;
+        uint64_t seq = 0;
+        protocol::FrameDecoder decoder;
+        std::optional<secure_link::Sealer> sealer;   // set on links to p2p_chat nodes
+        std::optional<secure_link::Opener> opener;
+        protocol::FrameDecoder records;              // frames opened from the link's records
+        std::string out;
+        size_t out_offset = 0;
+    };
+
+    // One event loop and its share of the clients. Counters are only touched
+    // by the worker's own thread and read after it has been joined.
+    struct Worker {
+        EventLoop loop;
+        std::vector<std::unique_ptr<Client>> clients;
+        std::vector<Client*> senders;
+        size_t next_sender = 0;
+        double rate = 0;               // this worker's share of the aggregate rate
+        uint64_t scheduled = 0;        // messages due so far, for the fixed-rate schedule
+        uint64_t sent = 0;             // measured window only, likewise below
+        uint64_t sent_bytes = 0;
+        uint64_t received = 0;
+        uint64_t received_bytes = 0;
+        uint64_t skipped = 0;          // sends skipped because the sender's socket was backed up
+        uint64_t disconnects = 0;
+        metrics::Histogram latency;    // nanoseconds
+        BufferPool pool;
+        std::vector<char> record;      // scratch for sealing
+        std::thread thread;
+    };
+
+    BenchConfig config_;
+    secure_link::Secret secret_;
+    std::optional<secure_link::GroupCipher> group_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    Clock::time_point start_;
+    Clock::time_point measure_from_;
+    Clock::time_point measure_until_;
+    Clock::time_point stop_at_;
+
+    static int64_t to_ns(Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    bool measured(Clock::time_point t) const {
+        return t >= measure_from_ && t < measure_until_;
+    }
+
+    static int connect_to(const Endpoint& endpoint) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(endpoint.host.c_str(), std::to_string(endpoint.port).c_str(), &hints, &found) != 0) {
+            throw std::runtime_error("Cannot resolve " + endpoint.host);
+        }
+        int fd = -1;
+        for (addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to connect to " + endpoint.host + ":" + std::to_string(endpoint.port) +
+                                     ": " + strerror(errno) + " (raise ulimit -n for many clients)");
+        }
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        return fd;
+    }
+
+    // Blocking until the frame is fully written; only used during setup.
+    static void send_all(int fd, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::runtime_error(std::string("Setup write failed: ") + strerror(errno));
+            data.remove_prefix(static_cast<size_t>(n));
+        }
+    }
+
+    // Keys the link as p2p_chat does, blocking; only used during setup. A
+    // relay answers with an empty key exchange and is then spoken to in the
+    // clear.
+    void handshake(Client& client) {
+        auto pair = secure_link::KeyPair::generate();
+        send_all(client.fd, secure_link::encode_key_exchange(client.id, pair.public_key));
+        timeval timeout{5, 0};
+        setsockopt(client.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        while (true) {
+            auto frame = client.decoder.next();
+            if (!frame) throw std::runtime_error("Setup read failed: " + frame.error());
+            if (!*frame) {
+                auto space = client.decoder.prepare();
+                ssize_t n = recv(client.fd, space.data(), space.size(), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error("No key exchange from the endpoint");
+                client.decoder.commit(static_cast<size_t>(n));
+                continue;
+            }
+            if ((*frame)->header.type != protocol::FrameType::KeyExchange) continue;
+            if ((*frame)->payload.empty()) return;
+            auto keys = secure_link::agree(pair, (*frame)->payload, secret_);
+            if (!keys) throw std::runtime_error("Unusable key exchange from the endpoint");
+            client.sealer.emplace(keys->send);
+            client.opener.emplace(keys->receive);
+            return;
+        }
+    }
+
+    // `frame` as it goes on the wire: sealed into a record on an encrypted
+    // link, sealed end to end for a relay if there is a secret.
+    void append_frame(Worker& worker, Client& client, std::string_view frame) {
+        if (!client.sealer) {
+            if (group_ && frame.size() >= protocol::HEADER_SIZE &&
+                protocol::read_header(frame.data()).type != protocol::FrameType::Join) {
+                if (auto sealed = group_->seal(client.id, config_.room, frame, worker.pool)) client.out += sealed->view();
+            } else {
+                client.out += frame;
+            }
+            return;
+        }
+        while (!frame.empty()) {
+            iovec piece{const_cast<char*>(frame.data()), frame.size()};
+            frame.remove_prefix(client.sealer->seal({&piece, 1}, worker.record));
+            client.out.append(worker.record.data(), worker.record.size());
+        }
+    }
+
+    // Chat must be UTF-8 to get through, so the header is written as hex
+    // digits: 16 for the send time and 8 for the low bits of the sequence.
+    static void put_hex(char* out, uint64_t value, int digits) {
+        for (int i = digits - 1; i >= 0; --i, value >>= 4) out[i] = "0123456789abcdef"[value & 0xf];
+    }
+    
+    static std::optional<uint64_t> get_hex(std::string_view text) {
+        uint64_t value = 0;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+        if (error != std::errc() || end != text.data() + text.size()) return std::nullopt;
+        return value;
+    }
+    
+    std::string make_frame(Client& client, Clock::time_point stamp) {
+        std::string text(std::max(config_.message_bytes, STAMP_BYTES), 'x');
+        put_hex(text.data(), static_cast<uint64_t>(to_ns(stamp)), 16);
+        put_hex(text.data() + 16, client.seq++, 8);
+        return config_.room.empty() ? protocol::encode_chat(client.id, NAME, text)
+                                    : protocol::encode_room_chat(client.id, config_.room, NAME, text);
+    }
+
+    // Runs every tick on each worker: sends whatever the fixed-rate schedule
+    // says is due, round-robin over this worker's senders.
+    void publish(Worker& worker) {
+        auto now = Clock::now();
+        if (now >= measure_until_ || worker.senders.empty()) return;
+
+        double elapsed = std::chrono::duration<double>(now - start_).count();
+        auto due = static_cast<uint64_t>(elapsed * worker.rate);
+        for (; worker.scheduled < due; ++worker.scheduled) {
+            auto stamp = start_ + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(worker.scheduled) / worker.rate));
+            Client& client = *worker.senders[worker.next_sender++ % worker.senders.size()];
+            if (client.closed || client.out.size() - client.out_offset >= MAX_PENDING) {
+                if (measured(stamp)) ++worker.skipped;
+                continue;
+            }
+            enqueue(worker, client, stamp, make_frame(client, stamp));
+        }
+    }
+
+    void enqueue(Worker& worker, Client& client, Clock::time_point stamp, std::string_view frame) {
+        size_t before = client.out.size();
+        append_frame(worker, client, frame);
+        if (measured(stamp)) {
+            ++worker.sent;
+            worker.sent_bytes += client.out.size() - before;
+        }
+        flush(worker, client);
+    }
+
+    void flush(Worker& worker, Client& client) {
+        while (!client.closed && client.out_offset < client.out.size()) {
+            ssize_t n = send(client.fd, client.out.data() + client.out_offset,
+                             client.out.size() - client.out_offset, MSG_NOSIGNAL);
+            if (n > 0) {
+                client.out_offset += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            drop(worker, client);
+            return;
+        }
+        client.out.clear();
+        client.out_offset = 0;
+    }
+
+    void receive(Worker& worker, Client& client) {
+        while (!client.closed) {
+            auto space = client.decoder.prepare();
+            ssize_t n = recv(client.fd, space.data(), space.size(), 0);
+            if (n > 0) {
+                client.decoder.commit(static_cast<size_t>(n));
+                if (!consume(worker, client)) {
+                    drop(worker, client);
+                    return;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            drop(worker, client);
+            return;
+        }
+    }
+
+    bool consume(Worker& worker, Client& client) {
+        auto now = Clock::now();
+        while (true) {
+            auto frame = client.decoder.next();
+            if (!frame) {
+                std::cerr << "Protocol error on client " << client.id << ": " << frame.error() << "\n";
+                return false;
+            }
+            if (!*frame) return true;
+            if (!client.opener) {
+                count(worker, **frame, (*frame)->raw.size(), now);
+                continue;
+            }
+            if (!client.opener->open(**frame, client.records)) {
+                std::cerr << "Cannot decrypt data on client " << client.id << "; is --secret right?\n";
+                return false;
+            }
+            while (true) {
+                auto inner = client.records.next();
+                if (!inner) {
+                    std::cerr << "Protocol error on client " << client.id << ": " << inner.error() << "\n";
+                    return false;
+                }
+                if (!*inner) break;
+                count(worker, **inner, (*inner)->raw.size() + secure_link::RECORD_OVERHEAD, now);
+            }
+        }
+    }
+
+    // Records the latency of a bench message sent in the measured window.
+    void count(Worker& worker, const protocol::FrameView& frame, size_t wire_bytes, Clock::time_point now) {
+        if (frame.header.flags & protocol::FrameFlags::Replayed) return;
+        if (frame.header.type == protocol::FrameType::Sealed) {
+            if (!group_) return;
+            // Every client here gets the same frame, so copies are expected.
+            if (auto opened = group_->open(frame, worker.pool, secure_link::GroupCipher::Copies::Allow)) {
+                count(worker, protocol::FrameView{protocol::read_header(opened->data()),
+                                                  opened->view().substr(protocol::HEADER_SIZE), opened->view()},
+                      wire_bytes, now);
+            }
+            return;
+        }
+
+        std::optional<protocol::ChatMessage> chat;
+        auto body = protocol::body_of(frame.header, frame.payload);
+        if (frame.header.type == protocol::FrameType::Chat) {
+            chat = protocol::decode_chat(body);
+        } else if (frame.header.type == protocol::FrameType::RoomChat) {
+            if (auto message = protocol::decode_room_chat(body)) chat = message->chat;
+        }
+        if (!chat || chat->name != NAME || chat->text.size() < STAMP_BYTES) return;
+
+        auto sent = get_hex(chat->text.substr(0, 16));
+        if (!sent) return;
+        Clock::time_point stamp{std::chrono::nanoseconds(*sent)};
+        if (!measured(stamp)) return;
+        ++worker.received;
+        worker.received_bytes += wire_bytes;
+        worker.latency.record(static_cast<uint64_t>(std::max<int64_t>(to_ns(now) - to_ns(stamp), 0)));
+    }
+
+    void drop(Worker& worker, Client& client) {
+        if (client.closed) return;
+        client.closed = true;
+        worker.loop.remove(client.fd);
+        close(client.fd);
+        client.fd = -1;
+        if (Clock::now() < stop_at_) ++worker.disconnects;
+    }
+
+    void run_worker(Worker& worker) {
+        for (auto& client_ptr : worker.clients) {
+            Client* client = client_ptr.get();
+            worker.loop.add(client->fd, EventLoop::READABLE | EventLoop::WRITABLE, [this, &worker, client](uint32_t events) {
+                if (events & EventLoop::WRITABLE) flush(worker, *client);
+                if (events & (EventLoop::READABLE | EventLoop::CLOSED)) receive(worker, *client);
+            });
+        }
+        worker.loop.run_every(TICK, [this, &worker] {
+            if (Clock::now() >= stop_at_) {
+                worker.loop.stop();
+                return;
+            }
+            publish(worker);
+        });
+        worker.loop.run();
+    }
+
+    void write_report(std::ostream& out) const {
+        uint64_t sent = 0, sent_bytes = 0, received = 0, received_bytes = 0, skipped = 0, disconnects = 0;
+        metrics::Histogram::Snapshot latency;
+        for (auto& worker : workers_) {
+            sent += worker->sent;
+            sent_bytes += worker->sent_bytes;
+            received += worker->received;
+            received_bytes += worker->received_bytes;
+            skipped += worker->skipped;
+            disconnects += worker->disconnects;
+            latency.merge(worker->latency);
+        }
+
+        double seconds = std::chrono::duration<double>(config_.duration).count();
+        auto us = [&latency](double q) { return static_cast<double>(latency.quantile(q)) / 1000.0; };
+        double mean_us = latency.count > 0 ? static_cast<double>(latency.sum) / static_cast<double>(latency.count) / 1000.0 : 0.0;
+
+        std::ostringstream endpoints;
+        for (size_t i = 0; i < config_.endpoints.size(); ++i) {
+            endpoints << (i ? ", " : "") << '"' << config_.endpoints[i].host << ':' << config_.endpoints[i].port << '"';
+        }
+
+        out << "{\n"
+            << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+            << "  \"endpoints\": [" << endpoints.str() << "],\n"
+            << "  \"clients\": " << config_.clients << ",\n"
+            << "  \"senders\": " << config_.senders << ",\n"
+            << "  \"threads\": " << config_.threads << ",\n"
+            << "  \"room\": \"" << config_.room << "\",\n"
+            << "  \"message_bytes\": " << std::max(config_.message_bytes, STAMP_BYTES) << ",\n"
+            << "  \"target_rate\": " << config_.rate << ",\n"
+            << "  \"duration_s\": " << seconds << ",\n"
+            << "  \"sent\": " << sent << ",\n"
+            << "  \"received\": " << received << ",\n"
+            << "  \"skipped\": " << skipped << ",\n"
+            << "  \"disconnects\": " << disconnects << ",\n"
+            << "  \"sent_msgs_per_sec\": " << static_cast<double>(sent) / seconds << ",\n"
+            << "  \"sent_bytes_per_sec\": " << static_cast<double>(sent_bytes) / seconds << ",\n"
+            << "  \"received_msgs_per_sec\": " << static_cast<double>(received) / seconds << ",\n"
+            << "  \"received_bytes_per_sec\": " << static_cast<double>(received_bytes) / seconds << ",\n"
+            << "  \"fanout\": " << (sent > 0 ? static_cast<double>(received) / static_cast<double>(sent) : 0.0) << ",\n"
+            << "  \"latency_us\": {\"p50\": " << us(0.5) << ", \"p90\": " << us(0.9) << ", \"p99\": " << us(0.99)
+            << ", \"p999\": " << us(0.999) << ", \"max\": " << static_cast<double>(latency.max) / 1000.0
+            << ", \"mean\": " << mean_us << "}\n"
+            << "}\n";
+
+        std::cerr << "sent " << sent << " (" << static_cast<uint64_t>(sent / seconds) << " msg/s), received "
+                  << received << " (" << static_cast<uint64_t>(received / seconds) << " msg/s, "
+                  << static_cast<uint64_t>(received_bytes / seconds / 1024) << " KiB/s), latency p50 " << us(0.5)
+                  << "us p99 " << us(0.99) << "us p999 " << us(0.999) << "us\n";
+    }
+
+public:
+    explicit ChatBench(const BenchConfig& config) : config_(config) {
+        if (config_.endpoints.empty()) config_.endpoints.push_back({"127.0.0.1", 8888});
+        if (config_.senders == 0 || config_.senders > config_.clients) config_.senders = config_.clients;
+        config_.threads = std::clamp<size_t>(config_.threads, 1, std::max<size_t>(config_.clients, 1));
+
+        for (size_t i = 0; i < config_.threads; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+
+        secret_ = secure_link::derive_secret(config_.secret);
+        if (secret_.group) group_.emplace(*secret_.group);
+
+        // Clients are spread over the endpoints and the workers round-robin;
+        // senders are spread the same way. Ids start at a random point, as
+        // they are part of the nonce for end-to-end sealing.
+        std::string join = config_.room.empty() ? std::string() : protocol::encode_join(0, config_.room);
+        uint64_t first_id = std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32);
+        for (size_t i = 0; i < config_.clients; ++i) {
+            auto client = std::make_unique<Client>();
+            client->id = first_id + i;
+            client->sender = i < config_.senders;
+            client->fd = connect_to(config_.endpoints[i % config_.endpoints.size()]);
+            handshake(*client);
+
+            Worker& worker = *workers_[i % workers_.size()];
+            if (!join.empty()) {
+                append_frame(worker, *client, join);
+                send_all(client->fd, client->out);
+                client->out.clear();
+            }
+            EventLoop::set_nonblocking(client->fd);
+
+            if (client->sender) worker.senders.push_back(client.get());
+            worker.clients.push_back(std::move(client));
+        }
+        for (auto& worker : workers_) {
+            worker->rate = config_.rate * static_cast<double>(worker->senders.size()) / static_cast<double>(config_.senders);
+        }
+        std::cerr << "Connected " << config_.clients << " client(s) to " << config_.endpoints.size()
+                  << " endpoint(s); " << config_.senders << " sending\n";
+    }
+
+    ~ChatBench() {
+        for (auto& worker : workers_) {
+            for (auto& client : worker->clients) {
+                if (client->fd >= 0) close(client->fd);
+            }
+        }
+    }
+
+    // Blocks for warmup + duration + drain, then writes the JSON report.
+    void run() {
+        start_ = Clock::now();
+        measure_from_ = start_ + config_.warmup;
+        measure_until_ = measure_from_ + config_.duration;
+        stop_at_ = measure_until_ + config_.drain;
+
+        for (auto& worker : workers_) {
+            worker->thread = std::thread([this, w = worker.get()] { run_worker(*w); });
+        }
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+
+        if (config_.json_path == "-") {
+            write_report(std::cout);
+        } else {
+            std::ofstream file(config_.json_path);
+            if (!file) throw std::runtime_error("Cannot write " + config_.json_path);
+            write_report(file);
+        }
+    }
+};
+
+static Endpoint parse_endpoint(std::string_view text) {
+    auto colon = text.rfind(':');
+    if (colon == std::string_view::npos) return {"127.0.0.1", std::stoi(std::string(text))};
+    return {std::string(text.substr(0, colon)), std::stoi(std::string(text.substr(colon + 1)))};
+}
+
+static void show_usage() {
+    std::cerr << "Usage: chat_bench [options]\n"
+                 "  --connect HOST:PORT[,HOST:PORT...]  relay or p2p_chat endpoints (default 127.0.0.1:8888)\n"
+                 "  --clients N        simulated clients (default 100)\n"
+                 "  --senders N        clients that publish; 0 means all (default 10)\n"
+                 "  --rate N           messages/sec across all senders (default 1000)\n"
+                 "  --size BYTES       chat text size, at least 24 (default 128)\n"
+                 "  --room NAME        join NAME and publish room messages\n"
+                 "  --secret TEXT      the nodes' --secret, to seal chat through relays\n"
+                 "  --warmup S         unmeasured lead-in (default 1)\n"
+                 "  --duration S       measured window (default 10)\n"
+                 "  --drain S          time to collect late deliveries (default 2)\n"
+                 "  --threads N        event loops driving the clients (default 1)\n"
+                 "  --json PATH        report file, - for stdout (default -)\n";
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--connect" && has_value) {
+                std::string_view list = argv[++i];
+                while (!list.empty()) {
+                    auto comma = list.find(',');
+                    config.endpoints.push_back(parse_endpoint(list.substr(0, comma)));
+                    list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+                }
+            } else if (arg == "--clients" && has_value) {
+                config.clients = std::stoul(argv[++i]);
+            } else if (arg == "--senders" && has_value) {
+                config.senders = std::stoul(argv[++i]);
+            } else if (arg == "--rate" && has_value) {
+                config.rate = std::stod(argv[++i]);
+            } else if (arg == "--size" && has_value) {
+                config.message_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--room" && has_value) {
+                config.room = argv[++i];
+            } else if (arg == "--secret" && has_value) {
+                config.secret = argv[++i];
+            } else if (arg == "--warmup" && has_value) {
+                config.warmup = std::chrono::seconds(std::stol(argv[++i]));
+            } else if (arg == "--duration" && has_value) {
+                config.duration = std::chrono::seconds(std::stol(argv[++i]));
+            } else if (arg == "--drain" && has_value) {
+                config.drain = std::chrono::seconds(std::stol(argv[++i]));
+            } else if (arg == "--threads" && has_value) {
+                config.threads = std::stoul(argv[++i]);
+            } else if (arg == "--json" && has_value) {
+                config.json_path = argv[++i];
+            } else {
+                show_usage();
+                return 1;
+            }
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Invalid argument\n";
+        show_usage();
+        return 1;
+    }
+
+    if (config.clients == 0 || config.rate <= 0 || config.duration.count() <= 0 ||
+        config.room.size() > protocol::MAX_ROOM_NAME) {
+        show_usage();
+        return 1;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+
+    try {
+        ChatBench bench(config);
+        bench.run();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "protocol.hpp"
+
+// LZ77 compression of chat frames (protocol::Codec::Lz), negotiated per link
+// with Compression frames. A chat message on its own rarely repeats itself,
+// but it repeats the messages before it: names, rooms, greetings, whole
+// phrases. So a match may reach back into a built-in dictionary of common
+// chat text and, on a TCP link, into the link's recent frames.
+//
+// A compressed payload is the original payload's size (4 bytes) followed by
+// sequences in the LZ4 style:
+//
+//   token     literal count (high 4 bits), match length - 4 (low 4 bits);
+//             15 means the count continues in the following bytes, each
+//             255 meaning "and more"
+//   literals
+//   offset    2 bytes, how far back the match starts
+//   (match length continued)
+//
+// The last sequence is literals only. Offsets count back through what has
+// been decoded so far, then the link's history if FrameFlags::Streamed is
+// set, then the dictionary.
+//
+// Only Chat and RoomChat frames are compressed, and only when that saves at
+// least an eighth; tiny and incompressible payloads go as they are.
+namespace compression {
+
+constexpr size_t MIN_SIZE = 32;             // smaller payloads are never worth it
+constexpr size_t MAX_SIZE = 64 * 1024;      // larger ones are rare, and go as they are
+constexpr size_t SIZE_FIELD = 4;
+
+// Matched by every compressed frame, so both ends must have exactly these
+// bytes: changing it needs a new codec id.
+inline constexpr std::string_view DICTIONARY =
+    "http://https://www..com/.org/.net/.io/github.com/ :) :( :D ;) <3 xD lol lmao haha "
+    "brb afk btw imo tbh idk np thx ty pls omg gg wp ok okay yeah yes no nope sure "
+    "Hello everyone! Hi all, Hey there, Good morning Good afternoon Good evening Good night "
+    "Thanks a lot! Thank you so much, Thanks for the help. You're welcome. No problem. "
+    "See you later, see you tomorrow. Talk to you soon. Have a nice day! Take care. "
+    "How are you doing today? How's it going? What's up? I'm fine, thanks. Not bad. "
+    "I think that we should I don't think so. I don't know. I'm not sure, let me check. "
+    "Can you please send me the Could you take a look at this? Did you see the message? "
+    "Let me know if you have any questions. Let me know when you are ready. "
+    "Sounds good to me. That makes sense. That's a good idea. Of course. Exactly. "
+    "I'll be there in a few minutes. I'm on my way. Sorry, I was away. Just a moment. "
+    "What time is the meeting? The meeting is at Are we still on for tomorrow? "
+    "Can we talk about this later? I'm working on it right now and will be done soon. "
+    "It works on my machine. Did you try restarting it? The build is failing again. "
+    "Please review my pull request when you have time. I pushed the fix to the branch. "
+    "the file the server the relay the room the connection the message the update "
+    " and the  of the  in the  to the  for the  on the  with the  at the  from the "
+    " this is  that is  there is  it is  what is  which is  would be  should be  will be "
+    " have been  has been  because  about  after  before  again  really  actually "
+    "something anything everything nothing someone everyone people everybody "
+    "today tomorrow yesterday tonight morning evening weekend Monday Tuesday Wednesday "
+    "Thursday Friday Saturday Sunday January February March April May June July August "
+    "September October November December #general #random #dev #ops room chat hello ";
+
+namespace detail {
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t MAX_OFFSET = 65535;
+    constexpr size_t HISTORY = 32 * 1024;   // link history kept when it is trimmed
+    constexpr int HASH_BITS = 12;
+    constexpr uint32_t NONE = UINT32_MAX;
+    using Table = std::array<uint32_t, size_t{1} << HASH_BITS>;
+
+    inline uint32_t load32(const char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline size_t hash(const char* p) {
+        return (load32(p) * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    // Where each 4-byte string of the dictionary occurs; built once.
+    inline const Table& dictionary_table() {
+        static const Table table = [] {
+            Table t;
+            t.fill(NONE);
+            for (size_t i = 0; i + MIN_MATCH <= DICTIONARY.size(); ++i) {
+                t[hash(DICTIONARY.data() + i)] = static_cast<uint32_t>(i);
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    // Bytes of output `size` input bytes can take in the worst case.
+    constexpr size_t bound(size_t size) {
+        return SIZE_FIELD + size + size / 255 + 16;
+    }
+
+    inline char* put_count(char* out, size_t count) {
+        for (; count >= 255; count -= 255) *out++ = static_cast<char>(255);
+        *out++ = static_cast<char>(count);
+        return out;
+    }
+
+    inline bool get_count(const char*& in, const char* end, size_t& count) {
+        while (in != end) {
+            auto byte = static_cast<uint8_t>(*in++);
+            count += byte;
+            if (byte != 255) return true;
+        }
+        return false;
+    }
+
+    // A match of `length` bytes at `offset` back; 0 for the final literals.
+    inline char* put_sequence(char* out, const char* literals, size_t count, size_t offset, size_t length) {
+        size_t extra = length > 0 ? length - MIN_MATCH : 0;
+        *out++ = static_cast<char>((std::min<size_t>(count, 15) << 4) | std::min<size_t>(extra, 15));
+        if (count >= 15) out = put_count(out, count - 15);
+        std::memcpy(out, literals, count);
+        out += count;
+        if (length == 0) return out;
+        protocol::detail::put_u16(out, static_cast<uint16_t>(offset));
+        out += 2;
+        if (extra >= 15) out = put_count(out, extra - 15);
+        return out;
+    }
+
+    // Greedy parse of w[start, end) into `out`, matching anything in `w`
+    // before the current position. `table` maps hashes to earlier positions
+    // in `w`; entries are only hints, since every match is checked against
+    // the bytes, so stale ones cost compression ratio, never correctness.
+    inline char* encode(const char* w, size_t start, size_t end, Table& table, char* out) {
+        const Table& dictionary = dictionary_table();
+        size_t anchor = start;
+        size_t i = start;
+        while (i + MIN_MATCH <= end) {
+            size_t h = hash(w + i);
+            size_t best = 0;
+            size_t best_length = 0;
+            for (uint32_t candidate : {table[h], dictionary[h]}) {
+                if (candidate >= i || i - candidate > MAX_OFFSET || load32(w + candidate) != load32(w + i)) continue;
+                size_t length = MIN_MATCH;
+                while (i + length < end && w[candidate + length] == w[i + length]) ++length;
+                if (length > best_length) {
+                    best = candidate;
+                    best_length = length;
+                }
+            }
+            table[h] = static_cast<uint32_t>(i);
+            if (best_length == 0) {
+                ++i;
+                continue;
+            }
+
+            out = put_sequence(out, w + anchor, i - anchor, i - best, best_length);
+            for (size_t j = i + 1; j < i + best_length && j + MIN_MATCH <= end; ++j) {
+                table[hash(w + j)] = static_cast<uint32_t>(j);
+            }
+            i += best_length;
+            anchor = i;
+        }
+        return put_sequence(out, w + anchor, end - anchor, 0, 0);
+    }
+
+    // Decodes sequences into w[start, end). Returns false if they are
+    // malformed or do not fill it exactly.
+    inline bool decode(const char* in, const char* in_end, char* w, size_t start, size_t end) {
+        size_t at = start;
+        while (in != in_end) {
+            auto token = static_cast<uint8_t>(*in++);
+            size_t count = token >> 4;
+            if (count == 15 && !get_count(in, in_end, count)) return false;
+            if (count > end - at || count > static_cast<size_t>(in_end - in)) return false;
+            std::memcpy(w + at, in, count);
+            at += count;
+            in += count;
+            if (at == end) return in == in_end;
+
+            if (in_end - in < 2) return false;
+            size_t offset = protocol::detail::get_u16(in);
+            in += 2;
+            size_t length = (token & 15) + MIN_MATCH;
+            if ((token & 15) == 15 && !get_count(in, in_end, length)) return false;
+            if (offset == 0 || offset > at || length > end - at) return false;
+            const char* from = w + at - offset;
+            if (offset >= length) {
+                std::memcpy(w + at, from, length);
+            } else {
+                for (size_t k = 0; k < length; ++k) w[at + k] = from[k];   // overlapping: a repeat
+            }
+            at += length;
+        }
+        return false;
+    }
+
+    // A window is the dictionary followed by the link's history. Both ends
+    // trim it at the same points, so offsets into it agree.
+    inline size_t trim(std::vector<char>& window) {
+        if (window.size() <= DICTIONARY.size() + 2 * HISTORY) return 0;
+        size_t drop = window.size() - DICTIONARY.size() - HISTORY;
+        window.erase(window.begin() + static_cast<ptrdiff_t>(DICTIONARY.size()),
+                     window.begin() + static_cast<ptrdiff_t>(DICTIONARY.size() + drop));
+        return drop;
+    }
+}
+
+// Compressing side of a link. Frames sent to that link alone may use its
+// history (`stream`); a frame fanned out to many links is compressed once
+// without it, so every recipient can decode the same bytes. Not
+// thread-safe, and streamed frames must reach the peer in the order they
+// were compressed.
+class Encoder {
+public:
+    Encoder() : window_(DICTIONARY.begin(), DICTIONARY.end()), scratch_(window_) {
+        stream_table_.fill(detail::NONE);
+        single_table_.fill(detail::NONE);
+    }
+
+    // Writes the compressed form of `payload` to `out`, which has room for
+    // bound(payload.size()) bytes. Returns its size, or 0 if compressing
+    // does not pay; nothing is added to the history then.
+    size_t compress(std::string_view payload, char* out, bool stream) {
+        if (payload.size() < MIN_SIZE || payload.size() > MAX_SIZE) return 0;
+        std::vector<char>& window = stream ? window_ : scratch_;
+        size_t start = stream ? window.size() : DICTIONARY.size();
+        window.resize(start);
+        window.insert(window.end(), payload.begin(), payload.end());
+
+        protocol::detail::put_u32(out, static_cast<uint32_t>(payload.size()));
+        char* end = detail::encode(window.data(), start, window.size(),
+                                   stream ? stream_table_ : single_table_, out + SIZE_FIELD);
+        size_t size = static_cast<size_t>(end - out);
+        if (size + payload.size() / 8 > payload.size()) {
+            if (stream) window.resize(start);
+            return 0;
+        }
+        if (stream) rebase(detail::trim(window_));
+        return size;
+    }
+
+    static constexpr size_t bound(size_t size) { return detail::bound(size); }
+
+private:
+    std::vector<char> window_;    // dictionary + history
+    std::vector<char> scratch_;   // dictionary + the frame being compressed on its own
+    detail::Table stream_table_;
+    detail::Table single_table_;
+
+    // Positions past the trimmed part moved back by `drop`.
+    void rebase(size_t drop) {
+        if (drop == 0) return;
+        for (uint32_t& position : stream_table_) {
+            if (position == detail::NONE) continue;
+            position = position >= DICTIONARY.size() + drop ? static_cast<uint32_t>(position - drop) : detail::NONE;
+        }
+    }
+};
+
+// Decompressing side of a link; mirrors the peer's Encoder. Not thread-safe.
+class Decoder {
+public:
+    Decoder() : window_(DICTIONARY.begin(), DICTIONARY.end()), scratch_(window_) {}
+
+    // Writes the original of `payload` (its size() bytes) to `out`. Returns
+    // false if it is malformed.
+    bool decompress(std::string_view payload, char* out, bool stream) {
+        auto original = size(payload);
+        if (!original) return false;
+        std::vector<char>& window = stream ? window_ : scratch_;
+        size_t start = stream ? window.size() : DICTIONARY.size();
+        window.resize(start + *original);
+        if (!detail::decode(payload.data() + SIZE_FIELD, payload.data() + payload.size(), window.data(),
+                            start, window.size())) {
+            window.resize(start);
+            return false;
+        }
+        std::memcpy(out, window.data() + start, *original);
+        if (stream) detail::trim(window_);
+        return true;
+    }
+
+    static std::optional<size_t> size(std::string_view payload) {
+        if (payload.size() < SIZE_FIELD) return std::nullopt;
+        size_t original = protocol::detail::get_u32(payload.data());
+        if (original > MAX_SIZE) return std::nullopt;
+        return original;
+    }
+
+private:
+    std::vector<char> window_;
+    std::vector<char> scratch_;
+};
+
+inline bool compressible(const protocol::FrameHeader& header) {
+    return (header.type == protocol::FrameType::Chat || header.type == protocol::FrameType::RoomChat) &&
+           !(header.flags & protocol::FrameFlags::Compressed) &&
+           header.length >= MIN_SIZE && header.length <= MAX_SIZE;
+}
+
+// `frame` compressed into a pooled buffer, or nothing if it is not a frame
+// worth compressing.
+inline std::optional<BufferSlice> pack(Encoder& encoder, std::string_view frame, bool stream, BufferPool& pool) {
+    auto header = protocol::read_header(frame.data());
+    if (!compressible(header)) return std::nullopt;
+    BufferRef buffer = pool.acquire(protocol::HEADER_SIZE + Encoder::bound(header.length));
+    size_t size = encoder.compress(frame.substr(protocol::HEADER_SIZE), buffer->data() + protocol::HEADER_SIZE, stream);
+    if (size == 0) return std::nullopt;
+
+    header.length = static_cast<uint32_t>(size);
+    header.flags |= protocol::FrameFlags::Compressed | (stream ? protocol::FrameFlags::Streamed : 0);
+    protocol::write_header(buffer->data(), header);
+    return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(protocol::HEADER_SIZE + size)};
+}
+
+// The original of the compressed frame `header` + `payload`, in a pooled
+// buffer, or nothing if it is malformed. Streamed frames are only valid in
+// the order they arrived on the link's TCP connection.
+inline std::optional<BufferSlice> unpack(Decoder& decoder, protocol::FrameHeader header, std::string_view payload,
+                                         BufferPool& pool) {
+    auto original = Decoder::size(payload);
+    if (!original) return std::nullopt;
+    BufferRef buffer = pool.acquire(protocol::HEADER_SIZE + *original);
+    if (!decoder.decompress(payload, buffer->data() + protocol::HEADER_SIZE,
+                            (header.flags & protocol::FrameFlags::Streamed) != 0)) {
+        return std::nullopt;
+    }
+
+    header.length = static_cast<uint32_t>(*original);
+    header.flags &= static_cast<uint16_t>(~(protocol::FrameFlags::Compressed | protocol::FrameFlags::Streamed));
+    protocol::write_header(buffer->data(), header);
+    return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(protocol::HEADER_SIZE + *original)};
+}
+
+}  // namespace compression
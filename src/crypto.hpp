@@ -0,0 +1,842 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define CRYPTO_X86 1
+    #include <immintrin.h>
+#endif
+
+// The primitives behind encrypted links: X25519 key agreement (RFC 7748),
+// SHA-256 with HMAC and HKDF (RFC 6234, 5869) to derive keys from it, and
+// the ChaCha20-Poly1305 AEAD (RFC 8439) to seal what is sent. Everything
+// here is self-contained, with no library to link.
+//
+// ChaCha20 does nearly all of the work on the data path, so it has SIMD
+// kernels that run several blocks side by side: 4 with SSE2 and 8 with
+// AVX2, picked once at run time from what the CPU supports. Poly1305 runs
+// in 64-bit limbs, which is fast enough not to matter next to it. The
+// AEAD is incremental: a batch of messages scattered over many buffers is
+// sealed in one pass, each piece encrypted and then authenticated while it
+// is still in cache.
+//
+// Secret-dependent work is constant time: no branches or table lookups on
+// keys, and tags are compared without early exit.
+namespace crypto {
+
+constexpr size_t KEY_SIZE = 32;
+constexpr size_t NONCE_SIZE = 12;
+constexpr size_t TAG_SIZE = 16;
+
+using Key = std::array<uint8_t, KEY_SIZE>;
+using Nonce = std::array<uint8_t, NONCE_SIZE>;
+using Tag = std::array<uint8_t, TAG_SIZE>;
+
+namespace detail {
+    inline uint32_t load32(const uint8_t* p) {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    inline uint64_t load64(const uint8_t* p) {
+        return uint64_t(load32(p)) | uint64_t(load32(p + 4)) << 32;
+    }
+
+    inline void store32(uint8_t* p, uint32_t v) {
+        p[0] = uint8_t(v);
+        p[1] = uint8_t(v >> 8);
+        p[2] = uint8_t(v >> 16);
+        p[3] = uint8_t(v >> 24);
+    }
+
+    inline void store64(uint8_t* p, uint64_t v) {
+        store32(p, uint32_t(v));
+        store32(p + 4, uint32_t(v >> 32));
+    }
+
+    inline uint32_t rotl(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+}
+
+// Compares without returning early, so timing does not reveal where two
+// tags differ.
+inline bool equal(std::span<const uint8_t> a, std::span<const uint8_t> b) {
+    if (a.size() != b.size()) return false;
+    uint8_t diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+// Key material from the operating system's generator.
+inline void random_bytes(std::span<uint8_t> out) {
+    std::random_device device;
+    for (size_t i = 0; i < out.size(); i += 4) {
+        uint32_t word = device();
+        for (size_t j = 0; j < 4 && i + j < out.size(); ++j) out[i + j] = uint8_t(word >> (8 * j));
+    }
+}
+
+// ---------------------------------------------------------------------------
+// SHA-256, HMAC-SHA-256 and HKDF. Only used when a link is set up.
+
+class Sha256 {
+public:
+    static constexpr size_t DIGEST_SIZE = 32;
+    static constexpr size_t BLOCK_SIZE = 64;
+    using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+    Sha256& update(std::span<const uint8_t> data) {
+        for (uint8_t byte : data) {
+            block_[used_++] = byte;
+            if (used_ == BLOCK_SIZE) {
+                compress(block_.data());
+                used_ = 0;
+            }
+        }
+        length_ += data.size();
+        return *this;
+    }
+
+    Sha256& update(std::string_view data) {
+        return update(std::span(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+    }
+
+    Digest finish() {
+        uint64_t bits = length_ * 8;
+        uint8_t pad = 0x80;
+        update(std::span(&pad, 1));
+        pad = 0;
+        while (used_ != BLOCK_SIZE - 8) update(std::span(&pad, 1));
+        for (int i = 7; i >= 0; --i) {
+            uint8_t byte = uint8_t(bits >> (8 * i));
+            update(std::span(&byte, 1));
+        }
+        Digest out;
+        for (size_t i = 0; i < 8; ++i) {
+            out[4 * i] = uint8_t(state_[i] >> 24);
+            out[4 * i + 1] = uint8_t(state_[i] >> 16);
+            out[4 * i + 2] = uint8_t(state_[i] >> 8);
+            out[4 * i + 3] = uint8_t(state_[i]);
+        }
+        return out;
+    }
+
+private:
+    std::array<uint32_t, 8> state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::array<uint8_t, BLOCK_SIZE> block_{};
+    size_t used_ = 0;
+    uint64_t length_ = 0;
+
+    static uint32_t rotr(uint32_t v, int n) { return (v >> n) | (v << (32 - n)); }
+
+    void compress(const uint8_t* block) {
+        static constexpr uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (size_t i = 0; i < 16; ++i) {
+            w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 |
+                   uint32_t(block[4 * i + 2]) << 8 | uint32_t(block[4 * i + 3]);
+        }
+        for (size_t i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for (size_t i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+        state_[5] += f;
+        state_[6] += g;
+        state_[7] += h;
+    }
+};
+
+inline Sha256::Digest hmac_sha256(std::span<const uint8_t> key, std::span<const uint8_t> message) {
+    std::array<uint8_t, Sha256::BLOCK_SIZE> block{};
+    if (key.size() > block.size()) {
+        auto digest = Sha256().update(key).finish();
+        std::memcpy(block.data(), digest.data(), digest.size());
+    } else {
+        std::memcpy(block.data(), key.data(), key.size());
+    }
+    std::array<uint8_t, Sha256::BLOCK_SIZE> pad;
+    for (size_t i = 0; i < pad.size(); ++i) pad[i] = block[i] ^ 0x36;
+    auto inner = Sha256().update(pad).update(message).finish();
+    for (size_t i = 0; i < pad.size(); ++i) pad[i] = block[i] ^ 0x5c;
+    return Sha256().update(pad).update(inner).finish();
+}
+
+// HKDF-SHA-256: fills `out` (at most 255 * 32 bytes) with keys derived from
+// the input key material, a salt and a context string.
+inline void hkdf(std::span<uint8_t> out, std::span<const uint8_t> ikm, std::span<const uint8_t> salt,
+                 std::span<const uint8_t> info) {
+    auto prk = hmac_sha256(salt, ikm);
+    std::array<uint8_t, Sha256::DIGEST_SIZE> block{};
+    std::vector<uint8_t> input;
+    size_t done = 0;
+    for (uint8_t counter = 1; done < out.size(); ++counter) {
+        input.clear();
+        if (counter > 1) input.insert(input.end(), block.begin(), block.end());
+        input.insert(input.end(), info.begin(), info.end());
+        input.push_back(counter);
+        block = hmac_sha256(prk, input);
+        size_t n = std::min(block.size(), out.size() - done);
+        std::memcpy(out.data() + done, block.data(), n);
+        done += n;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// X25519, in radix 2^51 with 128-bit products.
+
+class X25519 {
+public:
+    static constexpr size_t SIZE = 32;
+    using Bytes = std::array<uint8_t, SIZE>;
+
+    // scalar * point, both little-endian as in RFC 7748.
+    static Bytes multiply(const Bytes& scalar, const Bytes& point) {
+        Bytes k = scalar;
+        k[0] &= 248;
+        k[31] &= 127;
+        k[31] |= 64;
+
+        Fe x1 = from_bytes(point.data());
+        Fe x2{1}, z2{0}, x3 = x1, z3{1};
+        uint64_t swap = 0;
+        for (int t = 254; t >= 0; --t) {
+            uint64_t bit = (k[t / 8] >> (t % 8)) & 1;
+            swap ^= bit;
+            cswap(x2, x3, swap);
+            cswap(z2, z3, swap);
+            swap = bit;
+
+            Fe a = add(x2, z2), aa = square(a);
+            Fe b = sub(x2, z2), bb = square(b);
+            Fe e = sub(aa, bb);
+            Fe c = add(x3, z3), d = sub(x3, z3);
+            Fe da = mul(d, a), cb = mul(c, b);
+            x3 = square(add(da, cb));
+            z3 = mul(x1, square(sub(da, cb)));
+            x2 = mul(aa, bb);
+            z2 = mul(e, add(aa, mul_small(e, 121665)));
+        }
+        cswap(x2, x3, swap);
+        cswap(z2, z3, swap);
+        return to_bytes(mul(x2, invert(z2)));
+    }
+
+    static Bytes public_key(const Bytes& secret) {
+        Bytes base{9};
+        return multiply(secret, base);
+    }
+
+private:
+    using Fe = std::array<uint64_t, 5>;
+    __extension__ typedef unsigned __int128 u128;
+    static constexpr uint64_t MASK = (uint64_t{1} << 51) - 1;
+
+    static Fe from_bytes(const uint8_t* s) {
+        return {detail::load64(s) & MASK, (detail::load64(s + 6) >> 3) & MASK, (detail::load64(s + 12) >> 6) & MASK,
+                (detail::load64(s + 19) >> 1) & MASK, (detail::load64(s + 24) >> 12) & MASK};
+    }
+
+    static Bytes to_bytes(Fe h) {
+        carry(h);
+        carry(h);
+        // Subtract p once if h >= p: q is 1 exactly when h + 19 overflows 2^255.
+        uint64_t q = (h[0] + 19) >> 51;
+        q = (h[1] + q) >> 51;
+        q = (h[2] + q) >> 51;
+        q = (h[3] + q) >> 51;
+        q = (h[4] + q) >> 51;
+        h[0] += 19 * q;
+        h[1] += h[0] >> 51; h[0] &= MASK;
+        h[2] += h[1] >> 51; h[1] &= MASK;
+        h[3] += h[2] >> 51; h[2] &= MASK;
+        h[4] += h[3] >> 51; h[3] &= MASK;
+        h[4] &= MASK;
+
+        Bytes out;
+        detail::store64(out.data(), h[0] | h[1] << 51);
+        detail::store64(out.data() + 8, h[1] >> 13 | h[2] << 38);
+        detail::store64(out.data() + 16, h[2] >> 26 | h[3] << 25);
+        detail::store64(out.data() + 24, h[3] >> 39 | h[4] << 12);
+        return out;
+    }
+
+    static void carry(Fe& h) {
+        for (size_t i = 0; i < 4; ++i) {
+            h[i + 1] += h[i] >> 51;
+            h[i] &= MASK;
+        }
+        h[0] += 19 * (h[4] >> 51);
+        h[4] &= MASK;
+    }
+
+    static void cswap(Fe& a, Fe& b, uint64_t swap) {
+        uint64_t mask = 0 - swap;
+        for (size_t i = 0; i < 5; ++i) {
+            uint64_t t = mask & (a[i] ^ b[i]);
+            a[i] ^= t;
+            b[i] ^= t;
+        }
+    }
+
+    static Fe add(const Fe& a, const Fe& b) {
+        return {a[0] + b[0], a[1] + b[1], a[2] + b[2], a[3] + b[3], a[4] + b[4]};
+    }
+
+    // a + 2p - b, so limbs never go negative.
+    static Fe sub(const Fe& a, const Fe& b) {
+        Fe r{a[0] + 0xfffffffffffdaULL - b[0], a[1] + 0xffffffffffffeULL - b[1], a[2] + 0xffffffffffffeULL - b[2],
+             a[3] + 0xffffffffffffeULL - b[3], a[4] + 0xffffffffffffeULL - b[4]};
+        carry(r);
+        return r;
+    }
+
+    static Fe reduce(u128 r0, u128 r1, u128 r2, u128 r3, u128 r4) {
+        Fe h;
+        r1 += uint64_t(r0 >> 51); h[0] = uint64_t(r0) & MASK;
+        r2 += uint64_t(r1 >> 51); h[1] = uint64_t(r1) & MASK;
+        r3 += uint64_t(r2 >> 51); h[2] = uint64_t(r2) & MASK;
+        r4 += uint64_t(r3 >> 51); h[3] = uint64_t(r3) & MASK;
+        h[0] += 19 * uint64_t(r4 >> 51); h[4] = uint64_t(r4) & MASK;
+        h[1] += h[0] >> 51; h[0] &= MASK;
+        return h;
+    }
+
+    static Fe mul(const Fe& a, const Fe& b) {
+        uint64_t b1 = 19 * b[1], b2 = 19 * b[2], b3 = 19 * b[3], b4 = 19 * b[4];
+        u128 r0 = u128(a[0]) * b[0] + u128(a[1]) * b4 + u128(a[2]) * b3 + u128(a[3]) * b2 + u128(a[4]) * b1;
+        u128 r1 = u128(a[0]) * b[1] + u128(a[1]) * b[0] + u128(a[2]) * b4 + u128(a[3]) * b3 + u128(a[4]) * b2;
+        u128 r2 = u128(a[0]) * b[2] + u128(a[1]) * b[1] + u128(a[2]) * b[0] + u128(a[3]) * b4 + u128(a[4]) * b3;
+        u128 r3 = u128(a[0]) * b[3] + u128(a[1]) * b[2] + u128(a[2]) * b[1] + u128(a[3]) * b[0] + u128(a[4]) * b4;
+        u128 r4 = u128(a[0]) * b[4] + u128(a[1]) * b[3] + u128(a[2]) * b[2] + u128(a[3]) * b[1] + u128(a[4]) * b[0];
+        return reduce(r0, r1, r2, r3, r4);
+    }
+
+    static Fe square(const Fe& a) { return mul(a, a); }
+
+    static Fe mul_small(const Fe& a, uint64_t n) {
+        return reduce(u128(a[0]) * n, u128(a[1]) * n, u128(a[2]) * n, u128(a[3]) * n, u128(a[4]) * n);
+    }
+
+    static Fe square_times(Fe a, int n) {
+        while (n-- > 0) a = square(a);
+        return a;
+    }
+
+    // z^(p - 2), by the usual chain of 254 squarings and 11 multiplications.
+    static Fe invert(const Fe& z) {
+        Fe z2 = square(z);
+        Fe z9 = mul(square_times(z2, 2), z);
+        Fe z11 = mul(z9, z2);
+        Fe z_5_0 = mul(square(z11), z9);
+        Fe z_10_0 = mul(square_times(z_5_0, 5), z_5_0);
+        Fe z_20_0 = mul(square_times(z_10_0, 10), z_10_0);
+        Fe z_40_0 = mul(square_times(z_20_0, 20), z_20_0);
+        Fe z_50_0 = mul(square_times(z_40_0, 10), z_10_0);
+        Fe z_100_0 = mul(square_times(z_50_0, 50), z_50_0);
+        Fe z_200_0 = mul(square_times(z_100_0, 100), z_100_0);
+        Fe z_250_0 = mul(square_times(z_200_0, 50), z_50_0);
+        return mul(square_times(z_250_0, 5), z11);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// ChaCha20 (RFC 8439: 32-bit block counter, 96-bit nonce).
+
+enum class Kernel { Scalar, Sse2, Avx2 };
+
+namespace detail {
+    // Applies `blocks` keystream blocks starting at state[12] to `in`, writing
+    // `out` (which may equal `in`), and advances the counter.
+    using ChaChaKernel = void (*)(uint32_t state[16], const uint8_t* in, uint8_t* out, size_t blocks);
+
+    inline void chacha_block(const uint32_t state[16], uint32_t out[16]) {
+        uint32_t x[16];
+        std::memcpy(x, state, sizeof(x));
+        auto quarter = [&x](int a, int b, int c, int d) {
+            x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+            x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+            x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+            x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+        };
+        for (int i = 0; i < 10; ++i) {
+            quarter(0, 4, 8, 12);
+            quarter(1, 5, 9, 13);
+            quarter(2, 6, 10, 14);
+            quarter(3, 7, 11, 15);
+            quarter(0, 5, 10, 15);
+            quarter(1, 6, 11, 12);
+            quarter(2, 7, 8, 13);
+            quarter(3, 4, 9, 14);
+        }
+        for (int i = 0; i < 16; ++i) out[i] = x[i] + state[i];
+    }
+
+    inline void chacha_scalar(uint32_t state[16], const uint8_t* in, uint8_t* out, size_t blocks) {
+        uint32_t keystream[16];
+        for (; blocks > 0; --blocks, in += 64, out += 64) {
+            chacha_block(state, keystream);
+            for (int i = 0; i < 16; ++i) store32(out + 4 * i, load32(in + 4 * i) ^ keystream[i]);
+            ++state[12];
+        }
+    }
+
+#ifdef CRYPTO_X86
+    // Vertical layout: vector i holds word i of 4 consecutive blocks, so one
+    // quarter-round instruction works on all four. The results are then
+    // transposed back into block order.
+    inline __m128i rotl_sse2(__m128i v, int n) {
+        return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n));
+    }
+
+    inline void quarter_sse2(__m128i x[16], int a, int b, int c, int d) {
+        x[a] = _mm_add_epi32(x[a], x[b]); x[d] = rotl_sse2(_mm_xor_si128(x[d], x[a]), 16);
+        x[c] = _mm_add_epi32(x[c], x[d]); x[b] = rotl_sse2(_mm_xor_si128(x[b], x[c]), 12);
+        x[a] = _mm_add_epi32(x[a], x[b]); x[d] = rotl_sse2(_mm_xor_si128(x[d], x[a]), 8);
+        x[c] = _mm_add_epi32(x[c], x[d]); x[b] = rotl_sse2(_mm_xor_si128(x[b], x[c]), 7);
+    }
+
+    inline void chacha_sse2(uint32_t state[16], const uint8_t* in, uint8_t* out, size_t blocks) {
+        for (; blocks >= 4; blocks -= 4, in += 256, out += 256) {
+            __m128i s[16], x[16];
+            for (int i = 0; i < 16; ++i) s[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+            s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+            for (int i = 0; i < 16; ++i) x[i] = s[i];
+            for (int i = 0; i < 10; ++i) {
+                quarter_sse2(x, 0, 4, 8, 12);
+                quarter_sse2(x, 1, 5, 9, 13);
+                quarter_sse2(x, 2, 6, 10, 14);
+                quarter_sse2(x, 3, 7, 11, 15);
+                quarter_sse2(x, 0, 5, 10, 15);
+                quarter_sse2(x, 1, 6, 11, 12);
+                quarter_sse2(x, 2, 7, 8, 13);
+                quarter_sse2(x, 3, 4, 9, 14);
+            }
+            for (int i = 0; i < 16; ++i) x[i] = _mm_add_epi32(x[i], s[i]);
+
+            for (int g = 0; g < 4; ++g) {
+                // Words 4g..4g+3 of blocks 0..3.
+                __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+                __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+                __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m128i rows[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                                   _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+                for (int b = 0; b < 4; ++b) {
+                    auto* src = reinterpret_cast<const __m128i*>(in + 64 * b + 16 * g);
+                    auto* dst = reinterpret_cast<__m128i*>(out + 64 * b + 16 * g);
+                    _mm_storeu_si128(dst, _mm_xor_si128(_mm_loadu_si128(src), rows[b]));
+                }
+            }
+            state[12] += 4;
+        }
+        chacha_scalar(state, in, out, blocks);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i rotl_avx2(__m256i v, int n) {
+        if (n == 16) {
+            return _mm256_shuffle_epi8(v, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+        }
+        if (n == 8) {
+            return _mm256_shuffle_epi8(v, _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                                          14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3));
+        }
+        return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n));
+    }
+
+    __attribute__((target("avx2"))) inline void quarter_avx2(__m256i x[16], int a, int b, int c, int d) {
+        x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = rotl_avx2(_mm256_xor_si256(x[d], x[a]), 16);
+        x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = rotl_avx2(_mm256_xor_si256(x[b], x[c]), 12);
+        x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = rotl_avx2(_mm256_xor_si256(x[d], x[a]), 8);
+        x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = rotl_avx2(_mm256_xor_si256(x[b], x[c]), 7);
+    }
+
+    // As chacha_sse2, eight blocks at a time. Rotations by 16 and 8 are byte
+    // shuffles.
+    __attribute__((target("avx2"))) inline void chacha_avx2(uint32_t state[16], const uint8_t* in, uint8_t* out,
+                                                            size_t blocks) {
+        for (; blocks >= 8; blocks -= 8, in += 512, out += 512) {
+            __m256i s[16], x[16];
+            for (int i = 0; i < 16; ++i) s[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+            s[12] = _mm256_add_epi32(s[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+            for (int i = 0; i < 16; ++i) x[i] = s[i];
+            for (int i = 0; i < 10; ++i) {
+                quarter_avx2(x, 0, 4, 8, 12);
+                quarter_avx2(x, 1, 5, 9, 13);
+                quarter_avx2(x, 2, 6, 10, 14);
+                quarter_avx2(x, 3, 7, 11, 15);
+                quarter_avx2(x, 0, 5, 10, 15);
+                quarter_avx2(x, 1, 6, 11, 12);
+                quarter_avx2(x, 2, 7, 8, 13);
+                quarter_avx2(x, 3, 4, 9, 14);
+            }
+            for (int i = 0; i < 16; ++i) x[i] = _mm256_add_epi32(x[i], s[i]);
+
+            // A 4x4 transpose within each 128-bit half leaves words 4g..4g+3
+            // of block b in the low half of rows[b] and of block b + 4 in the
+            // high half; halves of two groups then make 32 bytes of a block.
+            __m256i rows[4][4];
+            for (int g = 0; g < 4; ++g) {
+                __m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+                __m256i t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m256i t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+                __m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+                rows[g][0] = _mm256_unpacklo_epi64(t0, t1);
+                rows[g][1] = _mm256_unpackhi_epi64(t0, t1);
+                rows[g][2] = _mm256_unpacklo_epi64(t2, t3);
+                rows[g][3] = _mm256_unpackhi_epi64(t2, t3);
+            }
+            for (int b = 0; b < 4; ++b) {
+                for (int half = 0; half < 2; ++half) {
+                    __m256i lo = _mm256_permute2x128_si256(rows[2 * half][b], rows[2 * half + 1][b], 0x20);
+                    __m256i hi = _mm256_permute2x128_si256(rows[2 * half][b], rows[2 * half + 1][b], 0x31);
+                    auto* src_lo = reinterpret_cast<const __m256i*>(in + 64 * b + 32 * half);
+                    auto* src_hi = reinterpret_cast<const __m256i*>(in + 64 * (b + 4) + 32 * half);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 64 * b + 32 * half),
+                                        _mm256_xor_si256(_mm256_loadu_si256(src_lo), lo));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 64 * (b + 4) + 32 * half),
+                                        _mm256_xor_si256(_mm256_loadu_si256(src_hi), hi));
+                }
+            }
+            state[12] += 8;
+        }
+        chacha_sse2(state, in, out, blocks);
+    }
+#endif
+
+    inline ChaChaKernel kernel_for(Kernel kernel) {
+#ifdef CRYPTO_X86
+        if (kernel == Kernel::Avx2) return chacha_avx2;
+        if (kernel == Kernel::Sse2) return chacha_sse2;
+#endif
+        (void)kernel;
+        return chacha_scalar;
+    }
+
+    // Blocks a kernel works on at once; fewer fall back to a narrower one.
+    inline size_t kernel_width(Kernel kernel) {
+        if (kernel == Kernel::Avx2) return 8;
+        if (kernel == Kernel::Sse2) return 4;
+        return 1;
+    }
+
+    inline Kernel detect_kernel() {
+#if defined(CRYPTO_X86) && (defined(__GNUC__) || defined(__clang__))
+        if (__builtin_cpu_supports("avx2")) return Kernel::Avx2;
+        if (__builtin_cpu_supports("sse2")) return Kernel::Sse2;
+#endif
+        return Kernel::Scalar;
+    }
+
+    inline Kernel& active_kernel() {
+        static Kernel kernel = detect_kernel();
+        return kernel;
+    }
+}
+
+// The kernel in use, chosen from the CPU on first use.
+inline Kernel kernel() { return detail::active_kernel(); }
+
+// Overrides the choice, e.g. to compare kernels. Not thread-safe; call it
+// before any encryption starts. Returns false if the CPU lacks it.
+inline bool use_kernel(Kernel kernel) {
+    if (kernel > detail::detect_kernel()) return false;
+    detail::active_kernel() = kernel;
+    return true;
+}
+
+inline std::string_view kernel_name(Kernel kernel) {
+    switch (kernel) {
+    case Kernel::Avx2: return "AVX2";
+    case Kernel::Sse2: return "SSE2";
+    case Kernel::Scalar: break;
+    }
+    return "scalar";
+}
+
+// A keystream that can be applied piecewise: pieces need not be multiples
+// of the 64-byte block. Keystream for partial blocks is made ahead and
+// kept, so a short message and its Poly1305 key block can share one vector
+// pass rather than take several scalar ones.
+class ChaCha20 {
+public:
+    ChaCha20(const Key& key, const Nonce& nonce, uint32_t counter)
+        : kernel_(detail::kernel_for(crypto::kernel())), width_(detail::kernel_width(crypto::kernel())) {
+        state_[0] = 0x61707865;
+        state_[1] = 0x3320646e;
+        state_[2] = 0x79622d32;
+        state_[3] = 0x6b206574;
+        for (size_t i = 0; i < 8; ++i) state_[4 + i] = detail::load32(key.data() + 4 * i);
+        state_[12] = counter;
+        for (size_t i = 0; i < 3; ++i) state_[13 + i] = detail::load32(nonce.data() + 4 * i);
+    }
+
+    // out = in ^ keystream; `out` may equal `in`.
+    void apply(const uint8_t* in, uint8_t* out, size_t size) {
+        while (size > 0) {
+            if (used_ == buffered_) {
+                // Whole batches go straight through the kernel.
+                size_t blocks = size / (64 * width_) * width_;
+                if (blocks > 0) {
+                    kernel_(state_, in, out, blocks);
+                    in += 64 * blocks;
+                    out += 64 * blocks;
+                    size -= 64 * blocks;
+                    continue;
+                }
+                refill((size + 63) / 64);
+            }
+            size_t n = std::min(size, buffered_ - used_);
+            const uint8_t* key = keystream_ + used_;
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) detail::store64(out + i, detail::load64(in + i) ^ detail::load64(key + i));
+            for (; i < n; ++i) out[i] = in[i] ^ key[i];
+            used_ += n;
+            in += n;
+            out += n;
+            size -= n;
+        }
+    }
+
+    // The next whole block of keystream, e.g. for a Poly1305 key.
+    // `following`, the bytes about to be applied after it, lets their
+    // keystream be made in the same pass if they are short of a batch.
+    std::array<uint8_t, 64> block(size_t following = 0) {
+        used_ = std::min((used_ + 63) & ~size_t{63}, buffered_);
+        size_t blocks = (following + 63) / 64;
+        if (used_ == buffered_) refill(blocks < width_ ? 1 + blocks : 1);
+        std::array<uint8_t, 64> out;
+        std::memcpy(out.data(), keystream_ + used_, out.size());
+        used_ += out.size();
+        return out;
+    }
+
+private:
+    uint32_t state_[16];
+    detail::ChaChaKernel kernel_;
+    size_t width_;
+    uint8_t keystream_[8 * 64];
+    size_t buffered_ = 0;   // bytes of keystream_ made
+    size_t used_ = 0;       // of which already applied
+
+    // A vector pass costs about as much as two scalar blocks, so one or two
+    // blocks are made as such and anything more as a full batch.
+    void refill(size_t wanted) {
+        size_t blocks = wanted <= 2 ? wanted : width_;
+        buffered_ = 64 * blocks;
+        std::memset(keystream_, 0, buffered_);
+        kernel_(state_, keystream_, keystream_, blocks);
+        used_ = 0;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Poly1305, 44/44/42-bit limbs.
+
+class Poly1305 {
+public:
+    explicit Poly1305(const uint8_t key[32]) {
+        uint64_t t0 = detail::load64(key), t1 = detail::load64(key + 8);
+        r_[0] = t0 & 0xffc0fffffffULL;
+        r_[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+        r_[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+        pad_[0] = detail::load64(key + 16);
+        pad_[1] = detail::load64(key + 24);
+    }
+
+    void update(const uint8_t* data, size_t size) {
+        if (buffered_ > 0) {
+            size_t n = std::min(size, size_t{16} - buffered_);
+            std::memcpy(buffer_ + buffered_, data, n);
+            buffered_ += n;
+            data += n;
+            size -= n;
+            if (buffered_ < 16) return;
+            blocks(buffer_, 16, HIBIT);
+            buffered_ = 0;
+        }
+        size_t whole = size & ~size_t{15};
+        if (whole > 0) blocks(data, whole, HIBIT);
+        std::memcpy(buffer_, data + whole, size - whole);
+        buffered_ = size - whole;
+    }
+
+    // Zero bytes up to the next 16-byte boundary, as the AEAD construction
+    // requires between its parts.
+    void pad() {
+        if (buffered_ == 0) return;
+        std::memset(buffer_ + buffered_, 0, 16 - buffered_);
+        blocks(buffer_, 16, HIBIT);
+        buffered_ = 0;
+    }
+
+    Tag finish() {
+        if (buffered_ > 0) {
+            buffer_[buffered_] = 1;
+            std::memset(buffer_ + buffered_ + 1, 0, 15 - buffered_);
+            blocks(buffer_, 16, 0);
+        }
+        uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+        uint64_t c = h1 >> 44; h1 &= M44;
+        h2 += c; c = h2 >> 42; h2 &= M42;
+        h0 += c * 5; c = h0 >> 44; h0 &= M44;
+        h1 += c; c = h1 >> 44; h1 &= M44;
+        h2 += c; c = h2 >> 42; h2 &= M42;
+        h0 += c * 5; c = h0 >> 44; h0 &= M44;
+        h1 += c;
+
+        // h - p, kept only if it did not go negative.
+        uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+        uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+        uint64_t g2 = h2 + c - (uint64_t{1} << 42);
+        c = (g2 >> 63) - 1;
+        g0 &= c; g1 &= c; g2 &= c;
+        c = ~c;
+        h0 = (h0 & c) | g0;
+        h1 = (h1 & c) | g1;
+        h2 = (h2 & c) | g2;
+
+        uint64_t t0 = pad_[0], t1 = pad_[1];
+        h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+        h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+        h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+        Tag tag;
+        detail::store64(tag.data(), h0 | (h1 << 44));
+        detail::store64(tag.data() + 8, (h1 >> 20) | (h2 << 24));
+        return tag;
+    }
+
+private:
+    __extension__ typedef unsigned __int128 u128;
+    static constexpr uint64_t M44 = 0xfffffffffffULL;
+    static constexpr uint64_t M42 = 0x3ffffffffffULL;
+    static constexpr uint64_t HIBIT = uint64_t{1} << 40;
+
+    uint64_t r_[3];
+    uint64_t h_[3] = {0, 0, 0};
+    uint64_t pad_[2];
+    uint8_t buffer_[16];
+    size_t buffered_ = 0;
+
+    void blocks(const uint8_t* m, size_t size, uint64_t hibit) {
+        uint64_t r0 = r_[0], r1 = r_[1], r2 = r_[2];
+        uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+        uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+        for (; size >= 16; size -= 16, m += 16) {
+            uint64_t t0 = detail::load64(m), t1 = detail::load64(m + 8);
+            h0 += t0 & M44;
+            h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+            h2 += ((t1 >> 24) & M42) | hibit;
+
+            u128 d0 = u128(h0) * r0 + u128(h1) * s2 + u128(h2) * s1;
+            u128 d1 = u128(h0) * r1 + u128(h1) * r0 + u128(h2) * s2;
+            u128 d2 = u128(h0) * r2 + u128(h1) * r1 + u128(h2) * r0;
+            uint64_t c = uint64_t(d0 >> 44); h0 = uint64_t(d0) & M44;
+            d1 += c; c = uint64_t(d1 >> 44); h1 = uint64_t(d1) & M44;
+            d2 += c; c = uint64_t(d2 >> 42); h2 = uint64_t(d2) & M42;
+            h0 += c * 5; c = h0 >> 44; h0 &= M44;
+            h1 += c;
+        }
+        h_[0] = h0;
+        h_[1] = h1;
+        h_[2] = h2;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// ChaCha20-Poly1305 (RFC 8439), fed piece by piece: associated data first,
+// then the message in any number of pieces, then the tag.
+
+class Aead {
+public:
+    enum class Mode { Seal, Open };
+
+    // `expected` is the message size, if known in advance; see
+    // ChaCha20::block.
+    Aead(Mode mode, const Key& key, const Nonce& nonce, std::span<const uint8_t> aad, size_t expected = 0)
+        : mode_(mode), stream_(key, nonce, 0), mac_(stream_.block(expected).data()) {
+        mac_.update(aad.data(), aad.size());
+        mac_.pad();
+        aad_size_ = aad.size();
+    }
+
+    // Seal: encrypts `in` into `out` and authenticates the ciphertext.
+    // Open: authenticates `in` and decrypts it into `out`. Either way each
+    // piece is read once and authenticated while still in cache. `out` may
+    // equal `in`.
+    void update(const uint8_t* in, uint8_t* out, size_t size) {
+        // Pieces of at most a few KiB keep both passes within L1.
+        constexpr size_t STRIDE = 4096;
+        while (size > 0) {
+            size_t n = std::min(size, STRIDE);
+            if (mode_ == Mode::Open) mac_.update(in, n);
+            stream_.apply(in, out, n);
+            if (mode_ == Mode::Seal) mac_.update(out, n);
+            in += n;
+            out += n;
+            size -= n;
+            message_size_ += n;
+        }
+    }
+
+    Tag finish() {
+        mac_.pad();
+        uint8_t sizes[16];
+        detail::store64(sizes, aad_size_);
+        detail::store64(sizes + 8, message_size_);
+        mac_.update(sizes, sizeof(sizes));
+        return mac_.finish();
+    }
+
+    // Open: whether `tag` is the one the message was sealed with.
+    bool verify(std::span<const uint8_t> tag) {
+        auto expected = finish();
+        return equal(expected, tag);
+    }
+
+private:
+    Mode mode_;
+    ChaCha20 stream_;
+    Poly1305 mac_;
+    uint64_t aad_size_ = 0;
+    uint64_t message_size_ = 0;
+};
+
+}  // namespace crypto
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Remembers recently seen 64-bit keys, e.g. message ids, in bounded memory.
+// Two fixed-size open-addressing tables take turns: inserts go to the current
+// table, lookups check both, and once the current table is half full or
+// `window` has passed it becomes the previous one and the old previous table
+// is wiped. A key is therefore remembered for at least `window` (or until
+// capacity/2 newer keys have arrived) and at most twice that.
+//
+// Not thread-safe; callers hold their own lock.
+class DedupCache {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit DedupCache(size_t capacity = size_t{1} << 16, Clock::duration window = std::chrono::seconds(30))
+        : mask_(std::bit_ceil(std::max<size_t>(capacity, 16)) - 1),
+          window_(window),
+          current_(mask_ + 1),
+          previous_(mask_ + 1),
+          rotated_(Clock::now()) {}
+
+    // Records `key`. Returns false if it was already seen recently.
+    bool insert(uint64_t key, Clock::time_point now = Clock::now()) {
+        key = fingerprint(key);
+        if (find(current_, key) || find(previous_, key)) return false;
+        if (size_ >= (mask_ + 1) / 2 || now - rotated_ >= window_) rotate(now);
+        place(current_, key);
+        ++size_;
+        return true;
+    }
+
+    bool contains(uint64_t key) const {
+        key = fingerprint(key);
+        return find(current_, key) || find(previous_, key);
+    }
+
+private:
+    static constexpr uint64_t EMPTY = 0;
+
+    size_t mask_;
+    Clock::duration window_;
+    std::vector<uint64_t> current_;
+    std::vector<uint64_t> previous_;
+    size_t size_ = 0;   // keys in current_
+    Clock::time_point rotated_;
+
+    // Bijective mix (splitmix64 finalizer) so sequential ids spread over the
+    // table; the one key that maps to EMPTY is folded onto 1.
+    static uint64_t fingerprint(uint64_t key) {
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        key ^= key >> 31;
+        return key == EMPTY ? 1 : key;
+    }
+
+    // Tables are at most half full, so probing always reaches an empty slot.
+    bool find(const std::vector<uint64_t>& table, uint64_t key) const {
+        for (size_t i = key & mask_;; i = (i + 1) & mask_) {
+            if (table[i] == key) return true;
+            if (table[i] == EMPTY) return false;
+        }
+    }
+
+    void place(std::vector<uint64_t>& table, uint64_t key) {
+        size_t i = key & mask_;
+        while (table[i] != EMPTY) i = (i + 1) & mask_;
+        table[i] = key;
+    }
+
+    void rotate(Clock::time_point now) {
+        std::swap(current_, previous_);
+        std::fill(current_.begin(), current_.end(), EMPTY);
+        size_ = 0;
+        rotated_ = now;
+    }
+};
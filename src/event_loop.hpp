@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+#else
+    #include <poll.h>
+#endif
+
+// Readiness-based reactor. Uses edge-triggered epoll on Linux and falls back
+// to poll() elsewhere. Handlers must drain their fd until EAGAIN, which keeps
+// the two backends behaviourally identical.
+//
+// Everything except post() and stop() must be called from the loop thread.
+class EventLoop {
+public:
+    static constexpr uint32_t READABLE = 1u << 0;
+    static constexpr uint32_t WRITABLE = 1u << 1;
+    static constexpr uint32_t CLOSED   = 1u << 2;
+    static constexpr uint32_t ERRORED  = 1u << 3;   // error pending; recv() or the error queue reports it
+
+    using Handler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+
+    EventLoop() {
+#ifdef __linux__
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            throw std::runtime_error(std::string("Failed to create epoll instance: ") + strerror(errno));
+        }
+        wake_read_fd_ = wake_write_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_read_fd_ < 0) {
+            close(epoll_fd_);
+            throw std::runtime_error(std::string("Failed to create eventfd: ") + strerror(errno));
+        }
+#else
+        int fds[2];
+        if (pipe(fds) < 0) {
+            throw std::runtime_error(std::string("Failed to create wakeup pipe: ") + strerror(errno));
+        }
+        set_nonblocking(fds[0]);
+        set_nonblocking(fds[1]);
+        wake_read_fd_ = fds[0];
+        wake_write_fd_ = fds[1];
+#endif
+        add(wake_read_fd_, READABLE, [this](uint32_t) { drain_wakeups(); });
+    }
+
+    ~EventLoop() {
+        remove(wake_read_fd_);
+        close(wake_read_fd_);
+        if (wake_write_fd_ != wake_read_fd_) close(wake_write_fd_);
+#ifdef __linux__
+        close(epoll_fd_);
+#endif
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    static bool set_nonblocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    // Returns false if `fd` cannot be watched (epoll rejects regular files and
+    // some devices, e.g. /dev/null); such fds never block anyway.
+    bool add(int fd, uint32_t interest, Handler handler) {
+        if (static_cast<size_t>(fd) >= handlers_.size()) {
+            handlers_.resize(static_cast<size_t>(fd) + 1);
+        }
+        handlers_[fd] = std::move(handler);
+#ifdef __linux__
+        epoll_event ev{};
+        ev.events = to_epoll(interest);
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            handlers_[fd] = nullptr;
+            return false;
+        }
+#else
+        pollfds_.push_back(pollfd{fd, to_poll(interest), 0});
+#endif
+        return true;
+    }
+
+    void modify(int fd, uint32_t interest) {
+#ifdef __linux__
+        epoll_event ev{};
+        ev.events = to_epoll(interest);
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+#else
+        for (auto& p : pollfds_) {
+            if (p.fd == fd) p.events = to_poll(interest);
+        }
+#endif
+    }
+
+    // Safe to call from inside the fd's own handler.
+    void remove(int fd) {
+#ifdef __linux__
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+#else
+        for (auto& p : pollfds_) {
+            if (p.fd == fd) p.fd = -1;
+        }
+#endif
+        if (static_cast<size_t>(fd) < handlers_.size()) {
+            // Defer destruction: the handler being removed may be the one running.
+            graveyard_.push_back(std::move(handlers_[fd]));
+            handlers_[fd] = nullptr;
+        }
+    }
+
+    // Thread-safe: queue a task to run on the loop thread.
+    void post(Task task) {
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(tasks_mutex_);
+            was_empty = tasks_.empty();
+            tasks_.push_back(std::move(task));
+        }
+        if (was_empty) wake();
+    }
+
+    // Thread-safe: wakes the loop without queueing a task. The hook installed
+    // with on_wakeup() then runs on the loop thread; producers that hand work
+    // over through their own lock-free queues use this instead of post().
+    void notify() {
+        wake();
+    }
+
+    void on_wakeup(Task hook) {
+        wakeup_hook_ = std::move(hook);
+    }
+
+    // Runs `task` on the loop thread every `interval`, starting one interval from now.
+    void run_every(std::chrono::milliseconds interval, Task task) {
+        periodic_.push_back({Clock::now() + interval, interval, std::move(task)});
+    }
+
+    // Adds a timer that runs `task` on the loop thread once each time it is
+    // armed and comes due. It starts disarmed. Call before run().
+    size_t add_timer(Task task) {
+        periodic_.push_back({Clock::time_point::max(), {}, std::move(task)});
+        return periodic_.size() - 1;
+    }
+
+    // Thread-safe: arms `timer` for `when`, unless it is already due sooner.
+    void arm_timer(size_t timer, Clock::time_point when) {
+        if (!in_loop_thread()) {
+            post([this, timer, when] { arm_timer(timer, when); });
+            return;
+        }
+        periodic_[timer].due = std::min(periodic_[timer].due, when);
+    }
+
+    void run() {
+        running_ = true;
+        loop_thread_ = std::this_thread::get_id();
+#ifdef __linux__
+        std::vector<epoll_event> events(MAX_EVENTS);
+#endif
+        while (running_) {
+#ifdef __linux__
+            int n = epoll_wait(epoll_fd_, events.data(), MAX_EVENTS, next_timeout_ms());
+            if (n < 0 && errno != EINTR) break;
+            for (int i = 0; i < n; ++i) {
+                dispatch(events[i].data.fd, from_epoll(events[i].events));
+            }
+#else
+            int n = ::poll(pollfds_.data(), pollfds_.size(), next_timeout_ms());
+            if (n < 0 && errno != EINTR) break;
+            for (size_t i = 0; i < pollfds_.size() && n > 0; ++i) {
+                if (pollfds_[i].fd < 0 || pollfds_[i].revents == 0) continue;
+                --n;
+                dispatch(pollfds_[i].fd, from_poll(pollfds_[i].revents));
+            }
+            std::erase_if(pollfds_, [](const pollfd& p) { return p.fd < 0; });
+#endif
+            run_due_periodic();
+            graveyard_.clear();
+        }
+    }
+
+    // Thread-safe.
+    void stop() {
+        running_ = false;
+        wake();
+    }
+
+    bool in_loop_thread() const {
+        return loop_thread_ == std::this_thread::get_id();
+    }
+
+private:
+    static constexpr int MAX_EVENTS = 256;
+
+#ifdef __linux__
+    int epoll_fd_ = -1;
+#else
+    std::vector<pollfd> pollfds_;
+#endif
+    int wake_read_fd_ = -1;
+    int wake_write_fd_ = -1;
+    std::vector<Handler> handlers_;
+    std::vector<Handler> graveyard_;
+    struct Periodic {
+        Clock::time_point due;
+        std::chrono::milliseconds interval;   // 0 for a timer that runs once per arm_timer()
+        Task task;
+    };
+    std::vector<Periodic> periodic_;
+    std::mutex tasks_mutex_;
+    std::vector<Task> tasks_;
+    std::vector<Task> running_tasks_;   // loop thread only
+    Task wakeup_hook_;
+    std::atomic<bool> running_{false};
+    std::thread::id loop_thread_;
+
+    void dispatch(int fd, uint32_t events) {
+        if (static_cast<size_t>(fd) < handlers_.size() && handlers_[fd]) {
+            handlers_[fd](events);
+        }
+    }
+
+    int next_timeout_ms() const {
+        if (periodic_.empty()) return -1;
+        auto due = std::ranges::min(periodic_, {}, &Periodic::due).due;
+        if (due == Clock::time_point::max()) return -1;
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(due - Clock::now()).count();
+        return static_cast<int>(std::max<decltype(wait)>(wait, 0));
+    }
+
+    void run_due_periodic() {
+        auto now = Clock::now();
+        for (auto& p : periodic_) {
+            if (p.due <= now) {
+                p.due = p.interval.count() > 0 ? now + p.interval : Clock::time_point::max();
+                p.task();
+            }
+        }
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        [[maybe_unused]] auto n = write(wake_write_fd_, &one, sizeof(one));
+    }
+
+    void drain_wakeups() {
+        uint64_t buf[8];
+        while (read(wake_read_fd_, buf, sizeof(buf)) > 0) {}
+
+        {
+            std::lock_guard<std::mutex> lock(tasks_mutex_);
+            running_tasks_.swap(tasks_);
+        }
+        for (auto& task : running_tasks_) task();
+        running_tasks_.clear();   // keeps its capacity for the next swap, so posting does not allocate
+        if (wakeup_hook_) wakeup_hook_();
+    }
+
+#ifdef __linux__
+    static uint32_t to_epoll(uint32_t interest) {
+        uint32_t ev = EPOLLET | EPOLLRDHUP;
+        if (interest & READABLE) ev |= EPOLLIN;
+        if (interest & WRITABLE) ev |= EPOLLOUT;
+        return ev;
+    }
+
+    static uint32_t from_epoll(uint32_t ev) {
+        uint32_t out = 0;
+        if (ev & EPOLLIN) out |= READABLE;
+        if (ev & EPOLLOUT) out |= WRITABLE;
+        if (ev & (EPOLLHUP | EPOLLRDHUP)) out |= CLOSED | READABLE;
+        if (ev & EPOLLERR) out |= ERRORED | READABLE;
+        return out;
+    }
+#else
+    static short to_poll(uint32_t interest) {
+        short ev = 0;
+        if (interest & READABLE) ev |= POLLIN;
+        if (interest & WRITABLE) ev |= POLLOUT;
+        return ev;
+    }
+
+    static uint32_t from_poll(short ev) {
+        uint32_t out = 0;
+        if (ev & POLLIN) out |= READABLE;
+        if (ev & POLLOUT) out |= WRITABLE;
+        if (ev & (POLLHUP | POLLNVAL)) out |= CLOSED | READABLE;
+        if (ev & POLLERR) out |= ERRORED | READABLE;
+        return out;
+    }
+#endif
+};
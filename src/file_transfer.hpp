@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32c.hpp"
+#include "protocol.hpp"
+#include "text_scan.hpp"
+
+// Files streamed between two directly connected peers as FileChunk frames
+// (see protocol::FileOffer).
+namespace file_transfer {
+
+constexpr size_t CHUNK_SIZE = 64 * 1024;
+// File bytes sent but not yet acknowledged as stored. Chat shares the
+// connection, so this is also the most file data a message can be queued
+// behind when the receiver's disk is the bottleneck.
+constexpr uint64_t WINDOW = 2 * 1024 * 1024;
+constexpr uint64_t ACK_INTERVAL = WINDOW / 4;   // receiver acknowledges after storing this much
+
+namespace detail {
+    inline std::runtime_error io_error(const std::string& what, const std::filesystem::path& path) {
+        return std::runtime_error(what + " " + path.string() + ": " + strerror(errno));
+    }
+}
+
+// Offered names become paths in the download directory, so anything that
+// could point outside it is refused. They are also shown on the console,
+// so they must be UTF-8 without control characters.
+inline bool is_safe_name(std::string_view name) {
+    if (name == "." || name == ".." || name.size() > protocol::MAX_FILE_NAME) return false;
+    if (!text_scan::valid_name(name)) return false;
+    return name.find_first_of(std::string_view("/\\", 2)) == std::string_view::npos;
+}
+
+// Sending side. Each chunk is read with pread into one buffer, checksummed
+// there and handed to the socket as an iovec next to its 36-byte frame
+// header. The file is not mapped: a mapping faults with SIGBUS if the file
+// is truncated while it is sent, where a short read is an ordinary error.
+//
+// Chunks go out strictly in order. A chunk that is partly written must be
+// finished before anything else is written to the socket, which is what
+// in_flight() is for. Not thread-safe; the owning outbox's lock covers it.
+class FileSource {
+public:
+    FileSource(const std::string& path, uint64_t id, uint64_t sender) : id_(id), sender_(sender) {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) throw detail::io_error("Failed to open", path);
+        struct stat st{};
+        if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd_);
+            throw std::runtime_error("Not a regular file: " + path);
+        }
+        size_ = static_cast<uint64_t>(st.st_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        name_ = text_scan::truncate(std::filesystem::path(path).filename().string(), protocol::MAX_FILE_NAME);
+        // Same file, size and modification time: same contents, as far as a
+        // resume is concerned.
+        tag_ = size_ ^ (static_cast<uint64_t>(st.st_ino) << 32) ^ (static_cast<uint64_t>(st.st_mtime) * 1000000007ULL);
+    }
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    ~FileSource() {
+        ::close(fd_);
+    }
+
+    protocol::FileOffer offer() const {
+        return {id_, size_, tag_, name_};
+    }
+
+    uint64_t id() const { return id_; }
+    uint64_t size() const { return size_; }
+    const std::string& name() const { return name_; }
+    uint64_t offset() const { return offset_; }   // bytes fully sent, including any skipped by a resume
+    bool started() const { return started_; }
+    bool in_flight() const { return chunk_len_ > 0; }
+    bool finished() const { return started_ && !in_flight() && offset_ >= size_; }
+    bool cancelled() const { return cancelled_; }
+    bool failed() const { return failed_; }
+
+    // The receiver answered the offer; it already holds the first `offset` bytes.
+    void start(uint64_t offset) {
+        started_ = true;
+        offset_ = acked_ = std::min(offset, size_);
+    }
+
+    // The receiver has stored everything before `offset`.
+    void acknowledge(uint64_t offset) {
+        acked_ = std::clamp(offset, acked_, offset_);
+    }
+
+    // Whether another chunk may be started; false while waiting for the
+    // receiver to acknowledge.
+    bool window_open() const {
+        return offset_ < acked_ + WINDOW;
+    }
+
+    // Stops after the chunk in flight, if any.
+    void cancel() {
+        started_ = true;
+        cancelled_ = true;
+        size_ = in_flight() ? offset_ + chunk_len_ : offset_;
+    }
+
+    // Fills `iov` with what is left of the current chunk's frame, starting a
+    // new chunk if none is in flight. Returns the number of iovecs (at most
+    // 2), or 0 when the file has been sent or the window is full. If the
+    // file can no longer be read, for instance because it was truncated,
+    // the transfer is cancelled, failed() turns true and 0 is returned.
+    int pending(iovec* iov) {
+        if (!in_flight()) {
+            if (!started_ || offset_ >= size_ || !window_open()) return 0;
+            auto len = static_cast<uint32_t>(std::min<uint64_t>(CHUNK_SIZE, size_ - offset_));
+            if (!read_chunk(len)) {
+                failed_ = true;
+                cancel();
+                return 0;
+            }
+            chunk_len_ = len;
+            chunk_sent_ = 0;
+            protocol::write_file_chunk_header(header_, sender_,
+                {id_, offset_, crc32c::extend(0, chunk_.get(), chunk_len_)}, chunk_len_);
+        }
+        int count = 0;
+        if (chunk_sent_ < sizeof(header_)) {
+            iov[count++] = {header_ + chunk_sent_, sizeof(header_) - chunk_sent_};
+        }
+        size_t data_sent = chunk_sent_ > sizeof(header_) ? chunk_sent_ - sizeof(header_) : 0;
+        iov[count++] = {chunk_.get() + data_sent, chunk_len_ - data_sent};
+        return count;
+    }
+
+    // Records `written` bytes of pending() as sent.
+    void advance(size_t written) {
+        chunk_sent_ += written;
+        if (chunk_sent_ == sizeof(header_) + chunk_len_) {
+            offset_ += chunk_len_;
+            chunk_len_ = 0;
+        }
+    }
+
+private:
+    int fd_ = -1;
+    std::unique_ptr<char[]> chunk_ = std::make_unique<char[]>(CHUNK_SIZE);   // the chunk being sent
+    uint64_t size_ = 0;
+    uint64_t tag_ = 0;
+    uint64_t id_;
+    uint64_t sender_;
+    std::string name_;
+    bool started_ = false;
+    bool cancelled_ = false;
+    bool failed_ = false;
+    uint64_t offset_ = 0;
+    uint64_t acked_ = 0;
+
+    char header_[protocol::HEADER_SIZE + protocol::FILE_CHUNK_HEADER_SIZE];
+    uint32_t chunk_len_ = 0;   // file bytes in the chunk being sent; 0 when none is
+    size_t chunk_sent_ = 0;    // frame bytes of it already written
+
+    // Reads `len` bytes at offset_ into chunk_. False if the file ends
+    // early or cannot be read.
+    bool read_chunk(uint32_t len) {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd_, chunk_.get() + done, len - done, static_cast<off_t>(offset_ + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+// Receiving side. Verified chunks are appended to "<name>.<tag>.part" in the
+// download directory, so after a disconnect the part file's size is exactly
+// where the next offer of the same file resumes. The finished file is renamed
+// to `name`, or "name.1", "name.2"... if that is taken. Names are shortened,
+// at a character boundary, so that these still fit in NAME_MAX bytes.
+class FileSink {
+public:
+    FileSink(const std::filesystem::path& directory, const protocol::FileOffer& offer)
+        : directory_(directory), name_(offer.name), id_(offer.id), size_(offer.size) {
+        char tag[17];
+        std::snprintf(tag, sizeof(tag), "%016llx", static_cast<unsigned long long>(offer.tag));
+        std::filesystem::create_directories(directory_);
+        part_path_ = directory_ / with_suffix(name_, std::string(".") + tag + ".part");
+
+        fd_ = ::open(part_path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) throw detail::io_error("Failed to open", part_path_);
+        struct stat st{};
+        if (fstat(fd_, &st) != 0) {
+            ::close(fd_);
+            throw detail::io_error("Failed to stat", part_path_);
+        }
+        offset_ = static_cast<uint64_t>(st.st_size);
+        if (offset_ > size_ && ftruncate(fd_, 0) == 0) offset_ = 0;
+    }
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    ~FileSink() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    uint64_t id() const { return id_; }
+    uint64_t size() const { return size_; }
+    uint64_t offset() const { return offset_; }
+    bool complete() const { return offset_ == size_; }
+
+    // Verifies and stores the next chunk. Throws if it is out of order, fails
+    // its checksum or cannot be written; what was stored before is kept.
+    void write(const protocol::FileChunkHeader& chunk, std::string_view data) {
+        if (chunk.offset != offset_ || data.size() > size_ - offset_) {
+            throw std::runtime_error("chunk at " + std::to_string(chunk.offset) + " out of order");
+        }
+        if (crc32c::compute(data) != chunk.crc) {
+            throw std::runtime_error("checksum mismatch at offset " + std::to_string(chunk.offset));
+        }
+        while (!data.empty()) {
+            ssize_t n = pwrite(fd_, data.data(), data.size(), static_cast<off_t>(offset_));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw detail::io_error("Failed to write", part_path_);
+            offset_ += static_cast<uint64_t>(n);
+            data.remove_prefix(static_cast<size_t>(n));
+        }
+    }
+
+    // Gives the complete file its final name and returns it.
+    std::filesystem::path finish() {
+        ::close(fd_);
+        fd_ = -1;
+        std::filesystem::path target = directory_ / name_;
+        for (int n = 1; std::filesystem::exists(target); ++n) {
+            target = directory_ / with_suffix(name_, "." + std::to_string(n));
+        }
+        std::filesystem::rename(part_path_, target);
+        return target;
+    }
+
+private:
+    static std::string with_suffix(std::string_view name, std::string_view suffix) {
+        std::string result(text_scan::truncate(name, NAME_MAX - suffix.size()));
+        result += suffix;
+        return result;
+    }
+
+    std::filesystem::path directory_;
+    std::filesystem::path part_path_;
+    std::string name_;
+    uint64_t id_;
+    uint64_t size_;
+    uint64_t offset_ = 0;
+    int fd_ = -1;
+};
+
+}  // namespace file_transfer
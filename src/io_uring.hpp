@@ -0,0 +1,277 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+// Thin io_uring wrapper over the raw syscalls (no liburing dependency).
+// Covers what the relay needs: multishot accept, multishot recv into
+// provided buffers, and sendmsg, with submissions batched until submit().
+//
+// Not thread-safe: a ring belongs to one event loop.
+class IoUring {
+public:
+    // Multishot recv needs Linux 6.0. Only the major version from uname is
+    // checked; the ring setup itself fails on anything else missing.
+    static bool kernel_supported() {
+        utsname info{};
+        if (uname(&info) != 0) return false;
+        int major = 0;
+        return std::sscanf(info.release, "%d.", &major) == 1 && major >= 6;
+    }
+
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+            close(fd_);
+            throw std::runtime_error("io_uring kernel support is too old");
+        }
+
+        ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (ring_ == MAP_FAILED) {
+            close(fd_);
+            throw std::runtime_error(std::string("io_uring ring mmap failed: ") + strerror(errno));
+        }
+
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            munmap(ring_, ring_size_);
+            close(fd_);
+            throw std::runtime_error(std::string("io_uring sqe mmap failed: ") + strerror(errno));
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto* base = static_cast<char*>(ring_);
+        sq_tail_ = reinterpret_cast<std::atomic<uint32_t>*>(base + params.sq_off.tail);
+        sq_head_ = reinterpret_cast<std::atomic<uint32_t>*>(base + params.sq_off.head);
+        sq_mask_ = *reinterpret_cast<uint32_t*>(base + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<uint32_t*>(base + params.sq_off.array);
+        cq_head_ = reinterpret_cast<std::atomic<uint32_t>*>(base + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<std::atomic<uint32_t>*>(base + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t*>(base + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+        // The SQ index array is an identity map; fill it once.
+        for (uint32_t i = 0; i < sq_entries_; ++i) sq_array_[i] = i;
+        local_tail_ = sq_tail_->load(std::memory_order_relaxed);
+    }
+
+    ~IoUring() {
+        munmap(sqes_, sqes_size_);
+        munmap(ring_, ring_size_);
+        close(fd_);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Pollable: becomes readable when completions are waiting.
+    int fd() const { return fd_; }
+
+    // Returns a zeroed SQE. Submits the pending batch first if the queue is full.
+    io_uring_sqe* get_sqe() {
+        if (local_tail_ - sq_head_->load(std::memory_order_acquire) >= sq_entries_) {
+            submit();
+            if (local_tail_ - sq_head_->load(std::memory_order_acquire) >= sq_entries_) {
+                return nullptr;
+            }
+        }
+        io_uring_sqe* sqe = &sqes_[local_tail_ & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++local_tail_;
+        return sqe;
+    }
+
+    // Hands every SQE prepared since the last call to the kernel in one syscall.
+    int submit() {
+        uint32_t pending = local_tail_ - sq_tail_->load(std::memory_order_relaxed);
+        if (pending == 0) return 0;
+        sq_tail_->store(local_tail_, std::memory_order_release);
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, pending, 0, 0, nullptr, 0));
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    // Submits the pending batch and blocks until the completion tagged
+    // `user_data` arrives; returns its result. For setup only: any other
+    // completion seen meanwhile is discarded.
+    int submit_and_wait(uint64_t user_data) {
+        submit();
+        while (true) {
+            int result = 0;
+            bool found = false;
+            drain_completions([&](const io_uring_cqe& cqe) {
+                if (cqe.user_data == user_data) {
+                    result = cqe.res;
+                    found = true;
+                }
+            });
+            if (found) return result;
+            if (syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                return -errno;
+            }
+        }
+    }
+
+    // Calls fn(const io_uring_cqe&) for every available completion.
+    template <typename Fn>
+    unsigned drain_completions(Fn&& fn) {
+        unsigned count = 0;
+        uint32_t head = cq_head_->load(std::memory_order_relaxed);
+        while (head != cq_tail_->load(std::memory_order_acquire)) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            ++head;
+            // Release the slot before running the callback, which may submit more work.
+            cq_head_->store(head, std::memory_order_release);
+            fn(cqe);
+            ++count;
+        }
+        return count;
+    }
+
+    static void prep_multishot_accept(io_uring_sqe* sqe, int listen_fd, uint64_t user_data) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data;
+    }
+
+    static void prep_multishot_recv(io_uring_sqe* sqe, int fd, uint16_t buffer_group, uint64_t user_data) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = user_data;
+    }
+
+    static void prep_sendmsg(io_uring_sqe* sqe, int fd, const msghdr* msg, uint64_t user_data) {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data;
+    }
+
+private:
+    int fd_ = -1;
+    void* ring_ = nullptr;
+    size_t ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    std::atomic<uint32_t>* sq_head_ = nullptr;
+    std::atomic<uint32_t>* sq_tail_ = nullptr;
+    uint32_t* sq_array_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t sq_entries_ = 0;
+    uint32_t local_tail_ = 0;
+
+    std::atomic<uint32_t>* cq_head_ = nullptr;
+    std::atomic<uint32_t>* cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+// A group of provided buffers: the kernel picks a free one for each multishot
+// recv completion, so idle connections hold no receive memory at all.
+// Consumed buffers go back with IORING_OP_PROVIDE_BUFFERS, queued into the
+// ring's current batch. Successful returns post no completion; a failed one
+// completes with `user_data`.
+class ProvidedBuffers {
+public:
+    ProvidedBuffers(IoUring& ring, uint16_t group_id, uint16_t count, uint32_t buffer_size, uint64_t user_data)
+        : ring_(ring), group_id_(group_id), buffer_size_(buffer_size), user_data_(user_data),
+          storage_(std::make_unique<char[]>(static_cast<size_t>(count) * buffer_size)) {
+        waiting_.reserve(count);
+        // Hand the whole group over at once and wait for the result, so an
+        // unsupported kernel is reported here rather than on the first recv.
+        io_uring_sqe* sqe = ring_.get_sqe();
+        if (!sqe) throw std::runtime_error("io_uring submission queue full");
+        prep_provide(sqe, 0, count);
+        sqe->flags = 0;
+        sqe->user_data = user_data_;
+
+        int result = ring_.submit_and_wait(user_data_);
+        if (result < 0) {
+            throw std::runtime_error(std::string("IORING_OP_PROVIDE_BUFFERS failed: ") + strerror(-result));
+        }
+    }
+
+    ProvidedBuffers(const ProvidedBuffers&) = delete;
+    ProvidedBuffers& operator=(const ProvidedBuffers&) = delete;
+
+    uint16_t group_id() const { return group_id_; }
+
+    const char* data(uint16_t bid) const {
+        return storage_.get() + static_cast<size_t>(bid) * buffer_size_;
+    }
+
+    // Gives a consumed buffer back to the kernel with the next submit(). If
+    // the submission queue is still full after submitting, the buffer waits
+    // for a later recycle() or resupply() instead of being lost to the group.
+    void recycle(uint16_t bid) {
+        waiting_.push_back(bid);
+        resupply();
+    }
+
+    // Queues every waiting buffer that the submission queue has room for.
+    // Call before submit(), so buffers come back even when no receive
+    // completes because the group ran dry.
+    void resupply() {
+        while (!waiting_.empty()) {
+            io_uring_sqe* sqe = ring_.get_sqe();
+            if (!sqe) return;
+            prep_provide(sqe, waiting_.back(), 1);
+            waiting_.pop_back();
+        }
+    }
+
+private:
+    IoUring& ring_;
+    uint16_t group_id_;
+    uint32_t buffer_size_;
+    uint64_t user_data_;
+    std::unique_ptr<char[]> storage_;
+    std::vector<uint16_t> waiting_;   // consumed, not yet given back
+
+    void prep_provide(io_uring_sqe* sqe, uint16_t first_bid, uint16_t count) {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = count;
+        sqe->addr = reinterpret_cast<uint64_t>(data(first_bid));
+        sqe->len = buffer_size_;
+        sqe->off = first_bid;
+        sqe->buf_group = group_id_;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = user_data_;
+    }
+};
+
+#endif  // __linux__
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Asynchronous logging. A log call formats the line on the calling thread,
+// copies it into that thread's lock-free ring and returns; it never takes a
+// lock, flushes or blocks on the output. A background thread collects the
+// rings every few milliseconds, orders the lines by time and writes each
+// batch with one call per stream: Debug and Info go to stdout, Warn and Error
+// to stderr. If output falls so far behind that a ring fills, new lines from
+// that thread are dropped and counted rather than stalling the caller.
+namespace logging {
+
+enum class Level : uint8_t { Debug, Info, Warn, Error, Off };
+
+inline std::optional<Level> parse_level(std::string_view name) {
+    if (name == "debug") return Level::Debug;
+    if (name == "info") return Level::Info;
+    if (name == "warn") return Level::Warn;
+    if (name == "error") return Level::Error;
+    if (name == "off") return Level::Off;
+    return std::nullopt;
+}
+
+// Single-producer/single-consumer byte ring holding variable-length records.
+// Records are padded to 16 bytes so a header never straddles the wrap point.
+class LogRing {
+public:
+    static constexpr size_t CAPACITY = 256 * 1024;
+    static constexpr size_t MAX_TEXT = CAPACITY / 4;
+
+    struct Header {
+        uint32_t length;   // text bytes, or WRAP
+        Level level;
+        int64_t time_ns;
+    };
+    static_assert(sizeof(Header) == 16);
+    static constexpr uint32_t WRAP = UINT32_MAX;
+
+    LogRing() : buffer_(std::make_unique<char[]>(CAPACITY)) {}
+
+    // Producer thread only. Returns false, counting the drop, if the ring is full.
+    bool push(Level level, int64_t time_ns, std::string_view text) {
+        text = text.substr(0, MAX_TEXT);
+        size_t need = padded(sizeof(Header) + text.size());
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        size_t pos = head & (CAPACITY - 1);
+        size_t skip = CAPACITY - pos < need ? CAPACITY - pos : 0;
+
+        if (head + skip + need - tail > CAPACITY) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (skip > 0) {
+            header_at(pos) = Header{WRAP, level, 0};
+            head += skip;
+            pos = 0;
+        }
+        header_at(pos) = Header{static_cast<uint32_t>(text.size()), level, time_ns};
+        std::memcpy(buffer_.get() + pos + sizeof(Header), text.data(), text.size());
+        head_.store(head + need, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only. Calls fn(const Header&, std::string_view) for every
+    // record published so far; the views stay valid until release().
+    template <typename Fn>
+    void peek(Fn&& fn) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        while (tail != head) {
+            size_t pos = tail & (CAPACITY - 1);
+            const Header& header = header_at(pos);
+            if (header.length == WRAP) {
+                tail += CAPACITY - pos;
+                continue;
+            }
+            fn(header, std::string_view(buffer_.get() + pos + sizeof(Header), header.length));
+            tail += padded(sizeof(Header) + header.length);
+        }
+        peeked_ = tail;
+    }
+
+    // Frees everything returned by the last peek().
+    void release() {
+        tail_.store(peeked_, std::memory_order_release);
+    }
+
+    uint64_t take_dropped() {
+        return dropped_.exchange(0, std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::unique_ptr<char[]> buffer_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t peeked_ = 0;
+    std::atomic<uint64_t> dropped_{0};
+
+    static size_t padded(size_t size) {
+        return (size + 15) & ~size_t(15);
+    }
+
+    Header& header_at(size_t pos) {
+        return *reinterpret_cast<Header*>(buffer_.get() + pos);
+    }
+};
+
+class Logger {
+public:
+    static constexpr auto WRITE_INTERVAL = std::chrono::milliseconds(10);
+
+    // Lives for the whole process; pending lines are written at exit.
+    static Logger& instance() {
+        static Logger* logger = [] {
+            auto* created = new Logger();
+            std::atexit([] { instance().shutdown(); });
+            return created;
+        }();
+        return *logger;
+    }
+
+    void set_level(Level level) {
+        level_.store(level, std::memory_order_relaxed);
+    }
+
+    bool enabled(Level level) const {
+        return level != Level::Off && level >= level_.load(std::memory_order_relaxed);
+    }
+
+    // For interactive programs: every batch starts at the beginning of the
+    // line and is followed by `prompt`, so the input line is redrawn.
+    void set_prompt(std::string prompt) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        prompt_ = std::move(prompt);
+    }
+
+    // Any thread. Never blocks on output.
+    void write(Level level, std::string_view text) {
+        if (!enabled(level)) return;
+        thread_local std::shared_ptr<LogRing> ring = register_ring();
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        ring->push(level, std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), text);
+    }
+
+    // Blocks until every line logged before the call has been written.
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!running_) return;
+        uint64_t target = ++flush_requested_;
+        wake_.notify_one();
+        flushed_.wait(lock, [&] { return flush_done_ >= target || !running_; });
+    }
+
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) return;
+            running_ = false;
+        }
+        wake_.notify_one();
+        if (writer_.joinable()) writer_.join();
+    }
+
+private:
+    std::atomic<Level> level_{Level::Info};
+    std::mutex mutex_;   // guards the ring list, prompt and flush state; never taken by write()
+    std::condition_variable wake_;
+    std::condition_variable flushed_;
+    std::vector<std::shared_ptr<LogRing>> rings_;
+    std::string prompt_;
+    uint64_t flush_requested_ = 0;
+    uint64_t flush_done_ = 0;
+    bool running_ = true;
+    std::thread writer_;
+
+    struct Line {
+        int64_t time_ns;
+        Level level;
+        std::string_view text;
+    };
+
+    Logger() : writer_([this] { run(); }) {}
+
+    std::shared_ptr<LogRing> register_ring() {
+        auto ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(ring);
+        return ring;
+    }
+
+    void run() {
+        std::vector<std::shared_ptr<LogRing>> rings;
+        std::vector<Line> lines;
+        std::string out;
+        std::string err;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait_for(lock, WRITE_INTERVAL, [this] { return flush_requested_ > flush_done_ || !running_; });
+            bool stopping = !running_;
+            uint64_t flush_target = flush_requested_;
+            // Rings of threads that have exited are dropped once drained.
+            std::erase_if(rings_, [](const auto& ring) { return ring.use_count() == 1 && ring->empty(); });
+            rings = rings_;
+            std::string prompt = prompt_;
+            lock.unlock();
+
+            write_batch(rings, lines, out, err, prompt);
+            rings.clear();
+
+            lock.lock();
+            flush_done_ = flush_target;
+            flushed_.notify_all();
+            if (stopping) return;
+        }
+    }
+
+    void write_batch(std::vector<std::shared_ptr<LogRing>>& rings, std::vector<Line>& lines,
+                     std::string& out, std::string& err, const std::string& prompt) {
+        lines.clear();
+        uint64_t dropped = 0;
+        for (auto& ring : rings) {
+            ring->peek([&lines](const LogRing::Header& header, std::string_view text) {
+                lines.push_back(Line{header.time_ns, header.level, text});
+            });
+            dropped += ring->take_dropped();
+        }
+        if (lines.empty() && dropped == 0) return;
+
+        // Each ring is already in order; this interleaves threads by time.
+        std::ranges::stable_sort(lines, {}, &Line::time_ns);
+
+        out.clear();
+        err.clear();
+        for (const auto& line : lines) {
+            std::string& stream = line.level >= Level::Warn ? err : out;
+            stream.append(line.text);
+            stream.push_back('\n');
+        }
+        if (dropped > 0) {
+            err += "Logger: dropped " + std::to_string(dropped) + " line(s); output is too slow\n";
+        }
+        for (auto& ring : rings) ring->release();
+
+        if (!prompt.empty()) std::fputc('\r', stdout);
+        emit(stdout, out);
+        emit(stderr, err);
+        if (!prompt.empty()) {
+            std::fputs(prompt.c_str(), stdout);
+            std::fflush(stdout);
+        }
+    }
+
+    static void emit(std::FILE* stream, const std::string& text) {
+        if (text.empty()) return;
+        std::fwrite(text.data(), 1, text.size(), stream);
+        std::fflush(stream);
+    }
+};
+
+// Formats `args` with operator<< into one line and logs it. Nothing is
+// formatted when `level` is filtered out.
+template <typename... Args>
+void log(Level level, const Args&... args) {
+    if (!Logger::instance().enabled(level)) return;
+    thread_local std::ostringstream line;
+    line.str({});
+    (line << ... << args);
+    Logger::instance().write(level, line.view());
+}
+
+template <typename... Args> void debug(const Args&... args) { log(Level::Debug, args...); }
+template <typename... Args> void info(const Args&... args) { log(Level::Info, args...); }
+template <typename... Args> void warn(const Args&... args) { log(Level::Warn, args...); }
+template <typename... Args> void error(const Args&... args) { log(Level::Error, args...); }
+
+}  // namespace logging
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer_pool.hpp"
+#include "logger.hpp"
+#include "protocol.hpp"
+
+struct MessageLogConfig {
+    std::string directory;                          // empty: keep only the in-memory ring
+    size_t segment_bytes = 64 * 1024 * 1024;
+    size_t retention_bytes = 1024 * 1024 * 1024;    // 0: no size limit
+    std::chrono::hours retention_age{0};            // 0: no age limit
+    size_t ring_messages = 1024;                    // recent frames kept in memory
+    size_t index_interval = 64;                     // frames per sparse index entry
+};
+
+// Append-only history of relayed frames, numbered by a global sequence.
+//
+// On disk the log is a directory of segments. A segment file holds raw frames
+// back to back, exactly as they went over the wire, so replaying is a walk
+// over contiguous bytes of the mapping with nothing to decode or re-encode.
+// Next to each segment, a .idx file holds a sparse index of
+// (sequence, time, offset) entries, one every `index_interval` frames.
+// Segments are preallocated, written through a shared mapping, trimmed to size
+// when full and deleted oldest-first by the retention limits. The log survives
+// a process crash; it is not fsync'd, so it may lose the tail on power loss.
+//
+// The newest `ring_messages` frames are also kept in memory, so a short
+// catch-up never touches the segments.
+//
+// append() and read() may be called from any thread.
+class MessageLog {
+public:
+    MessageLog(BufferPool& pool, MessageLogConfig config) : pool_(pool), config_(std::move(config)) {
+        config_.index_interval = std::max<size_t>(config_.index_interval, 1);
+        if (config_.directory.empty()) return;
+
+        std::filesystem::create_directories(config_.directory);
+        recover();
+        std::lock_guard<std::mutex> lock(mutex_);
+        enforce_retention_locked();
+    }
+
+    MessageLog(const MessageLog&) = delete;
+    MessageLog& operator=(const MessageLog&) = delete;
+
+    // Records one complete frame and returns its sequence number.
+    uint64_t append(std::string_view frame) {
+        int64_t now = now_ms();
+        BufferSlice copy = config_.ring_messages > 0 ? pool_.copy(frame) : BufferSlice{};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t seq = next_seq_++;
+        if (config_.ring_messages > 0) {
+            ring_.push_back(RingEntry{seq, now, std::move(copy)});
+            if (ring_.size() > config_.ring_messages) ring_.pop_front();
+        }
+        if (disk_enabled_) write_locked(seq, now, frame);
+        return seq;
+    }
+
+    // Calls fn(std::string_view frame) for every retained frame from sequence
+    // `from` on, oldest first, stopping before the frame that would take the
+    // total past `max_bytes` (at least one frame is always passed). Starts at
+    // the oldest retained frame if `from` is older. Returns the sequence after
+    // the last frame passed.
+    template <typename Fn>
+    uint64_t read(uint64_t from, size_t max_bytes, Fn&& fn) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        from = std::max(from, first_seq_locked());
+        if (from >= next_seq_) return next_seq_;
+
+        if (!ring_.empty() && from >= ring_.front().seq) {
+            std::vector<BufferSlice> frames;
+            size_t bytes = 0;
+            for (auto it = ring_.begin() + static_cast<ptrdiff_t>(from - ring_.front().seq); it != ring_.end(); ++it) {
+                if (!frames.empty() && bytes + it->frame.size() > max_bytes) break;
+                bytes += it->frame.size();
+                frames.push_back(it->frame);
+            }
+            lock.unlock();
+
+            for (const auto& frame : frames) fn(frame.view());
+            return from + frames.size();
+        }
+
+        // Older than the ring: seek with the index under the lock, then walk the
+        // mappings without it. Holding the segments keeps them mapped even if
+        // retention drops them meanwhile.
+        auto first = std::upper_bound(segments_.begin(), segments_.end(), from,
+            [](uint64_t seq, const auto& segment) { return seq < segment->base_seq; });
+        std::vector<std::shared_ptr<Segment>> segments(std::prev(first), segments_.end());
+
+        const auto& index = segments.front()->index;
+        auto entry = std::upper_bound(index.begin(), index.end(), from,
+            [](uint64_t seq, const IndexEntry& e) { return seq < e.seq; });
+        uint64_t seq = segments.front()->base_seq;
+        size_t offset = 0;
+        if (entry != index.begin()) {
+            seq = std::prev(entry)->seq;
+            offset = std::prev(entry)->offset;
+        }
+        lock.unlock();
+
+        size_t bytes = 0;
+        for (size_t i = 0; i < segments.size(); ++i) {
+            const Segment& segment = *segments[i];
+            if (i > 0) {
+                seq = segment.base_seq;
+                offset = 0;
+            }
+            size_t used = segment.used.load(std::memory_order_acquire);
+            while (offset + protocol::HEADER_SIZE <= used) {
+                size_t size = protocol::HEADER_SIZE + protocol::detail::get_u32(segment.data + offset);
+                if (seq >= from) {
+                    if (bytes > 0 && bytes + size > max_bytes) return seq;
+                    fn(std::string_view(segment.data + offset, size));
+                    bytes += size;
+                }
+                offset += size;
+                ++seq;
+            }
+        }
+        return seq;
+    }
+
+    // Sequence of the oldest frame written at or after `time_ms`. Resolved
+    // exactly within the ring and to the index interval on disk, erring on the
+    // side of older frames.
+    uint64_t seq_at_time(int64_t time_ms) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!ring_.empty() && time_ms >= ring_.front().time_ms) {
+            auto it = std::ranges::find_if(ring_, [time_ms](const RingEntry& e) { return e.time_ms >= time_ms; });
+            return it == ring_.end() ? next_seq_ : it->seq;
+        }
+
+        uint64_t seq = first_seq_locked();
+        for (const auto& segment : segments_) {
+            for (const auto& entry : segment->index) {
+                if (entry.time_ms >= time_ms) return seq;
+                seq = entry.seq;
+            }
+        }
+        return seq;
+    }
+
+    uint64_t first_seq() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return first_seq_locked();
+    }
+
+    uint64_t next_seq() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return next_seq_;
+    }
+
+    // Applies the age limit; size limits are also enforced on every rollover.
+    void enforce_retention() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enforce_retention_locked();
+    }
+
+private:
+    struct IndexEntry {
+        uint64_t seq;
+        int64_t time_ms;
+        uint64_t offset;
+    };
+
+    struct Segment {
+        uint64_t base_seq = 0;
+        std::filesystem::path path;
+        int fd = -1;
+        int index_fd = -1;
+        char* data = nullptr;
+        size_t capacity = 0;
+        std::atomic<size_t> used{0};     // frames below this offset are complete
+        uint64_t count = 0;              // frames written; guarded by the log mutex
+        std::vector<IndexEntry> index;   // guarded by the log mutex
+
+        Segment() = default;
+        Segment(const Segment&) = delete;
+        Segment& operator=(const Segment&) = delete;
+
+        ~Segment() {
+            if (data) munmap(data, capacity);
+            if (fd >= 0) close(fd);
+            if (index_fd >= 0) close(index_fd);
+        }
+
+        std::filesystem::path index_path() const {
+            return std::filesystem::path(path).replace_extension(".idx");
+        }
+    };
+
+    struct RingEntry {
+        uint64_t seq;
+        int64_t time_ms;
+        BufferSlice frame;
+    };
+
+    BufferPool& pool_;
+    MessageLogConfig config_;
+    std::mutex mutex_;
+    uint64_t next_seq_ = 0;
+    std::deque<RingEntry> ring_;
+    std::deque<std::shared_ptr<Segment>> segments_;
+    bool disk_enabled_ = false;
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static std::runtime_error io_error(const std::string& what, const std::filesystem::path& path) {
+        return std::runtime_error(what + " " + path.string() + ": " + strerror(errno));
+    }
+
+    uint64_t first_seq_locked() const {
+        if (!segments_.empty()) return segments_.front()->base_seq;
+        if (!ring_.empty()) return ring_.front().seq;
+        return next_seq_;
+    }
+
+    // Segment files are named after their first sequence number, zero-padded
+    // so they sort in order.
+    std::filesystem::path segment_path(uint64_t base_seq) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%020llu.log", static_cast<unsigned long long>(base_seq));
+        return std::filesystem::path(config_.directory) / name;
+    }
+
+    void map(Segment& segment, size_t capacity) {
+        void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+        if (data == MAP_FAILED) throw io_error("Failed to map", segment.path);
+        segment.data = static_cast<char*>(data);
+        segment.capacity = capacity;
+    }
+
+    std::shared_ptr<Segment> create_segment(uint64_t base_seq, size_t capacity) {
+        auto segment = std::make_shared<Segment>();
+        segment->base_seq = base_seq;
+        segment->path = segment_path(base_seq);
+
+        segment->fd = open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (segment->fd < 0) throw io_error("Failed to create", segment->path);
+        // Reserve the blocks up front: running out of disk while writing through
+        // the mapping would raise SIGBUS instead of returning an error.
+        if (int err = posix_fallocate(segment->fd, 0, static_cast<off_t>(capacity)); err != 0) {
+            errno = err;
+            throw io_error("Failed to allocate", segment->path);
+        }
+        segment->index_fd = open(segment->index_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (segment->index_fd < 0) throw io_error("Failed to create", segment->index_path());
+
+        map(*segment, capacity);
+        return segment;
+    }
+
+    // Reopens the segments left by a previous run and finds where the newest
+    // one ends: the index gives the last checkpoint, and frames are walked from
+    // there until the zeroed, preallocated tail.
+    void recover() {
+        std::vector<std::pair<uint64_t, std::filesystem::path>> found;
+        for (const auto& file : std::filesystem::directory_iterator(config_.directory)) {
+            if (file.path().extension() != ".log") continue;
+            std::string stem = file.path().stem().string();
+            uint64_t base_seq = 0;
+            auto [end, ec] = std::from_chars(stem.data(), stem.data() + stem.size(), base_seq);
+            if (ec == std::errc{} && end == stem.data() + stem.size()) found.emplace_back(base_seq, file.path());
+        }
+        std::ranges::sort(found);
+
+        for (auto& [base_seq, path] : found) {
+            auto segment = std::make_shared<Segment>();
+            segment->base_seq = base_seq;
+            segment->path = path;
+            segment->fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+            if (segment->fd < 0) throw io_error("Failed to open", path);
+
+            struct stat info{};
+            if (fstat(segment->fd, &info) != 0) throw io_error("Failed to stat", path);
+            if (info.st_size == 0) continue;
+            map(*segment, static_cast<size_t>(info.st_size));
+
+            load_index(*segment);
+            uint64_t seq = base_seq;
+            size_t offset = 0;
+            if (!segment->index.empty()) {
+                seq = segment->index.back().seq;
+                offset = segment->index.back().offset;
+            }
+            while (offset + protocol::HEADER_SIZE <= segment->capacity) {
+                auto header = protocol::read_header(segment->data + offset);
+                size_t size = protocol::HEADER_SIZE + header.length;
+                if (header.version != protocol::PROTOCOL_VERSION || offset + size > segment->capacity) break;
+                offset += size;
+                ++seq;
+            }
+            segment->used.store(offset, std::memory_order_relaxed);
+            segment->count = seq - base_seq;
+            next_seq_ = seq;
+            segments_.push_back(std::move(segment));
+        }
+
+        disk_enabled_ = true;
+        if (!segments_.empty()) {
+            logging::info("Message log: recovered ", segments_.size(), " segment(s), sequences ",
+                          segments_.front()->base_seq, "-", next_seq_);
+        }
+    }
+
+    void load_index(Segment& segment) {
+        segment.index_fd = open(segment.index_path().c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (segment.index_fd < 0) throw io_error("Failed to open", segment.index_path());
+
+        IndexEntry entry{};
+        while (::read(segment.index_fd, &entry, sizeof(entry)) == static_cast<ssize_t>(sizeof(entry))) {
+            if (entry.offset >= segment.capacity || entry.seq < segment.base_seq) break;
+            segment.index.push_back(entry);
+        }
+    }
+
+    void write_locked(uint64_t seq, int64_t now, std::string_view frame) {
+        Segment* segment = segments_.empty() ? nullptr : segments_.back().get();
+        if (!segment || segment->used.load(std::memory_order_relaxed) + frame.size() > segment->capacity) {
+            segment = roll_locked(seq, frame.size());
+            if (!segment) return;
+        }
+
+        size_t offset = segment->used.load(std::memory_order_relaxed);
+        std::memcpy(segment->data + offset, frame.data(), frame.size());
+        if (segment->count % config_.index_interval == 0) {
+            IndexEntry entry{seq, now, offset};
+            segment->index.push_back(entry);
+            if (::write(segment->index_fd, &entry, sizeof(entry)) != static_cast<ssize_t>(sizeof(entry))) {
+                logging::error("Message log: failed to write index ", segment->index_path(), ": ", strerror(errno));
+            }
+        }
+        segment->count++;
+        segment->used.store(offset + frame.size(), std::memory_order_release);
+    }
+
+    // Trims the full segment to its contents and starts the next one. A frame
+    // bigger than a segment gets a segment of its own size. On I/O failure the
+    // log keeps running from memory only.
+    Segment* roll_locked(uint64_t seq, size_t min_capacity) {
+        if (!segments_.empty()) {
+            Segment& full = *segments_.back();
+            if (ftruncate(full.fd, static_cast<off_t>(full.used.load(std::memory_order_relaxed))) != 0) {
+                logging::error("Message log: failed to trim ", full.path, ": ", strerror(errno));
+            }
+        }
+
+        try {
+            segments_.push_back(create_segment(seq, std::max(config_.segment_bytes, min_capacity)));
+        } catch (const std::exception& e) {
+            logging::error("Message log: ", e.what(), "; continuing without disk history");
+            disk_enabled_ = false;
+            return nullptr;
+        }
+        enforce_retention_locked();
+        return segments_.back().get();
+    }
+
+    // Drops whole segments, oldest first; the active segment always stays.
+    void enforce_retention_locked() {
+        size_t total = 0;
+        for (const auto& segment : segments_) total += segment->used.load(std::memory_order_relaxed);
+        int64_t cutoff = now_ms() - std::chrono::duration_cast<std::chrono::milliseconds>(config_.retention_age).count();
+
+        while (segments_.size() > 1) {
+            const Segment& oldest = *segments_.front();
+            // Everything in a segment predates the first frame of the next one.
+            const auto& next_index = segments_[1]->index;
+            bool too_big = config_.retention_bytes > 0 && total > config_.retention_bytes;
+            bool too_old = config_.retention_age.count() > 0 && !next_index.empty() && next_index.front().time_ms < cutoff;
+            if (!too_big && !too_old) break;
+
+            total -= oldest.used.load(std::memory_order_relaxed);
+            std::error_code ec;
+            std::filesystem::remove(oldest.path, ec);
+            std::filesystem::remove(oldest.index_path(), ec);
+            segments_.pop_front();
+        }
+    }
+};
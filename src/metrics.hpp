@@ -0,0 +1,312 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Counters, gauges and latency histograms cheap enough for the relay's hot
+// path. Every thread updates only its own block of metrics (PerThread<T>), so
+// an update is a relaxed load and store with no locked instruction and no
+// shared cache line; readers sum the blocks when they render. Output is the
+// Prometheus text exposition format.
+namespace metrics {
+
+// Monotonic count. Only the owning thread may add().
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Last sampled value. Only the owning thread may set().
+class Gauge {
+public:
+    void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Log-linear histogram in the style of HdrHistogram. Values below 16 get a
+// bucket each; larger values fall into one of 16 linear sub-buckets of their
+// power of two, so any 64-bit value is recorded within 1/16 (~6%) of its true
+// size in a fixed 976-bucket array. Only the owning thread may record().
+class Histogram {
+public:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    void record(uint64_t value) {
+        bump(buckets_[bucket_of(value)], 1);
+        bump(count_, 1);
+        bump(sum_, value);
+        if (value > max_.load(std::memory_order_relaxed)) max_.store(value, std::memory_order_relaxed);
+    }
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        unsigned shift = static_cast<unsigned>(std::bit_width(value)) - 1 - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((value >> shift) - SUB_BUCKETS);
+    }
+
+    // Largest value that lands in `bucket`.
+    static uint64_t bucket_limit(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+        uint64_t low = static_cast<uint64_t>(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return low + ((uint64_t{1} << shift) - 1);
+    }
+
+    // A point-in-time copy that histograms from several threads merge into.
+    struct Snapshot {
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS);
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        void merge(const Histogram& histogram) {
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                buckets[i] += histogram.buckets_[i].load(std::memory_order_relaxed);
+            }
+            count += histogram.count_.load(std::memory_order_relaxed);
+            sum += histogram.sum_.load(std::memory_order_relaxed);
+            max = std::max(max, histogram.max_.load(std::memory_order_relaxed));
+        }
+
+        // Upper bound of the bucket holding the q-quantile (0 < q <= 1),
+        // clamped to the largest value seen.
+        uint64_t quantile(double q) const {
+            if (count == 0) return 0;
+            auto rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count)));
+            rank = std::clamp<uint64_t>(rank, 1, count);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += buckets[i];
+                if (seen >= rank) return std::min(bucket_limit(i), max);
+            }
+            return max;
+        }
+    };
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+
+    static void bump(std::atomic<uint64_t>& value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+// One T per thread that touches it. Blocks are never freed, so totals do not
+// go backwards when a thread exits.
+template <typename T>
+class PerThread {
+public:
+    static T& local() {
+        thread_local T* mine = add();
+        return *mine;
+    }
+
+    // Calls fn(const T&) for every thread's block.
+    template <typename Fn>
+    static void for_each(Fn&& fn) {
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const auto& block : s.blocks) fn(std::as_const(*block));
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<T>> blocks;
+    };
+
+    // Leaked so blocks outlive threads still running during static destruction.
+    static State& state() {
+        static State* s = new State();
+        return *s;
+    }
+
+    static T* add() {
+        auto block = std::make_unique<T>();
+        T* raw = block.get();
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.blocks.push_back(std::move(block));
+        return raw;
+    }
+};
+
+// Builds a Prometheus text exposition page.
+class TextWriter {
+public:
+    void counter(std::string_view name, std::string_view help, uint64_t value) {
+        describe(name, help, "counter");
+        sample(name, {}, std::to_string(value));
+    }
+
+    void gauge(std::string_view name, std::string_view help, int64_t value) {
+        describe(name, help, "gauge");
+        sample(name, {}, std::to_string(value));
+    }
+
+    // Exported as a summary: fixed quantiles plus _sum and _count.
+    void summary(std::string_view name, std::string_view help, const Histogram::Snapshot& histogram) {
+        describe(name, help, "summary");
+        static constexpr std::pair<const char*, double> QUANTILES[] = {
+            {"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999}, {"1", 1.0}};
+        for (auto [label, q] : QUANTILES) {
+            sample(name, std::string("quantile=\"") + label + "\"", std::to_string(histogram.quantile(q)));
+        }
+        sample(std::string(name) + "_sum", {}, std::to_string(histogram.sum));
+        sample(std::string(name) + "_count", {}, std::to_string(histogram.count));
+    }
+
+    std::string take() { return std::move(out_); }
+
+private:
+    std::string out_;
+
+    void describe(std::string_view name, std::string_view help, std::string_view type) {
+        out_.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out_.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    void sample(std::string_view name, std::string_view labels, const std::string& value) {
+        out_.append(name);
+        if (!labels.empty()) out_.append("{").append(labels).append("}");
+        out_.append(" ").append(value).append("\n");
+    }
+};
+
+// Serves render() over plain HTTP on 127.0.0.1:port from its own thread, so
+// a scrape never runs on an event loop. GET /metrics (or /) only, one request
+// per connection.
+class HttpExporter {
+public:
+    HttpExporter(int port, std::function<std::string()> render) : render_(std::move(render)) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            throw std::runtime_error("Failed to create metrics socket");
+        }
+        int opt = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd_, 16) < 0) {
+            std::string reason = strerror(errno);
+            close(listen_fd_);
+            throw std::runtime_error("Failed to listen for metrics on port " + std::to_string(port) + ": " + reason);
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~HttpExporter() {
+        running_.store(false, std::memory_order_relaxed);
+        shutdown(listen_fd_, SHUT_RDWR);   // wakes the blocking accept()
+        if (thread_.joinable()) thread_.join();
+        close(listen_fd_);
+    }
+
+    HttpExporter(const HttpExporter&) = delete;
+    HttpExporter& operator=(const HttpExporter&) = delete;
+
+private:
+    static constexpr size_t MAX_REQUEST = 8 * 1024;
+
+    int listen_fd_ = -1;
+    std::function<std::string()> render_;
+    std::atomic<bool> running_{true};
+    std::thread thread_;
+
+    void run() {
+        while (running_.load(std::memory_order_relaxed)) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            serve(fd);
+            close(fd);
+        }
+    }
+
+    void serve(int fd) {
+        // A stuck scraper must not hold the exporter forever.
+        timeval timeout{2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_REQUEST) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            request.append(buffer, static_cast<size_t>(n));
+        }
+
+        std::string_view line(request);
+        line = line.substr(0, line.find("\r\n"));
+        std::string status = "200 OK";
+        std::string body;
+        if (!line.starts_with("GET ")) {
+            status = "405 Method Not Allowed";
+        } else {
+            std::string_view path = line.substr(4, line.find(' ', 4) - 4);
+            path = path.substr(0, path.find('?'));
+            if (path == "/metrics" || path == "/") {
+                body = render_();
+            } else {
+                status = "404 Not Found";
+            }
+        }
+
+        std::string response = "HTTP/1.1 " + status + "\r\n"
+                               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            sent += static_cast<size_t>(n);
+        }
+    }
+};
+
+}  // namespace metrics
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+
+#include "buffer_pool.hpp"
+
+// What to do when a consumer falls behind its queue limits.
+enum class SlowConsumerPolicy {
+    DropOldest,   // evict queued messages from the front until within limits
+    DropNewest,   // refuse the incoming message
+    Disconnect    // report overflow so the owner can close the connection
+};
+
+inline std::optional<SlowConsumerPolicy> parse_slow_consumer_policy(std::string_view name) {
+    if (name == "drop-oldest") return SlowConsumerPolicy::DropOldest;
+    if (name == "drop-newest") return SlowConsumerPolicy::DropNewest;
+    if (name == "disconnect") return SlowConsumerPolicy::Disconnect;
+    return std::nullopt;
+}
+
+struct OutboundLimits {
+    size_t max_bytes = 4 * 1024 * 1024;
+    std::chrono::milliseconds max_lag{10000};   // 0 disables the lag check
+    SlowConsumerPolicy policy = SlowConsumerPolicy::Disconnect;
+};
+
+// Bounded, per-connection queue of outbound messages. Entries are slices of
+// shared buffers, so one message queued on many connections is stored once.
+//
+// Producers on any thread push(); the owning event loop drains the queue with
+// begin_flush()/end_flush() around a non-blocking writev. No lock is held
+// during the write itself: the messages handed out by begin_flush() are pinned
+// so DropOldest cannot evict them mid-write.
+class OutboundQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class PushStatus {
+        Queued,     // queued within the limits
+        Evicted,    // queued after evicting older messages (DropOldest)
+        Dropped,    // refused
+        Overflow    // the Disconnect policy was triggered
+    };
+
+    struct PushResult {
+        PushStatus status = PushStatus::Queued;
+        size_t evicted = 0;   // older messages discarded to make room, whether or not this one was queued
+    };
+
+    struct Stats {
+        size_t queued_bytes = 0;
+        size_t queued_messages = 0;
+        size_t dropped_messages = 0;
+        std::chrono::milliseconds lag{0};
+    };
+
+    explicit OutboundQueue(OutboundLimits limits = {}) : limits_(limits) {}
+
+    // Returns Queued, Evicted (queued, but older messages were discarded),
+    // Dropped (message refused), or Overflow when the Disconnect policy has
+    // been triggered, with the number of messages evicted. `was_empty` is set
+    // when the queue had nothing pending, i.e. the caller must schedule a flush.
+    // `done`, if given, is held until the message has been fully written or
+    // discarded; a deleter on it observes delivery.
+    PushResult push(const BufferSlice& message, bool& was_empty, std::shared_ptr<const void> done = {}) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        was_empty = entries_.empty();
+
+        if (over_limits(message.size(), now)) {
+            switch (limits_.policy) {
+            case SlowConsumerPolicy::Disconnect:
+                return {PushStatus::Overflow};
+            case SlowConsumerPolicy::DropNewest:
+                ++dropped_;
+                return {PushStatus::Dropped};
+            case SlowConsumerPolicy::DropOldest: {
+                size_t evicted = evict_until_within_limits(message.size(), now);
+                if (bytes_ + message.size() > limits_.max_bytes) {
+                    ++dropped_;
+                    return {PushStatus::Dropped, evicted};
+                }
+                entries_.push_back({message, now, std::move(done)});
+                bytes_ += message.size();
+                return {evicted > 0 ? PushStatus::Evicted : PushStatus::Queued, evicted};
+            }
+            }
+        }
+
+        entries_.push_back({message, now, std::move(done)});
+        bytes_ += message.size();
+        return {PushStatus::Queued};
+    }
+
+    // Fills up to `max` iovecs with pending data and pins those messages until
+    // end_flush(). Returns the number of iovecs filled.
+    int begin_flush(iovec* iov, int max) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int count = 0;
+        size_t offset = front_offset_;
+        for (auto it = entries_.begin(); it != entries_.end() && count < max; ++it) {
+            iov[count].iov_base = const_cast<char*>(it->data.data()) + offset;
+            iov[count].iov_len = it->data.size() - offset;
+            offset = 0;
+            ++count;
+        }
+        pinned_ = static_cast<size_t>(count);
+        return count;
+    }
+
+    // Consumes `written` bytes from the front and releases the pin. Returns true
+    // when data remains queued.
+    bool end_flush(size_t written) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytes_ -= written;
+        while (written > 0) {
+            auto& front = entries_.front();
+            size_t remaining = front.data.size() - front_offset_;
+            if (written < remaining) {
+                front_offset_ += written;
+                break;
+            }
+            written -= remaining;
+            front_offset_ = 0;
+            entries_.pop_front();
+        }
+        pinned_ = 0;
+        return !entries_.empty();
+    }
+
+    // Buffer backing the first iovec of the current flush; lets the owner keep
+    // it alive past end_flush() when the kernel still references it (MSG_ZEROCOPY).
+    BufferRef front_buffer() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.empty() ? BufferRef() : entries_.front().data.buffer;
+    }
+
+    // True when the queue violates its limits under the Disconnect policy;
+    // lets the owner reap stalled consumers even when no new messages arrive.
+    bool stalled() const {
+        if (limits_.policy != SlowConsumerPolicy::Disconnect) return false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        return over_limits(0, Clock::now());
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats s;
+        s.queued_bytes = bytes_;
+        s.queued_messages = entries_.size();
+        s.dropped_messages = dropped_;
+        if (!entries_.empty()) {
+            s.lag = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - entries_.front().enqueued);
+        }
+        return s;
+    }
+
+private:
+    struct Entry {
+        BufferSlice data;
+        Clock::time_point enqueued;
+        std::shared_ptr<const void> done;
+    };
+
+    OutboundLimits limits_;
+    mutable std::mutex mutex_;
+    std::deque<Entry> entries_;
+    size_t front_offset_ = 0;   // bytes of entries_.front() already written
+    size_t bytes_ = 0;          // unsent bytes across all entries
+    size_t pinned_ = 0;         // front entries currently handed to writev
+    size_t dropped_ = 0;
+
+    bool over_limits(size_t incoming, Clock::time_point now) const {
+        if (bytes_ + incoming > limits_.max_bytes) return true;
+        if (limits_.max_lag.count() > 0 && !entries_.empty()) {
+            return now - entries_.front().enqueued > limits_.max_lag;
+        }
+        return false;
+    }
+
+    // Never evicts pinned or partially written messages, so the byte stream a
+    // consumer sees is always made of whole messages.
+    // Returns the number of messages evicted.
+    size_t evict_until_within_limits(size_t incoming, Clock::time_point now) {
+        size_t evicted = 0;
+        size_t keep = std::max(pinned_, front_offset_ > 0 ? size_t{1} : size_t{0});
+        while (entries_.size() > keep) {
+            auto victim = entries_.begin() + static_cast<std::ptrdiff_t>(keep);
+            bool too_big = bytes_ + incoming > limits_.max_bytes;
+            bool too_old = limits_.max_lag.count() > 0 && now - victim->enqueued > limits_.max_lag;
+            if (!too_big && !too_old) break;
+            bytes_ -= victim->data.size();
+            entries_.erase(victim);
+            ++dropped_;
+            ++evicted;
+        }
+        return evicted;
+    }
+};
@@ -4,16 +4,24 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
 #include <cstring>
 #include <format>
 #include <chrono>
+#include <ctime>
+#include <iterator>
 #include <ranges>
 #include <expected>
 #include <span>
 #include <optional>
 #include <algorithm>
 #include <cerrno>
+#include <random>
+#include <atomic>
+#include <string_view>
+#include <map>
+#include <memory>
+#include <charconv>
+#include <unordered_map>
 
 #ifdef _WIN32
     #include <winsock2.h>
@@ -25,6 +33,7 @@
     #include <unistd.h>
     #include <sys/socket.h>
     #include <netinet/in.h>
+    #include <netinet/tcp.h>
     #include <arpa/inet.h>
     #include <fcntl.h>
     #define INVALID_SOCKET -1
@@ -33,31 +42,314 @@
     typedef int SOCKET;
 #endif
 
+#include "logger.hpp"
+#include "protocol.hpp"
+#include "slot_map.hpp"
+#include "dedup_cache.hpp"
+#include "mpsc_queue.hpp"
+#include "buffer_pool.hpp"
+#include "compression.hpp"
+#ifndef _WIN32
+    #include <poll.h>
+    #include <sys/uio.h>
+    #include "event_loop.hpp"
+    #include "file_transfer.hpp"
+    #include "outbound_queue.hpp"
+    #include "reliable_udp.hpp"
+    #include "secure_link.hpp"
+    #include "timer_wheel.hpp"
+#endif
+
+struct ChatOptions {
+    int port = 8888;
+    bool reactor = false;           // single event loop instead of a thread per peer
+    uint8_t gossip_ttl = 16;        // times a message may be forwarded
+    size_t gossip_fanout = 0;       // peers each message is forwarded to; 0 means all
+    std::chrono::microseconds coalesce_window{200};   // how long outgoing messages may wait to share a write
+    size_t coalesce_bytes = 64 * 1024;                // ...unless this much is already waiting
+    std::string download_dir = "downloads";           // where accepted files are saved
+    bool udp = false;                 // offer and accept the datagram transport on peer links
+    bool udp_unordered = false;       // deliver datagram frames as they arrive, not per sender in order
+    double udp_loss = 0;              // simulated: fraction of sent datagrams dropped
+    std::chrono::milliseconds udp_delay{0};           // simulated: delay added to sent datagrams
+    bool compress = false;            // offer and accept compression on peer links
+    std::chrono::seconds heartbeat_interval{5};   // heartbeat on every link this often; 0 disables
+    std::chrono::seconds idle_timeout{15};        // drop a peer that sends heartbeats once silent this long; 0 disables
+    std::chrono::seconds handshake_timeout{10};   // drop a peer we connected to that has not answered by then; 0 disables
+    std::chrono::seconds stall_timeout{30};       // drop a peer whose socket took nothing for this long; 0 disables
+    std::string secret;               // shared by the group: authenticates links and seals chat through relays
+    bool plaintext_relays = false;    // without a secret, still link to relays, which then see chat in the clear
+};
+
 class P2PChat {
 private:
     static constexpr int DEFAULT_PORT = 8888;
-    static constexpr int BUFFER_SIZE = 1024;
+    static constexpr size_t MAX_PENDING_BYTES = 8 * 1024 * 1024;   // unsent bytes before a peer is dropped
+    static constexpr int MAX_IOVECS = 64;
+    static constexpr size_t INBOX_CAPACITY = 4096;   // received messages waiting to be displayed
+    static constexpr size_t RENDER_BATCH = 256;      // messages written to the console at once
+    static constexpr auto BLOCKED_RETRY = std::chrono::milliseconds(1);   // writer: longest new messages wait while it polls full sockets
+    static constexpr size_t CHUNKS_PER_FLUSH = 16;   // file chunks written to one peer before the writer moves on
+    static constexpr size_t MAX_INCOMING = 64;       // file offers waiting for /accept or being downloaded
+    static constexpr auto HISTORY_WAIT = std::chrono::seconds(10);   // replayed messages are taken this long after /history
+    static constexpr size_t READS_PER_EVENT = 16;    // reactor: reads from one peer before the others get a turn
+    static constexpr int FILE_UNSENT_LIMIT = 128 * 1024;   // kernel-side unsent bytes allowed while a file is sent
+    static constexpr auto TIMER_TICK = std::chrono::milliseconds(100);
+    static constexpr auto CHECK_INTERVAL = std::chrono::seconds(1);   // liveness checks without heartbeats
+#ifdef MSG_NOSIGNAL
+    static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static constexpr int SEND_FLAGS = 0;
+#endif
     
+    // A received message on its way to the console. Nothing in it owns heap
+    // memory of its own: the sender, room and text share one pooled buffer,
+    // so receiving and displaying allocate nothing once warmed up. Names are
+    // chosen by peers, so they are kept with the message rather than in any
+    // table that one peer could fill.
     struct Message {
-        std::string content;
-        std::string sender;
-        std::chrono::system_clock::time_point timestamp;
+        BufferSlice body;          // sender, room and text, back to back
+        uint8_t sender_size = 0;   // names are at most 255 bytes on the wire
+        uint8_t room_size = 0;     // 0 for messages to everyone
+        std::chrono::steady_clock::time_point received;
+        bool replayed = false;   // history from the relay's log
+        
+        std::string_view sender() const { return body.view().substr(0, sender_size); }
+        std::string_view room() const { return body.view().substr(sender_size, room_size); }
+        std::string_view text() const { return body.view().substr(sender_size + room_size); }
+    };
+    
+#ifndef _WIN32
+    // Sending side of a peer connection. Messages are queued as shared slices
+    // and written in batches with writev, never under peers_mutex_. `closed` is
+    // set under `mutex` before the socket is closed, so a late flush cannot
+    // write to a reused descriptor.
+    struct Outbox {
+        Outbox(SOCKET fd, std::string name)
+            : fd(fd), name(std::move(name)),
+              queue(OutboundLimits{MAX_PENDING_BYTES, std::chrono::milliseconds(0), SlowConsumerPolicy::Disconnect}) {}
+        
+        SOCKET fd;
+        std::string name;   // address:port, for log messages
+        OutboundQueue queue;
+        std::mutex mutex;
+        bool closed = false;
+        bool dropped = false;             // shut down for falling behind; waiting for its reader to notice
+        bool watching_writable = false;   // reactor: WRITABLE is only watched while data is stuck
+        // File being sent to this peer. Its chunks are only written while the
+        // queue is empty, so chat waits for at most the chunk being written.
+        std::unique_ptr<file_transfer::FileSource> file;
+        bool unsent_limited = false;
+        int saved_lowat = 0;   // TCP_NOTSENT_LOWAT before the transfer lowered it
+        // Set once the link negotiated compression. A frame for this peer
+        // alone is compressed against the link's history and queued under
+        // `compress_mutex`, so frames arrive in the order they were compressed.
+        std::unique_ptr<compression::Encoder> compressor;
+        std::mutex compress_mutex;
+        std::chrono::steady_clock::time_point blocked_since{};   // when the socket filled up; zero while it takes data
+        // Encryption. `wire` holds bytes ready to go out as they are, the
+        // link's KeyExchange at first and then one sealed record at a time;
+        // they are written before anything else. Queued frames wait until
+        // the key exchange sets `sealer` or shows the peer is a relay.
+        std::vector<char> wire;
+        size_t wire_sent = 0;
+        std::unique_ptr<secure_link::Sealer> sealer;
+        bool plain = false;   // a relay: frames go out as they are
+        // Frames broadcast during the key exchange. They are queued once it
+        // is done, except that chat for a relay is sealed for the group first.
+        std::vector<BufferSlice> awaiting_keys;
+        size_t awaiting_bytes = 0;
+        std::unique_ptr<secure_link::Sealer> datagram_sealer;   // under udp_mutex_
+    };
+    
+    // When a link last showed signs of life. Its reader notes the time of
+    // every read; the thread serving the timer wheel looks at it only when
+    // the link's timer fires, so reads never touch the wheel.
+    struct Liveness {
+        std::atomic<std::chrono::steady_clock::rep> received{0};   // steady clock ticks; 0 until anything arrived
+        std::atomic<bool> heartbeats{false};   // the peer sends them, so its silence means it is gone
+        std::chrono::steady_clock::time_point opened = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point next_heartbeat{};   // timer thread only
+        bool outgoing = false;   // we connected, so the peer is a chat node and must answer
+    };
+    
+    enum class Security : uint8_t {
+        Handshake,   // waiting for the peer's key exchange; nothing else is sent or accepted
+        Encrypted,   // both ways, everything travels in records
+        Relay,       // plain frames; chat is sealed end to end when there is a secret
     };
     
+    enum class FlushResult {
+        Idle,      // everything queued was written
+        Blocked,   // the socket is full; retry once it drains
+        Yielded,   // a file transfer has more to send; come back after other peers
+    };
+#endif
+    
+    // Live peers only: a peer is removed as soon as its connection ends, and
+    // its handle goes stale rather than pointing at a reused slot.
+    struct Peer;
+    using PeerHandle = SlotMap<Peer>::Handle;
+    
     struct Peer {
         std::string address;
         int port;
         SOCKET socket_fd = INVALID_SOCKET;
+        bool mesh = false;   // has sent gossip frames, so it is a node rather than a plain client
+#ifndef _WIN32
+        std::shared_ptr<Outbox> outbox{};
+        uint32_t udp = 0;          // datagram session opened for this link; 0 if none
+        bool udp_ready = false;    // both sides agreed: small frames now go as datagrams
+        bool compression_offered = false;   // we offered compression and wait for the answer
+        bool compress = false;              // negotiated: frames to this peer may be compressed
+        std::shared_ptr<Liveness> liveness{};
+        TimerWheel<PeerHandle>::Handle timer{};    // liveness checks; see check_link()
+        // Encryption: the key pair for the link's key exchange, and what the
+        // exchange showed the link to be. The reading side opens records
+        // with `opener` into `records`, and reads its frames from there.
+        secure_link::KeyPair key_pair{};
+        Security security = Security::Handshake;
+        std::shared_ptr<const secure_link::LinkKeys> keys{};
+        std::optional<secure_link::Opener> opener{};
+        protocol::FrameDecoder records{};
+        bool sealed_warned = false;   // said once that Sealed frames do not open
+#endif
+        // Reading side: created by the first compressed frame received.
+        std::shared_ptr<compression::Decoder> decompressor{};
+        
+        // Reactor mode only: partial frames received.
+        protocol::FrameDecoder decoder{};
+    };
+    
+#ifndef _WIN32
+    // An accepted download. Chunks are written under its own mutex, not
+    // files_mutex_, so a slow disk holds up only the peer sending them.
+    struct Receiving {
+        Receiving(const std::filesystem::path& directory, const protocol::FileOffer& offer)
+            : sink(directory, offer), received(sink.offset()), acked(sink.offset()) {}
+        
+        std::mutex mutex;
+        file_transfer::FileSink sink;
+        std::atomic<uint64_t> received;   // sink.offset(), readable without the mutex
+        uint64_t acked;                   // offset last sent back in a FileAccept
+    };
+    
+    // A file offered to us, numbered for /accept. `receiving` is set once accepted.
+    struct Incoming {
+        PeerHandle from;
+        std::string peer_name;
+        uint64_t id = 0;
+        uint64_t size = 0;
+        uint64_t tag = 0;
+        std::string name;
+        std::shared_ptr<Receiving> receiving;
     };
     
+    // A link's datagram session, as the thread reading the endpoint sees it:
+    // its own copy of the peer, like a peer thread's.
+    struct DatagramLink {
+        PeerHandle handle;
+        Peer peer;
+        std::optional<secure_link::DatagramOpener> opener;
+    };
+#endif
+    
     SOCKET listen_socket_ = INVALID_SOCKET;
-    std::vector<Peer> peers_;
-    std::queue<Message> message_queue_;
-    std::mutex queue_mutex_;
+    BufferPool pool_;   // message bytes; declared before everything that holds slices of it
+    SlotMap<Peer> peers_;
+    
+    // Received messages on their way to the console. Peer threads push
+    // without locking; the display thread only takes inbox_mutex_ to sleep
+    // once the inbox is empty, and producers only lock it to wake it up.
+    MpscQueue<Message> inbox_{INBOX_CAPACITY};
+    std::atomic<bool> inbox_sleeping_{false};
+    std::mutex inbox_mutex_;
+    std::condition_variable inbox_cv_;
+    std::time_t rendered_second_ = -1;
+    std::string rendered_time_;
+    
     std::mutex peers_mutex_;
-    std::condition_variable queue_cv_;
     bool running_ = false;
     std::string username_;
+    std::string current_room_;   // relay room our messages go to; only the input thread touches it
+    uint64_t node_id_ = std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32);
+    
+    // Mesh forwarding: every chat frame carries a gossip envelope with a
+    // message id, and ids seen recently are not displayed or forwarded again,
+    // so messages cannot circulate around cycles. Ids start at a random point
+    // so they are unique across nodes.
+    uint8_t gossip_ttl_;
+    size_t gossip_fanout_;
+    DedupCache seen_;
+    std::mutex seen_mutex_;
+    std::atomic<uint64_t> next_message_id_{node_id_ ^ (static_cast<uint64_t>(std::random_device{}()) << 16)};
+    std::atomic<int64_t> history_until_{0};   // steady clock ticks; see expecting_history()
+    std::minstd_rand rng_{std::random_device{}()};   // fan-out peer choice; used under peers_mutex_
+    
+    // Reactor mode: one event loop on the calling thread serves the listener,
+    // every peer and stdin, so nothing is shared and no locks are taken.
+    bool reactor_ = false;
+#ifndef _WIN32
+    std::unique_ptr<EventLoop> loop_;
+    std::string input_buffer_;
+    bool flush_scheduled_ = false;
+    std::string render_buffer_;   // messages to display at the end of this batch of events
+    bool render_scheduled_ = false;
+    
+    // Outboxes that went from empty to non-empty since the last flush. A
+    // writer thread (the loop, in reactor mode) flushes them once the
+    // coalescing window has passed or enough bytes are waiting, so a burst of
+    // messages reaches each peer in a few large writes instead of one
+    // syscall and one small segment per message.
+    std::chrono::microseconds coalesce_window_;
+    size_t coalesce_bytes_;
+    std::mutex outbox_mutex_;
+    std::condition_variable outbox_cv_;
+    std::vector<std::shared_ptr<Outbox>> dirty_;
+    size_t dirty_bytes_ = 0;
+    
+    // Files offered to us, by the number /accept takes. Outgoing transfers
+    // live in their peer's outbox.
+    std::filesystem::path download_dir_;
+    std::map<uint32_t, Incoming> incoming_;
+    uint32_t next_offer_ = 1;
+    std::mutex files_mutex_;
+    
+    // Threaded mode: a loop on a thread of its own serves the datagram
+    // endpoint and the liveness timers, which the reactor loop serves itself.
+    std::unique_ptr<EventLoop> service_loop_;
+    
+    // Datagram transport (--udp). Links that negotiated it send frames that
+    // fit in a datagram through the endpoint instead of their outbox; file
+    // transfers and larger frames stay on TCP.
+    // Lock order: peers_mutex_, then udp_mutex_.
+    std::unique_ptr<reliable_udp::Endpoint> udp_;
+    std::unordered_map<uint32_t, std::shared_ptr<DatagramLink>> udp_links_;   // by session token
+    std::mutex udp_mutex_;
+    bool udp_unordered_ = false;
+    
+    bool compress_ = false;   // --compress: chat frames are compressed on links that agree to it
+    
+    // --secret. Without it links are encrypted but not authenticated, and
+    // relays are refused unless --plaintext-relays lets chat to them go out
+    // as it is.
+    secure_link::Secret secret_;
+    std::unique_ptr<secure_link::GroupCipher> group_;
+    std::atomic<bool> group_exhausted_{false};   // warned that group_ refuses to seal
+    bool plaintext_relays_ = false;
+    
+    // Liveness: every link has one timer on the wheel, which sends its
+    // heartbeats and drops it once it breaks a timeout. Disabled when all
+    // four settings are 0. Lock order: peers_mutex_, then timers_mutex_.
+    std::chrono::seconds heartbeat_interval_{0};
+    std::chrono::seconds idle_timeout_{0};
+    std::chrono::seconds handshake_timeout_{0};
+    std::chrono::seconds stall_timeout_{0};
+    bool liveness_ = false;
+    BufferSlice heartbeat_;
+    TimerWheel<PeerHandle> timers_{TIMER_TICK};
+    std::mutex timers_mutex_;
+#endif
     
 #ifdef _WIN32
     static bool winsock_initialized_;
@@ -79,166 +371,1574 @@ private:
             winsock_initialized_ = false;
         }
     }
-#endif
+#endif
+    
+    std::expected<SOCKET, std::string> create_socket() {
+#ifdef _WIN32
+        if (!initialize_winsock()) {
+            return std::unexpected("Failed to initialize Winsock");
+        }
+#endif
+        
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+#ifdef _WIN32
+            return std::unexpected(std::format("Failed to create socket: WSA Error {}", WSAGetLastError()));
+#else
+            return std::unexpected(std::format("Failed to create socket: {}", strerror(errno)));
+#endif
+        }
+        
+        int opt = 1;
+#ifdef _WIN32
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0) {
+            closesocket(sock);
+            return std::unexpected(std::format("Failed to set SO_REUSEADDR: WSA Error {}", WSAGetLastError()));
+        }
+#else
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            closesocket(sock);
+            return std::unexpected(std::format("Failed to set SO_REUSEADDR: {}", strerror(errno)));
+        }
+        
+        // On macOS, also set SO_REUSEPORT to avoid "Address already in use" errors
+#ifdef __APPLE__
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            closesocket(sock);
+            return std::unexpected(std::format("Failed to set SO_REUSEPORT: {}", strerror(errno)));
+        }
+#endif
+#endif
+        
+        return sock;
+    }
+    
+    std::expected<void, std::string> bind_and_listen(int port) {
+        sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+        
+        if (bind(listen_socket_, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) == SOCKET_ERROR) {
+#ifdef _WIN32
+            return std::unexpected(std::format("Failed to bind to port {}: WSA Error {}", port, WSAGetLastError()));
+#else
+            return std::unexpected(std::format("Failed to bind to port {}: {}", port, strerror(errno)));
+#endif
+        }
+        
+        if (listen(listen_socket_, 5) == SOCKET_ERROR) {
+#ifdef _WIN32
+            return std::unexpected(std::format("Failed to listen on socket: WSA Error {}", WSAGetLastError()));
+#else
+            return std::unexpected(std::format("Failed to listen on socket: {}", strerror(errno)));
+#endif
+        }
+        
+        return {};
+    }
+    
+    void accept_connections() {
+        while (running_) {
+            sockaddr_in client_addr{};
+            socklen_t addr_len = sizeof(client_addr);
+            
+            SOCKET client_sock = accept(listen_socket_, reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
+            if (client_sock == INVALID_SOCKET) {
+                if (running_) {
+#ifdef _WIN32
+                    if (WSAGetLastError() != WSAEINTR) {
+#else
+                    if (errno != EINTR) {
+#endif
+                        logging::error("Failed to accept connection");
+                    }
+                }
+                continue;
+            }
+            
+            char addr_str[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, addr_str, INET_ADDRSTRLEN);
+            
+            logging::info(std::format("[SYSTEM] New peer connected: {}:{}", addr_str, ntohs(client_addr.sin_port)));
+            register_peer(Peer{
+                .address = std::string(addr_str),
+                .port = ntohs(client_addr.sin_port),
+                .socket_fd = client_sock
+            });
+        }
+    }
+    
+    // Adds a connected peer and starts reading from it: on the reactor loop,
+    // or on a thread of its own in threaded mode. `outgoing` is set for
+    // links we opened.
+    PeerHandle register_peer(Peer peer, [[maybe_unused]] bool outgoing = false) {
+#ifndef _WIN32
+        peer.outbox = std::make_shared<Outbox>(peer.socket_fd, std::format("{}:{}", peer.address, peer.port));
+        peer.liveness = std::make_shared<Liveness>();
+        peer.liveness->outgoing = outgoing;
+        // The key exchange goes out first and alone; everything queued after
+        // it waits for the peer's.
+        peer.key_pair = secure_link::KeyPair::generate();
+        std::string key_exchange = secure_link::encode_key_exchange(node_id_, peer.key_pair.public_key);
+        peer.outbox->wire.assign(key_exchange.begin(), key_exchange.end());
+#endif
+        PeerHandle handle;
+        {
+            auto lock = guard(peers_mutex_);
+            handle = peers_.insert(peer);
+#ifndef _WIN32
+            if (liveness_) {
+                // Fires on the next tick, which greets the peer with a heartbeat.
+                auto timers_lock = guard(timers_mutex_);
+                auto& timer = peers_.get(handle)->timer;
+                timer = timers_.add(handle);
+                timers_.schedule(timer, std::chrono::steady_clock::now());
+            }
+#endif
+        }
+#ifndef _WIN32
+        wake_outbox(peer.outbox);
+        if (reactor_) {
+            EventLoop::set_nonblocking(peer.socket_fd);
+            loop_->add(peer.socket_fd, EventLoop::READABLE,
+                [this, handle](uint32_t events) { on_peer_ready(handle, events); });
+            return handle;
+        }
+        peer.outbox.reset();   // the reader never sends, and must not keep pooled buffers alive
+#endif
+        std::thread(&P2PChat::handle_peer, this, handle, std::move(peer)).detach();
+        return handle;
+    }
+    
+    // The reactor touches shared state from its loop thread only, so it skips the lock.
+    std::unique_lock<std::mutex> guard(std::mutex& mutex) {
+        return reactor_ ? std::unique_lock<std::mutex>() : std::unique_lock<std::mutex>(mutex);
+    }
+    
+    // Reads only note the time; the link's timer looks at it when it fires.
+    static void note_received([[maybe_unused]] const Peer& peer) {
+#ifndef _WIN32
+        if (peer.liveness) {
+            peer.liveness->received.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                                          std::memory_order_relaxed);
+        }
+#endif
+    }
+    
+    // Runs on the peer's own thread with a copy of its entry, so it never
+    // holds a reference into the registry while other peers come and go.
+    void handle_peer(PeerHandle handle, Peer peer) {
+        protocol::FrameDecoder decoder;
+        
+        while (running_) {
+            auto space = decoder.prepare();
+            auto bytes_received = recv(peer.socket_fd, space.data(), static_cast<int>(space.size()), 0);
+            
+            if (bytes_received > 0) {
+                decoder.commit(static_cast<size_t>(bytes_received));
+                note_received(peer);
+            }
+            
+            if (bytes_received <= 0 || !process_frames(decoder, peer, handle)) {
+                logging::info(std::format("[SYSTEM] Peer {}:{} disconnected", peer.address, peer.port));
+                remove_peer(handle, peer.socket_fd);
+                break;
+            }
+        }
+    }
+    
+    // The socket is closed only once no broadcast can reach it any more.
+    void remove_peer(PeerHandle handle, SOCKET sock) {
+#ifndef _WIN32
+        std::shared_ptr<Outbox> outbox;
+#endif
+        {
+            auto lock = guard(peers_mutex_);
+            Peer* peer = peers_.get(handle);
+            if (!peer) return;
+#ifndef _WIN32
+            outbox = std::move(peer->outbox);
+            if (liveness_) {
+                auto timers_lock = guard(timers_mutex_);
+                timers_.remove(peer->timer);
+            }
+            if (peer->udp != 0) {
+                auto udp_lock = guard(udp_mutex_);
+                udp_->close(peer->udp);
+                udp_links_.erase(peer->udp);
+            }
+#endif
+            peers_.erase(handle);
+        }
+#ifndef _WIN32
+        if (reactor_) loop_->remove(sock);
+        drop_downloads(handle);
+        auto lock = guard(outbox->mutex);
+        outbox->closed = true;
+        if (outbox->file && !outbox->file->finished()) {
+            logging::info(std::format("[FILE] Sending {} to {} interrupted at {}; /send it again to resume",
+                                      outbox->file->name(), outbox->name, format_size(outbox->file->offset())));
+        }
+        outbox->file.reset();
+#endif
+        closesocket(sock);
+    }
+    
+#ifndef _WIN32
+    void run_reactor() {
+        EventLoop::set_nonblocking(listen_socket_);
+        loop_->add(listen_socket_, EventLoop::READABLE, [this](uint32_t) { accept_ready(); });
+        if (!loop_->add(STDIN_FILENO, EventLoop::READABLE, [this](uint32_t) { read_input(); })) {
+            // A regular file or /dev/null: it never blocks, so read it straight away.
+            loop_->post([this] { read_input(); });
+        }
+        loop_->run();
+    }
+    
+    void accept_ready() {
+        while (true) {
+            sockaddr_in client_addr{};
+            socklen_t addr_len = sizeof(client_addr);
+            SOCKET client_sock = accept(listen_socket_, reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
+            if (client_sock == INVALID_SOCKET) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) logging::error("Failed to accept connection");
+                return;
+            }
+            
+            char addr_str[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, addr_str, INET_ADDRSTRLEN);
+            logging::info(std::format("[SYSTEM] New peer connected: {}:{}", addr_str, ntohs(client_addr.sin_port)));
+            register_peer(Peer{
+                .address = std::string(addr_str),
+                .port = ntohs(client_addr.sin_port),
+                .socket_fd = client_sock
+            });
+        }
+    }
+    
+    void on_peer_ready(PeerHandle handle, uint32_t events) {
+        // Frame handling only broadcasts and displays; it never adds or removes
+        // peers, so `peer` stays valid until remove_peer() below.
+        Peer* peer = peers_.get(handle);
+        if (!peer) return;
+        if (events & EventLoop::WRITABLE) {
+            FlushResult result = flush_outbox(*peer->outbox);
+            if (result != FlushResult::Blocked) watch_writable(*peer->outbox, false);
+            if (result == FlushResult::Yielded) wake_outbox(peer->outbox);
+        }
+        if (!(events & (EventLoop::READABLE | EventLoop::CLOSED | EventLoop::ERRORED))) return;
+        
+        for (size_t reads = 0;; ++reads) {
+            if (reads == READS_PER_EVENT) {
+                // A peer streaming a file could keep this loop busy for good;
+                // let everything else run, then carry on where it left off.
+                loop_->post([this, handle] { on_peer_ready(handle, EventLoop::READABLE); });
+                return;
+            }
+            auto space = peer->decoder.prepare();
+            ssize_t bytes_received = recv(peer->socket_fd, space.data(), space.size(), 0);
+            if (bytes_received > 0) {
+                peer->decoder.commit(static_cast<size_t>(bytes_received));
+                note_received(*peer);
+                if (process_frames(peer->decoder, *peer, handle)) continue;
+            } else if (bytes_received < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            
+            logging::info(std::format("[SYSTEM] Peer {}:{} disconnected", peer->address, peer->port));
+            remove_peer(handle, peer->socket_fd);
+            return;
+        }
+    }
+    
+    void watch_writable(Outbox& outbox, bool on) {
+        if (outbox.watching_writable == on) return;
+        outbox.watching_writable = on;
+        loop_->modify(outbox.fd, on ? EventLoop::READABLE | EventLoop::WRITABLE : EventLoop::READABLE);
+    }
+    
+    // Runs every complete line from stdin as a command. Only the first read is
+    // known not to block, so later ones wait for poll() to report more input.
+    // At end of input the node stops reading stdin but keeps relaying.
+    void read_input() {
+        char buffer[4096];
+        do {
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                loop_->remove(STDIN_FILENO);
+                if (n == 0) logging::info("[SYSTEM] End of input; still relaying until interrupted");
+                return;
+            }
+            input_buffer_.append(buffer, static_cast<size_t>(n));
+            
+            // Lines are handled where they lie in the buffer, and everything
+            // consumed is erased once per read rather than once per line.
+            std::string_view pending = input_buffer_;
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string_view::npos) {
+                std::string_view line = pending.substr(0, newline);
+                pending.remove_prefix(newline + 1);
+                if (line.ends_with('\r')) line.remove_suffix(1);
+                if (!handle_command(line)) {
+                    running_ = false;
+                    loop_->stop();
+                    return;
+                }
+                std::cout << "> ";
+                std::cout.flush();
+            }
+            input_buffer_.erase(0, input_buffer_.size() - pending.size());
+        } while (input_ready());
+    }
+    
+    static bool input_ready() {
+        pollfd p{STDIN_FILENO, POLLIN, 0};
+        return ::poll(&p, 1, 0) > 0;
+    }
+    
+    // Queues one encoded message on every target outbox; all of them share
+    // the same pooled copy. A `streamed` message is compressed against each
+    // target's link history instead.
+    void enqueue(const std::vector<std::shared_ptr<Outbox>>& targets, const BufferSlice& message, bool streamed = false) {
+        if (targets.empty()) return;
+        thread_local std::vector<std::shared_ptr<Outbox>> woken;
+        woken.clear();
+        for (const auto& outbox : targets) {
+            bool was_empty;
+            auto result = streamed ? push_streamed(*outbox, message, was_empty) : outbox->queue.push(message, was_empty);
+            if (result.status == OutboundQueue::PushStatus::Overflow) {
+                drop_peer(*outbox, "is not reading");
+            } else if (was_empty) {
+                woken.push_back(outbox);
+            }
+        }
+        
+        size_t waiting;
+        {
+            auto lock = guard(outbox_mutex_);
+            dirty_.insert(dirty_.end(), woken.begin(), woken.end());
+            woken.clear();
+            dirty_bytes_ += message.size() * targets.size();
+            waiting = dirty_bytes_;
+        }
+        if (!reactor_) {
+            outbox_cv_.notify_one();
+        } else if (waiting >= coalesce_bytes_) {
+            flush_dirty();
+        } else {
+            schedule_flush();
+        }
+    }
+    
+    OutboundQueue::PushResult push_streamed(Outbox& outbox, const BufferSlice& message, bool& was_empty) {
+        auto lock = guard(outbox.compress_mutex);
+        std::optional<BufferSlice> packed;
+        if (outbox.compressor) packed = compression::pack(*outbox.compressor, message.view(), true, pool_);
+        return outbox.queue.push(packed ? *packed : message, was_empty);
+    }
+    
+    void drop_peer(Outbox& outbox, std::string_view reason) {
+        auto lock = guard(outbox.mutex);
+        if (outbox.closed || std::exchange(outbox.dropped, true)) return;
+        logging::warn(std::format("[SYSTEM] Peer {} {}; dropping it", outbox.name, reason));
+        shutdown(outbox.fd, SHUT_RDWR);   // its reader notices and removes the peer
+    }
+    
+    // Runs when a link's timer fires, on the reactor loop or the service
+    // thread: drops the peer if it broke a timeout, sends its heartbeat when
+    // one is due, and re-arms the timer for the earliest deadline left.
+    void check_link(PeerHandle handle) {
+        using Clock = std::chrono::steady_clock;
+        std::shared_ptr<Outbox> outbox;
+        std::shared_ptr<Liveness> liveness;
+        TimerWheel<PeerHandle>::Handle timer;
+        {
+            auto lock = guard(peers_mutex_);
+            Peer* peer = peers_.get(handle);
+            if (!peer) return;
+            outbox = peer->outbox;
+            liveness = peer->liveness;
+            timer = peer->timer;
+        }
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        auto passed = [&](Clock::time_point deadline) {
+            next = std::min(next, deadline);
+            return now >= deadline;
+        };
+        
+        auto received = liveness->received.load(std::memory_order_relaxed);
+        Clock::time_point last = received != 0 ? Clock::time_point(Clock::duration(received)) : liveness->opened;
+        if (liveness->outgoing && received == 0 && handshake_timeout_.count() > 0 &&
+            passed(liveness->opened + handshake_timeout_)) {
+            drop_peer(*outbox, std::format("did not answer within {}s", handshake_timeout_.count()));
+            return;
+        }
+        if (liveness->heartbeats && idle_timeout_.count() > 0 && passed(last + idle_timeout_)) {
+            drop_peer(*outbox, std::format("sent nothing for {}s", idle_timeout_.count()));
+            return;
+        }
+        Clock::time_point blocked;
+        {
+            auto lock = guard(outbox->mutex);
+            if (outbox->closed || outbox->dropped) return;
+            blocked = outbox->blocked_since;
+        }
+        if (blocked != Clock::time_point{} && stall_timeout_.count() > 0 && passed(blocked + stall_timeout_)) {
+            drop_peer(*outbox, std::format("took no data for {}s", stall_timeout_.count()));
+            return;
+        }
+        
+        // The first heartbeat goes out even with heartbeats off: it answers
+        // the peer's handshake timeout.
+        bool queued = outbox->queue.stats().queued_messages > 0;
+        bool greeted = liveness->next_heartbeat != Clock::time_point{};
+        if (!greeted || (heartbeat_interval_.count() > 0 && now >= liveness->next_heartbeat)) {
+            // Queued data reaches the peer anyway once it drains.
+            if (!queued) enqueue({outbox}, heartbeat_);
+            liveness->next_heartbeat = now + heartbeat_interval_;
+        }
+        if (heartbeat_interval_.count() > 0) next = std::min(next, liveness->next_heartbeat);
+        if (queued || heartbeat_interval_.count() == 0) next = std::min(next, now + CHECK_INTERVAL);
+        
+        auto lock = guard(timers_mutex_);
+        timers_.schedule(timer, next);
+    }
+    
+    // Runs every tick; only links whose timer is due are visited. Their
+    // checks run outside the wheel's lock, since they take the peers lock.
+    void run_timers() {
+        thread_local std::vector<PeerHandle> due;
+        due.clear();
+        {
+            auto lock = guard(timers_mutex_);
+            timers_.advance(std::chrono::steady_clock::now(),
+                [](TimerWheel<PeerHandle>::Handle, PeerHandle handle) { due.push_back(handle); });
+        }
+        for (PeerHandle handle : due) check_link(handle);
+    }
+    
+    // Writes as much of the outbox as the socket takes without blocking:
+    // queued messages first, then file chunks while nothing else is waiting.
+    // A partly written chunk always goes out before anything else, since
+    // frames cannot be interleaved on the wire. On an encrypted link each
+    // batch gathered for one write is sealed into a record instead, which
+    // then goes out whole before the next batch is sealed.
+    FlushResult flush_outbox(Outbox& outbox) {
+        auto lock = guard(outbox.mutex);
+        if (outbox.closed) return FlushResult::Idle;
+        iovec iov[MAX_IOVECS];
+        size_t chunks = 0;
+        while (true) {
+            if (outbox.wire_sent < outbox.wire.size()) {
+                ssize_t n = send(outbox.fd, outbox.wire.data() + outbox.wire_sent, outbox.wire.size() - outbox.wire_sent,
+                                 SEND_FLAGS | MSG_DONTWAIT);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        if (outbox.blocked_since == std::chrono::steady_clock::time_point{}) {
+                            outbox.blocked_since = std::chrono::steady_clock::now();
+                        }
+                        return FlushResult::Blocked;
+                    }
+                    shutdown(outbox.fd, SHUT_RDWR);
+                    return FlushResult::Idle;
+                }
+                outbox.blocked_since = {};
+                outbox.wire_sent += static_cast<size_t>(n);
+                continue;
+            }
+            if (!outbox.sealer && !outbox.plain) return FlushResult::Idle;   // until the key exchange is done
+            
+            file_transfer::FileSource* file = outbox.file.get();
+            bool chunk = file && file->in_flight();
+            int count = chunk ? 0 : outbox.queue.begin_flush(iov, MAX_IOVECS);
+            if (count == 0) {
+                if (!file || !file->started()) return FlushResult::Idle;
+                if (!chunk && file->finished()) {
+                    finish_upload(outbox);
+                    return FlushResult::Idle;
+                }
+                if (!chunk && !file->window_open()) return FlushResult::Idle;   // until the receiver catches up
+                if (!chunk && chunks++ == CHUNKS_PER_FLUSH) return FlushResult::Yielded;
+                count = file->pending(iov);
+                if (file->failed()) {
+                    // The file shrank or became unreadable while being sent.
+                    logging::info(std::format("[FILE] Could not read {} any more", file->name()));
+                    bool was_empty;
+                    outbox.queue.push(pool_.copy(protocol::encode_file_cancel(node_id_, file->id())), was_empty);
+                    finish_upload(outbox);
+                    continue;
+                }
+                chunk = true;
+            }
+            if (outbox.sealer) {
+                size_t sealed = outbox.sealer->seal(std::span(iov, static_cast<size_t>(count)), outbox.wire);
+                outbox.wire_sent = 0;
+                if (chunk) {
+                    file->advance(sealed);
+                } else {
+                    outbox.queue.end_flush(sealed);
+                }
+                continue;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = static_cast<decltype(msg.msg_iovlen)>(count);
+            ssize_t n = sendmsg(outbox.fd, &msg, SEND_FLAGS | MSG_DONTWAIT);
+            if (n < 0) {
+                if (!chunk) outbox.queue.end_flush(0);
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (outbox.blocked_since == std::chrono::steady_clock::time_point{}) {
+                        outbox.blocked_since = std::chrono::steady_clock::now();
+                    }
+                    return FlushResult::Blocked;
+                }
+                shutdown(outbox.fd, SHUT_RDWR);
+                return FlushResult::Idle;
+            }
+            outbox.blocked_since = {};
+            if (chunk) {
+                file->advance(static_cast<size_t>(n));
+            } else {
+                outbox.queue.end_flush(static_cast<size_t>(n));
+            }
+        }
+    }
+    
+    // Queues `outbox` for the writer without adding a message, e.g. when a
+    // file transfer has more to send.
+    void wake_outbox(const std::shared_ptr<Outbox>& outbox) {
+        {
+            auto lock = guard(outbox_mutex_);
+            dirty_.push_back(outbox);
+        }
+        if (!reactor_) {
+            outbox_cv_.notify_one();
+        } else {
+            schedule_flush();
+        }
+    }
+    
+    void schedule_flush() {
+        if (flush_scheduled_) return;
+        // Runs after the loop has handled the rest of this batch of events.
+        flush_scheduled_ = true;
+        loop_->post([this] { flush_dirty(); });
+    }
+    
+    // Reactor mode: flushes everything queued while handling the last events.
+    void flush_dirty() {
+        flush_scheduled_ = false;
+        std::vector<std::shared_ptr<Outbox>> batch;
+        batch.swap(dirty_);
+        dirty_bytes_ = 0;
+        for (const auto& outbox : batch) {
+            switch (flush_outbox(*outbox)) {
+            case FlushResult::Blocked: watch_writable(*outbox, true); break;
+            case FlushResult::Yielded: wake_outbox(outbox); break;
+            case FlushResult::Idle: break;
+            }
+        }
+    }
+    
+    // Threaded mode: the one thread that writes to peers. Waits for the
+    // coalescing window, then flushes every outbox that has data; outboxes
+    // whose socket was full are retried as soon as it drains.
+    void write_outboxes() {
+        std::vector<std::shared_ptr<Outbox>> batch;
+        std::vector<std::shared_ptr<Outbox>> blocked;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(outbox_mutex_);
+                auto ready = [this] { return !dirty_.empty() || !running_; };
+                if (blocked.empty()) {
+                    outbox_cv_.wait(lock, ready);
+                } else if (!ready()) {
+                    lock.unlock();
+                    wait_writable(blocked);
+                    lock.lock();
+                }
+                if (!running_) return;
+                if (!dirty_.empty()) {
+                    outbox_cv_.wait_for(lock, coalesce_window_,
+                        [this] { return dirty_bytes_ >= coalesce_bytes_ || !running_; });
+                }
+                batch.swap(dirty_);
+                dirty_bytes_ = 0;
+            }
+            
+            batch.insert(batch.end(), blocked.begin(), blocked.end());
+            blocked.clear();
+            for (const auto& outbox : batch) {
+                switch (flush_outbox(*outbox)) {
+                case FlushResult::Blocked: blocked.push_back(outbox); break;
+                case FlushResult::Yielded: wake_outbox(outbox); break;
+                case FlushResult::Idle: break;
+                }
+            }
+            batch.clear();
+        }
+    }
+    
+    // Sleeps until one of `outboxes` can take more data, or for BLOCKED_RETRY
+    // so newly queued messages are not kept waiting.
+    static void wait_writable(const std::vector<std::shared_ptr<Outbox>>& outboxes) {
+        thread_local std::vector<pollfd> fds;
+        fds.clear();
+        for (const auto& outbox : outboxes) fds.push_back(pollfd{outbox->fd, POLLOUT, 0});
+        ::poll(fds.data(), static_cast<nfds_t>(fds.size()), static_cast<int>(BLOCKED_RETRY.count()));
+    }
+    
+    // While a file is being sent, only a little of it may sit unsent in the
+    // kernel: otherwise a chat message queued behind the socket buffer waits
+    // for megabytes of file to go first. Writes stop early instead, and the
+    // socket reports writable once it is below the limit again.
+    static void limit_unsent(Outbox& outbox, bool on) {
+#ifdef TCP_NOTSENT_LOWAT
+        if (on == outbox.unsent_limited) return;
+        if (on) {
+            socklen_t len = sizeof(outbox.saved_lowat);
+            if (getsockopt(outbox.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &outbox.saved_lowat, &len) != 0) return;
+            setsockopt(outbox.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &FILE_UNSENT_LIMIT, sizeof(FILE_UNSENT_LIMIT));
+        } else {
+            setsockopt(outbox.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &outbox.saved_lowat, sizeof(outbox.saved_lowat));
+        }
+        outbox.unsent_limited = on;
+#else
+        (void)outbox;
+        (void)on;
+#endif
+    }
+    
+    // Called with outbox.mutex held once a transfer's last chunk is out.
+    void finish_upload(Outbox& outbox) {
+        const auto& file = *outbox.file;
+        if (file.cancelled()) {
+            logging::info(std::format("[FILE] Sending {} to {} cancelled after {}", file.name(), outbox.name, format_size(file.offset())));
+        } else {
+            logging::info(std::format("[FILE] Sent {} ({}) to {}", file.name(), format_size(file.size()), outbox.name));
+        }
+        outbox.file.reset();
+        limit_unsent(outbox, false);
+    }
+    
+    std::shared_ptr<Outbox> outbox_of(PeerHandle handle) {
+        auto lock = guard(peers_mutex_);
+        Peer* peer = peers_.get(handle);
+        return peer ? peer->outbox : nullptr;
+    }
+    
+    // Sends `frame` to one peer only.
+    void send_to(PeerHandle handle, std::string_view frame) {
+        if (auto outbox = outbox_of(handle)) enqueue({outbox}, pool_.copy(frame));
+    }
+    
+    // File transfer frames concern only the two peers involved and are never
+    // forwarded. Returns false for any other frame.
+    bool handle_file_frame(const protocol::FrameView& frame, const Peer& peer, PeerHandle from) {
+        switch (frame.header.type) {
+        case protocol::FrameType::FileOffer:
+            if (auto offer = protocol::decode_file_offer(frame.payload)) on_file_offer(*offer, peer, from);
+            return true;
+        case protocol::FrameType::FileAccept:
+            if (auto accept = protocol::decode_file_accept(frame.payload)) on_file_accept(*accept, from);
+            return true;
+        case protocol::FrameType::FileChunk:
+            if (auto chunk = protocol::decode_file_chunk(frame.payload)) on_file_chunk(chunk->first, chunk->second, from);
+            return true;
+        case protocol::FrameType::FileCancel:
+            if (auto id = protocol::decode_file_cancel(frame.payload)) on_file_cancel(*id, from);
+            return true;
+        default:
+            return false;
+        }
+    }
+    
+    // Relays never pass file frames on, and nothing to or from one is
+    // encrypted, so a relay's offer is declined.
+    void on_file_offer(const protocol::FileOffer& offer, const Peer& peer, PeerHandle from) {
+        std::string peer_name = std::format("{}:{}", peer.address, peer.port);
+        bool listed = false;
+        uint32_t number = 0;
+        if (peer.security != Security::Relay && file_transfer::is_safe_name(offer.name)) {
+            auto lock = guard(files_mutex_);
+            if (incoming_.size() < MAX_INCOMING) {
+                number = next_offer_++;
+                incoming_.emplace(number, Incoming{from, peer_name, offer.id, offer.size, offer.tag, std::string(offer.name), nullptr});
+                listed = true;
+            }
+        }
+        if (!listed) {
+            logging::warn(std::format("[FILE] Declined a file offer from {}", peer_name));
+            send_to(from, protocol::encode_file_cancel(node_id_, offer.id));
+            return;
+        }
+        logging::info(std::format("[FILE] {} offers {} ({}); type /accept {} to download it",
+                                  peer_name, offer.name, format_size(offer.size), number));
+    }
+    
+    void on_file_accept(const protocol::FileAccept& accept, PeerHandle from) {
+        auto outbox = outbox_of(from);
+        if (!outbox) return;
+        {
+            auto lock = guard(outbox->mutex);
+            auto& file = outbox->file;
+            if (!file || file->id() != accept.id) return;
+            if (file->started()) {
+                file->acknowledge(accept.offset);
+            } else {
+                file->start(accept.offset);
+                limit_unsent(*outbox, true);
+                logging::info(std::format("[FILE] {} accepted {}{}", outbox->name, file->name(),
+                    file->offset() > 0 ? std::format("; resuming at {}", format_size(file->offset())) : ""));
+            }
+        }
+        wake_outbox(outbox);
+    }
+    
+    // Runs on the reader of the sending peer. The write happens outside
+    // files_mutex_, so in threaded mode a slow disk slows that peer down
+    // rather than anyone else; in reactor mode it still holds up the loop.
+    void on_file_chunk(const protocol::FileChunkHeader& chunk, std::string_view data, PeerHandle from) {
+        std::shared_ptr<Receiving> receiving;
+        std::string name;
+        std::string peer_name;
+        {
+            auto lock = guard(files_mutex_);
+            auto it = std::ranges::find_if(incoming_, [&](const auto& entry) {
+                return entry.second.from == from && entry.second.id == chunk.id && entry.second.receiving;
+            });
+            if (it == incoming_.end()) return;
+            receiving = it->second.receiving;
+            name = it->second.name;
+            peer_name = it->second.peer_name;
+        }
+        {
+            auto lock = guard(receiving->mutex);
+            auto& sink = receiving->sink;
+            try {
+                sink.write(chunk, data);
+                receiving->received.store(sink.offset(), std::memory_order_relaxed);
+                if (!sink.complete()) {
+                    if (sink.offset() - receiving->acked >= file_transfer::ACK_INTERVAL) {
+                        receiving->acked = sink.offset();
+                        send_to(from, protocol::encode_file_accept(node_id_, {chunk.id, receiving->acked}));
+                    }
+                    return;
+                }
+                auto path = sink.finish();
+                logging::info(std::format("[FILE] Received {} ({}) from {}: {}",
+                                          name, format_size(sink.size()), peer_name, path.string()));
+            } catch (const std::exception& e) {
+                logging::warn(std::format("[FILE] Download of {} from {} failed: {}", name, peer_name, e.what()));
+                send_to(from, protocol::encode_file_cancel(node_id_, chunk.id));
+            }
+        }
+        // Unless it was cancelled or dropped meanwhile.
+        auto lock = guard(files_mutex_);
+        std::erase_if(incoming_, [&](const auto& entry) { return entry.second.receiving == receiving; });
+    }
+    
+    // Either side may give up: stop sending, or forget the offer.
+    void on_file_cancel(uint64_t id, PeerHandle from) {
+        if (auto outbox = outbox_of(from)) {
+            auto lock = guard(outbox->mutex);
+            auto& file = outbox->file;
+            if (file && file->id() == id && !file->cancelled()) {
+                file->cancel();
+                if (file->finished()) finish_upload(*outbox);   // else once the chunk in flight is out
+            }
+        }
+        auto lock = guard(files_mutex_);
+        auto it = std::ranges::find_if(incoming_, [&](const auto& entry) {
+            return entry.second.from == from && entry.second.id == id;
+        });
+        if (it == incoming_.end()) return;
+        logging::info(std::format("[FILE] {} cancelled {}", it->second.peer_name, it->second.name));
+        incoming_.erase(it);
+    }
+    
+    // Part files are kept, so offering the same file again resumes it.
+    void drop_downloads(PeerHandle from) {
+        auto lock = guard(files_mutex_);
+        std::erase_if(incoming_, [&](const auto& entry) {
+            const Incoming& download = entry.second;
+            if (download.from != from) return false;
+            if (download.receiving) {
+                auto received = download.receiving->received.load(std::memory_order_relaxed);
+                logging::info(std::format("[FILE] Download of {} interrupted at {} of {}; it resumes if offered again",
+                                          download.name, format_size(received), format_size(download.size)));
+            }
+            return true;
+        });
+    }
+    
+    // /send <peer> <path>, where <peer> is a number from /peers or address:port.
+    void send_file(std::string_view args) {
+        size_t space = args.find(' ');
+        if (space == std::string_view::npos || space + 1 == args.size()) {
+            std::cout << "Usage: /send <peer> <path>\n";
+            return;
+        }
+        std::string_view target = args.substr(0, space);
+        std::string path(args.substr(space + 1));
+        auto outbox = find_outbox(target);
+        if (!outbox) {
+            std::cout << std::format("No peer {}; see /peers\n", target);
+            return;
+        }
+        
+        std::unique_ptr<file_transfer::FileSource> file;
+        try {
+            file = std::make_unique<file_transfer::FileSource>(path, new_message_id(), node_id_);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << "\n";
+            return;
+        }
+        std::string offer = protocol::encode_file_offer(node_id_, file->offer());
+        std::string announce = std::format("[FILE] Offered {} ({}) to {}; it starts once they /accept\n",
+                                           file->name(), format_size(file->size()), outbox->name);
+        {
+            auto lock = guard(outbox->mutex);
+            if (outbox->plain) {
+                std::cout << std::format("{} is a relay; files go to peers only\n", outbox->name);
+                return;
+            }
+            if (outbox->file) {
+                std::cout << std::format("Already sending {} to {}\n", outbox->file->name(), outbox->name);
+                return;
+            }
+            outbox->file = std::move(file);
+        }
+        enqueue({outbox}, pool_.copy(offer));
+        std::cout << announce;
+    }
+    
+    // Stops sending to `target` once the chunk in flight is out, and tells the
+    // receiver; its part file stays, so a later /send resumes.
+    void cancel_file(std::string_view target) {
+        auto outbox = find_outbox(target);
+        if (!outbox) {
+            std::cout << std::format("No peer {}; see /peers\n", target);
+            return;
+        }
+        uint64_t id;
+        {
+            auto lock = guard(outbox->mutex);
+            auto& file = outbox->file;
+            if (!file || file->cancelled()) {
+                std::cout << std::format("Not sending a file to {}\n", outbox->name);
+                return;
+            }
+            id = file->id();
+            file->cancel();
+            if (file->finished()) finish_upload(*outbox);
+        }
+        enqueue({outbox}, pool_.copy(protocol::encode_file_cancel(node_id_, id)));
+    }
+    
+    std::shared_ptr<Outbox> find_outbox(std::string_view target) {
+        auto lock = guard(peers_mutex_);
+        auto peers = peers_.values();
+        size_t index = 0;
+        auto [end, error] = std::from_chars(target.data(), target.data() + target.size(), index);
+        if (error == std::errc() && end == target.data() + target.size()) {
+            return index >= 1 && index <= peers.size() ? peers[index - 1].outbox : nullptr;
+        }
+        for (const auto& peer : peers) {
+            if (peer.outbox->name == target) return peer.outbox;
+        }
+        return nullptr;
+    }
+    
+    void accept_file(std::string_view arg) {
+        uint32_t number = 0;
+        auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), number);
+        if (error != std::errc() || end != arg.data() + arg.size()) {
+            std::cout << "Usage: /accept <number>\n";
+            return;
+        }
+        
+        PeerHandle from;
+        std::string reply;
+        {
+            auto lock = guard(files_mutex_);
+            auto it = incoming_.find(number);
+            if (it == incoming_.end()) {
+                std::cout << std::format("No file offer {}; see /files\n", number);
+                return;
+            }
+            Incoming& download = it->second;
+            if (download.receiving) {
+                std::cout << std::format("Already downloading {}\n", download.name);
+                return;
+            }
+            try {
+                download.receiving = std::make_shared<Receiving>(download_dir_,
+                    protocol::FileOffer{download.id, download.size, download.tag, download.name});
+            } catch (const std::exception& e) {
+                std::cout << std::format("Cannot save {}: {}\n", download.name, e.what());
+                incoming_.erase(it);
+                return;
+            }
+            
+            // Chunks find the sink only through incoming_, so files_mutex_ covers it here.
+            from = download.from;
+            auto& sink = download.receiving->sink;
+            uint64_t offset = sink.offset();
+            reply = protocol::encode_file_accept(node_id_, {download.id, offset});
+            if (sink.complete()) {
+                // Nothing left to fetch; the sender still hears back so it can finish.
+                try {
+                    std::cout << std::format("[FILE] Received {}: {}\n", download.name, sink.finish().string());
+                } catch (const std::exception& e) {
+                    std::cout << std::format("Cannot save {}: {}\n", download.name, e.what());
+                }
+                incoming_.erase(it);
+            } else {
+                std::cout << std::format("[FILE] Downloading {} from {}{}\n", download.name, download.peer_name,
+                    offset > 0 ? std::format("; resuming at {}", format_size(offset)) : "");
+            }
+        }
+        send_to(from, reply);
+    }
+    
+    void list_files() {
+        std::string out;
+        {
+            auto lock = guard(peers_mutex_);
+            for (const auto& peer : peers_) {
+                auto outbox_lock = guard(peer.outbox->mutex);
+                if (const auto& file = peer.outbox->file) {
+                    std::format_to(std::back_inserter(out), "  sending {} to {}: {}\n", file->name(), peer.outbox->name,
+                        file->started() ? std::format("{} of {}", format_size(file->offset()), format_size(file->size()))
+                                        : std::string("waiting for /accept"));
+                }
+            }
+        }
+        {
+            auto lock = guard(files_mutex_);
+            for (const auto& [number, download] : incoming_) {
+                if (download.receiving) {
+                    std::format_to(std::back_inserter(out), "  receiving {} from {}: {} of {}\n", download.name,
+                        download.peer_name, format_size(download.receiving->received.load(std::memory_order_relaxed)),
+                        format_size(download.size));
+                } else {
+                    std::format_to(std::back_inserter(out), "  {}. {} ({}) offered by {}\n", number, download.name,
+                        format_size(download.size), download.peer_name);
+                }
+            }
+        }
+        std::cout << (out.empty() ? std::string("No file transfers\n") : "\nFile transfers:\n" + out + "\n");
+    }
+    
+    static std::string format_size(uint64_t bytes) {
+        if (bytes < 1024) return std::format("{} B", bytes);
+        if (bytes < 1024 * 1024) return std::format("{:.1f} KB", static_cast<double>(bytes) / 1024);
+        if (bytes < 1024 * 1024 * 1024) return std::format("{:.1f} MB", static_cast<double>(bytes) / (1024 * 1024));
+        return std::format("{:.2f} GB", static_cast<double>(bytes) / (1024 * 1024 * 1024));
+    }
+    
+    // The side that connected offers datagrams as soon as the link is up. A
+    // peer with --udp answers with its own offer; anything else ignores it
+    // and the link stays TCP only.
+    void offer_udp(PeerHandle handle) {
+        uint32_t token;
+        {
+            auto lock = guard(peers_mutex_);
+            Peer* peer = peers_.get(handle);
+            if (!peer) return;
+            auto udp_lock = guard(udp_mutex_);
+            token = peer->udp = udp_->open();
+            udp_links_.emplace(token, datagram_link(handle, *peer));
+        }
+        send_to(handle, protocol::encode_udp_offer(node_id_, {udp_->port(), token}));
+    }
+    
+    // The datagram reader's own copy of a link's peer, with the keys its
+    // datagrams are sealed with.
+    static std::shared_ptr<DatagramLink> datagram_link(PeerHandle handle, const Peer& peer) {
+        auto link = std::make_shared<DatagramLink>(DatagramLink{handle, Peer{
+            .address = peer.address, .port = peer.port, .socket_fd = peer.socket_fd}, std::nullopt});
+        link->peer.security = peer.security;
+        link->peer.keys = peer.keys;
+        if (peer.keys) link->opener.emplace(peer.keys->datagram_receive);
+        return link;
+    }
+    
+    // Datagrams go to the address the link's TCP connection comes from, at
+    // the port the peer named. Answers an offer we did not make with our own.
+    void on_udp_offer(const protocol::UdpOffer& offer, const Peer& peer, PeerHandle from) {
+        if (!udp_) return;
+        sockaddr_in remote{};
+        remote.sin_family = AF_INET;
+        remote.sin_port = htons(offer.port);
+        if (inet_pton(AF_INET, peer.address.c_str(), &remote.sin_addr) != 1) return;
+        
+        uint32_t token;
+        bool answer = false;
+        {
+            auto lock = guard(peers_mutex_);
+            Peer* entry = peers_.get(from);
+            if (!entry || entry->udp_ready) return;
+            auto udp_lock = guard(udp_mutex_);
+            if (entry->udp == 0) {
+                entry->udp = udp_->open();
+                udp_links_.emplace(entry->udp, datagram_link(from, *entry));
+                answer = true;
+            }
+            token = entry->udp;
+            udp_->connect(token, remote, offer.token);
+            entry->udp_ready = true;
+        }
+        if (answer) send_to(from, protocol::encode_udp_offer(node_id_, {udp_->port(), token}));
+        logging::info(std::format("[SYSTEM] Link to {}:{} uses datagrams (UDP port {})", peer.address, peer.port, offer.port));
+    }
+    
+    // Like datagrams, compression is offered by the side that connected.
+    void offer_compression(PeerHandle handle) {
+        {
+            auto lock = guard(peers_mutex_);
+            Peer* peer = peers_.get(handle);
+            if (!peer) return;
+            peer->compression_offered = true;
+        }
+        constexpr protocol::Codec codecs[] = {protocol::Codec::Lz};
+        send_to(handle, protocol::encode_compression_offer(node_id_, codecs));
+    }
+    
+    // Answers an offer, or takes up the answer to ours; either way the link
+    // compresses from now on. Frames compressed on their own may even reach
+    // the peer before our answer, since decoding them needs no shared state.
+    void on_compression(const protocol::CompressionHello& hello, const Peer& peer, PeerHandle from) {
+        if (!compress_ || !protocol::offers(hello, protocol::Codec::Lz)) return;
+        std::shared_ptr<Outbox> outbox;
+        {
+            auto lock = guard(peers_mutex_);
+            Peer* entry = peers_.get(from);
+            if (!entry || entry->compress || hello.answer != entry->compression_offered) return;
+            entry->compress = true;
+            outbox = entry->outbox;
+        }
+        if (!hello.answer) send_to(from, protocol::encode_compression_answer(node_id_, protocol::Codec::Lz));
+        {
+            auto lock = guard(outbox->compress_mutex);
+            outbox->compressor = std::make_unique<compression::Encoder>();
+        }
+        logging::info(std::format("[SYSTEM] Link to {}:{} is compressed", peer.address, peer.port));
+    }
+    
+    // Datagrams go out at once rather than after the coalescing window; each
+    // carries one frame anyway, sealed for its link if the link is
+    // encrypted. Frames from one sender share a stream and arrive in order
+    // unless --udp-unordered is set.
+    void send_datagrams(const std::vector<std::pair<uint32_t, std::shared_ptr<Outbox>>>& targets, const BufferSlice& frame) {
+        if (targets.empty()) return;
+        uint8_t stream = udp_unordered_ ? reliable_udp::UNORDERED
+                                        : reliable_udp::stream_for(protocol::read_header(frame.data()).sender);
+        thread_local std::vector<std::shared_ptr<Outbox>> behind;
+        {
+            auto lock = guard(udp_mutex_);
+            for (const auto& [token, outbox] : targets) {
+                bool sent = outbox->datagram_sealer
+                    ? udp_->send(token, outbox->datagram_sealer->seal_datagram(frame.view(), pool_), stream)
+                    : udp_->send(token, frame, stream);
+                if (!sent) behind.push_back(outbox);
+            }
+        }
+        for (const auto& outbox : behind) drop_peer(*outbox, "is not reading");
+        behind.clear();
+    }
+    
+    // Runs on the loop serving the endpoint. Frames are handled outside
+    // udp_mutex_, since forwarding them sends datagrams again.
+    void receive_datagrams() {
+        thread_local std::vector<reliable_udp::Received> received;
+        thread_local std::vector<std::shared_ptr<DatagramLink>> links;
+        {
+            auto lock = guard(udp_mutex_);
+            udp_->receive(received);
+            for (const auto& datagram : received) {
+                auto it = udp_links_.find(datagram.session);
+                links.push_back(it != udp_links_.end() ? it->second : nullptr);
+            }
+        }
+        for (size_t i = 0; i < received.size(); ++i) {
+            if (!links[i]) continue;
+            const auto& frame = received[i].frame;
+            const Peer& peer = links[i]->peer;
+            protocol::FrameView view{frame.header, frame.payload(), frame.raw.view()};
+            std::optional<BufferSlice> opened;
+            if (links[i]->opener) {
+                opened = links[i]->opener->open(view, pool_);
+                if (!opened) {
+                    logging::warn(std::format("[SYSTEM] Could not decrypt a datagram from {}:{}, or it was a copy",
+                                              peer.address, peer.port));
+                    continue;
+                }
+                view = {protocol::read_header(opened->data()), opened->view().substr(protocol::HEADER_SIZE), opened->view()};
+            }
+            if (!receive_frame(view, links[i]->peer, links[i]->handle, true)) {
+                logging::warn(std::format("[SYSTEM] Bad compressed datagram from {}:{}", peer.address, peer.port));
+            }
+        }
+        received.clear();
+        links.clear();
+    }
+#endif
+    
+    // Handles every complete frame buffered in `decoder`. Returns false if the
+    // peer sent a malformed stream.
+    bool process_frames(protocol::FrameDecoder& decoder, Peer& peer, PeerHandle from) {
+        while (true) {
+            auto frame = decoder.next();
+            if (!frame) {
+                logging::warn(std::format("[SYSTEM] Protocol error from {}:{}: {}", peer.address, peer.port, frame.error()));
+                return false;
+            }
+            if (!*frame) return true;
+#ifndef _WIN32
+            if (peer.security != Security::Relay) {
+                if (!receive_sealed(**frame, peer, from)) return false;
+                continue;
+            }
+#endif
+            if (!receive_frame(**frame, peer, from, false)) {
+                logging::warn(std::format("[SYSTEM] Protocol error from {}:{}: bad compressed frame", peer.address, peer.port));
+                return false;
+            }
+        }
+    }
+    
+#ifndef _WIN32
+    // A frame from a peer that is not a relay: its key exchange while that
+    // is awaited, then only records, whose frames are handled in turn. A
+    // relay may greet us with a heartbeat before it answers; that carries
+    // nothing, so it is let through. Returns false if the link must be
+    // dropped.
+    bool receive_sealed(const protocol::FrameView& frame, Peer& peer, PeerHandle from) {
+        if (peer.security == Security::Handshake) {
+            if (frame.header.type == protocol::FrameType::KeyExchange) return on_key_exchange(frame.payload, peer, from);
+            if (frame.header.type == protocol::FrameType::Heartbeat && frame.header.length == 0) {
+                handle_frame(frame, peer, from);
+                return true;
+            }
+            logging::warn(std::format("[SYSTEM] Peer {}:{} sent data before its key exchange; it may be an older version",
+                                      peer.address, peer.port));
+            return false;
+        }
+        if (!peer.opener->open(frame, peer.records)) {
+            logging::warn(std::format("[SYSTEM] Could not decrypt data from {}:{}; do both sides use the same --secret?",
+                                      peer.address, peer.port));
+            return false;
+        }
+        while (true) {
+            auto inner = peer.records.next();
+            if (!inner) {
+                logging::warn(std::format("[SYSTEM] Protocol error from {}:{}: {}", peer.address, peer.port, inner.error()));
+                return false;
+            }
+            if (!*inner) return true;
+            if (!receive_frame(**inner, peer, from, false)) {
+                logging::warn(std::format("[SYSTEM] Protocol error from {}:{}: bad compressed frame", peer.address, peer.port));
+                return false;
+            }
+        }
+    }
+    
+    // The peer's half of the key exchange; an empty one comes from a relay.
+    // Releases everything queued meanwhile, and on a link we opened, offers
+    // compression and datagrams, which now travel encrypted.
+    bool on_key_exchange(std::string_view payload, Peer& peer, PeerHandle from) {
+        auto outbox = outbox_of(from);
+        if (!outbox) return false;
+        if (payload.empty() && !group_ && !plaintext_relays_) {
+            logging::warn(std::format("[SYSTEM] {}:{} is a relay and would see messages in the clear; dropping it. "
+                                      "Use --secret, or --plaintext-relays to allow this", peer.address, peer.port));
+            return false;
+        }
+        std::shared_ptr<const secure_link::LinkKeys> keys;
+        if (!payload.empty()) {
+            auto agreed = secure_link::agree(peer.key_pair, payload, secret_);
+            if (!agreed) {
+                logging::warn(std::format("[SYSTEM] Peer {}:{} sent an unusable key", peer.address, peer.port));
+                return false;
+            }
+            keys = std::make_shared<const secure_link::LinkKeys>(*agreed);
+            peer.opener.emplace(keys->receive);
+        }
+        // Frames held during the exchange are queued under the outbox lock,
+        // before the registry shows the link as ready, so later broadcasts
+        // queue behind them.
+        bool overflow = false;
+        {
+            auto lock = guard(outbox->mutex);
+            if (keys) {
+                outbox->sealer = std::make_unique<secure_link::Sealer>(keys->send);
+            } else {
+                outbox->plain = true;
+            }
+            for (const auto& frame : outbox->awaiting_keys) {
+                bool was_empty;
+                auto queued = !keys && group_ && is_chat(frame) ? seal_for_relays(frame) : frame;
+                if (!queued) continue;
+                overflow |= outbox->queue.push(*queued, was_empty).status == OutboundQueue::PushStatus::Overflow;
+            }
+            outbox->awaiting_keys.clear();
+            outbox->awaiting_bytes = 0;
+        }
+        if (overflow) drop_peer(*outbox, "is not reading");
+        // `peer` may be the reading thread's own copy, so the registry entry
+        // is updated as well.
+        peer.security = keys ? Security::Encrypted : Security::Relay;
+        peer.keys = keys;
+        peer.key_pair = {};
+        {
+            auto lock = guard(peers_mutex_);
+            if (Peer* entry = peers_.get(from)) {
+                entry->security = peer.security;
+                entry->keys = keys;
+                entry->key_pair = {};
+            }
+        }
+        if (keys && udp_) {
+            auto lock = guard(udp_mutex_);
+            outbox->datagram_sealer = std::make_unique<secure_link::Sealer>(keys->datagram_send);
+        }
+        wake_outbox(outbox);
+        
+        if (keys) {
+            logging::info(std::format("[SYSTEM] Link to {}:{} is encrypted{}", peer.address, peer.port,
+                                      secret_.link_salt ? "" : " but not authenticated (no --secret)"));
+        } else if (group_) {
+            logging::info(std::format("[SYSTEM] {}:{} is a relay; messages through it are encrypted end to end",
+                                      peer.address, peer.port));
+        } else {
+            logging::warn(std::format("[SYSTEM] {}:{} is a relay and can read messages sent through it; use --secret to encrypt them",
+                                      peer.address, peer.port));
+        }
+        if (peer.liveness && peer.liveness->outgoing) {
+            if (compress_) offer_compression(from);
+            if (udp_) offer_udp(from);
+        }
+        return true;
+    }
+#endif
+    
+    // Restores a compressed frame, then handles it. Returns false if it
+    // cannot be restored. Frames compressed against the link's history are
+    // only valid in TCP order, never as datagrams.
+    bool receive_frame(const protocol::FrameView& frame, Peer& peer, PeerHandle from, bool datagram) {
+        if (!(frame.header.flags & protocol::FrameFlags::Compressed)) {
+            handle_frame(frame, peer, from);
+            return true;
+        }
+        if (datagram && (frame.header.flags & protocol::FrameFlags::Streamed)) return false;
+        if (!peer.decompressor) peer.decompressor = std::make_shared<compression::Decoder>();
+        auto original = compression::unpack(*peer.decompressor, frame.header, frame.payload, pool_);
+        if (!original) return false;
+        handle_frame(protocol::FrameView{protocol::read_header(original->data()),
+                                         original->view().substr(protocol::HEADER_SIZE), original->view()}, peer, from);
+        return true;
+    }
     
-    std::expected<SOCKET, std::string> create_socket() {
-#ifdef _WIN32
-        if (!initialize_winsock()) {
-            return std::unexpected("Failed to initialize Winsock");
+    // Handles one frame from `peer`, received over TCP or as a datagram.
+    // `sealed` is set for a chat frame opened from a relay's Sealed frame.
+    void handle_frame(const protocol::FrameView& frame, Peer& peer, PeerHandle from, bool sealed = false) {
+#ifndef _WIN32
+        if (handle_file_frame(frame, peer, from)) return;
+        if (frame.header.type == protocol::FrameType::UdpOffer) {
+            if (auto offer = protocol::decode_udp_offer(frame.payload)) on_udp_offer(*offer, peer, from);
+            return;
         }
+        if (frame.header.type == protocol::FrameType::Compression) {
+            if (auto hello = protocol::decode_compression(frame.payload)) on_compression(*hello, peer, from);
+            return;
+        }
+        if (frame.header.type == protocol::FrameType::Heartbeat) {
+            if (peer.liveness) peer.liveness->heartbeats = true;
+            return;
+        }
+        if (frame.header.type == protocol::FrameType::Sealed) {
+            open_sealed(frame, peer, from);
+            return;
+        }
+        // With a secret, chat through a relay must be sealed: a plain
+        // message may come from anyone, the relay included.
+        if (group_ && !sealed && peer.security == Security::Relay) return;
 #endif
+        if (frame.header.type == protocol::FrameType::ReplayEnd) {
+            if (auto end = protocol::decode_replay_end(frame.payload)) {
+                uint64_t skipped = end->head_seq - end->next_seq;
+                logging::info(std::format("[SYSTEM] End of history from {}:{}{}", peer.address, peer.port,
+                    skipped > 0 ? std::format(" ({} newer messages did not fit)", skipped) : ""));
+            }
+            return;
+        }
         
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock == INVALID_SOCKET) {
-#ifdef _WIN32
-            return std::unexpected(std::format("Failed to create socket: WSA Error {}", WSAGetLastError()));
-#else
-            return std::unexpected(std::format("Failed to create socket: {}", strerror(errno)));
-#endif
+        std::optional<protocol::ChatMessage> chat;
+        std::string_view room;
+        auto body = protocol::body_of(frame.header, frame.payload);
+        if (frame.header.type == protocol::FrameType::Chat) {
+            chat = protocol::decode_chat(body);
+        } else if (frame.header.type == protocol::FrameType::RoomChat) {
+            if (auto message = protocol::decode_room_chat(body)) {
+                chat = message->chat;
+                room = message->room;
+            }
         }
+        if (!chat || !protocol::well_formed(*chat, room)) return;
         
-        int opt = 1;
-#ifdef _WIN32
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0) {
-            closesocket(sock);
-            return std::unexpected(std::format("Failed to set SO_REUSEADDR: WSA Error {}", WSAGetLastError()));
+        // Frames from clients that do not speak gossip (relay clients,
+        // chat_bench) are given an envelope by the first node they reach.
+        bool replayed = (frame.header.flags & protocol::FrameFlags::Replayed) != 0;
+        if (replayed && !expecting_history()) return;
+        auto envelope = protocol::gossip_of(frame.header, frame.payload);
+        if (envelope && !peer.mesh) mark_mesh(peer, from);
+        auto gossip = envelope.value_or(protocol::GossipHeader{new_message_id(), gossip_ttl_});
+        if (!replayed && !first_sighting(gossip.id)) return;
+        
+        deliver_local(make_message(*chat, room, replayed));
+        
+        // Forward with the author's name and id preserved and one hop less
+        // to go. History was requested by us alone, so it is not passed on.
+        if (replayed || gossip.ttl == 0) return;
+        if (body.size() + protocol::GOSSIP_HEADER_SIZE > protocol::MAX_PAYLOAD) return;
+        size_t size = protocol::gossip_frame_size(frame.raw);
+        BufferSlice forward{pool_.acquire(size), 0, static_cast<uint32_t>(size)};
+        protocol::write_with_gossip(forward.buffer->data(), frame.raw,
+                                    {gossip.id, static_cast<uint8_t>(gossip.ttl - 1)});
+        broadcast_frame(forward, from, gossip_fanout_);
+    }
+    
+#ifndef _WIN32
+    // A chat frame sealed end to end by another holder of the secret, passed
+    // on by a relay. It is handled as if it came straight from the relay,
+    // and marked as history if the relay replayed it.
+    void open_sealed(const protocol::FrameView& frame, Peer& peer, PeerHandle from) {
+        bool replayed = (frame.header.flags & protocol::FrameFlags::Replayed) != 0;
+        if (replayed && !expecting_history()) return;
+        std::optional<BufferSlice> opened;
+        if (group_) {
+            opened = group_->open(frame, pool_, replayed ? secure_link::GroupCipher::Copies::Allow
+                                                          : secure_link::GroupCipher::Copies::Reject);
         }
-#else
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            closesocket(sock);
-            return std::unexpected(std::format("Failed to set SO_REUSEADDR: {}", strerror(errno)));
+        auto inner = opened ? protocol::read_header(opened->data()) : protocol::FrameHeader{};
+        if (!opened || (inner.type != protocol::FrameType::Chat && inner.type != protocol::FrameType::RoomChat) ||
+            (inner.flags & protocol::FrameFlags::Compressed)) {
+            if (!std::exchange(peer.sealed_warned, true)) {
+                logging::warn(std::format("[SYSTEM] Cannot decrypt messages from {}:{}; they need the same --secret",
+                                          peer.address, peer.port));
+            }
+            return;
         }
-        
-        // On macOS, also set SO_REUSEPORT to avoid "Address already in use" errors
-#ifdef __APPLE__
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-            closesocket(sock);
-            return std::unexpected(std::format("Failed to set SO_REUSEPORT: {}", strerror(errno)));
+        if (replayed) {
+            inner.flags |= protocol::FrameFlags::Replayed;
+            protocol::write_header(opened->buffer->data() + opened->offset, inner);
         }
+        handle_frame(protocol::FrameView{inner, opened->view().substr(protocol::HEADER_SIZE), opened->view()}, peer, from,
+                     true);
+    }
 #endif
-#endif
-        
-        return sock;
+    
+    // `peer` may be the reading thread's own copy, so the registry entry is
+    // updated as well.
+    void mark_mesh(Peer& peer, PeerHandle handle) {
+        peer.mesh = true;
+        auto lock = guard(peers_mutex_);
+        if (Peer* entry = peers_.get(handle)) entry->mesh = true;
     }
     
-    std::expected<void, std::string> bind_and_listen(int port) {
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = htons(port);
+    uint64_t new_message_id() {
+        return next_message_id_.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    // Returns true the first time `id` is seen within the dedup window.
+    bool first_sighting(uint64_t id) {
+        auto lock = guard(seen_mutex_);
+        return seen_.insert(id);
+    }
+    
+    // Our own messages go to every peer; the id is remembered so copies that
+    // come back around a cycle are dropped.
+    void broadcast_message(std::string_view room, std::string_view text) {
+        protocol::GossipHeader gossip{new_message_id(), gossip_ttl_};
+        first_sighting(gossip.id);
+        if (room.empty()) {
+            broadcast_frame(protocol::with_gossip(protocol::encode_chat(node_id_, username_, text), gossip));
+        } else {
+            broadcast_frame(protocol::with_gossip(protocol::encode_room_chat(node_id_, room, username_, text), gossip));
+        }
+    }
+    
+    // Sends `frame` to every peer but `exclude`. With a non-zero `fanout`, only
+    // that many mesh nodes picked at random get it; plain clients always do,
+    // since nobody else would pass it on to them.
+    void broadcast_frame(std::string_view frame, std::optional<PeerHandle> exclude = std::nullopt, size_t fanout = 0) {
+        broadcast_frame(pool_.copy(frame), exclude, fanout);
+    }
+    
+    void broadcast_frame(const BufferSlice& frame, std::optional<PeerHandle> exclude, size_t fanout) {
+        // Scratch lists reused across calls, so a broadcast does not allocate.
+        thread_local std::vector<size_t> targets;
+        thread_local std::vector<size_t> nodes;
+        targets.clear();
+        nodes.clear();
         
-        if (bind(listen_socket_, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) == SOCKET_ERROR) {
-#ifdef _WIN32
-            return std::unexpected(std::format("Failed to bind to port {}: WSA Error {}", port, WSAGetLastError()));
-#else
-            return std::unexpected(std::format("Failed to bind to port {}: {}", port, strerror(errno)));
-#endif
+        auto lock = guard(peers_mutex_);
+        auto peers = peers_.values();
+        for (size_t i = 0; i < peers.size(); ++i) {
+            if (exclude && peers_.handle_at(i) == *exclude) continue;
+            (fanout > 0 && peers[i].mesh ? nodes : targets).push_back(i);
+        }
+        for (size_t i = 0; i < nodes.size() && i < fanout; ++i) {
+            std::uniform_int_distribution<size_t> pick(i, nodes.size() - 1);
+            std::swap(nodes[i], nodes[pick(rng_)]);
+            targets.push_back(nodes[i]);
         }
         
-        if (listen(listen_socket_, 5) == SOCKET_ERROR) {
 #ifdef _WIN32
-            return std::unexpected(std::format("Failed to listen on socket: WSA Error {}", WSAGetLastError()));
+        for (size_t i : targets) {
+            send_all(peers[i].socket_fd, frame.view());
+        }
 #else
-            return std::unexpected(std::format("Failed to listen on socket: {}", strerror(errno)));
-#endif
+        // Peers that negotiated compression are kept apart: they get the
+        // frame compressed, against the link's history if it goes to that
+        // one peer alone, otherwise once for all of them. With a secret,
+        // relays get chat sealed end to end, once for all of them. Links
+        // still exchanging keys hold the frame until they know what to do.
+        thread_local std::vector<std::shared_ptr<Outbox>> outboxes;
+        thread_local std::vector<std::shared_ptr<Outbox>> compressing;
+        thread_local std::vector<std::pair<uint32_t, std::shared_ptr<Outbox>>> datagrams;
+        thread_local std::vector<std::pair<uint32_t, std::shared_ptr<Outbox>>> compressed_datagrams;
+        thread_local std::vector<std::pair<uint32_t, std::shared_ptr<Outbox>>> relays;
+        thread_local std::vector<std::shared_ptr<Outbox>> handshaking;
+        bool fits = udp_ && frame.size() + secure_link::RECORD_OVERHEAD <= reliable_udp::MAX_FRAME;
+        auto header = protocol::read_header(frame.data());
+        bool compressible = compress_ && compression::compressible(header);
+        bool chat = header.type == protocol::FrameType::Chat || header.type == protocol::FrameType::RoomChat;
+        for (size_t i : targets) {
+            if (peers[i].security == Security::Handshake) {
+                handshaking.push_back(peers[i].outbox);
+                continue;
+            }
+            if (group_ && chat && peers[i].security == Security::Relay) {
+                relays.emplace_back(peers[i].udp_ready ? peers[i].udp : 0, peers[i].outbox);
+                continue;
+            }
+            bool compressed = compressible && peers[i].compress;
+            if (fits && peers[i].udp_ready) {
+                (compressed ? compressed_datagrams : datagrams).emplace_back(peers[i].udp, peers[i].outbox);
+            } else {
+                (compressed ? compressing : outboxes).push_back(peers[i].outbox);
+            }
         }
-        
-        return {};
+        lock = {};   // queueing needs only the outboxes' own locks
+        enqueue(outboxes, frame);
+        send_datagrams(datagrams, frame);
+        if (compressing.size() == 1 && compressed_datagrams.empty()) {
+            enqueue(compressing, frame, true);
+        } else if (!compressing.empty() || !compressed_datagrams.empty()) {
+            thread_local compression::Encoder encoder;
+            auto packed = compression::pack(encoder, frame.view(), false, pool_);
+            enqueue(compressing, packed ? *packed : frame);
+            send_datagrams(compressed_datagrams, packed ? *packed : frame);
+        }
+        if (!relays.empty()) send_to_relays(relays, frame);
+        if (!handshaking.empty()) hold_for_keys(handshaking, frame);
+        outboxes.clear();
+        compressing.clear();
+        datagrams.clear();
+        compressed_datagrams.clear();
+        relays.clear();
+        handshaking.clear();
+#endif
     }
     
-    void accept_connections() {
-        while (running_) {
-            sockaddr_in client_addr{};
-            socklen_t addr_len = sizeof(client_addr);
-            
-            SOCKET client_sock = accept(listen_socket_, reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
-            if (client_sock == INVALID_SOCKET) {
-                if (running_) {
-#ifdef _WIN32
-                    if (WSAGetLastError() != WSAEINTR) {
-#else
-                    if (errno != EINTR) {
-#endif
-                        std::cerr << "Failed to accept connection\n";
-                    }
+#ifndef _WIN32
+    // Keeps `frame` for each of `outboxes` until its key exchange is done.
+    // One that finished meanwhile gets it as it would now. A link that
+    // holds too much is dropped, as when its queue overflows.
+    void hold_for_keys(const std::vector<std::shared_ptr<Outbox>>& outboxes, const BufferSlice& frame) {
+        for (const auto& outbox : outboxes) {
+            bool keyed;
+            bool overflow = false;
+            {
+                auto lock = guard(outbox->mutex);
+                keyed = outbox->sealer || outbox->plain;
+                if (!keyed && outbox->awaiting_bytes + frame.size() > MAX_PENDING_BYTES) {
+                    overflow = true;
+                } else if (!keyed) {
+                    outbox->awaiting_keys.push_back(frame);
+                    outbox->awaiting_bytes += frame.size();
                 }
-                continue;
             }
-            
-            char addr_str[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_addr.sin_addr, addr_str, INET_ADDRSTRLEN);
-            
-            Peer new_peer{
-                .address = std::string(addr_str),
-                .port = ntohs(client_addr.sin_port),
-                .socket_fd = client_sock
-            };
-            
-            {
-                std::lock_guard<std::mutex> lock(peers_mutex_);
-                peers_.push_back(new_peer);
+            if (overflow) {
+                drop_peer(*outbox, "is not reading");
+            } else if (keyed && outbox->plain && group_ && is_chat(frame)) {
+                if (auto sealed = seal_for_relays(frame)) enqueue({outbox}, *sealed);
+            } else if (keyed) {
+                enqueue({outbox}, frame);
             }
-            
-            std::cout << std::format("\n[SYSTEM] New peer connected: {}:{}\n> ", new_peer.address, new_peer.port);
-            std::cout.flush();
-            
-            std::thread(&P2PChat::handle_peer, this, peers_.size() - 1).detach();
         }
     }
     
-    void handle_peer(size_t peer_index) {
-        char buffer[BUFFER_SIZE];
-        Peer* peer = nullptr;
-        
-        {
-            std::lock_guard<std::mutex> lock(peers_mutex_);
-            if (peer_index < peers_.size()) {
-                peer = &peers_[peer_index];
-            }
+    static bool is_chat(const BufferSlice& frame) {
+        auto type = protocol::read_header(frame.data()).type;
+        return type == protocol::FrameType::Chat || type == protocol::FrameType::RoomChat;
+    }
+    
+    // The chat frame `frame` sealed for the group, routed by its room.
+    // Nothing once this node id has sealed all the frames it may.
+    std::optional<BufferSlice> seal_for_relays(const BufferSlice& frame) {
+        auto header = protocol::read_header(frame.data());
+        auto room = header.type == protocol::FrameType::RoomChat
+            ? protocol::room_of(protocol::body_of(header, frame.view().substr(protocol::HEADER_SIZE))) : std::nullopt;
+        auto sealed = group_->seal(node_id_, room.value_or(std::string_view()), frame.view(), pool_);
+        if (!sealed && !group_exhausted_.exchange(true, std::memory_order_relaxed)) {
+            logging::error("[SYSTEM] This node has sealed all the messages one id allows for --secret; "
+                           "restart it to send through relays again");
         }
-        
-        if (!peer) return;
-        
-        while (running_ && peer->socket_fd != INVALID_SOCKET) {
-            ssize_t bytes_received = recv(peer->socket_fd, buffer, BUFFER_SIZE - 1, 0);
-            
-            if (bytes_received <= 0) {
-                std::cout << std::format("\n[SYSTEM] Peer {}:{} disconnected\n> ", peer->address, peer->port);
-                std::cout.flush();
-                closesocket(peer->socket_fd);
-                peer->socket_fd = INVALID_SOCKET;
-                break;
-            }
-            
-            buffer[bytes_received] = '\0';
-            
-            Message msg{
-                .content = std::string(buffer),
-                .sender = std::format("{}:{}", peer->address, peer->port),
-                .timestamp = std::chrono::system_clock::now()
-            };
-            
-            {
-                std::lock_guard<std::mutex> lock(queue_mutex_);
-                message_queue_.push(msg);
+        return sealed;
+    }
+    
+    // The chat frame `frame` sealed for the group, to each of `relays` (a
+    // datagram session, or 0, and an outbox), as a datagram where it fits.
+    void send_to_relays(const std::vector<std::pair<uint32_t, std::shared_ptr<Outbox>>>& relays, const BufferSlice& frame) {
+        thread_local std::vector<std::shared_ptr<Outbox>> outboxes;
+        thread_local std::vector<std::pair<uint32_t, std::shared_ptr<Outbox>>> datagrams;
+        auto sealed_frame = seal_for_relays(frame);
+        if (!sealed_frame) return;
+        const BufferSlice& sealed = *sealed_frame;
+        bool fits = sealed.size() <= reliable_udp::MAX_FRAME;
+        for (const auto& [token, outbox] : relays) {
+            if (fits && token != 0) {
+                datagrams.emplace_back(token, outbox);
+            } else {
+                outboxes.push_back(outbox);
             }
-            queue_cv_.notify_one();
-            
-            broadcast_message(msg, peer_index);
         }
+        enqueue(outboxes, sealed);
+        send_datagrams(datagrams, sealed);
+        outboxes.clear();
+        datagrams.clear();
     }
+#endif
     
-    void broadcast_message(const Message& msg, std::optional<size_t> exclude_index = std::nullopt) {
-        std::string formatted_msg = std::format("[{}] {}: {}", 
-            format_time(msg.timestamp), msg.sender, msg.content);
-        
-        std::lock_guard<std::mutex> lock(peers_mutex_);
-        for (size_t i = 0; i < peers_.size(); ++i) {
-            if (exclude_index && i == *exclude_index) continue;
-            if (peers_[i].socket_fd == INVALID_SOCKET) continue;
-            
-            send(peers_[i].socket_fd, formatted_msg.c_str(), formatted_msg.length(), 0);
+    static bool send_all(SOCKET sock, std::string_view data) {
+        while (!data.empty()) {
+            auto sent = send(sock, data.data(), static_cast<int>(data.size()), SEND_FLAGS);
+            if (sent <= 0) return false;
+            data.remove_prefix(static_cast<size_t>(sent));
         }
+        return true;
     }
     
     std::string format_time(const std::chrono::system_clock::time_point& tp) {
@@ -247,23 +1947,103 @@ private:
         return std::format("{:02}:{:02}:{:02}", tm->tm_hour, tm->tm_min, tm->tm_sec);
     }
     
+    // Copies what is shown of a received chat into one pooled buffer.
+    Message make_message(const protocol::ChatMessage& chat, std::string_view room, bool replayed) {
+        std::string scratch;
+        auto text = text_scan::strip_controls(chat.text, scratch);
+        size_t size = chat.name.size() + room.size() + text.size();
+        BufferSlice body{pool_.acquire(size), 0, static_cast<uint32_t>(size)};
+        char* out = body.buffer->data();
+        out = std::ranges::copy(chat.name, out).out;
+        out = std::ranges::copy(room, out).out;
+        std::ranges::copy(text, out);
+        return Message{
+            .body = std::move(body),
+            .sender_size = static_cast<uint8_t>(chat.name.size()),
+            .room_size = static_cast<uint8_t>(room.size()),
+            .received = std::chrono::steady_clock::now(),
+            .replayed = replayed
+        };
+    }
+    
+    // Hands a received message to the console. The reactor renders on its
+    // own thread at the end of the current batch of events.
+    void deliver_local(Message msg) {
+#ifndef _WIN32
+        if (reactor_) {
+            append_message(render_buffer_, msg);
+            if (!render_scheduled_) {
+                render_scheduled_ = true;
+                loop_->post([this] {
+                    render_scheduled_ = false;
+                    write_console(render_buffer_);
+                });
+            }
+            return;
+        }
+#endif
+        // A full inbox means the console is behind; wait for it rather than
+        // lose messages, which in turn slows this peer's reads.
+        while (!inbox_.try_push(std::move(msg))) {
+            std::this_thread::yield();
+        }
+        // Pairs with the fence in process_messages(): either we see it asleep
+        // or it sees our message before going to sleep.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (inbox_sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(inbox_mutex_);
+            inbox_cv_.notify_one();
+        }
+    }
+    
+    // Drains the inbox in batches, writing each batch with one flush.
     void process_messages() {
+        std::string out;
         while (running_) {
-            std::unique_lock<std::mutex> lock(queue_mutex_);
-            queue_cv_.wait(lock, [this] { return !message_queue_.empty() || !running_; });
-            
-            while (!message_queue_.empty()) {
-                auto msg = message_queue_.front();
-                message_queue_.pop();
-                lock.unlock();
-                
-                std::cout << std::format("\r[{}] {}: {}\n> ", 
-                    format_time(msg.timestamp), msg.sender, msg.content);
-                std::cout.flush();
-                
-                lock.lock();
+            for (size_t n = 0; n < RENDER_BATCH; ++n) {
+                auto msg = inbox_.try_pop();
+                if (!msg) break;
+                append_message(out, *msg);
+            }
+            if (!out.empty()) {
+                write_console(out);
+                continue;
             }
+            
+            std::unique_lock<std::mutex> lock(inbox_mutex_);
+            inbox_sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            inbox_cv_.wait(lock, [this] { return !inbox_.empty() || !running_; });
+            inbox_sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+    
+    // Only the rendering thread (or the reactor loop) calls this.
+    void append_message(std::string& out, const Message& msg) {
+        auto room = msg.room();
+        std::format_to(std::back_inserter(out), "\r[{}] {}{}{}{}: {}\n",
+            msg.replayed ? std::string_view("history") : render_time(msg.received),
+            room.empty() ? "" : "[#", room, room.empty() ? "" : "] ", msg.sender(), msg.text());
+    }
+    
+    // Time stamps change once a second, so a batch mostly reuses the last one.
+    std::string_view render_time(std::chrono::steady_clock::time_point received) {
+        auto wall = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::steady_clock::now() - received);
+        auto second = std::chrono::system_clock::to_time_t(wall);
+        if (second != rendered_second_) {
+            rendered_second_ = second;
+            rendered_time_ = format_time(wall);
         }
+        return rendered_time_;
+    }
+    
+    // Writes rendered messages and the prompt in one go, then clears `out`.
+    static void write_console(std::string& out) {
+        out += "> ";
+        std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+        std::cout.flush();
+        out.clear();
     }
     
     void handle_user_input() {
@@ -276,28 +2056,9 @@ private:
             
             if (!running_) break;
             
-            if (input == "/quit" || input == "/exit") {
+            if (!handle_command(input)) {
                 running_ = false;
                 break;
-            } else if (input.starts_with("/connect ")) {
-                auto parts = input | std::views::split(' ') | std::ranges::to<std::vector<std::string>>();
-                if (parts.size() == 3) {
-                    try {
-                        connect_to_peer(parts[1], std::stoi(parts[2]));
-                    } catch (const std::exception& e) {
-                        std::cout << "Invalid port number\n";
-                    }
-                } else {
-                    std::cout << "Usage: /connect <address> <port>\n";
-                }
-            } else if (input == "/peers") {
-                list_peers();
-            } else if (input == "/help") {
-                show_help();
-            } else if (!input.empty() && input[0] != '/') {
-                send_to_all_peers(input);
-            } else if (!input.empty()) {
-                std::cout << "Unknown command. Type /help for available commands.\n";
             }
             
             std::cout << "> ";
@@ -305,15 +2066,123 @@ private:
         }
     }
     
+    // Runs one line of user input. Returns false when the user asked to quit.
+    // The line is split in place; arguments are views into it.
+    bool handle_command(std::string_view input) {
+        auto [command, argument] = text_scan::parse_command(input);
+        if ((command == "quit" || command == "exit") && argument.empty()) {
+            return false;
+        } else if (command == "connect") {
+            std::string_view rest = argument;
+            auto address = text_scan::next_word(rest);
+            auto port_text = text_scan::next_word(rest);
+            if (address.empty() || port_text.empty() || !text_scan::next_word(rest).empty()) {
+                std::cout << "Usage: /connect <address> <port>\n";
+                return true;
+            }
+            int port = 0;
+            auto [end, error] = std::from_chars(port_text.data(), port_text.data() + port_text.size(), port);
+            if (error != std::errc() || end != port_text.data() + port_text.size()) {
+                std::cout << "Invalid port number\n";
+            } else {
+                connect_to_peer(std::string(address), port);
+            }
+        } else if (command == "join" && !argument.empty()) {
+            join_room(argument);
+        } else if (command == "history") {
+            request_history(argument);
+        } else if (command == "leave") {
+            leave_room();
+        } else if (command == "peers") {
+            list_peers();
+#ifndef _WIN32
+        } else if (command == "send" && !argument.empty()) {
+            send_file(argument);
+        } else if (command == "accept" && !argument.empty()) {
+            accept_file(argument);
+        } else if (command == "cancel" && !argument.empty()) {
+            cancel_file(argument);
+        } else if (command == "files") {
+            list_files();
+#endif
+        } else if (command == "help") {
+            show_help();
+        } else if (!input.empty() && input[0] != '/') {
+            send_to_all_peers(input);
+        } else if (!input.empty()) {
+            std::cout << "Unknown command. Type /help for available commands.\n";
+        }
+        return true;
+    }
+    
     void show_help() {
         std::cout << "\nAvailable commands:\n"
                   << "  /connect <address> <port> - Connect to a peer\n"
                   << "  /peers                    - List connected peers\n"
+                  << "  /join <room>              - Talk in a relay room instead of to everyone\n"
+                  << "  /leave                    - Leave the current room\n"
+                  << "  /history [count]          - Show recent messages logged by the relay\n"
+                  << "  /send <peer> <path>       - Send a file to a peer (number from /peers or address:port)\n"
+                  << "  /accept <number>          - Download a file offered to you\n"
+                  << "  /cancel <peer>            - Stop sending a file to a peer\n"
+                  << "  /files                    - List file transfers\n"
                   << "  /help                     - Show this help message\n"
                   << "  /quit or /exit           - Exit the application\n"
                   << "  <message>                - Send a message to all peers\n\n";
     }
     
+    static std::string room_prefix(const std::string& room) {
+        return room.empty() ? std::string() : std::format("[#{}] ", room);
+    }
+    
+    // Rooms are routed by the relay server; directly connected peers forward
+    // room messages like any other.
+    void join_room(std::string_view room) {
+        if (room.size() > protocol::MAX_ROOM_NAME || room.find(' ') != std::string_view::npos ||
+            !text_scan::valid_name(room)) {
+            std::cout << std::format("Room names are 1-{} bytes of UTF-8 without spaces or control characters\n",
+                                     protocol::MAX_ROOM_NAME);
+            return;
+        }
+        if (room == current_room_) return;
+        
+        leave_room();
+        broadcast_frame(protocol::encode_join(node_id_, room));
+        current_room_ = room;
+        std::cout << std::format("[SYSTEM] Joined #{}\n", room);
+    }
+    
+    void leave_room() {
+        if (current_room_.empty()) return;
+        
+        broadcast_frame(protocol::encode_leave(node_id_, current_room_));
+        std::cout << std::format("[SYSTEM] Left #{}\n", current_room_);
+        current_room_.clear();
+    }
+    
+    void request_history(std::string_view count) {
+        constexpr uint64_t DEFAULT_HISTORY = 20;
+        uint64_t messages = DEFAULT_HISTORY;
+        if (!count.empty()) {
+            auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), messages);
+            if (error != std::errc() || end != count.data() + count.size()) {
+                std::cout << "Usage: /history [count]\n";
+                return;
+            }
+        }
+        history_until_.store((std::chrono::steady_clock::now() + HISTORY_WAIT).time_since_epoch().count(),
+                             std::memory_order_relaxed);
+        broadcast_frame(protocol::encode_replay_request(node_id_, {protocol::ReplayRequest::Since::Last, messages}));
+    }
+    
+    // The Replayed flag is set by the relay, outside anything the author
+    // signed, so history skips the dedup cache only shortly after we asked
+    // for it. Otherwise a relay could show old messages again at will.
+    bool expecting_history() const {
+        return std::chrono::steady_clock::now().time_since_epoch().count() <
+               history_until_.load(std::memory_order_relaxed);
+    }
+    
     void connect_to_peer(const std::string& address, int port) {
         auto sock_result = create_socket();
         if (!sock_result) {
@@ -343,69 +2212,146 @@ private:
             return;
         }
         
-        Peer new_peer{
+        std::cout << std::format("[SYSTEM] Connected to peer {}:{}\n", address, port);
+        
+        // Compression and datagrams are offered once the key exchange is done.
+        register_peer(Peer{
             .address = address,
             .port = port,
             .socket_fd = sock
-        };
-        
-        {
-            std::lock_guard<std::mutex> lock(peers_mutex_);
-            peers_.push_back(new_peer);
-        }
-        
-        std::cout << std::format("[SYSTEM] Connected to peer {}:{}\n", address, port);
-        
-        std::thread(&P2PChat::handle_peer, this, peers_.size() - 1).detach();
+        }, true);
     }
     
     void list_peers() {
-        std::lock_guard<std::mutex> lock(peers_mutex_);
-        
-        auto active_peers = std::ranges::count_if(peers_, [](const auto& p) { 
-            return p.socket_fd != INVALID_SOCKET; 
-        });
+        auto lock = guard(peers_mutex_);
         
-        if (active_peers == 0) {
+        if (peers_.empty()) {
             std::cout << "No connected peers\n";
             return;
         }
         
         std::cout << "\nConnected peers:\n";
+        size_t number = 0;
         for (const auto& peer : peers_) {
-            if (peer.socket_fd != INVALID_SOCKET) {
-                std::cout << std::format("  - {}:{}\n", peer.address, peer.port);
+            std::string transport;
+#ifndef _WIN32
+            if (peer.compress) transport = "  (compressed)";
+            if (peer.udp_ready) {
+                auto udp_lock = guard(udp_mutex_);
+                if (auto stats = udp_->stats(peer.udp)) {
+                    transport = std::format("  (udp, rtt {:.2f} ms, {} retransmitted{})",
+                                            static_cast<double>(stats->srtt.count()) / 1000, stats->retransmitted,
+                                            peer.compress ? ", compressed" : "");
+                }
             }
+#endif
+            std::cout << std::format("  {}. {}:{}{}\n", ++number, peer.address, peer.port, transport);
         }
         std::cout << "\n";
     }
     
-    void send_to_all_peers(const std::string& message) {
-        Message msg{
-            .content = message,
-            .sender = username_,
-            .timestamp = std::chrono::system_clock::now()
-        };
-        
-        broadcast_message(msg);
+    // Peers drop chat that is not UTF-8, so it is refused here where the
+    // user can see why.
+    void send_to_all_peers(std::string_view message) {
+        if (!text_scan::valid_utf8(message)) {
+            std::cout << "Message not sent: it is not valid UTF-8\n";
+            return;
+        }
+        broadcast_message(current_room_, message);
         
-        std::cout << std::format("\r[{}] You: {}\n", format_time(msg.timestamp), message);
+        std::cout << std::format("\r[{}] {}You: {}\n", format_time(std::chrono::system_clock::now()),
+                                 room_prefix(current_room_), message);
     }
     
 public:
-    P2PChat(const std::string& username, int port = DEFAULT_PORT) 
-        : username_(username) {
+    P2PChat(const std::string& username, const ChatOptions& options = {}) 
+        : username_(username), gossip_ttl_(options.gossip_ttl), gossip_fanout_(options.gossip_fanout)
+#ifndef _WIN32
+        , coalesce_window_(options.coalesce_window), coalesce_bytes_(options.coalesce_bytes)
+        , download_dir_(options.download_dir)
+#endif
+    {
         auto sock_result = create_socket();
         if (!sock_result) {
             throw std::runtime_error(sock_result.error());
         }
         listen_socket_ = sock_result.value();
         
-        auto bind_result = bind_and_listen(port);
+        auto bind_result = bind_and_listen(options.port);
         if (!bind_result) {
             closesocket(listen_socket_);
             throw std::runtime_error(bind_result.error());
         }
+        
+        if (options.reactor) {
+#ifdef _WIN32
+            std::cerr << "Reactor mode is not available on Windows; using threads\n";
+#else
+            loop_ = std::make_unique<EventLoop>();
+            reactor_ = true;
+#endif
+        }
+        
+        if (options.udp) {
+#ifdef _WIN32
+            std::cerr << "The datagram transport is not available on Windows; using TCP only\n";
+#else
+            try {
+                udp_ = std::make_unique<reliable_udp::Endpoint>(pool_, static_cast<uint16_t>(options.port),
+                    reliable_udp::Impairment{options.udp_loss, options.udp_delay});
+            } catch (...) {
+                closesocket(listen_socket_);
+                throw;
+            }
+            udp_unordered_ = options.udp_unordered;
+            if (!reactor_) service_loop_ = std::make_unique<EventLoop>();
+            EventLoop& loop = reactor_ ? *loop_ : *service_loop_;
+            loop.add(udp_->fd(), EventLoop::READABLE, [this](uint32_t) { receive_datagrams(); });
+            auto tick = loop.add_timer([this] {
+                auto lock = guard(udp_mutex_);
+                udp_->tick();
+            });
+            udp_->on_deadline([&loop, tick](auto when) { loop.arm_timer(tick, when); });
+#endif
+        }
+        
+        if (!options.secret.empty()) {
+#ifdef _WIN32
+            std::cerr << "Encryption is not available on Windows; links carry plain frames\n";
+#endif
+        }
+        
+        if (options.compress) {
+#ifdef _WIN32
+            std::cerr << "Compression is not available on Windows; sending frames as they are\n";
+#else
+            compress_ = true;
+#endif
+        }
+        
+#ifndef _WIN32
+        secret_ = secure_link::derive_secret(options.secret);
+        if (secret_.group) {
+            group_ = std::make_unique<secure_link::GroupCipher>(*secret_.group);
+        } else {
+            plaintext_relays_ = options.plaintext_relays;
+            std::cerr << std::format("No --secret given: links are encrypted, but peers are not authenticated{}\n",
+                                     plaintext_relays_ ? " and relays can read messages" : ", and relays are refused");
+        }
+        
+        heartbeat_interval_ = options.heartbeat_interval;
+        idle_timeout_ = options.idle_timeout;
+        handshake_timeout_ = options.handshake_timeout;
+        stall_timeout_ = options.stall_timeout;
+        liveness_ = heartbeat_interval_.count() > 0 || idle_timeout_.count() > 0 ||
+                    handshake_timeout_.count() > 0 || stall_timeout_.count() > 0;
+        if (liveness_) {
+            heartbeat_ = pool_.copy(protocol::encode_heartbeat(node_id_));
+            if (!reactor_ && !service_loop_) service_loop_ = std::make_unique<EventLoop>();
+            EventLoop& loop = reactor_ ? *loop_ : *service_loop_;
+            loop.run_every(TIMER_TICK, [this] { run_timers(); });
+        }
+#endif
     }
     
     ~P2PChat() {
@@ -414,12 +2360,15 @@ public:
             closesocket(listen_socket_);
         }
         
-        std::lock_guard<std::mutex> lock(peers_mutex_);
+        auto lock = guard(peers_mutex_);
         for (auto& peer : peers_) {
-            if (peer.socket_fd != INVALID_SOCKET) {
-                closesocket(peer.socket_fd);
-            }
+#ifndef _WIN32
+            std::lock_guard<std::mutex> outbox_lock(peer.outbox->mutex);
+            peer.outbox->closed = true;
+#endif
+            closesocket(peer.socket_fd);
         }
+        peers_.clear();
         
 #ifdef _WIN32
         cleanup_winsock();
@@ -428,24 +2377,58 @@ public:
     
     void start() {
         running_ = true;
+        // Notices from the network threads are written in the background;
+        // redraw the prompt after each batch.
+        logging::Logger::instance().set_prompt("> ");
         
         std::cout << "\n=== P2P Chat Application ===\n";
         std::cout << std::format("Listening on port: {}\n", DEFAULT_PORT);
         std::cout << std::format("Username: {}\n", username_);
         std::cout << "Type /help for available commands\n\n";
         
+#ifndef _WIN32
+        if (reactor_) {
+            std::cout << "> ";
+            std::cout.flush();
+            run_reactor();
+            return;
+        }
+#endif
+        
         std::thread accept_thread(&P2PChat::accept_connections, this);
         std::thread message_thread(&P2PChat::process_messages, this);
+#ifndef _WIN32
+        std::thread writer_thread(&P2PChat::write_outboxes, this);
+        std::thread service_thread;
+        if (service_loop_) service_thread = std::thread([this] { service_loop_->run(); });
+#endif
         
         handle_user_input();
+        stop();
         
         if (accept_thread.joinable()) accept_thread.join();
         if (message_thread.joinable()) message_thread.join();
+#ifndef _WIN32
+        if (writer_thread.joinable()) writer_thread.join();
+        if (service_thread.joinable()) service_thread.join();
+#endif
     }
     
     void stop() {
         running_ = false;
-        queue_cv_.notify_all();
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex_);
+        }
+        inbox_cv_.notify_all();
+#ifndef _WIN32
+        {
+            // Taken so the writer cannot miss the wakeup between its check and its wait.
+            std::lock_guard<std::mutex> lock(outbox_mutex_);
+        }
+        outbox_cv_.notify_all();
+        if (loop_) loop_->stop();
+        if (service_loop_) service_loop_->stop();
+#endif
         
         if (listen_socket_ != INVALID_SOCKET) {
             shutdown(listen_socket_, SHUT_RDWR);
@@ -461,27 +2444,80 @@ bool P2PChat::winsock_initialized_ = false;
 
 int main(int argc, char* argv[]) {
     std::string username;
-    int port = 8888;
+    ChatOptions options;
+    
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        try {
+            if (arg == "--reactor") {
+                options.reactor = true;
+            } else if (arg == "--ttl" && i + 1 < argc) {
+                options.gossip_ttl = static_cast<uint8_t>(std::clamp(std::stoi(argv[++i]), 0, 255));
+            } else if (arg == "--fanout" && i + 1 < argc) {
+                options.gossip_fanout = static_cast<size_t>(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--coalesce-us" && i + 1 < argc) {
+                options.coalesce_window = std::chrono::microseconds(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--coalesce-bytes" && i + 1 < argc) {
+                options.coalesce_bytes = static_cast<size_t>(std::max(std::stoi(argv[++i]), 1));
+            } else if (arg == "--download-dir" && i + 1 < argc) {
+                options.download_dir = argv[++i];
+            } else if (arg == "--udp") {
+                options.udp = true;
+            } else if (arg == "--udp-unordered") {
+                options.udp_unordered = true;
+            } else if (arg == "--udp-loss" && i + 1 < argc) {
+                options.udp_loss = std::clamp(std::stod(argv[++i]), 0.0, 100.0) / 100;
+            } else if (arg == "--udp-delay-ms" && i + 1 < argc) {
+                options.udp_delay = std::chrono::milliseconds(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--compress") {
+                options.compress = true;
+            } else if (arg == "--heartbeat-interval" && i + 1 < argc) {
+                options.heartbeat_interval = std::chrono::seconds(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--idle-timeout" && i + 1 < argc) {
+                options.idle_timeout = std::chrono::seconds(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--handshake-timeout" && i + 1 < argc) {
+                options.handshake_timeout = std::chrono::seconds(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--stall-timeout" && i + 1 < argc) {
+                options.stall_timeout = std::chrono::seconds(std::max(std::stoi(argv[++i]), 0));
+            } else if (arg == "--secret" && i + 1 < argc) {
+                options.secret = argv[++i];
+            } else if (arg == "--plaintext-relays") {
+                options.plaintext_relays = true;
+            } else {
+                args.emplace_back(arg);
+            }
+        } catch (const std::exception&) {
+            std::cerr << std::format("Invalid value for {}\n", arg);
+            return 1;
+        }
+    }
     
-    if (argc < 2) {
+    if (args.empty()) {
         std::cout << "Enter your username: ";
         std::getline(std::cin, username);
         if (username.empty()) {
             username = "Anonymous";
         }
     } else {
-        username = argv[1];
-        if (argc >= 3) {
+        username = args[0];
+        if (args.size() >= 2) {
             try {
-                port = std::stoi(argv[2]);
+                options.port = std::stoi(args[1]);
             } catch (const std::exception&) {
                 std::cerr << "Invalid port number, using default port 8888\n";
             }
         }
     }
     
+    // Peers drop messages whose sender name is malformed.
+    if (!text_scan::valid_name(username)) {
+        std::cerr << "Usernames must be UTF-8 without control characters\n";
+        return 1;
+    }
+    
     try {
-        P2PChat chat(username, port);
+        P2PChat chat(username, options);
         chat.start();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << "\n";
@@ -490,4 +2526,4 @@ int main(int argc, char* argv[]) {
     
     std::cout << "\nGoodbye!\n";
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,758 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "text_scan.hpp"
+
+// Wire format shared by p2p_chat and relay_server.
+//
+// Every message is a frame: a fixed 16-byte header followed by `length`
+// payload bytes. All integers are big-endian.
+//
+//   offset  size  field
+//   0       4     length    payload bytes following the header
+//   4       1     version   PROTOCOL_VERSION
+//   5       1     type      FrameType
+//   6       2     flags     FrameFlags bitmask
+//   8       8     sender    sender id chosen by the originating node
+namespace protocol {
+
+constexpr uint8_t PROTOCOL_VERSION = 1;
+constexpr size_t HEADER_SIZE = 16;
+constexpr uint32_t MAX_PAYLOAD = 16 * 1024 * 1024;
+
+enum class FrameType : uint8_t {
+    Chat = 1,        // chat payload, broadcast to everyone
+    Join = 2,        // payload: room name
+    Leave = 3,       // payload: room name
+    RoomChat = 4,    // room payload, delivered to the room's members only
+    Replay = 5,      // ReplayRequest payload; answered by the relay
+    ReplayEnd = 6,   // ReplayEnd payload; closes a replay
+    FileOffer = 7,   // FileOffer payload; point-to-point, never forwarded
+    FileAccept = 8,  // FileAccept payload; answers a FileOffer, then acknowledges chunks
+    FileChunk = 9,   // FileChunk header followed by file bytes
+    FileCancel = 10, // transfer id; either side gives up on a transfer
+    UdpOffer = 11,   // UdpOffer payload; sets up the link's datagram transport
+    Compression = 12, // CompressionHello payload; negotiates the link's codec
+    Heartbeat = 13,   // no payload; shows a quiet link is alive, never forwarded
+    RelayHello = 14,  // no payload; the sender is a relay, and its id is the sender field
+    Interest = 15,    // Interest payload; what a relay's clients want from linked relays
+    Federated = 16,   // payload: a whole frame, passed between relays; the sender is its origin
+    KeyExchange = 17, // payload: X25519 public key, or empty from a relay; opens a link (see secure_link.hpp)
+    Record = 18,      // payload: encrypted frames; all a link carries once its keys are agreed
+    Sealed = 19,      // Sealed payload; a chat frame encrypted end to end, routed unread by relays
+};
+
+constexpr size_t MAX_ROOM_NAME = 255;
+
+namespace FrameFlags {
+    constexpr uint16_t None = 0;
+    constexpr uint16_t Replayed = 1 << 0;   // history sent on request, not live traffic
+    constexpr uint16_t Gossip = 1 << 1;     // payload starts with a GossipHeader
+    constexpr uint16_t Compressed = 1 << 2; // payload is compressed (see compression.hpp)
+    constexpr uint16_t Streamed = 1 << 3;   // ...against the link's earlier frames too; TCP only
+}
+
+struct FrameHeader {
+    uint32_t length = 0;
+    uint8_t version = PROTOCOL_VERSION;
+    FrameType type = FrameType::Chat;
+    uint16_t flags = FrameFlags::None;
+    uint64_t sender = 0;
+};
+
+// A decoded frame. `payload` and `raw` point into the decoder's buffer and
+// stay valid until the next prepare()/commit() on that decoder.
+struct FrameView {
+    FrameHeader header;
+    std::string_view payload;
+    std::string_view raw;   // header + payload, for forwarding unchanged
+};
+
+namespace detail {
+    inline void put_u16(char* p, uint16_t v) {
+        p[0] = static_cast<char>(v >> 8);
+        p[1] = static_cast<char>(v);
+    }
+    inline void put_u32(char* p, uint32_t v) {
+        for (int i = 0; i < 4; ++i) p[i] = static_cast<char>(v >> (24 - 8 * i));
+    }
+    inline void put_u64(char* p, uint64_t v) {
+        for (int i = 0; i < 8; ++i) p[i] = static_cast<char>(v >> (56 - 8 * i));
+    }
+    inline uint16_t get_u16(const char* p) {
+        auto u = reinterpret_cast<const unsigned char*>(p);
+        return static_cast<uint16_t>((u[0] << 8) | u[1]);
+    }
+    inline uint32_t get_u32(const char* p) {
+        auto u = reinterpret_cast<const unsigned char*>(p);
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) v = (v << 8) | u[i];
+        return v;
+    }
+    inline uint64_t get_u64(const char* p) {
+        auto u = reinterpret_cast<const unsigned char*>(p);
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) v = (v << 8) | u[i];
+        return v;
+    }
+}
+
+inline void write_header(char* out, const FrameHeader& header) {
+    detail::put_u32(out, header.length);
+    out[4] = static_cast<char>(header.version);
+    out[5] = static_cast<char>(header.type);
+    detail::put_u16(out + 6, header.flags);
+    detail::put_u64(out + 8, header.sender);
+}
+
+inline FrameHeader read_header(const char* in) {
+    FrameHeader header;
+    header.length = detail::get_u32(in);
+    header.version = static_cast<uint8_t>(in[4]);
+    header.type = static_cast<FrameType>(static_cast<uint8_t>(in[5]));
+    header.flags = detail::get_u16(in + 6);
+    header.sender = detail::get_u64(in + 8);
+    return header;
+}
+
+inline std::string encode_frame(FrameType type, uint64_t sender, std::string_view payload,
+                                uint16_t flags = FrameFlags::None) {
+    std::string frame(HEADER_SIZE + payload.size(), '\0');
+    write_header(frame.data(), FrameHeader{
+        .length = static_cast<uint32_t>(payload.size()),
+        .version = PROTOCOL_VERSION,
+        .type = type,
+        .flags = flags,
+        .sender = sender
+    });
+    std::memcpy(frame.data() + HEADER_SIZE, payload.data(), payload.size());
+    return frame;
+}
+
+// Mesh forwarding envelope, present when FrameFlags::Gossip is set. It sits in
+// front of the type-specific payload so p2p nodes can drop duplicates and stop
+// forwarding without parsing the message:
+//
+//   offset  size  field
+//   0       8     id    globally unique message id
+//   8       1     ttl   times the message may still be forwarded
+//
+// Everything that looks into a payload goes through body_of() first.
+struct GossipHeader {
+    uint64_t id = 0;
+    uint8_t ttl = 0;
+};
+
+constexpr size_t GOSSIP_HEADER_SIZE = 9;
+
+inline std::optional<GossipHeader> gossip_of(const FrameHeader& header, std::string_view payload) {
+    if (!(header.flags & FrameFlags::Gossip) || payload.size() < GOSSIP_HEADER_SIZE) return std::nullopt;
+    return GossipHeader{detail::get_u64(payload.data()), static_cast<uint8_t>(payload[8])};
+}
+
+// The payload without its gossip envelope.
+inline std::string_view body_of(const FrameHeader& header, std::string_view payload) {
+    if (!(header.flags & FrameFlags::Gossip)) return payload;
+    return payload.size() < GOSSIP_HEADER_SIZE ? std::string_view() : payload.substr(GOSSIP_HEADER_SIZE);
+}
+
+// Size of the frame `raw` once it carries a gossip envelope.
+inline size_t gossip_frame_size(std::string_view raw) {
+    FrameHeader header = read_header(raw.data());
+    return HEADER_SIZE + GOSSIP_HEADER_SIZE + body_of(header, raw.substr(HEADER_SIZE)).size();
+}
+
+// Writes the frame `raw` carrying `gossip`, replacing any envelope it had, to
+// `out`, which holds gossip_frame_size(raw) bytes. The caller checks that the
+// result stays within MAX_PAYLOAD.
+inline void write_with_gossip(char* out, std::string_view raw, const GossipHeader& gossip) {
+    FrameHeader header = read_header(raw.data());
+    std::string_view body = body_of(header, raw.substr(HEADER_SIZE));
+    header.length = static_cast<uint32_t>(GOSSIP_HEADER_SIZE + body.size());
+    header.flags |= FrameFlags::Gossip;
+
+    write_header(out, header);
+    detail::put_u64(out + HEADER_SIZE, gossip.id);
+    out[HEADER_SIZE + 8] = static_cast<char>(gossip.ttl);
+    std::memcpy(out + HEADER_SIZE + GOSSIP_HEADER_SIZE, body.data(), body.size());
+}
+
+inline std::string with_gossip(std::string_view raw, const GossipHeader& gossip) {
+    std::string frame(gossip_frame_size(raw), '\0');
+    write_with_gossip(frame.data(), raw, gossip);
+    return frame;
+}
+
+// Chat payload: 1-byte name length, the sender's display name, then the text.
+// Carrying the name in the payload lets it survive forwarding and relaying.
+struct ChatMessage {
+    std::string_view name;
+    std::string_view text;
+};
+
+namespace detail {
+    // Appends a 1-byte length and up to 255 bytes of `field`.
+    inline void put_short_string(std::string& out, std::string_view field) {
+        field = field.substr(0, 255);
+        out.push_back(static_cast<char>(field.size()));
+        out.append(field);
+    }
+}
+
+inline std::string encode_chat(uint64_t sender, std::string_view name, std::string_view text) {
+    std::string payload;
+    payload.reserve(1 + name.size() + text.size());
+    detail::put_short_string(payload, name);
+    payload.append(text);
+    return encode_frame(FrameType::Chat, sender, payload);
+}
+
+inline std::optional<ChatMessage> decode_chat(std::string_view payload) {
+    if (payload.empty()) return std::nullopt;
+    size_t name_len = static_cast<unsigned char>(payload[0]);
+    if (payload.size() < 1 + name_len) return std::nullopt;
+    return ChatMessage{payload.substr(1, name_len), payload.substr(1 + name_len)};
+}
+
+// Room payload: 1-byte room name length, the room name, then a chat payload.
+// Join and Leave carry just the room name.
+struct RoomMessage {
+    std::string_view room;
+    ChatMessage chat;
+};
+
+inline std::string encode_join(uint64_t sender, std::string_view room) {
+    return encode_frame(FrameType::Join, sender, room.substr(0, MAX_ROOM_NAME));
+}
+
+inline std::string encode_leave(uint64_t sender, std::string_view room) {
+    return encode_frame(FrameType::Leave, sender, room.substr(0, MAX_ROOM_NAME));
+}
+
+inline std::string encode_room_chat(uint64_t sender, std::string_view room, std::string_view name,
+                                    std::string_view text) {
+    std::string payload;
+    payload.reserve(2 + room.size() + name.size() + text.size());
+    detail::put_short_string(payload, room);
+    detail::put_short_string(payload, name);
+    payload.append(text);
+    return encode_frame(FrameType::RoomChat, sender, payload);
+}
+
+// Just the room name, for routing without parsing the rest.
+inline std::optional<std::string_view> room_of(std::string_view payload) {
+    if (payload.empty()) return std::nullopt;
+    size_t room_len = static_cast<unsigned char>(payload[0]);
+    if (room_len == 0 || payload.size() < 1 + room_len) return std::nullopt;
+    return payload.substr(1, room_len);
+}
+
+inline std::optional<RoomMessage> decode_room_chat(std::string_view payload) {
+    auto room = room_of(payload);
+    if (!room) return std::nullopt;
+    auto chat = decode_chat(payload.substr(1 + room->size()));
+    if (!chat) return std::nullopt;
+    return RoomMessage{*room, *chat};
+}
+
+// Whether a chat message may be passed on: UTF-8 throughout, with no control
+// characters in the name or room. Checked in place before fan-out.
+inline bool well_formed(const ChatMessage& chat, std::string_view room = {}) {
+    return text_scan::valid_name(chat.name) && text_scan::valid_utf8(chat.text) &&
+           (room.empty() || text_scan::valid_name(room));
+}
+
+// Asks the relay for logged history. The relay answers with the matching
+// frames, flagged Replayed, followed by one ReplayEnd.
+struct ReplayRequest {
+    enum class Since : uint8_t {
+        Sequence = 0,   // value: first sequence number wanted
+        Time = 1,       // value: unix time in milliseconds
+        Last = 2,       // value: number of most recent messages
+    };
+    Since since = Since::Last;
+    uint64_t value = 0;
+};
+
+// `next_seq` is where a follow-up request should start; it is below
+// `head_seq` when the replay was cut short to bound the reply.
+struct ReplayEnd {
+    uint64_t next_seq = 0;
+    uint64_t head_seq = 0;
+};
+
+inline std::string encode_replay_request(uint64_t sender, const ReplayRequest& request) {
+    char payload[9];
+    payload[0] = static_cast<char>(request.since);
+    detail::put_u64(payload + 1, request.value);
+    return encode_frame(FrameType::Replay, sender, std::string_view(payload, sizeof(payload)));
+}
+
+inline std::optional<ReplayRequest> decode_replay_request(std::string_view payload) {
+    if (payload.size() != 9 || static_cast<uint8_t>(payload[0]) > static_cast<uint8_t>(ReplayRequest::Since::Last)) {
+        return std::nullopt;
+    }
+    return ReplayRequest{static_cast<ReplayRequest::Since>(payload[0]), detail::get_u64(payload.data() + 1)};
+}
+
+inline std::string encode_replay_end(uint64_t sender, const ReplayEnd& end) {
+    char payload[16];
+    detail::put_u64(payload, end.next_seq);
+    detail::put_u64(payload + 8, end.head_seq);
+    return encode_frame(FrameType::ReplayEnd, sender, std::string_view(payload, sizeof(payload)));
+}
+
+inline std::optional<ReplayEnd> decode_replay_end(std::string_view payload) {
+    if (payload.size() != 16) return std::nullopt;
+    return ReplayEnd{detail::get_u64(payload.data()), detail::get_u64(payload.data() + 8)};
+}
+
+// File transfer between two directly connected peers. The sender offers a
+// file, the receiver answers with the offset it already holds (0 for a fresh
+// download, the size of its partial file when resuming) and the sender then
+// streams FileChunk frames from that offset in order. The receiver repeats
+// FileAccept with its new offset as it stores data; the sender keeps only a
+// bounded window beyond that in flight. `tag` identifies the file's contents
+// so a resume never splices two different versions together.
+struct FileOffer {
+    uint64_t id = 0;     // transfer id, chosen by the sender
+    uint64_t size = 0;
+    uint64_t tag = 0;
+    std::string_view name;
+};
+
+struct FileAccept {
+    uint64_t id = 0;
+    uint64_t offset = 0;
+};
+
+// FileChunk payload: this header, then `length` file bytes.
+//
+//   offset  size  field
+//   0       8     id       transfer id
+//   8       8     offset   position of the bytes within the file
+//   16      4     crc      CRC-32C of the bytes
+struct FileChunkHeader {
+    uint64_t id = 0;
+    uint64_t offset = 0;
+    uint32_t crc = 0;
+};
+
+constexpr size_t FILE_CHUNK_HEADER_SIZE = 20;
+constexpr size_t MAX_FILE_NAME = 255;
+
+inline std::string encode_file_offer(uint64_t sender, const FileOffer& offer) {
+    std::string payload(24, '\0');
+    detail::put_u64(payload.data(), offer.id);
+    detail::put_u64(payload.data() + 8, offer.size);
+    detail::put_u64(payload.data() + 16, offer.tag);
+    payload.append(offer.name.substr(0, MAX_FILE_NAME));
+    return encode_frame(FrameType::FileOffer, sender, payload);
+}
+
+inline std::optional<FileOffer> decode_file_offer(std::string_view payload) {
+    if (payload.size() <= 24 || payload.size() > 24 + MAX_FILE_NAME) return std::nullopt;
+    return FileOffer{detail::get_u64(payload.data()), detail::get_u64(payload.data() + 8),
+                     detail::get_u64(payload.data() + 16), payload.substr(24)};
+}
+
+inline std::string encode_file_accept(uint64_t sender, const FileAccept& accept) {
+    char payload[16];
+    detail::put_u64(payload, accept.id);
+    detail::put_u64(payload + 8, accept.offset);
+    return encode_frame(FrameType::FileAccept, sender, std::string_view(payload, sizeof(payload)));
+}
+
+inline std::optional<FileAccept> decode_file_accept(std::string_view payload) {
+    if (payload.size() != 16) return std::nullopt;
+    return FileAccept{detail::get_u64(payload.data()), detail::get_u64(payload.data() + 8)};
+}
+
+inline std::string encode_file_cancel(uint64_t sender, uint64_t id) {
+    char payload[8];
+    detail::put_u64(payload, id);
+    return encode_frame(FrameType::FileCancel, sender, std::string_view(payload, sizeof(payload)));
+}
+
+inline std::optional<uint64_t> decode_file_cancel(std::string_view payload) {
+    if (payload.size() != 8) return std::nullopt;
+    return detail::get_u64(payload.data());
+}
+
+// Writes the frame header and chunk header for `length` file bytes to `out`,
+// which holds HEADER_SIZE + FILE_CHUNK_HEADER_SIZE bytes. The bytes themselves
+// are sent straight from wherever they live.
+inline void write_file_chunk_header(char* out, uint64_t sender, const FileChunkHeader& chunk, uint32_t length) {
+    write_header(out, FrameHeader{
+        .length = static_cast<uint32_t>(FILE_CHUNK_HEADER_SIZE + length),
+        .version = PROTOCOL_VERSION,
+        .type = FrameType::FileChunk,
+        .flags = FrameFlags::None,
+        .sender = sender
+    });
+    char* p = out + HEADER_SIZE;
+    detail::put_u64(p, chunk.id);
+    detail::put_u64(p + 8, chunk.offset);
+    detail::put_u32(p + 16, chunk.crc);
+}
+
+// Splits a FileChunk payload into its header and the file bytes.
+inline std::optional<std::pair<FileChunkHeader, std::string_view>> decode_file_chunk(std::string_view payload) {
+    if (payload.size() < FILE_CHUNK_HEADER_SIZE) return std::nullopt;
+    FileChunkHeader chunk{detail::get_u64(payload.data()), detail::get_u64(payload.data() + 8),
+                          detail::get_u32(payload.data() + 16)};
+    return std::pair{chunk, payload.substr(FILE_CHUNK_HEADER_SIZE)};
+}
+
+// Offers the datagram transport (see reliable_udp.hpp) for the rest of the
+// link. The side that connected sends it first; a side willing to use it
+// answers with its own, and from then on each puts the other's token in
+// every datagram. Anything else ignores the offer and the link stays TCP only.
+struct UdpOffer {
+    uint16_t port = 0;    // where the sender receives datagrams
+    uint32_t token = 0;   // session the sender opened for this link
+};
+
+inline std::string encode_udp_offer(uint64_t sender, const UdpOffer& offer) {
+    char payload[6];
+    detail::put_u16(payload, offer.port);
+    detail::put_u32(payload + 2, offer.token);
+    return encode_frame(FrameType::UdpOffer, sender, std::string_view(payload, sizeof(payload)));
+}
+
+inline std::optional<UdpOffer> decode_udp_offer(std::string_view payload) {
+    if (payload.size() != 6) return std::nullopt;
+    UdpOffer offer{detail::get_u16(payload.data()), detail::get_u32(payload.data() + 2)};
+    if (offer.port == 0 || offer.token == 0) return std::nullopt;
+    return offer;
+}
+
+// Codecs a link can compress frames with.
+enum class Codec : uint8_t {
+    Lz = 1,   // compression::Encoder with its built-in dictionary
+};
+
+// Negotiates compression for the rest of the link. The side that connected
+// offers the codecs it supports; a side willing to compress answers with the
+// one it picked, and from then on each may send compressed frames. Anything
+// else ignores the offer and the link stays uncompressed.
+//
+//   offset  size  field
+//   0       1     1 for an answer, 0 for an offer
+//   1       n     codec ids; an answer names exactly one
+struct CompressionHello {
+    bool answer = false;
+    std::string_view codecs;
+};
+
+inline std::string encode_compression_offer(uint64_t sender, std::span<const Codec> codecs) {
+    std::string payload(1, '\0');
+    for (Codec codec : codecs) payload.push_back(static_cast<char>(codec));
+    return encode_frame(FrameType::Compression, sender, payload);
+}
+
+inline std::string encode_compression_answer(uint64_t sender, Codec codec) {
+    const char payload[2] = {1, static_cast<char>(codec)};
+    return encode_frame(FrameType::Compression, sender, std::string_view(payload, sizeof(payload)));
+}
+
+inline std::optional<CompressionHello> decode_compression(std::string_view payload) {
+    if (payload.size() < 2 || static_cast<uint8_t>(payload[0]) > 1) return std::nullopt;
+    CompressionHello hello{payload[0] == 1, payload.substr(1)};
+    if (hello.answer && hello.codecs.size() != 1) return std::nullopt;
+    return hello;
+}
+
+inline bool offers(const CompressionHello& hello, Codec codec) {
+    return hello.codecs.find(static_cast<char>(codec)) != std::string_view::npos;
+}
+
+// Sent on every link now and then, and as soon as it opens. Silence from a
+// peer that sends heartbeats means the peer or the path to it is gone;
+// silence from one that never did says nothing, since older clients do not.
+inline std::string encode_heartbeat(uint64_t sender) {
+    return encode_frame(FrameType::Heartbeat, sender, {});
+}
+
+// Relay federation. Two relays that link up greet each other with RelayHello
+// and then keep each other posted with Interest summaries: whether the relay
+// has any clients, and which rooms have members there. A chat or room frame
+// published on a relay is passed once to each interested linked relay inside
+// a Federated frame whose sender is the relay it was published on. Relays
+// hand federated frames to their own clients only and never pass them on, so
+// a frame cannot loop, and every relay must be linked to every other.
+//
+// Interest payload:
+//
+//   offset  size  field
+//   0       1     1 if the relay has clients, else 0
+//   1       n     room names, each with a 1-byte length
+struct Interest {
+    bool clients = false;
+    std::vector<std::string_view> rooms;
+};
+
+inline std::string encode_relay_hello(uint64_t relay) {
+    return encode_frame(FrameType::RelayHello, relay, {});
+}
+
+// Rooms that would take the payload past MAX_PAYLOAD are left out.
+inline std::string encode_interest(uint64_t relay, bool clients, std::span<const std::string_view> rooms) {
+    std::string payload(1, clients ? '\1' : '\0');
+    for (std::string_view room : rooms) {
+        if (room.empty() || room.size() > MAX_ROOM_NAME || payload.size() + 1 + room.size() > MAX_PAYLOAD) continue;
+        detail::put_short_string(payload, room);
+    }
+    return encode_frame(FrameType::Interest, relay, payload);
+}
+
+inline std::optional<Interest> decode_interest(std::string_view payload) {
+    if (payload.empty() || static_cast<uint8_t>(payload[0]) > 1) return std::nullopt;
+    Interest interest{payload[0] == 1, {}};
+    for (size_t at = 1; at < payload.size();) {
+        size_t length = static_cast<unsigned char>(payload[at]);
+        if (length == 0 || payload.size() - at - 1 < length) return std::nullopt;
+        interest.rooms.push_back(payload.substr(at + 1, length));
+        at += 1 + length;
+    }
+    return interest;
+}
+
+// Size of the frame `raw` once it is wrapped to go to a linked relay.
+inline size_t federated_frame_size(std::string_view raw) {
+    return HEADER_SIZE + raw.size();
+}
+
+// Writes the frame `raw`, published on relay `origin`, wrapped to go to a
+// linked relay, to `out`, which holds federated_frame_size(raw) bytes. The
+// caller checks that `raw` fits within MAX_PAYLOAD.
+inline void write_federated(char* out, uint64_t origin, std::string_view raw) {
+    write_header(out, FrameHeader{
+        .length = static_cast<uint32_t>(raw.size()),
+        .version = PROTOCOL_VERSION,
+        .type = FrameType::Federated,
+        .flags = FrameFlags::None,
+        .sender = origin
+    });
+    std::memcpy(out + HEADER_SIZE, raw.data(), raw.size());
+}
+
+// The frame inside a Federated payload, if it is exactly one whole frame.
+inline std::optional<FrameHeader> federated_header(std::string_view payload) {
+    if (payload.size() < HEADER_SIZE) return std::nullopt;
+    FrameHeader inner = read_header(payload.data());
+    if (inner.version != PROTOCOL_VERSION || inner.length != payload.size() - HEADER_SIZE) return std::nullopt;
+    return inner;
+}
+
+// A chat or room frame encrypted end to end for the members of a group (see
+// secure_link.hpp). Relays route it like the frame inside, by the room name
+// in front, and log and replay it without reading it:
+//
+//   offset  size  field
+//   0       1     room name length, 0 for a message to everyone
+//   1       n     room name
+//   1+n     12    nonce
+//   13+n    m     the encrypted frame, then a 16-byte tag
+struct SealedMessage {
+    std::string_view room;    // empty for everyone
+    std::string_view nonce;
+    std::string_view data;    // ciphertext and tag
+};
+
+constexpr size_t SEALED_NONCE_SIZE = 12;
+
+inline std::optional<SealedMessage> decode_sealed(std::string_view payload) {
+    if (payload.empty()) return std::nullopt;
+    size_t room_len = static_cast<unsigned char>(payload[0]);
+    if (payload.size() < 1 + room_len + SEALED_NONCE_SIZE) return std::nullopt;
+    return SealedMessage{payload.substr(1, room_len), payload.substr(1 + room_len, SEALED_NONCE_SIZE),
+                         payload.substr(1 + room_len + SEALED_NONCE_SIZE)};
+}
+
+// A relay's answer to KeyExchange: it takes no part in link encryption, and
+// the link carries plain frames.
+inline std::string encode_relay_key_exchange(uint64_t sender) {
+    return encode_frame(FrameType::KeyExchange, sender, {});
+}
+
+// Where a relay delivers a published frame: the room of a room frame, empty
+// for a frame to everyone, nothing if a room frame is malformed.
+inline std::optional<std::string_view> destination_of(const FrameHeader& header, std::string_view payload) {
+    if (header.type == FrameType::RoomChat) return room_of(body_of(header, payload));
+    if (header.type == FrameType::Sealed) {
+        auto sealed = decode_sealed(payload);
+        if (!sealed) return std::nullopt;
+        return sealed->room;
+    }
+    return std::string_view();
+}
+
+// Incremental stream decoder. Callers receive directly into the decoder's
+// buffer, so complete frames are parsed in place without an extra copy:
+//
+//   auto space = decoder.prepare();
+//   ssize_t n = recv(fd, space.data(), space.size(), 0);
+//   decoder.commit(n);
+//
+// and then call next() until it yields an empty optional or an error.
+// Partial frames stay buffered across reads; several frames in one read are
+// returned one by one.
+class FrameDecoder {
+public:
+    static constexpr size_t READ_CHUNK = 16 * 1024;
+
+    // Returns writable space at the tail of the buffer, at least `min_size` bytes.
+    std::span<char> prepare(size_t min_size = READ_CHUNK) {
+        compact();
+        if (end_ >= HEADER_SIZE) {
+            // Make room for the whole pending frame in one go.
+            size_t pending = HEADER_SIZE + std::min<size_t>(detail::get_u32(buffer_.data()), MAX_PAYLOAD);
+            if (pending > end_) min_size = std::max(min_size, pending - end_);
+        }
+        if (buffer_.size() - end_ < min_size) {
+            buffer_.resize(end_ + min_size);
+        }
+        return {buffer_.data() + end_, buffer_.size() - end_};
+    }
+
+    void commit(size_t bytes) {
+        end_ += bytes;
+    }
+
+    // Returns the next complete frame, std::nullopt if more bytes are needed,
+    // or an error if the stream is malformed (the connection should be dropped).
+    std::expected<std::optional<FrameView>, std::string> next() {
+        if (end_ - begin_ < HEADER_SIZE) return std::nullopt;
+
+        const char* base = buffer_.data() + begin_;
+        FrameHeader header = read_header(base);
+        if (header.version != PROTOCOL_VERSION) {
+            return std::unexpected("unsupported protocol version " + std::to_string(header.version));
+        }
+        if (header.length > MAX_PAYLOAD) {
+            return std::unexpected("frame too large: " + std::to_string(header.length) + " bytes");
+        }
+
+        size_t total = HEADER_SIZE + header.length;
+        if (end_ - begin_ < total) return std::nullopt;
+
+        begin_ += total;
+        return FrameView{
+            .header = header,
+            .payload = std::string_view(base + HEADER_SIZE, header.length),
+            .raw = std::string_view(base, total)
+        };
+    }
+
+    size_t buffered() const {
+        return end_ - begin_;
+    }
+
+private:
+    std::vector<char> buffer_;
+    size_t begin_ = 0;   // first unconsumed byte
+    size_t end_ = 0;     // one past the last received byte
+
+    // Moves any partial frame to the front so the buffer does not grow without
+    // bound; the buffer itself keeps its capacity for the next read.
+    void compact() {
+        if (begin_ == 0) return;
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+            return;
+        }
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+};
+
+// A decoded frame that shares ownership of the buffer it was received into.
+// Forwarding it to many connections only copies the reference.
+struct SharedFrame {
+    FrameHeader header;
+    BufferSlice raw;   // header + payload
+
+    std::string_view payload() const {
+        return raw.view().substr(HEADER_SIZE);
+    }
+};
+
+// FrameDecoder variant that receives into pooled, reference-counted chunks.
+// Complete frames are handed out as slices of the chunk they arrived in, so a
+// frame is never copied between recv() and the last send(). Only a frame that
+// straddles the end of a chunk is moved into the next one.
+class SharedFrameDecoder {
+public:
+    static constexpr size_t READ_CHUNK = 16 * 1024;
+
+    explicit SharedFrameDecoder(BufferPool& pool) : pool_(pool) {}
+
+    std::span<char> prepare(size_t min_size = READ_CHUNK) {
+        size_t pending = end_ - begin_;
+        if (pending >= HEADER_SIZE) {
+            size_t frame_size = HEADER_SIZE + std::min<size_t>(detail::get_u32(chunk_->data() + begin_), MAX_PAYLOAD);
+            if (frame_size > pending) min_size = std::max(min_size, frame_size - pending);
+        }
+
+        if (!chunk_ || chunk_->capacity() - end_ < min_size) {
+            // Earlier frames of the current chunk may still be queued elsewhere,
+            // so never write over it; start a fresh chunk instead.
+            BufferRef next = pool_.acquire(std::max(READ_CHUNK, pending + min_size));
+            if (pending > 0) std::memcpy(next->data(), chunk_->data() + begin_, pending);
+            chunk_ = std::move(next);
+            begin_ = 0;
+            end_ = pending;
+        } else if (begin_ == end_ && chunk_->use_count() == 1) {
+            begin_ = end_ = 0;   // nobody else holds the chunk; reuse it from the start
+        }
+        return {chunk_->data() + end_, chunk_->capacity() - end_};
+    }
+
+    void commit(size_t bytes) {
+        end_ += bytes;
+    }
+
+    // Bytes received but not yet handed out as frames.
+    size_t buffered() const { return end_ - begin_; }
+
+    std::expected<std::optional<SharedFrame>, std::string> next() {
+        if (end_ - begin_ < HEADER_SIZE) return std::nullopt;
+
+        FrameHeader header = read_header(chunk_->data() + begin_);
+        if (header.version != PROTOCOL_VERSION) {
+            return std::unexpected("unsupported protocol version " + std::to_string(header.version));
+        }
+        if (header.length > MAX_PAYLOAD) {
+            return std::unexpected("frame too large: " + std::to_string(header.length) + " bytes");
+        }
+
+        size_t total = HEADER_SIZE + header.length;
+        if (end_ - begin_ < total) return std::nullopt;
+
+        SharedFrame frame{header, BufferSlice{chunk_, static_cast<uint32_t>(begin_), static_cast<uint32_t>(total)}};
+        begin_ += total;
+        return frame;
+    }
+
+private:
+    BufferPool& pool_;
+    BufferRef chunk_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+}  // namespace protocol
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// What to do with a message from a client that is over its rate limit.
+enum class RateLimitPolicy {
+    Delay,       // hold the message and stop reading from the client until it fits
+    Drop,        // discard the message
+    Disconnect   // report it so the owner can close the connection
+};
+
+inline std::optional<RateLimitPolicy> parse_rate_limit_policy(std::string_view name) {
+    if (name == "delay") return RateLimitPolicy::Delay;
+    if (name == "drop") return RateLimitPolicy::Drop;
+    if (name == "disconnect") return RateLimitPolicy::Disconnect;
+    return std::nullopt;
+}
+
+// Units per second, and how many may pass at once after a quiet spell. A
+// rate of 0 disables the limit.
+struct RateLimit {
+    double rate = 0;
+    double burst = 1;
+
+    bool enabled() const { return rate > 0; }
+};
+
+struct RateLimits {
+    RateLimit messages;        // per client
+    RateLimit bytes;           // per client
+    RateLimit room_messages;   // per room, across all of its senders
+    RateLimitPolicy policy = RateLimitPolicy::Delay;
+};
+
+namespace rate_limit_detail {
+
+using Clock = std::chrono::steady_clock;
+
+inline int64_t nanos(Clock::time_point when) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+}
+
+// The bucket is kept in its GCRA form: rather than a token count refilled on
+// a clock, it stores the time at which it will be full again. Taking `cost`
+// moves that time on by cost / rate; the cost fits while that time is at
+// most `burst` units' worth ahead of now. Refilling is implicit, so a bucket
+// is one number and needs no timer.
+struct Rule {
+    double interval = 0;     // nanoseconds per unit; 0 disables
+    int64_t tolerance = 0;   // nanoseconds; the burst
+
+    explicit Rule(RateLimit limit) {
+        if (!limit.enabled()) return;
+        interval = 1e9 / limit.rate;
+        tolerance = std::max<int64_t>(std::llround(std::max(limit.burst, 1.0) * interval), 1);
+    }
+
+    // A cost larger than the burst is charged as the burst, so it still
+    // passes once the bucket is full.
+    int64_t charge(double cost) const {
+        return std::min<int64_t>(std::llround(cost * interval), tolerance);
+    }
+
+    // How far `full` (when the bucket is full again) would be past what the
+    // burst allows after taking `cost` at `now`; 0 if it fits.
+    int64_t excess(int64_t full, int64_t now, double cost) const {
+        return std::max<int64_t>(std::max(full, now) + charge(cost) - now - tolerance, 0);
+    }
+};
+
+}  // namespace rate_limit_detail
+
+// Token bucket for one owner thread.
+class TokenBucket {
+public:
+    using Clock = rate_limit_detail::Clock;
+
+    TokenBucket() = default;   // unlimited
+    explicit TokenBucket(RateLimit limit) : rule_(limit) {}
+
+    bool enabled() const { return rule_.interval > 0; }
+
+    // How long until `cost` fits; zero if it does now. Takes nothing, so
+    // several buckets can be checked before any of them is charged.
+    Clock::duration wait(double cost, Clock::time_point now) const {
+        if (!enabled()) return {};
+        return std::chrono::nanoseconds(rule_.excess(full_, rate_limit_detail::nanos(now), cost));
+    }
+
+    void take(double cost, Clock::time_point now) {
+        if (!enabled()) return;
+        full_ = std::max(full_, rate_limit_detail::nanos(now)) + rule_.charge(cost);
+    }
+
+private:
+    rate_limit_detail::Rule rule_{RateLimit{}};
+    int64_t full_ = 0;
+};
+
+// Token bucket any thread may draw from. Taking is one compare-and-swap on
+// the time the bucket is full again; there is no lock and no refill work.
+class SharedTokenBucket {
+public:
+    using Clock = rate_limit_detail::Clock;
+
+    explicit SharedTokenBucket(RateLimit limit) : rule_(limit) {}
+
+    // Takes `cost` and returns zero if it fits; otherwise takes nothing and
+    // returns how long until it would.
+    Clock::duration try_take(double cost, Clock::time_point now) {
+        if (rule_.interval <= 0) return {};
+        int64_t at = rate_limit_detail::nanos(now);
+        int64_t full = full_.load(std::memory_order_relaxed);
+        while (true) {
+            if (int64_t excess = rule_.excess(full, at, cost)) return std::chrono::nanoseconds(excess);
+            if (full_.compare_exchange_weak(full, std::max(full, at) + rule_.charge(cost),
+                                            std::memory_order_relaxed)) {
+                return {};
+            }
+        }
+    }
+
+private:
+    rate_limit_detail::Rule rule_;
+    std::atomic<int64_t> full_{0};
+};
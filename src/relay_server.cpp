@@ -1,165 +1,2101 @@
-#include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <thread>
-#include <mutex>
+#include <memory>
+#include <atomic>
 #include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <csignal>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <unistd.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef __linux__
+    #include <linux/errqueue.h>
+#endif
+
+#include "buffer_pool.hpp"
+#include "compression.hpp"
+#include "event_loop.hpp"
+#include "io_uring.hpp"
+#include "logger.hpp"
+#include "message_log.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+#include "outbound_queue.hpp"
+#include "protocol.hpp"
+#include "rate_limit.hpp"
+#include "reliable_udp.hpp"
+#include "timer_wheel.hpp"
+
+enum class IoEngine { Epoll, IoUring };
+
+struct RelayConfig {
+    int port = 8888;
+    size_t shards = 1;               // 0: one per hardware thread
+    OutboundLimits outbound;
+    std::chrono::seconds stats_interval{0};
+    size_t zerocopy_threshold = 0;   // frames at least this large use MSG_ZEROCOPY; 0 disables
+    IoEngine engine = IoEngine::Epoll;
+    MessageLogConfig log;
+    uint64_t log_sample = 1;         // log every Nth relayed message; 0 disables
+    int metrics_port = 0;            // serve /metrics on 127.0.0.1:port; 0 disables
+    std::chrono::seconds metrics_interval{0};   // log a metrics summary this often; 0 disables
+    bool udp = false;                 // accept clients' offers of the datagram transport
+    bool udp_unordered = false;       // deliver datagram frames as they arrive, not per sender in order
+    reliable_udp::Impairment udp_impairment;   // simulated loss and delay on sent datagrams
+    bool compress = false;            // accept clients' offers of compression
+    std::chrono::seconds heartbeat_interval{5};   // heartbeat every client this often; 0 disables
+    std::chrono::seconds idle_timeout{15};        // drop a client that sends heartbeats once silent this long; 0 disables
+    std::chrono::seconds stall_timeout{30};       // drop a client whose socket took nothing for this long; 0 disables
+    std::vector<std::string> peers;   // relays to link to, as host:port
+    RateLimits rate;                  // on messages clients publish
+
+    bool metrics_enabled() const { return metrics_port > 0 || metrics_interval.count() > 0; }
+};
+
+// Each shard thread updates its own block; exporters sum them. Latencies are
+// in microseconds.
+struct RelayMetrics {
+    metrics::Counter frames_in;
+    metrics::Counter bytes_in;
+    metrics::Counter frames_out;         // copies queued to recipients
+    metrics::Counter bytes_out;          // bytes written to client sockets
+    metrics::Counter dropped;            // copies refused or evicted by the slow-consumer policy
+    metrics::Counter throttled;          // messages held back by --rate-policy delay
+    metrics::Counter rate_dropped;       // messages dropped, or clients disconnected, for exceeding a rate limit
+    metrics::Counter rejected;           // malformed chat dropped, or a frame type a client may not send
+    metrics::Gauge clients;
+    metrics::Gauge queued_bytes;         // sampled once a second
+    metrics::Gauge queued_frames;
+    metrics::Gauge max_client_queue;
+    metrics::Histogram fanout;           // recipients per message per shard
+    metrics::Histogram queue_depth;      // per-client queued bytes, sampled once a second
+    metrics::Histogram send_stall;       // socket full until writable again (io_uring: sendmsg in flight)
+    metrics::Histogram delivery;         // frame received until its last copy is written
+};
+using Metrics = metrics::PerThread<RelayMetrics>;
 
 class RelayServer {
 private:
     static constexpr int DEFAULT_PORT = 8888;
-    static constexpr int BUFFER_SIZE = 1024;
-    
-    struct Client {
+    static constexpr int MAX_IOVECS = 64;
+
+    static constexpr size_t MAILBOX_CAPACITY = 64 * 1024;
+    static constexpr auto PARKED_RETRY = std::chrono::milliseconds(1);
+    static constexpr size_t MAX_ROOMS_PER_CLIENT = 64;
+    static constexpr size_t REPLAY_CHUNK = 64 * 1024;
+    static constexpr unsigned URING_ENTRIES = 4096;
+    static constexpr uint16_t URING_RECV_BUFFERS = 64;   // bounds read-ahead per shard below the outbox limit
+    static constexpr uint32_t URING_RECV_BUFFER_SIZE = 16 * 1024;
+    static constexpr auto TIMER_TICK = std::chrono::milliseconds(100);
+    static constexpr auto CHECK_INTERVAL = std::chrono::seconds(1);   // longest a client goes unchecked while data is queued
+    static constexpr auto LINK_RETRY_MIN = std::chrono::seconds(1);   // first wait before dialing a relay again
+    static constexpr auto LINK_RETRY_MAX = std::chrono::seconds(30);
+
+    // io_uring user_data: the Client pointer with the operation in the low bits.
+    enum UringOp : uint64_t { URING_ACCEPT = 0, URING_RECV = 1, URING_SEND = 2, URING_PROVIDE = 3 };
+    static constexpr uint64_t URING_OP_MASK = 3;
+
+    struct Shard;
+
+    // A message held back by the Delay rate-limit policy.
+    struct HeldFrame {
+        protocol::SharedFrame frame;
+        BufferSlice compressed;
+    };
+
+    // A client belongs to exactly one shard; only that shard's thread touches it.
+    struct Client : std::enable_shared_from_this<Client> {
         int socket_fd;
         std::string address;
         int port;
         std::string name;
+        Shard* shard;
+
+        protocol::SharedFrameDecoder decoder;
+        OutboundQueue outbox;
+        bool closed = false;
+
+        // MSG_ZEROCOPY sends still referenced by the kernel, keyed by the
+        // per-socket sequence number its completion notifications report.
+        bool zerocopy = false;
+        uint32_t zerocopy_next = 0;
+        std::deque<std::pair<uint32_t, BufferRef>> zerocopy_inflight;
+        std::vector<std::string> rooms;   // joined rooms, for cleanup on disconnect
+        uint32_t udp = 0;                 // datagram session on the shard's endpoint; 0 while TCP only
+        // Set once compression is negotiated; from then on frames go both
+        // ways compressed where that pays.
+        std::unique_ptr<compression::Decoder> decompressor;
+        // Liveness, see check_client(). Reading only notes the time; the
+        // client's timer is re-armed when it fires, not on every frame.
+        TimerWheel<Client*>::Handle timer;
+        OutboundQueue::Clock::time_point last_received = OutboundQueue::Clock::now();
+        OutboundQueue::Clock::time_point next_heartbeat{};
+        bool heartbeats = false;   // has sent one, so silence means it is gone
+        // Federation, see on_relay_hello(). A linked relay is a client that
+        // only ever gets federated frames; its rooms are the ones its
+        // Interest summary named.
+        bool link = false;             // a relay, or one we dialed that has not answered yet
+        uint64_t relay = 0;            // its id, once it greeted us
+        int dialed = -1;               // index in peers_ if we dialed it
+        bool forwarding = false;       // the one link to that relay that frames are forwarded on
+        bool remote_clients = false;   // it has clients, so plain chat is worth sending
+        uint64_t interest_sent = 0;    // version of our summary it last got
+        // Rate limits, see admit(). While a message is held, nothing more is
+        // read from the client; its timer sends the message on at resume_at.
+        TokenBucket message_limit;
+        TokenBucket byte_limit;
+        std::optional<HeldFrame> held;
+        OutboundQueue::Clock::time_point resume_at{};
+        uint64_t throttled = 0;      // messages held back
+        uint64_t rate_dropped = 0;   // messages dropped
+        uint64_t rejected = 0;       // malformed messages, see reject()
+
+        // io_uring engine: the sendmsg header and iovecs must stay put until
+        // the send completes, and the client must outlive its in-flight ops.
+        struct UringSend {
+            msghdr msg{};
+            iovec iov[MAX_IOVECS];
+        };
+        std::unique_ptr<UringSend> uring_send;
+        bool send_inflight = false;
+        int uring_ops = 0;
+
+        OutboundQueue::Clock::time_point send_blocked{};   // when the socket last filled up; zero when writable
+
+        Client(BufferPool& pool, const OutboundLimits& limits) : decoder(pool), outbox(limits) {}
     };
-    
-    int server_socket_;
-    std::vector<Client> clients_;
-    std::mutex clients_mutex_;
+
+    // A room's members on one shard. A room spanning shards has an entry on
+    // each; publishes reach the other shards through their mailboxes.
+    struct Room {
+        std::vector<std::shared_ptr<Client>> members;
+        size_t local = 0;         // members that are clients rather than linked relays
+        uint64_t published = 0;   // messages fanned out to this shard's members
+        uint64_t delivered = 0;   // copies queued, one per recipient
+        std::shared_ptr<SharedTokenBucket> limit;   // --room-rate, shared by the room's shards
+    };
+
+    // Lets the room index be searched by the string_view parsed from a frame.
+    struct RoomNameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+    };
+    using RoomIndex = std::unordered_map<std::string, Room, RoomNameHash, std::equal_to<>>;
+
+    // A frame handed from the shard that received it to another shard, which
+    // fans it out to its own clients. Sent once per shard, not once per client.
+    struct ShardMessage {
+        BufferSlice frame;
+        BufferSlice compressed;                 // for clients that negotiated compression; may be empty
+        BufferSlice federated;                  // for linked relays; empty if it came from one
+        std::shared_ptr<const void> delivery;   // see track_delivery()
+    };
+
+    // One event loop, listener and client table per core. Nothing here is
+    // shared: other shards reach this one only through its mailbox.
+    struct Shard {
+        size_t id = 0;
+        EventLoop loop;
+        int listen_fd = -1;
+        std::vector<std::shared_ptr<Client>> clients;
+        std::vector<std::shared_ptr<Client>> links;   // linked relays among `clients`
+        RoomIndex rooms;
+        uint64_t relayed = 0;   // messages seen, for --log-sample
+        MpscQueue<ShardMessage> mailbox{MAILBOX_CAPACITY};
+        std::atomic<bool> wake_pending{false};
+        // Handoffs that found another shard's mailbox full, by target shard.
+        // Retried from `retry_timer`, never while a client is being handled.
+        std::vector<std::deque<ShardMessage>> parked;
+        size_t retry_timer = 0;
+        std::thread thread;
+        // Datagram transport (--udp): one endpoint per shard, so a client's
+        // datagrams are handled on the same thread as its TCP connection.
+        std::unique_ptr<reliable_udp::Endpoint> udp;
+        std::unordered_map<uint32_t, std::shared_ptr<Client>> udp_clients;
+        std::vector<reliable_udp::Received> udp_received;
+        compression::Encoder compressor;   // compresses frames once for all of the shard's clients
+        TimerWheel<Client*> timers{TIMER_TICK};   // one per client: heartbeats, idle and stall checks
+#ifdef __linux__
+        std::unique_ptr<IoUring> ring;   // set when the io_uring engine is active
+        std::unique_ptr<ProvidedBuffers> recv_buffers;
+        std::vector<std::shared_ptr<Client>> retired;   // closed, ops still in flight
+#endif
+    };
+
+    // Declared first so it outlives every client and queued buffer.
+    BufferPool pool_;
+    RelayConfig config_;
+    std::unique_ptr<MessageLog> log_;   // null when history is disabled
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::unique_ptr<metrics::HttpExporter> exporter_;
+    size_t next_shard_ = 0;
     bool running_ = false;
-    
-    void handle_client(int client_socket, const std::string& client_addr, int client_port) {
-        char buffer[BUFFER_SIZE];
-        Client client{client_socket, client_addr, client_port, ""};
-        
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex_);
-            clients_.push_back(client);
-        }
-        
-        std::cout << "Client connected: " << client_addr << ":" << client_port << std::endl;
-        
-        while (running_) {
-            ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-            
-            if (bytes_received <= 0) {
+    std::atomic<size_t> compressing_clients_{0};   // across all shards; 0 skips compressing fan-out
+    BufferSlice heartbeat_;   // one encoded heartbeat, queued to every client that needs one
+
+    // Federation (see protocol.hpp). Linked relays are clients of the shard
+    // that accepted or dialed them. If two relays both dial each other,
+    // each forwards on the link that came up first and keeps the other
+    // standing by.
+    struct PeerRelay {
+        std::string name;           // host:port, as given
+        sockaddr_in address{};
+        bool dialing = false;       // a link we dialed is up or being set up
+        bool disabled = false;      // turned out to be this relay
+        std::chrono::seconds retry{LINK_RETRY_MIN};
+        OutboundQueue::Clock::time_point retry_at{};
+    };
+    uint64_t relay_id_ = 0;
+    std::vector<PeerRelay> peers_;   // shard 0 only
+    std::atomic<size_t> local_clients_{0};       // across all shards, not counting relays
+    std::atomic<size_t> forwarding_links_{0};    // 0 skips wrapping frames for relays
+    std::atomic<uint64_t> interest_version_{1};  // bumped whenever our summary changes
+    std::mutex federation_mutex_;                // guards the members below
+    std::unordered_map<std::string, size_t, RoomNameHash, std::equal_to<>> interest_rooms_;   // shards with members
+    std::unordered_map<uint64_t, std::vector<std::shared_ptr<Client>>> links_;   // by relay id; the first forwards
+    BufferSlice interest_;   // our summary, encoded at version interest_encoded_
+    uint64_t interest_encoded_ = 0;
+
+    std::mutex room_limits_mutex_;
+    std::unordered_map<std::string, std::weak_ptr<SharedTokenBucket>, RoomNameHash, std::equal_to<>> room_limits_;
+
+    // With SO_REUSEPORT every shard accepts on its own listener and the kernel
+    // spreads connections. Without it only shard 0 listens and hands sockets
+    // out round-robin.
+#ifdef __linux__
+    static constexpr bool per_shard_listeners = true;
+#else
+    static constexpr bool per_shard_listeners = false;
+#endif
+
+    static int open_listener(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create socket");
+        }
+
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (per_shard_listeners) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        }
+
+        sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+
+        if (bind(fd, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to bind socket");
+        }
+
+        if (listen(fd, SOMAXCONN) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to listen on socket");
+        }
+
+        EventLoop::set_nonblocking(fd);
+        return fd;
+    }
+
+    void accept_clients(Shard& shard) {
+        while (true) {
+            sockaddr_in client_addr{};
+            socklen_t addr_len = sizeof(client_addr);
+
+            int client_socket = accept(shard.listen_fd, reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
+            if (client_socket < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK && running_) {
+                    logging::error("Failed to accept connection: ", strerror(errno));
+                }
+                return;
+            }
+
+            EventLoop::set_nonblocking(client_socket);
+            on_accepted(shard, client_socket, client_addr);
+        }
+    }
+
+    void on_accepted(Shard& shard, int client_socket, const sockaddr_in& client_addr) {
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        auto client = std::make_shared<Client>(pool_, config_.outbound);
+        client->socket_fd = client_socket;
+        client->address = inet_ntoa(client_addr.sin_addr);
+        client->port = ntohs(client_addr.sin_port);
+        client->shard = per_shard_listeners ? &shard : shards_[next_shard_++ % shards_.size()].get();
+        client->message_limit = TokenBucket(config_.rate.messages);
+        client->byte_limit = TokenBucket(config_.rate.bytes);
+#ifdef SO_ZEROCOPY
+        if (config_.zerocopy_threshold > 0 && !uring_active(*client->shard)) {
+            int one = 1;
+            client->zerocopy = setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+#endif
+
+        if (client->shard == &shard) {
+            register_client(client);
+        } else {
+            client->shard->loop.post([this, client] { register_client(client); });
+        }
+    }
+
+    void register_client(const std::shared_ptr<Client>& client) {
+        Shard& shard = *client->shard;
+        shard.clients.push_back(client);
+        Metrics::local().clients.set(static_cast<int64_t>(shard.clients.size()));
+        if (!client->link) count_client(true);
+        client->timer = shard.timers.add(client.get());
+        check_client(client);   // greets it with a heartbeat and arms its timer
+#ifdef __linux__
+        if (shard.ring) {
+            uring_arm_recv(shard, *client);
+            shard.ring->submit();
+        } else
+#endif
+        shard.loop.add(client->socket_fd, EventLoop::READABLE | EventLoop::WRITABLE,
+            [this, client](uint32_t events) { handle_client(client, events); });
+
+        if (client->dialed >= 0) {
+            logging::info("Linking to relay ", peers_[client->dialed].name);
+        } else {
+            logging::info("Client connected: ", client->address, ":", client->port);
+        }
+    }
+
+    void handle_client(const std::shared_ptr<Client>& client, uint32_t events) {
+        if ((events & EventLoop::ERRORED) && client->zerocopy) {
+            reap_zerocopy(*client);
+        }
+        if (events & EventLoop::WRITABLE) {
+            flush_client(*client);
+        }
+        // A client held back by its rate limit is not read from; TCP flow
+        // control then slows it down.
+        if (!(events & EventLoop::READABLE) || client->closed || client->held) {
+            return;
+        }
+
+        while (true) {
+            auto space = client->decoder.prepare();
+            ssize_t bytes_received = recv(client->socket_fd, space.data(), space.size(), 0);
+
+            if (bytes_received > 0) {
+                client->decoder.commit(static_cast<size_t>(bytes_received));
+                if (!relay_frames(*client)) {
+                    disconnect_client(client);
+                    return;
+                }
+                // Its fd may already belong to someone else.
+                if (client->closed || client->held) return;
+                continue;
+            }
+            if (bytes_received < 0 && errno == EINTR) continue;
+            if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+            disconnect_client(client);
+            return;
+        }
+
+        if (events & EventLoop::CLOSED) {
+            disconnect_client(client);
+        }
+    }
+
+    // Forwards every complete frame in the client's decoder. Returns false on a
+    // protocol error, or if handling a frame disconnected the client.
+    bool relay_frames(Client& client) {
+        client.last_received = OutboundQueue::Clock::now();
+        while (true) {
+            if (client.closed) return false;
+            if (client.held) {
+                // io_uring keeps receiving meanwhile; bound what piles up.
+                if (client.decoder.buffered() <= config_.outbound.max_bytes) return true;
+                logging::warn("Client ", client.address, ":", client.port,
+                              " kept sending while held back by its rate limit; disconnecting");
+                return false;
+            }
+            auto frame = client.decoder.next();
+            if (!frame) {
+                logging::warn("Protocol error from ", client.address, ":", client.port, ": ", frame.error());
+                return false;
+            }
+            if (!*frame) return true;
+            if (!receive_frame(client, **frame, false)) return false;
+        }
+    }
+
+    // Restores a compressed frame before anything looks into it. One the
+    // client compressed without its link history is also kept as it is, to
+    // be passed on to other clients that compress. Returns false if the
+    // client had to be disconnected.
+    bool receive_frame(Client& client, const protocol::SharedFrame& frame, bool datagram) {
+        auto& stats = Metrics::local();
+        stats.frames_in.add();
+        stats.bytes_in.add(frame.raw.size());
+        if (!(frame.header.flags & protocol::FrameFlags::Compressed)) return handle_frame(client, frame, {}, datagram);
+
+        bool streamed = (frame.header.flags & protocol::FrameFlags::Streamed) != 0;
+        auto original = client.decompressor && !(streamed && datagram)
+            ? compression::unpack(*client.decompressor, frame.header, frame.payload(), pool_) : std::nullopt;
+        if (!original) {
+            logging::warn("Protocol error from ", client.address, ":", client.port, ": bad compressed frame");
+            return false;
+        }
+        protocol::SharedFrame plain{protocol::read_header(original->data()), std::move(*original)};
+        return handle_frame(client, plain, streamed ? BufferSlice{} : frame.raw, datagram);
+    }
+
+    // Handles one frame from `client`. `compressed`, if not empty, is the
+    // same frame compressed on its own. Returns false if the client had to
+    // be disconnected.
+    bool handle_frame(Client& client, const protocol::SharedFrame& frame, const BufferSlice& compressed,
+                      bool datagram) {
+        if (frame.header.type == protocol::FrameType::RelayHello) return on_relay_hello(client, frame.header.sender);
+        if (client.link) return handle_link_frame(client, frame);
+
+        switch (frame.header.type) {
+        case protocol::FrameType::Join:
+            join_room(client, frame.payload());
+            break;
+        case protocol::FrameType::Leave:
+            leave_room(client, frame.payload());
+            break;
+        case protocol::FrameType::RoomChat: {
+            auto message = protocol::decode_room_chat(protocol::body_of(frame.header, frame.payload()));
+            if (!message || !is_member(client, message->room)) break;
+            if (!protocol::well_formed(message->chat, message->room)) {
+                reject(client);
                 break;
             }
-            
-            buffer[bytes_received] = '\0';
-            std::string message(buffer);
-            
-            std::cout << "Relaying message from " << client_addr << ": " << message << std::endl;
-            
-            // Broadcast to all other clients
-            std::lock_guard<std::mutex> lock(clients_mutex_);
-            for (auto& other_client : clients_) {
-                if (other_client.socket_fd != client_socket) {
-                    send(other_client.socket_fd, buffer, bytes_received, 0);
+            if (auto verdict = admit(client, frame, compressed, datagram, message->room)) return *verdict;
+            if (sample_message(client)) {
+                std::string scratch;
+                logging::info("Relaying message from ", client.address, " (", message->chat.name,
+                              ") to #", message->room, ": ", text_scan::strip_controls(message->chat.text, scratch));
+            }
+            if (log_) log_->append(frame.raw.view());
+            broadcast(client, frame.raw, compressed_copy(*client.shard, frame, compressed), federated_copy(frame.raw),
+                      track_delivery());
+            break;
+        }
+        case protocol::FrameType::Chat: {
+            auto chat = protocol::decode_chat(protocol::body_of(frame.header, frame.payload()));
+            if (!chat || !protocol::well_formed(*chat)) {
+                reject(client);
+                break;
+            }
+            if (auto verdict = admit(client, frame, compressed, datagram, {})) return *verdict;
+            if (sample_message(client)) {
+                std::string scratch;
+                logging::info("Relaying message from ", client.address, " (", chat->name, "): ",
+                              text_scan::strip_controls(chat->text, scratch));
+            }
+            if (log_) log_->append(frame.raw.view());
+            broadcast(client, frame.raw, compressed_copy(*client.shard, frame, compressed), federated_copy(frame.raw),
+                      track_delivery());
+            break;
+        }
+        case protocol::FrameType::Sealed: {
+            auto sealed = protocol::decode_sealed(frame.payload());
+            if (!sealed || (!sealed->room.empty() && !is_member(client, sealed->room))) break;
+            if (auto verdict = admit(client, frame, compressed, datagram, sealed->room)) return *verdict;
+            if (sample_message(client)) {
+                logging::info("Relaying sealed message from ", client.address,
+                              sealed->room.empty() ? "" : " to #", sealed->room);
+            }
+            if (log_) log_->append(frame.raw.view());
+            broadcast(client, frame.raw, {}, federated_copy(frame.raw), track_delivery());
+            break;
+        }
+        case protocol::FrameType::KeyExchange: {
+            // Chat nodes open every link this way. A relay encrypts no
+            // links; it says so, and the node seals its chat end to end.
+            bool was_empty = false;
+            client.outbox.push(pool_.copy(protocol::encode_relay_key_exchange(0)), was_empty);
+            if (was_empty) flush_client(client);
+            break;
+        }
+        case protocol::FrameType::Replay:
+            if (auto request = protocol::decode_replay_request(frame.payload())) {
+                if (!replay(client, *request)) return false;
+            }
+            break;
+        case protocol::FrameType::UdpOffer:
+            accept_udp(client, frame.payload());
+            break;
+        case protocol::FrameType::Compression:
+            accept_compression(client, frame.payload());
+            break;
+        case protocol::FrameType::Heartbeat:
+            client.heartbeats = true;
+            break;
+        default:
+            // Record and file frames only travel between two peers, Interest
+            // and Federated only between relays, and ReplayEnd only from a
+            // relay. Anything else is not a frame a client may send.
+            logging::warn("Protocol error from ", client.address, ":", client.port, ": unexpected frame type ",
+                          static_cast<unsigned>(frame.header.type));
+            reject(client);
+            return false;
+        }
+        return true;
+    }
+
+    // Charges a message the client publishes to its rate limits and, for a
+    // room message, the room's. Returns nothing if it may go out now.
+    // Otherwise it was held, dropped or must cost the client its connection,
+    // and the result is what handle_frame() returns. Frames that came as
+    // datagrams cannot be held, since the transport has already
+    // acknowledged them, so Delay drops those. A full room never
+    // disconnects anyone, as the sender may be within its own limits, and
+    // nor does a linked relay, which speaks for all of its clients.
+    std::optional<bool> admit(Client& client, const protocol::SharedFrame& frame, const BufferSlice& compressed,
+                              bool datagram, std::string_view room) {
+        Room* limited_room = nullptr;
+        if (!room.empty() && config_.rate.room_messages.enabled()) {
+            auto it = client.shard->rooms.find(room);
+            if (it != client.shard->rooms.end()) limited_room = &it->second;
+        }
+        if (!client.message_limit.enabled() && !client.byte_limit.enabled() && !limited_room) return std::nullopt;
+
+        auto now = OutboundQueue::Clock::now();
+        auto wait = std::max(client.message_limit.wait(1, now), client.byte_limit.wait(frame.raw.size(), now));
+        bool room_full = false;
+        if (wait == wait.zero() && limited_room) {
+            wait = limited_room->limit->try_take(1, now);
+            room_full = wait != wait.zero();
+        }
+        if (wait == wait.zero()) {
+            client.message_limit.take(1, now);
+            client.byte_limit.take(frame.raw.size(), now);
+            return std::nullopt;
+        }
+
+        auto& stats = Metrics::local();
+        if (config_.rate.policy == RateLimitPolicy::Delay && !datagram) {
+            client.held = HeldFrame{frame, compressed};
+            client.resume_at = now + wait;
+            auto armed = client.shard->timers.expiry(client.timer);
+            if (!armed || *armed > client.resume_at) client.shard->timers.schedule(client.timer, client.resume_at);
+            ++client.throttled;
+            stats.throttled.add();
+            return true;
+        }
+        stats.rate_dropped.add();
+        if (config_.rate.policy == RateLimitPolicy::Disconnect && !room_full && !client.link) {
+            logging::warn("Client ", client.address, ":", client.port, " exceeded its rate limit; disconnecting");
+            return false;
+        }
+        ++client.rate_dropped;
+        return true;
+    }
+
+    // Runs from the client's timer once its held message fits: sends it on,
+    // then whatever the client sent meanwhile. Returns false if the client
+    // was disconnected.
+    bool resume(const std::shared_ptr<Client>& client) {
+        HeldFrame held = std::move(*client->held);
+        client->held.reset();
+        if (!handle_frame(*client, held.frame, held.compressed, false) || !relay_frames(*client)) {
+            disconnect_client(client);
+            return false;
+        }
+        // epoll is edge-triggered, so read what waited in the socket now.
+        if (!client->held && !uring_active(*client->shard)) handle_client(client, EventLoop::READABLE);
+        return !client->closed;
+    }
+
+    // A room's --room-rate bucket, shared by every shard the room is on.
+    std::shared_ptr<SharedTokenBucket> room_limit(std::string_view room) {
+        std::lock_guard<std::mutex> lock(room_limits_mutex_);
+        auto it = room_limits_.find(room);
+        if (it == room_limits_.end()) it = room_limits_.emplace(room, std::weak_ptr<SharedTokenBucket>{}).first;
+        auto limit = it->second.lock();
+        if (!limit) {
+            limit = std::make_shared<SharedTokenBucket>(config_.rate.room_messages);
+            it->second = limit;
+        }
+        return limit;
+    }
+
+    void release_room_limit(std::string_view room, std::shared_ptr<SharedTokenBucket> limit) {
+        std::lock_guard<std::mutex> lock(room_limits_mutex_);
+        limit.reset();
+        auto it = room_limits_.find(room);
+        if (it != room_limits_.end() && it->second.expired()) room_limits_.erase(it);
+    }
+
+    // What clients that negotiated compression are sent instead of `frame`:
+    // the sender's own compressed copy if there is one, otherwise the frame
+    // compressed here, once for all of them. Empty if nobody compresses or
+    // it does not pay.
+    BufferSlice compressed_copy(Shard& shard, const protocol::SharedFrame& frame, const BufferSlice& compressed) {
+        if (compressed.buffer || compressing_clients_.load(std::memory_order_relaxed) == 0) return compressed;
+        auto packed = compression::pack(shard.compressor, frame.raw.view(), false, pool_);
+        return packed ? std::move(*packed) : BufferSlice{};
+    }
+
+    // Takes up a client's offer of compression. The answer is queued before
+    // anything compressed, so the client learns in time to decode it.
+    void accept_compression(Client& client, std::string_view payload) {
+        auto hello = protocol::decode_compression(payload);
+        if (!config_.compress || !hello || hello->answer || client.decompressor ||
+            !protocol::offers(*hello, protocol::Codec::Lz)) return;
+
+        bool was_empty = false;
+        client.outbox.push(pool_.copy(protocol::encode_compression_answer(0, protocol::Codec::Lz)), was_empty);
+        if (was_empty) flush_client(client);
+        client.decompressor = std::make_unique<compression::Decoder>();
+        compressing_clients_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Takes up a client's offer of the datagram transport: from now on frames
+    // that fit in a datagram travel both ways on the shard's endpoint, while
+    // replays and larger frames stay on TCP.
+    void accept_udp(Client& client, std::string_view payload) {
+        Shard& shard = *client.shard;
+        auto offer = protocol::decode_udp_offer(payload);
+        if (!shard.udp || !offer || client.udp != 0) return;
+
+        sockaddr_in remote{};
+        remote.sin_family = AF_INET;
+        remote.sin_port = htons(offer->port);
+        if (inet_pton(AF_INET, client.address.c_str(), &remote.sin_addr) != 1) return;
+        client.udp = shard.udp->open();
+        shard.udp->connect(client.udp, remote, offer->token);
+        shard.udp_clients.emplace(client.udp, client.shared_from_this());
+
+        bool was_empty = false;
+        client.outbox.push(pool_.copy(protocol::encode_udp_offer(0, {shard.udp->port(), client.udp})), was_empty);
+        if (was_empty) flush_client(client);
+        logging::info("Client ", client.address, ":", client.port, " uses datagrams (UDP port ", offer->port, ")");
+    }
+
+    void receive_datagrams(Shard& shard) {
+        shard.udp->receive(shard.udp_received);
+        auto now = OutboundQueue::Clock::now();
+        for (auto& received : shard.udp_received) {
+            auto it = shard.udp_clients.find(received.session);
+            if (it == shard.udp_clients.end()) continue;
+            auto client = it->second;   // handling the frame may disconnect it
+            client->last_received = now;
+            if (!receive_frame(*client, received.frame, true)) disconnect_client(client);
+        }
+        shard.udp_received.clear();
+    }
+
+    uint8_t udp_stream(const BufferSlice& message) const {
+        if (config_.udp_unordered) return reliable_udp::UNORDERED;
+        return reliable_udp::stream_for(protocol::read_header(message.data()).sender);
+    }
+
+    // Streams logged frames to `client` straight from the log, copied into
+    // pooled chunks with the Replayed flag set, then a ReplayEnd. Room frames
+    // are only replayed to current members. The reply is capped at half the
+    // outbox limit; the client asks again from ReplayEnd::next_seq for more.
+    // Returns false if the client had to be disconnected.
+    bool replay(Client& client, const protocol::ReplayRequest& request) {
+        uint64_t from = 0;
+        uint64_t head = log_ ? log_->next_seq() : 0;
+        switch (request.since) {
+        case protocol::ReplayRequest::Since::Sequence:
+            from = request.value;
+            break;
+        case protocol::ReplayRequest::Since::Time:
+            from = log_ ? log_->seq_at_time(static_cast<int64_t>(request.value)) : 0;
+            break;
+        case protocol::ReplayRequest::Since::Last:
+            from = head - std::min(head, request.value);
+            break;
+        }
+
+        std::vector<BufferSlice> chunks;
+        BufferRef chunk;
+        size_t used = 0;
+        auto seal = [&] {
+            if (used > 0) chunks.push_back(BufferSlice{chunk, 0, static_cast<uint32_t>(used)});
+            used = 0;
+        };
+
+        uint64_t next = !log_ ? head : log_->read(from, config_.outbound.max_bytes / 2, [&](std::string_view frame) {
+            auto header = protocol::read_header(frame.data());
+            auto room = protocol::destination_of(header, frame.substr(protocol::HEADER_SIZE));
+            if (!room || (!room->empty() && !is_member(client, *room))) return;
+            if (!chunk || chunk->capacity() - used < frame.size()) {
+                seal();
+                chunk = pool_.acquire(std::max(REPLAY_CHUNK, frame.size()));
+            }
+            char* out = chunk->data() + used;
+            std::memcpy(out, frame.data(), frame.size());
+            protocol::detail::put_u16(out + 6, header.flags | protocol::FrameFlags::Replayed);
+            used += frame.size();
+        });
+        seal();
+        chunks.push_back(pool_.copy(protocol::encode_replay_end(0, {next, head})));
+
+        bool idle = false;
+        for (auto& slice : chunks) {
+            bool was_empty = false;
+            if (client.outbox.push(slice, was_empty).status == OutboundQueue::PushStatus::Overflow) {
+                return false;
+            }
+            idle |= was_empty;
+        }
+        if (idle) flush_client(client);
+        return true;
+    }
+
+    // Malformed chat is dropped as soon as it is decoded, before it is
+    // charged, logged or fanned out; a frame a client may not send at all
+    // also costs it the connection.
+    void reject(Client& client) {
+        Metrics::local().rejected.add();
+        ++client.rejected;
+    }
+
+    // The per-message line is the relay's hottest log call, so it is sampled:
+    // one in every `log_sample` messages per shard, none if 0.
+    bool sample_message(const Client& client) {
+        uint64_t seen = client.shard->relayed++;
+        return config_.log_sample > 0 && seen % config_.log_sample == 0 && logging::Logger::instance().enabled(logging::Level::Info);
+    }
+
+    void join_room(Client& client, std::string_view room) {
+        if (room.size() > protocol::MAX_ROOM_NAME || !text_scan::valid_name(room) || is_member(client, room)) return;
+        if (client.rooms.size() >= MAX_ROOMS_PER_CLIENT) {
+            logging::warn(client.address, ":", client.port, " is already in ", MAX_ROOMS_PER_CLIENT,
+                          " rooms; ignoring join of #", room);
+            return;
+        }
+
+        enter_room(client, room);
+    }
+
+    void enter_room(Client& client, std::string_view room) {
+        auto it = client.shard->rooms.find(room);
+        if (it == client.shard->rooms.end()) {
+            it = client.shard->rooms.emplace(room, Room{}).first;
+            if (config_.rate.room_messages.enabled()) it->second.limit = room_limit(room);
+        }
+        it->second.members.push_back(client.shared_from_this());
+        if (!client.link && it->second.local++ == 0) count_room(room, true);
+        client.rooms.emplace_back(room);
+    }
+
+    void leave_room(Client& client, std::string_view room) {
+        auto joined = std::ranges::find(client.rooms, room);
+        if (joined == client.rooms.end()) return;
+        client.rooms.erase(joined);
+
+        auto it = client.shard->rooms.find(room);
+        if (it == client.shard->rooms.end()) return;
+        std::erase_if(it->second.members, [&client](const auto& member) { return member.get() == &client; });
+        if (!client.link && --it->second.local == 0) count_room(room, false);
+        if (it->second.members.empty()) {
+            if (it->second.limit) release_room_limit(room, std::move(it->second.limit));
+            client.shard->rooms.erase(it);
+        }
+    }
+
+    static bool is_member(const Client& client, std::string_view room) {
+        return std::ranges::find(client.rooms, room) != client.rooms.end();
+    }
+
+    // With metrics on, every queued copy of a relayed frame shares one handle;
+    // the last copy to be written (or discarded) records the frame's delivery
+    // latency on whichever shard released it.
+    std::shared_ptr<const void> track_delivery() const {
+        if (!config_.metrics_enabled()) return {};
+        auto received = OutboundQueue::Clock::now();
+        return std::shared_ptr<const void>(nullptr, [received](const void*) {
+            Metrics::local().delivery.record(micros_since(received));
+        });
+    }
+
+    static uint64_t micros_since(OutboundQueue::Clock::time_point start) {
+        auto elapsed = OutboundQueue::Clock::now() - start;
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    // Fans the frame out to the sender's shard-mates directly and hands it to
+    // every other shard once through its mailbox.
+    void broadcast(Client& sender, const BufferSlice& message, const BufferSlice& compressed,
+                   const BufferSlice& federated, const std::shared_ptr<const void>& delivery) {
+        Shard& home = *sender.shard;
+        deliver(home, &sender, message, compressed, federated, delivery);
+
+        for (auto& shard : shards_) {
+            if (shard.get() == &home) continue;
+
+            ShardMessage handoff{message, compressed, federated, delivery};
+            auto& parked = home.parked[shard->id];
+            if (parked.empty() && shard->mailbox.try_push(std::move(handoff))) {
+                wake(*shard);
+                continue;
+            }
+            // The target is far behind. Waiting here could deadlock two shards
+            // flooding each other, and draining our own mailbox could
+            // disconnect the sender under us, so park the handoff and retry
+            // from the loop. Past a mailbox's worth, the target is stuck.
+            if (parked.size() >= MAILBOX_CAPACITY) {
+                Metrics::local().dropped.add();
+                continue;
+            }
+            if (parked.empty()) {
+                home.loop.arm_timer(home.retry_timer, EventLoop::Clock::now() + PARKED_RETRY);
+            }
+            parked.push_back(std::move(handoff));
+        }
+    }
+
+    // Runs from the shard's retry timer: moves parked handoffs, in order, into
+    // mailboxes that have room again.
+    void flush_parked(Shard& home) {
+        bool waiting = false;
+        for (auto& shard : shards_) {
+            auto& parked = home.parked[shard->id];
+            if (parked.empty()) continue;
+            while (!parked.empty() && shard->mailbox.try_push(std::move(parked.front()))) {
+                parked.pop_front();
+            }
+            wake(*shard);
+            waiting = waiting || !parked.empty();
+        }
+        if (waiting) home.loop.arm_timer(home.retry_timer, EventLoop::Clock::now() + PARKED_RETRY);
+    }
+
+    // Call after pushing to `shard`'s mailbox.
+    static void wake(Shard& shard) {
+        // Pairs with the fence in drain_mailbox(): either we see its flag
+        // cleared or it sees our message after clearing it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!shard.wake_pending.exchange(true, std::memory_order_acq_rel)) {
+            shard.loop.notify();
+        }
+    }
+
+    void drain_mailbox(Shard& shard) {
+        shard.wake_pending.store(false, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (auto message = shard.mailbox.try_pop()) {
+            deliver(shard, nullptr, message->frame, message->compressed, message->federated, message->delivery);
+        }
+    }
+
+    // Room frames go to the room's local members only; a shard with no members
+    // pays one hash lookup. Everything else goes to all local clients.
+    void deliver(Shard& shard, const Client* exclude, const BufferSlice& message, const BufferSlice& compressed,
+                 const BufferSlice& federated, const std::shared_ptr<const void>& delivery) {
+        auto header = protocol::read_header(message.data());
+        auto room_name = protocol::destination_of(header, message.view().substr(protocol::HEADER_SIZE));
+        if (!room_name) return;
+        if (room_name->empty()) {
+            fan_out(shard, shard.clients, exclude, message, compressed, federated, delivery);
+            return;
+        }
+
+        auto it = shard.rooms.find(*room_name);
+        if (it == shard.rooms.end()) return;
+
+        Room& room = it->second;
+        room.published++;
+        room.delivered += room.members.size() - (exclude && exclude->shard == &shard ? 1 : 0);
+        fan_out(shard, room.members, exclude, message, compressed, federated, delivery);
+    }
+
+    // Runs on `shard`'s thread. Queues the frame on each of `targets` except
+    // `exclude`, compressed for those that negotiated it and wrapped for
+    // linked relays, and flushes the ones that were idle.
+    void fan_out(Shard& shard, const std::vector<std::shared_ptr<Client>>& targets, const Client* exclude,
+                 const BufferSlice& plain, const BufferSlice& compressed, const BufferSlice& federated,
+                 const std::shared_ptr<const void>& delivery) {
+        // Disconnecting edits the client and room tables, so collect overflowed clients first.
+        std::vector<std::shared_ptr<Client>> overflowed;
+        auto& stats = Metrics::local();
+        uint64_t queued = 0;
+
+        for (auto& client : targets) {
+            if (client.get() == exclude) continue;
+            if (client->link && (!federated.buffer || !client->forwarding || !client->remote_clients)) continue;
+            const BufferSlice& message = client->link ? federated
+                                       : client->decompressor && compressed.buffer ? compressed : plain;
+
+            if (client->udp != 0 && message.size() <= reliable_udp::MAX_FRAME) {
+                // A datagram client too far behind to take more is dropped,
+                // whatever the slow-consumer policy.
+                if (shard.udp->send(client->udp, message, udp_stream(message))) {
+                    ++queued;
+                } else {
+                    overflowed.push_back(client);
+                }
+                continue;
+            }
+
+            bool was_empty = false;
+            auto result = client->outbox.push(message, was_empty, delivery);
+
+            if (result.status == OutboundQueue::PushStatus::Overflow) {
+                overflowed.push_back(client);
+                continue;
+            }
+            if (result.status == OutboundQueue::PushStatus::Dropped) {
+                stats.dropped.add();
+            } else {
+                ++queued;
+            }
+            if (result.evicted > 0) stats.dropped.add(result.evicted);
+            if (was_empty) flush_client(*client);
+        }
+        stats.frames_out.add(queued);
+        stats.fanout.record(queued);
+
+        for (auto& client : overflowed) {
+            disconnect_client(client);
+        }
+#ifdef __linux__
+        // Every send queued above goes to the kernel in a single io_uring_enter.
+        if (shard.ring) shard.ring->submit();
+#endif
+    }
+
+    // Runs on the client's loop. Writes with writev until the outbox drains or
+    // the socket would block; the next WRITABLE edge resumes the flush.
+    void flush_client(Client& client) {
+#ifdef __linux__
+        if (client.shard->ring) {
+            uring_flush(client);
+            return;
+        }
+#endif
+        iovec iov[MAX_IOVECS];
+
+        while (!client.closed) {
+            int count = client.outbox.begin_flush(iov, MAX_IOVECS);
+            if (count == 0) {
+                client.outbox.end_flush(0);
+                return;
+            }
+
+            ssize_t n;
+            if (client.zerocopy && iov[0].iov_len >= config_.zerocopy_threshold) {
+                n = send_zerocopy(client, iov[0]);
+            } else {
+                if (client.zerocopy) {
+                    // Stop the batch before the next large frame so it goes out zero-copy.
+                    for (int i = 1; i < count; ++i) {
+                        if (iov[i].iov_len >= config_.zerocopy_threshold) {
+                            count = i;
+                            break;
+                        }
+                    }
+                }
+                n = writev(client.socket_fd, iov, count);
+            }
+            if (n < 0 && errno == EINTR) {
+                client.outbox.end_flush(0);
+                continue;
+            }
+            bool blocked = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+            if (n > 0) note_written(client, static_cast<size_t>(n));
+            bool more = client.outbox.end_flush(n > 0 ? static_cast<size_t>(n) : 0);
+            if (blocked && client.send_blocked == OutboundQueue::Clock::time_point{}) {
+                client.send_blocked = OutboundQueue::Clock::now();
+            }
+            if (n <= 0 || !more) return;
+        }
+    }
+
+    // A write after the socket filled up ends the client's send stall.
+    static void note_written(Client& client, size_t bytes) {
+        auto& stats = Metrics::local();
+        stats.bytes_out.add(bytes);
+        if (client.send_blocked != OutboundQueue::Clock::time_point{}) {
+            stats.send_stall.record(micros_since(client.send_blocked));
+            client.send_blocked = {};
+        }
+    }
+
+    // Sends one large frame without copying it into the kernel. The buffer is
+    // retained until the completion notification arrives on the error queue.
+    ssize_t send_zerocopy(Client& client, iovec& iov) {
+#ifdef MSG_ZEROCOPY
+        BufferRef keep_alive = client.outbox.front_buffer();
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t n = sendmsg(client.socket_fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (n >= 0) {
+            client.zerocopy_inflight.emplace_back(client.zerocopy_next++, std::move(keep_alive));
+            return n;
+        }
+        if (errno != ENOBUFS) return n;
+        // Out of optmem for pinned pages: fall back to an ordinary copy.
+#endif
+        return send(client.socket_fd, iov.iov_base, iov.iov_len, MSG_NOSIGNAL);
+    }
+
+    void reap_zerocopy([[maybe_unused]] Client& client) {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+        while (true) {
+            char control[128];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(client.socket_fd, &msg, MSG_ERRQUEUE) < 0) return;
+
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                auto* err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+                if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+                // Notifications cover the inclusive range [ee_info, ee_data].
+                uint32_t last = err->ee_data;
+                while (!client.zerocopy_inflight.empty() &&
+                       static_cast<int32_t>(client.zerocopy_inflight.front().first - last) <= 0) {
+                    client.zerocopy_inflight.pop_front();
+                }
+            }
+        }
+#endif
+    }
+
+    // A socket closed normally keeps sending what it has queued, from pages
+    // that are still ours. Before a client's buffers are released, collect
+    // what has completed; if any send is still outstanding, reset the
+    // connection so that the kernel drops its queue instead.
+    void abort_zerocopy(Client& client) {
+        reap_zerocopy(client);
+        if (client.zerocopy_inflight.empty()) return;
+        linger reset{.l_onoff = 1, .l_linger = 0};
+        setsockopt(client.socket_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+
+    bool uring_active([[maybe_unused]] const Shard& shard) const {
+#ifdef __linux__
+        return shard.ring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+#ifdef __linux__
+    // Switches every shard to io_uring. Returns false, leaving all shards on
+    // epoll, if uname reports a kernel before 6.x, which lacks multishot
+    // recv, or if a ring or its buffer group (IORING_OP_PROVIDE_BUFFERS)
+    // cannot be set up.
+    bool enable_uring() {
+        if (!IoUring::kernel_supported()) {
+            logging::warn("io_uring engine needs multishot recv, and the kernel's major version is below 6; using epoll");
+            return false;
+        }
+        try {
+            for (auto& shard : shards_) {
+                shard->ring = std::make_unique<IoUring>(URING_ENTRIES);
+                shard->recv_buffers = std::make_unique<ProvidedBuffers>(
+                    *shard->ring, 0, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE, uring_tag(nullptr, URING_PROVIDE));
+            }
+        } catch (const std::exception& e) {
+            logging::warn("io_uring unavailable (", e.what(), "); using epoll");
+            for (auto& shard : shards_) {
+                shard->recv_buffers.reset();
+                shard->ring.reset();
+            }
+            return false;
+        }
+        return true;
+    }
+
+    static uint64_t uring_tag(Client* client, UringOp op) {
+        return reinterpret_cast<uint64_t>(client) | op;
+    }
+
+    void uring_arm_accept(Shard& shard) {
+        if (auto* sqe = shard.ring->get_sqe()) {
+            IoUring::prep_multishot_accept(sqe, shard.listen_fd, uring_tag(nullptr, URING_ACCEPT));
+        }
+    }
+
+    void uring_arm_recv(Shard& shard, Client& client) {
+        if (auto* sqe = shard.ring->get_sqe()) {
+            IoUring::prep_multishot_recv(sqe, client.socket_fd, shard.recv_buffers->group_id(),
+                                         uring_tag(&client, URING_RECV));
+            ++client.uring_ops;
+        }
+    }
+
+    // Queues one sendmsg covering as much of the outbox as fits; the caller's
+    // batch is submitted together. At most one send per client is in flight,
+    // which keeps the byte stream ordered without linking SQEs.
+    void uring_flush(Client& client) {
+        if (client.closed || client.send_inflight) return;
+        if (!client.uring_send) client.uring_send = std::make_unique<Client::UringSend>();
+
+        auto& send = *client.uring_send;
+        int count = client.outbox.begin_flush(send.iov, MAX_IOVECS);
+        auto* sqe = count > 0 ? client.shard->ring->get_sqe() : nullptr;
+        if (!sqe) {
+            client.outbox.end_flush(0);
+            return;
+        }
+
+        send.msg = msghdr{};
+        send.msg.msg_iov = send.iov;
+        send.msg.msg_iovlen = static_cast<size_t>(count);
+        IoUring::prep_sendmsg(sqe, client.socket_fd, &send.msg, uring_tag(&client, URING_SEND));
+        client.send_inflight = true;
+        client.send_blocked = OutboundQueue::Clock::now();
+        ++client.uring_ops;
+    }
+
+    void process_completions(Shard& shard) {
+        shard.ring->drain_completions([this, &shard](const io_uring_cqe& cqe) { handle_completion(shard, cqe); });
+        submit(shard);
+    }
+
+    void handle_completion(Shard& shard, const io_uring_cqe& cqe) {
+        auto op = static_cast<UringOp>(cqe.user_data & URING_OP_MASK);
+        auto* client = reinterpret_cast<Client*>(cqe.user_data & ~URING_OP_MASK);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        switch (op) {
+        case URING_ACCEPT:
+            if (cqe.res >= 0) {
+                sockaddr_in client_addr{};
+                socklen_t addr_len = sizeof(client_addr);
+                getpeername(cqe.res, reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
+                on_accepted(shard, cqe.res, client_addr);
+            }
+            if (!more && running_) uring_arm_accept(shard);
+            return;
+
+        case URING_RECV: {
+            auto self = client->shared_from_this();
+            if (!more) --client->uring_ops;
+
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res > 0 && !client->closed) {
+                    // One copy out of the kernel-selected buffer so it can be
+                    // recycled immediately; frames are then sliced from the chunk.
+                    auto space = client->decoder.prepare(static_cast<size_t>(cqe.res));
+                    std::memcpy(space.data(), shard.recv_buffers->data(bid), static_cast<size_t>(cqe.res));
+                    client->decoder.commit(static_cast<size_t>(cqe.res));
+                }
+                shard.recv_buffers->recycle(bid);
+            }
+
+            if (!client->closed) {
+                if (cqe.res > 0) {
+                    if (!relay_frames(*client)) disconnect_client(self);
+                } else if (cqe.res != -ENOBUFS) {
+                    disconnect_client(self);
+                }
+            }
+            if (!more && !client->closed) uring_arm_recv(shard, *client);
+            release_if_idle(shard, *client);
+            return;
+        }
+
+        case URING_SEND: {
+            auto self = client->shared_from_this();
+            --client->uring_ops;
+            client->send_inflight = false;
+            if (cqe.res > 0) note_written(*client, static_cast<size_t>(cqe.res));
+            bool pending = client->outbox.end_flush(cqe.res > 0 ? static_cast<size_t>(cqe.res) : 0);
+
+            if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR) {
+                disconnect_client(self);
+            } else if (pending) {
+                uring_flush(*client);
+            }
+            release_if_idle(shard, *client);
+            return;
+        }
+
+        case URING_PROVIDE:
+            // Only failures complete; the buffer stays out of the group.
+            logging::error("Returning a receive buffer failed: ", strerror(-cqe.res));
+            return;
+        }
+    }
+
+    // A disconnected client's fd is closed only once the kernel has finished
+    // every operation that references it.
+    void release_if_idle(Shard& shard, Client& client) {
+        if (!client.closed || client.uring_ops > 0) return;
+        if (client.socket_fd >= 0) {
+            close(client.socket_fd);
+            client.socket_fd = -1;
+        }
+        std::erase_if(shard.retired, [&client](const auto& c) { return c.get() == &client; });
+    }
+#endif
+
+    // Runs on the client's shard when its timer fires, and once when it
+    // connects. Drops the client if it went silent after sending heartbeats,
+    // if its socket took nothing for the stall timeout, or if its outbox is
+    // past the lag limit even though no new broadcast came to trip the
+    // overflow check. Otherwise sends a heartbeat if one is due and re-arms
+    // the timer for the earliest deadline. A client with data queued is
+    // checked every second, any other one at least once per heartbeat.
+    void check_client(const std::shared_ptr<Client>& client) {
+        if (client->closed) return;
+        using Clock = OutboundQueue::Clock;
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        auto passed = [&](Clock::time_point deadline) {
+            next = std::min(next, deadline);
+            return now >= deadline;
+        };
+
+        if (client->held && now >= client->resume_at && !resume(client)) return;
+        if (client->held) next = std::min(next, client->resume_at);
+
+        if (client->heartbeats && config_.idle_timeout.count() > 0 &&
+            passed(client->last_received + config_.idle_timeout)) {
+            logging::warn("Client ", client->address, ":", client->port, " sent nothing for ",
+                          config_.idle_timeout.count(), "s; disconnecting");
+            disconnect_client(client);
+            return;
+        }
+        if (client->send_blocked != Clock::time_point{} && config_.stall_timeout.count() > 0 &&
+            passed(client->send_blocked + config_.stall_timeout)) {
+            logging::warn("Client ", client->address, ":", client->port, " took no data for ",
+                          config_.stall_timeout.count(), "s; disconnecting");
+            disconnect_client(client);
+            return;
+        }
+        if (client->outbox.stalled()) {
+            disconnect_client(client);
+            return;
+        }
+
+        auto queue = client->outbox.stats();
+        if (config_.heartbeat_interval.count() > 0) {
+            if (now >= client->next_heartbeat) {
+                // Queued data reaches the client anyway once it drains.
+                if (queue.queued_messages == 0) {
+                    bool was_empty = false;
+                    client->outbox.push(heartbeat_, was_empty);
+                    if (was_empty) flush_client(*client);
                 }
+                client->next_heartbeat = now + config_.heartbeat_interval;
+            }
+            next = std::min(next, client->next_heartbeat);
+        }
+        if (queue.queued_messages > 0 || config_.heartbeat_interval.count() == 0) {
+            next = std::min(next, now + CHECK_INTERVAL);
+        }
+        client->shard->timers.schedule(client->timer, next);
+    }
+
+    // Runs on every shard every tick; a client's check costs O(1) and only
+    // clients whose timer is due are visited.
+    void run_timers(Shard& shard) {
+        shard.timers.advance(OutboundQueue::Clock::now(), [this](TimerWheel<Client*>::Handle, Client* client) {
+            check_client(client->shared_from_this());
+        });
+        submit(shard);   // heartbeats queued above
+    }
+
+    // Runs on every shard once a second: per-client queue depth is read under
+    // each outbox's lock, so it is sampled rather than tracked on every push.
+    void sample_queues(Shard& shard) {
+        auto& stats = Metrics::local();
+        size_t total_bytes = 0;
+        size_t total_frames = 0;
+        size_t deepest = 0;
+        for (auto& client : shard.clients) {
+            auto queue = client->outbox.stats();
+            total_bytes += queue.queued_bytes;
+            total_frames += queue.queued_messages;
+            deepest = std::max(deepest, queue.queued_bytes);
+            stats.queue_depth.record(queue.queued_bytes);
+        }
+        stats.queued_bytes.set(static_cast<int64_t>(total_bytes));
+        stats.queued_frames.set(static_cast<int64_t>(total_frames));
+        stats.max_client_queue.set(static_cast<int64_t>(deepest));
+    }
+
+    struct MetricsTotals {
+        uint64_t frames_in = 0;
+        uint64_t bytes_in = 0;
+        uint64_t frames_out = 0;
+        uint64_t bytes_out = 0;
+        uint64_t dropped = 0;
+        uint64_t throttled = 0;
+        uint64_t rate_dropped = 0;
+        uint64_t rejected = 0;
+        int64_t clients = 0;
+        int64_t queued_bytes = 0;
+        int64_t queued_frames = 0;
+        int64_t max_client_queue = 0;
+        metrics::Histogram::Snapshot fanout;
+        metrics::Histogram::Snapshot queue_depth;
+        metrics::Histogram::Snapshot send_stall;
+        metrics::Histogram::Snapshot delivery;
+    };
+
+    // Safe from any thread: reads only the per-thread metric blocks.
+    static MetricsTotals collect_metrics() {
+        MetricsTotals totals;
+        Metrics::for_each([&totals](const RelayMetrics& m) {
+            totals.frames_in += m.frames_in.value();
+            totals.bytes_in += m.bytes_in.value();
+            totals.frames_out += m.frames_out.value();
+            totals.bytes_out += m.bytes_out.value();
+            totals.dropped += m.dropped.value();
+            totals.throttled += m.throttled.value();
+            totals.rate_dropped += m.rate_dropped.value();
+            totals.rejected += m.rejected.value();
+            totals.clients += m.clients.value();
+            totals.queued_bytes += m.queued_bytes.value();
+            totals.queued_frames += m.queued_frames.value();
+            totals.max_client_queue = std::max(totals.max_client_queue, m.max_client_queue.value());
+            totals.fanout.merge(m.fanout);
+            totals.queue_depth.merge(m.queue_depth);
+            totals.send_stall.merge(m.send_stall);
+            totals.delivery.merge(m.delivery);
+        });
+        return totals;
+    }
+
+    static std::string render_metrics() {
+        auto t = collect_metrics();
+        metrics::TextWriter out;
+        out.counter("relay_frames_received_total", "Frames received from clients", t.frames_in);
+        out.counter("relay_bytes_received_total", "Bytes of frames received from clients", t.bytes_in);
+        out.counter("relay_frames_queued_total", "Frame copies queued to recipients", t.frames_out);
+        out.counter("relay_bytes_sent_total", "Bytes written to client sockets", t.bytes_out);
+        out.counter("relay_frames_dropped_total", "Frame copies refused or evicted by the slow-consumer policy", t.dropped);
+        out.counter("relay_messages_throttled_total", "Messages held back by the rate limit's delay policy", t.throttled);
+        out.counter("relay_messages_rate_dropped_total", "Messages dropped, or clients disconnected, for exceeding a rate limit",
+                    t.rate_dropped);
+        out.counter("relay_messages_rejected_total", "Malformed chat, or frames of a type a client may not send, that were dropped",
+                    t.rejected);
+        out.gauge("relay_clients", "Connected clients", t.clients);
+        out.gauge("relay_queued_bytes", "Bytes waiting in client outboxes", t.queued_bytes);
+        out.gauge("relay_queued_frames", "Frames waiting in client outboxes", t.queued_frames);
+        out.gauge("relay_max_client_queued_bytes", "Deepest single client outbox in bytes", t.max_client_queue);
+        out.summary("relay_fanout_recipients", "Recipients per relayed frame per shard", t.fanout);
+        out.summary("relay_client_queue_bytes", "Per-client outbox depth, sampled every second", t.queue_depth);
+        out.summary("relay_send_stall_microseconds", "Time a client socket stayed full before accepting more data", t.send_stall);
+        out.summary("relay_delivery_latency_microseconds", "Time from receiving a frame to writing its last copy", t.delivery);
+        return out.take();
+    }
+
+    static void log_metrics() {
+        auto t = collect_metrics();
+        logging::info("metrics: in=", t.frames_in, "/", t.bytes_in, "B out=", t.frames_out, "/", t.bytes_out,
+                      "B dropped=", t.dropped, " throttled=", t.throttled, " rate-dropped=", t.rate_dropped,
+                      " rejected=", t.rejected, " clients=", t.clients, " queued=", t.queued_bytes,
+                      "B max=", t.max_client_queue, "B fanout p50=", t.fanout.quantile(0.5),
+                      " p99=", t.fanout.quantile(0.99), " stall p99=", t.send_stall.quantile(0.99),
+                      "us max=", t.send_stall.max, "us delivery p50=", t.delivery.quantile(0.5),
+                      "us p99=", t.delivery.quantile(0.99), "us p999=", t.delivery.quantile(0.999),
+                      "us max=", t.delivery.max, "us");
+    }
+
+    void print_stats(Shard& shard) {
+        std::ostringstream report;
+        report << "--- shard " << shard.id << ": " << shard.clients.size() << " client(s), "
+               << shard.rooms.size() << " room(s) ---";
+        for (auto& client : shard.clients) {
+            auto stats = client->outbox.stats();
+            report << "\n  " << client->address << ":" << client->port
+                   << "  queued=" << stats.queued_bytes << "B/" << stats.queued_messages << "msg"
+                   << "  lag=" << stats.lag.count() << "ms"
+                   << "  dropped=" << stats.dropped_messages;
+            if (auto udp = client->udp != 0 ? shard.udp->stats(client->udp) : std::nullopt) {
+                report << "  udp rtt=" << udp->srtt.count() << "us window=" << udp->window
+                       << "B backlog=" << udp->backlog << "B sent=" << udp->sent
+                       << " retransmitted=" << udp->retransmitted;
+            }
+            if (client->throttled || client->rate_dropped) {
+                report << "  throttled=" << client->throttled << " rate-dropped=" << client->rate_dropped;
+            }
+            if (client->rejected) report << "  rejected=" << client->rejected;
+            if (client->held) report << "  held";
+            if (client->decompressor) report << "  compressed";
+            if (client->relay != 0) report << "  relay " << relay_name(client->relay) << (client->forwarding ? "" : " (standing by)");
+        }
+        for (auto& [name, room] : shard.rooms) {
+            report << "\n  #" << name << "  members=" << room.members.size()
+                   << "  published=" << room.published << "  delivered=" << room.delivered;
+        }
+        logging::info(report.view());
+    }
+
+    // A client that greets us with RelayHello is a relay, and from then on a
+    // link to it; a relay we dialed answers our own greeting the same way.
+    // Only the addresses given with --peer may link, since a link's frames
+    // reach every client. Returns false if the client had to be disconnected.
+    bool on_relay_hello(Client& client, uint64_t id) {
+        if (client.relay != 0 || id == 0) return true;
+        if (!client.link && !is_peer_address(client.address)) {
+            logging::warn(client.address, ":", client.port, " is not a relay given with --peer; refusing to link");
+            return false;
+        }
+        if (!client.link) {
+            while (!client.rooms.empty()) {
+                leave_room(client, std::string(client.rooms.back()));
+            }
+            count_client(false);
+            client.link = true;
+            bool was_empty = false;
+            client.outbox.push(pool_.copy(protocol::encode_relay_hello(relay_id_)), was_empty);
+            if (was_empty) flush_client(client);
+        }
+        if (id == relay_id_) {
+            logging::warn(client.address, ":", client.port, " is this relay itself; not linking to it");
+            if (client.dialed >= 0) peers_[client.dialed].disabled = true;
+            return false;
+        }
+
+        client.relay = id;
+        client.heartbeats = true;   // relays always send them
+        if (client.dialed >= 0) peers_[client.dialed].retry = LINK_RETRY_MIN;
+        auto link = client.shared_from_this();
+        {
+            std::lock_guard<std::mutex> lock(federation_mutex_);
+            auto& links = links_[id];
+            links.push_back(link);
+            client.forwarding = links.size() == 1;
+        }
+        if (client.forwarding) forwarding_links_.fetch_add(1, std::memory_order_relaxed);
+        client.shard->links.push_back(link);
+        send_interest(client);
+        logging::info("Linked to relay ", relay_name(id), " at ", client.address, ":", client.port,
+                      client.forwarding ? "" : " (standing by; already linked)");
+        return true;
+    }
+
+    // Addresses in peers_ are set once at startup, so any shard may read them.
+    bool is_peer_address(const std::string& address) const {
+        in_addr ip{};
+        if (inet_pton(AF_INET, address.c_str(), &ip) != 1) return false;
+        return std::ranges::any_of(peers_, [&](const PeerRelay& peer) {
+            return peer.address.sin_addr.s_addr == ip.s_addr;
+        });
+    }
+
+    // Frames from a linked relay. It sends nothing else that concerns us.
+    bool handle_link_frame(Client& link, const protocol::SharedFrame& frame) {
+        if (link.relay == 0) return true;   // dialed, and has not answered yet
+        if (frame.header.type == protocol::FrameType::Interest) {
+            if (auto interest = protocol::decode_interest(frame.payload())) on_interest(link, *interest);
+        } else if (frame.header.type == protocol::FrameType::Federated) {
+            return receive_federated(link, frame);
+        }
+        return true;
+    }
+
+    // A linked relay's summary. It joins every room it has members in as a
+    // single member, so a room frame reaches it once, and only if wanted.
+    void on_interest(Client& link, const protocol::Interest& interest) {
+        link.remote_clients = interest.clients;
+        std::unordered_set<std::string_view> wanted(interest.rooms.begin(), interest.rooms.end());
+        std::vector<std::string> gone;
+        for (const auto& room : link.rooms) {
+            if (!wanted.contains(room)) gone.push_back(room);
+        }
+        for (const auto& room : gone) leave_room(link, room);
+
+        std::unordered_set<std::string, RoomNameHash, std::equal_to<>> joined(link.rooms.begin(), link.rooms.end());
+        for (std::string_view room : wanted) {
+            if (!joined.contains(room)) enter_room(link, room);
+        }
+    }
+
+    // A frame published on another relay goes to our own clients and into
+    // our history, and is never forwarded again. It is checked and charged
+    // to the link's rate limits like a client's frame, except that a link
+    // over its limit is never disconnected. Returns false if the link had
+    // to be disconnected.
+    bool receive_federated(Client& link, const protocol::SharedFrame& frame) {
+        auto inner = protocol::federated_header(frame.payload());
+        if (!inner || frame.header.sender == relay_id_ || (inner->flags & protocol::FrameFlags::Compressed)) return true;
+        protocol::SharedFrame original{*inner, BufferSlice{frame.raw.buffer, frame.raw.offset + static_cast<uint32_t>(protocol::HEADER_SIZE),
+                                                           frame.raw.length - static_cast<uint32_t>(protocol::HEADER_SIZE)}};
+
+        auto body = protocol::body_of(*inner, original.payload());
+        std::optional<protocol::ChatMessage> chat;
+        std::string_view room;
+        bool valid = false;
+        if (inner->type == protocol::FrameType::Chat) {
+            chat = protocol::decode_chat(body);
+            valid = chat && protocol::well_formed(*chat);
+        } else if (inner->type == protocol::FrameType::RoomChat) {
+            if (auto message = protocol::decode_room_chat(body)) {
+                chat = message->chat;
+                room = message->room;
+                valid = protocol::well_formed(*chat, room);
+            }
+        } else if (inner->type == protocol::FrameType::Sealed) {
+            if (auto sealed = protocol::decode_sealed(original.payload())) {
+                room = sealed->room;
+                valid = room.empty() || text_scan::valid_name(room);
+            }
+        }
+        if (!valid) {
+            reject(link);
+            return true;
+        }
+        if (auto verdict = admit(link, frame, {}, false, room)) return *verdict;
+
+        if (sample_message(link)) {
+            std::string scratch;
+            if (!chat) {
+                logging::info("Relaying sealed message from relay ", relay_name(frame.header.sender),
+                              room.empty() ? "" : " to #", room);
+            } else if (room.empty()) {
+                logging::info("Relaying message from relay ", relay_name(frame.header.sender),
+                              " (", chat->name, "): ", text_scan::strip_controls(chat->text, scratch));
+            } else {
+                logging::info("Relaying message from relay ", relay_name(frame.header.sender), " (",
+                              chat->name, ") to #", room, ": ", text_scan::strip_controls(chat->text, scratch));
             }
         }
-        
-        // Remove client
+        if (log_) log_->append(original.raw.view());
+        broadcast(link, original.raw, compressed_copy(*link.shard, original, {}), {}, track_delivery());
+        return true;
+    }
+
+    // The frame wrapped for linked relays, once for all of them. Empty if no
+    // relay is linked or the frame is too large to wrap.
+    BufferSlice federated_copy(const BufferSlice& frame) {
+        if (forwarding_links_.load(std::memory_order_relaxed) == 0 || frame.size() > protocol::MAX_PAYLOAD) return {};
+        size_t size = protocol::federated_frame_size(frame.view());
+        BufferRef buffer = pool_.acquire(size);
+        protocol::write_federated(buffer->data(), relay_id_, frame.view());
+        return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(size)};
+    }
+
+    // Our summary says whether we have any clients and lists every room with
+    // members on some shard. Both change only when a count crosses zero.
+    void count_client(bool added) {
+        bool crossed = added ? local_clients_.fetch_add(1, std::memory_order_relaxed) == 0
+                             : local_clients_.fetch_sub(1, std::memory_order_relaxed) == 1;
+        if (crossed) interest_version_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Called when a shard's first member joins `room` or its last one leaves.
+    void count_room(std::string_view room, bool added) {
+        std::lock_guard<std::mutex> lock(federation_mutex_);
+        auto it = interest_rooms_.find(room);
+        if (added) {
+            if (it != interest_rooms_.end()) {
+                ++it->second;
+                return;
+            }
+            interest_rooms_.emplace(room, 1);
+        } else {
+            if (it == interest_rooms_.end() || --it->second > 0) return;
+            interest_rooms_.erase(it);
+        }
+        interest_version_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Queues our current summary to a linked relay. It is encoded once per
+    // change, for all links.
+    void send_interest(Client& link) {
+        BufferSlice summary;
         {
-            std::lock_guard<std::mutex> lock(clients_mutex_);
-            clients_.erase(
-                std::remove_if(clients_.begin(), clients_.end(),
-                    [client_socket](const Client& c) { return c.socket_fd == client_socket; }),
-                clients_.end());
+            std::lock_guard<std::mutex> lock(federation_mutex_);
+            uint64_t version = interest_version_.load(std::memory_order_relaxed);
+            if (interest_encoded_ != version) {
+                std::vector<std::string_view> rooms;
+                rooms.reserve(interest_rooms_.size());
+                for (const auto& [room, shards] : interest_rooms_) rooms.push_back(room);
+                interest_ = pool_.copy(protocol::encode_interest(relay_id_, local_clients_.load(std::memory_order_relaxed) > 0, rooms));
+                interest_encoded_ = version;
+            }
+            summary = interest_;
+            link.interest_sent = interest_encoded_;
         }
-        
-        close(client_socket);
-        std::cout << "Client disconnected: " << client_addr << ":" << client_port << std::endl;
+        bool was_empty = false;
+        link.outbox.push(summary, was_empty);
+        if (was_empty) flush_client(link);
     }
-    
+
+    // Runs on every shard every tick: sends the shard's linked relays our
+    // summary if it changed since they last got it.
+    void update_links(Shard& shard) {
+        if (shard.links.empty()) return;
+        uint64_t version = interest_version_.load(std::memory_order_relaxed);
+        for (auto& link : shard.links) {
+            if (link->relay != 0 && link->interest_sent != version) send_interest(*link);
+        }
+        submit(shard);
+    }
+
+    // Runs on shard 0 every second: dials each relay given with --peer that
+    // has no link from us, waiting longer after each failed attempt.
+    void dial_peers(Shard& shard) {
+        auto now = OutboundQueue::Clock::now();
+        for (size_t i = 0; i < peers_.size(); ++i) {
+            PeerRelay& peer = peers_[i];
+            if (peer.dialing || peer.disabled || now < peer.retry_at) continue;
+
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0) {
+                logging::error("Failed to create socket for relay ", peer.name, ": ", strerror(errno));
+                return;
+            }
+            EventLoop::set_nonblocking(fd);
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            if (connect(fd, reinterpret_cast<const sockaddr*>(&peer.address), sizeof(peer.address)) < 0 &&
+                errno != EINPROGRESS) {
+                logging::warn("Could not link to relay ", peer.name, ": ", strerror(errno),
+                              "; retrying in ", peer.retry.count(), "s");
+                close(fd);
+                back_off(peer);
+                continue;
+            }
+
+            auto client = std::make_shared<Client>(pool_, config_.outbound);
+            client->socket_fd = fd;
+            client->address = inet_ntoa(peer.address.sin_addr);
+            client->port = ntohs(peer.address.sin_port);
+            client->shard = &shard;
+            client->link = true;
+            client->dialed = static_cast<int>(i);
+            client->message_limit = TokenBucket(config_.rate.messages);
+            client->byte_limit = TokenBucket(config_.rate.bytes);
+            client->heartbeats = true;   // a relay answers, so silence means it is not one
+            peer.dialing = true;
+            bool was_empty = false;
+            client->outbox.push(pool_.copy(protocol::encode_relay_hello(relay_id_)), was_empty);
+            register_client(client);
+            flush_client(*client);   // goes out once the connection is up
+        }
+        submit(shard);
+    }
+
+    void back_off(PeerRelay& peer) {
+        peer.retry_at = OutboundQueue::Clock::now() + peer.retry;
+        peer.retry = std::min(peer.retry * 2, std::chrono::seconds(LINK_RETRY_MAX));
+    }
+
+    // Runs on the link's shard once it closes. If frames went to that relay
+    // on it, a link standing by takes over on its own shard.
+    void unlink_relay(const std::shared_ptr<Client>& link) {
+        std::erase(link->shard->links, link);
+        if (link->relay != 0) {
+            std::shared_ptr<Client> next;
+            {
+                std::lock_guard<std::mutex> lock(federation_mutex_);
+                auto it = links_.find(link->relay);
+                if (it != links_.end()) {
+                    std::erase(it->second, link);
+                    if (it->second.empty()) {
+                        links_.erase(it);
+                    } else if (link->forwarding) {
+                        next = it->second.front();
+                    }
+                }
+            }
+            if (std::exchange(link->forwarding, false)) forwarding_links_.fetch_sub(1, std::memory_order_relaxed);
+            if (next) {
+                next->shard->loop.post([this, next] {
+                    if (next->closed || next->forwarding) return;
+                    next->forwarding = true;
+                    forwarding_links_.fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+            logging::warn("Lost link to relay ", relay_name(link->relay));
+        }
+        if (link->dialed >= 0) {
+            PeerRelay& peer = peers_[link->dialed];
+            peer.dialing = false;
+            if (peer.disabled) return;
+            if (link->relay == 0) {
+                logging::warn("Could not link to relay ", peer.name, "; retrying in ", peer.retry.count(), "s");
+            }
+            back_off(peer);
+        }
+    }
+
+    static std::string relay_name(uint64_t id) {
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(id));
+        return name;
+    }
+
+    // io_uring: hands everything queued since the last submit to the kernel,
+    // with any receive buffers that earlier found the queue full.
+    static void submit([[maybe_unused]] Shard& shard) {
+#ifdef __linux__
+        if (!shard.ring) return;
+        shard.recv_buffers->resupply();
+        shard.ring->submit();
+#endif
+    }
+
+    // Runs on the client's shard.
+    void disconnect_client(const std::shared_ptr<Client>& client) {
+        if (client->closed) return;
+        client->closed = true;
+
+        std::erase(client->shard->clients, client);
+        Metrics::local().clients.set(static_cast<int64_t>(client->shard->clients.size()));
+        while (!client->rooms.empty()) {
+            leave_room(*client, std::string(client->rooms.back()));
+        }
+        if (client->link) {
+            unlink_relay(client);
+        } else {
+            count_client(false);
+        }
+        if (client->udp != 0) {
+            client->shard->udp->close(client->udp);
+            client->shard->udp_clients.erase(client->udp);
+        }
+        if (client->decompressor) compressing_clients_.fetch_sub(1, std::memory_order_relaxed);
+        client->shard->timers.remove(client->timer);
+#ifdef __linux__
+        if (client->shard->ring) {
+            // Shutting down completes the in-flight recv and send; the fd is
+            // closed from release_if_idle() once they have drained.
+            shutdown(client->socket_fd, SHUT_RDWR);
+            client->shard->retired.push_back(client);
+            release_if_idle(*client->shard, *client);
+            logging::info("Client disconnected: ", client->address, ":", client->port);
+            return;
+        }
+#endif
+        client->shard->loop.remove(client->socket_fd);
+        if (!client->zerocopy_inflight.empty()) abort_zerocopy(*client);
+        close(client->socket_fd);
+        client->zerocopy_inflight.clear();
+        logging::info("Client disconnected: ", client->address, ":", client->port);
+    }
+
 public:
-    RelayServer(int port = DEFAULT_PORT) {
-        server_socket_ = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_socket_ < 0) {
-            throw std::runtime_error("Failed to create socket");
+    explicit RelayServer(const RelayConfig& config) : config_(config) {
+        heartbeat_ = pool_.copy(protocol::encode_heartbeat(0));
+        std::random_device random;
+        relay_id_ = (static_cast<uint64_t>(random()) << 32 | random()) | 1;   // never 0
+        for (const auto& name : config_.peers) {
+            peers_.push_back(PeerRelay{.name = name, .address = resolve(name)});
         }
-        
-        int opt = 1;
-        setsockopt(server_socket_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = htons(port);
-        
-        if (bind(server_socket_, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) < 0) {
-            close(server_socket_);
-            throw std::runtime_error("Failed to bind socket");
+        if (!config_.log.directory.empty() || config_.log.ring_messages > 0) {
+            log_ = std::make_unique<MessageLog>(pool_, config_.log);
         }
-        
-        if (listen(server_socket_, 10) < 0) {
-            close(server_socket_);
-            throw std::runtime_error("Failed to listen on socket");
+
+        size_t count = config_.shards > 0 ? config_.shards
+                                          : std::max(1u, std::thread::hardware_concurrency());
+
+        for (size_t i = 0; i < count; ++i) {
+            auto shard = std::make_unique<Shard>();
+            shard->id = i;
+            if (i == 0 || per_shard_listeners) {
+                try {
+                    shard->listen_fd = open_listener(config_.port);
+                } catch (...) {
+                    close_listeners();
+                    throw;
+                }
+            }
+            if (config_.udp) {
+                try {
+                    shard->udp = std::make_unique<reliable_udp::Endpoint>(pool_, 0, config_.udp_impairment);
+                } catch (...) {
+                    close_listeners();
+                    throw;
+                }
+            }
+            shards_.push_back(std::move(shard));
+        }
+
+        logging::info("Relay server listening on port ", config_.port,
+                      " (", shards_.size(), " shard", (shards_.size() > 1 ? "s" : ""), ")");
+        if (config_.udp) {
+            std::string ports;
+            for (auto& shard : shards_) ports += (ports.empty() ? "" : ", ") + std::to_string(shard->udp->port());
+            logging::info("Datagram transport on UDP port", (shards_.size() > 1 ? "s " : " "), ports,
+                          config_.udp_impairment.active() ? " (simulating loss and delay)" : "");
+        }
+
+        if (!peers_.empty()) {
+            std::string names;
+            for (auto& peer : peers_) names += (names.empty() ? "" : ", ") + peer.name;
+            logging::info("Relay ", relay_name(relay_id_), " linking to ", names);
+        }
+
+        if (config_.metrics_port > 0) {
+            try {
+                exporter_ = std::make_unique<metrics::HttpExporter>(config_.metrics_port, [] { return render_metrics(); });
+            } catch (...) {
+                close_listeners();
+                throw;
+            }
+            logging::info("Metrics at http://127.0.0.1:", config_.metrics_port, "/metrics");
         }
-        
-        std::cout << "Relay server listening on port " << port << std::endl;
     }
-    
+
     ~RelayServer() {
         stop();
     }
-    
+
+    // Shard 0 runs on the calling thread; every other shard gets its own.
     void start() {
         running_ = true;
-        
-        while (running_) {
-            sockaddr_in client_addr{};
-            socklen_t addr_len = sizeof(client_addr);
-            
-            int client_socket = accept(server_socket_, reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
-            if (client_socket < 0) {
-                if (running_) {
-                    std::cerr << "Failed to accept connection" << std::endl;
-                }
-                continue;
+
+#ifdef __linux__
+        bool uring = config_.engine == IoEngine::IoUring && enable_uring();
+#else
+        if (config_.engine == IoEngine::IoUring) {
+            logging::warn("io_uring engine is only available on Linux; using the portable event loop");
+        }
+        bool uring = false;
+#endif
+        logging::info("I/O engine: ", (uring ? "io_uring" : "epoll"));
+
+        for (auto& shard_ptr : shards_) {
+            Shard& shard = *shard_ptr;
+#ifdef __linux__
+            if (shard.ring) {
+                shard.loop.add(shard.ring->fd(), EventLoop::READABLE, [this, &shard](uint32_t) { process_completions(shard); });
+                if (shard.listen_fd >= 0) uring_arm_accept(shard);
+                shard.ring->submit();
+            } else
+#endif
+            if (shard.listen_fd >= 0) {
+                shard.loop.add(shard.listen_fd, EventLoop::READABLE, [this, &shard](uint32_t) { accept_clients(shard); });
+            }
+            shard.loop.on_wakeup([this, &shard] { drain_mailbox(shard); });
+            shard.parked.resize(shards_.size());
+            shard.retry_timer = shard.loop.add_timer([this, &shard] { flush_parked(shard); });
+            if (shard.udp) {
+                shard.loop.add(shard.udp->fd(), EventLoop::READABLE, [this, &shard](uint32_t) { receive_datagrams(shard); });
+                auto tick = shard.loop.add_timer([&shard] { shard.udp->tick(); });
+                shard.udp->on_deadline([&loop = shard.loop, tick](auto when) { loop.arm_timer(tick, when); });
+            }
+            shard.loop.run_every(TIMER_TICK, [this, &shard] { run_timers(shard); });
+            shard.loop.run_every(TIMER_TICK, [this, &shard] { update_links(shard); });
+            if (shard.id == 0 && !peers_.empty()) {
+                shard.loop.post([this, &shard] { dial_peers(shard); });
+                shard.loop.run_every(std::chrono::seconds(1), [this, &shard] { dial_peers(shard); });
+            }
+            shard.loop.run_every(std::chrono::seconds(1), [this, &shard] { sample_queues(shard); });
+            if (log_ && shard.id == 0 && config_.log.retention_age.count() > 0) {
+                shard.loop.run_every(std::chrono::minutes(1), [this] { log_->enforce_retention(); });
+            }
+            if (config_.stats_interval.count() > 0) {
+                shard.loop.run_every(config_.stats_interval, [this, &shard] { print_stats(shard); });
             }
-            
-            std::string client_ip = inet_ntoa(client_addr.sin_addr);
-            int client_port = ntohs(client_addr.sin_port);
-            
-            std::thread(&RelayServer::handle_client, this, client_socket, client_ip, client_port).detach();
+            if (shard.id == 0 && config_.metrics_interval.count() > 0) {
+                shard.loop.run_every(config_.metrics_interval, [] { log_metrics(); });
+            }
+        }
+
+        for (size_t i = 1; i < shards_.size(); ++i) {
+            shards_[i]->thread = std::thread([shard = shards_[i].get()] { shard->loop.run(); });
         }
+
+        shards_[0]->loop.run();
     }
-    
+
     void stop() {
         running_ = false;
-        if (server_socket_ >= 0) {
-            close(server_socket_);
-            server_socket_ = -1;
+        exporter_.reset();
+        for (auto& shard : shards_) {
+            shard->loop.stop();
         }
-        
-        std::lock_guard<std::mutex> lock(clients_mutex_);
-        for (auto& client : clients_) {
-            close(client.socket_fd);
+        for (auto& shard : shards_) {
+            if (shard->thread.joinable()) shard->thread.join();
+        }
+
+        close_listeners();
+
+        for (auto& shard : shards_) {
+            for (auto& client : shard->clients) {
+                client->closed = true;
+                if (client->socket_fd >= 0) close(client->socket_fd);
+            }
+            shard->clients.clear();
+            shard->links.clear();
+            shard->rooms.clear();
+            shard->udp_clients.clear();
+#ifdef __linux__
+            for (auto& client : shard->retired) {
+                if (client->socket_fd >= 0) close(client->socket_fd);
+            }
+            shard->retired.clear();
+#endif
+        }
+        std::lock_guard<std::mutex> lock(federation_mutex_);
+        links_.clear();
+    }
+
+private:
+    // Resolves a --peer address given as host:port.
+    static sockaddr_in resolve(const std::string& name) {
+        size_t colon = name.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == name.size()) {
+            throw std::runtime_error("Expected host:port for relay " + name);
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(name.substr(0, colon).c_str(), name.substr(colon + 1).c_str(), &hints, &found) != 0 || !found) {
+            throw std::runtime_error("Cannot resolve relay " + name);
+        }
+        sockaddr_in address = *reinterpret_cast<const sockaddr_in*>(found->ai_addr);
+        freeaddrinfo(found);
+        return address;
+    }
+
+    void close_listeners() {
+        for (auto& shard : shards_) {
+            if (shard->listen_fd >= 0) {
+                close(shard->listen_fd);
+                shard->listen_fd = -1;
+            }
         }
-        clients_.clear();
     }
 };
 
 int main(int argc, char* argv[]) {
-    int port = 8888;
-    
-    if (argc >= 2) {
-        port = std::stoi(argv[1]);
+    RelayConfig config;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--shards" && has_value) {
+                config.shards = std::stoul(argv[++i]);
+            } else if (arg == "--max-queue-bytes" && has_value) {
+                config.outbound.max_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--max-lag-ms" && has_value) {
+                config.outbound.max_lag = std::chrono::milliseconds(std::stol(argv[++i]));
+            } else if (arg == "--slow-policy" && has_value) {
+                auto policy = parse_slow_consumer_policy(argv[++i]);
+                if (!policy) {
+                    logging::error("Unknown slow consumer policy: ", argv[i],
+                                   " (expected drop-oldest, drop-newest or disconnect)");
+                    return 1;
+                }
+                config.outbound.policy = *policy;
+            } else if (arg == "--engine" && has_value) {
+                std::string engine = argv[++i];
+                if (engine == "epoll") {
+                    config.engine = IoEngine::Epoll;
+                } else if (engine == "io_uring" || engine == "uring") {
+                    config.engine = IoEngine::IoUring;
+                } else {
+                    logging::error("Unknown I/O engine: ", engine, " (expected epoll or io_uring)");
+                    return 1;
+                }
+            } else if (arg == "--zerocopy-threshold" && has_value) {
+                config.zerocopy_threshold = std::stoul(argv[++i]);
+            } else if (arg == "--log-dir" && has_value) {
+                config.log.directory = argv[++i];
+            } else if (arg == "--log-segment-mb" && has_value) {
+                config.log.segment_bytes = std::stoul(argv[++i]) * 1024 * 1024;
+            } else if (arg == "--log-retention-mb" && has_value) {
+                config.log.retention_bytes = std::stoul(argv[++i]) * 1024 * 1024;
+            } else if (arg == "--log-retention-hours" && has_value) {
+                config.log.retention_age = std::chrono::hours(std::stol(argv[++i]));
+            } else if (arg == "--history" && has_value) {
+                config.log.ring_messages = std::stoul(argv[++i]);
+            } else if (arg == "--log-level" && has_value) {
+                auto level = logging::parse_level(argv[++i]);
+                if (!level) {
+                    logging::error("Unknown log level: ", argv[i], " (expected debug, info, warn, error or off)");
+                    return 1;
+                }
+                logging::Logger::instance().set_level(*level);
+            } else if (arg == "--log-sample" && has_value) {
+                config.log_sample = std::stoull(argv[++i]);
+            } else if (arg == "--metrics-port" && has_value) {
+                config.metrics_port = std::stoi(argv[++i]);
+            } else if (arg == "--metrics-interval" && has_value) {
+                config.metrics_interval = std::chrono::seconds(std::stol(argv[++i]));
+            } else if (arg == "--udp") {
+                config.udp = true;
+            } else if (arg == "--udp-unordered") {
+                config.udp_unordered = true;
+            } else if (arg == "--udp-loss" && has_value) {
+                config.udp_impairment.loss = std::clamp(std::stod(argv[++i]), 0.0, 100.0) / 100;
+            } else if (arg == "--udp-delay-ms" && has_value) {
+                config.udp_impairment.delay = std::chrono::milliseconds(std::max(std::stol(argv[++i]), 0L));
+            } else if (arg == "--compress") {
+                config.compress = true;
+            } else if (arg == "--heartbeat-interval" && has_value) {
+                config.heartbeat_interval = std::chrono::seconds(std::max(std::stol(argv[++i]), 0L));
+            } else if (arg == "--idle-timeout" && has_value) {
+                config.idle_timeout = std::chrono::seconds(std::max(std::stol(argv[++i]), 0L));
+            } else if (arg == "--stall-timeout" && has_value) {
+                config.stall_timeout = std::chrono::seconds(std::max(std::stol(argv[++i]), 0L));
+            } else if (arg == "--msg-rate" && has_value) {
+                config.rate.messages.rate = std::stod(argv[++i]);
+            } else if (arg == "--msg-burst" && has_value) {
+                config.rate.messages.burst = std::stod(argv[++i]);
+            } else if (arg == "--byte-rate" && has_value) {
+                config.rate.bytes.rate = std::stod(argv[++i]);
+            } else if (arg == "--byte-burst" && has_value) {
+                config.rate.bytes.burst = std::stod(argv[++i]);
+            } else if (arg == "--room-rate" && has_value) {
+                config.rate.room_messages.rate = std::stod(argv[++i]);
+            } else if (arg == "--room-burst" && has_value) {
+                config.rate.room_messages.burst = std::stod(argv[++i]);
+            } else if (arg == "--rate-policy" && has_value) {
+                auto policy = parse_rate_limit_policy(argv[++i]);
+                if (!policy) {
+                    logging::error("Unknown rate limit policy: ", argv[i], " (expected delay, drop or disconnect)");
+                    return 1;
+                }
+                config.rate.policy = *policy;
+            } else if (arg == "--peer" && has_value) {
+                config.peers.emplace_back(argv[++i]);
+            } else if (arg == "--stats-interval" && has_value) {
+                config.stats_interval = std::chrono::seconds(std::stol(argv[++i]));
+            } else {
+                config.port = std::stoi(arg);
+            }
+        }
+    } catch (const std::exception&) {
+        logging::error("Invalid argument");
+        return 1;
     }
-    
+
+    std::signal(SIGPIPE, SIG_IGN);
+
     try {
-        RelayServer server(port);
-        
-        std::cout << "Simple P2P Chat Relay Server" << std::endl;
-        std::cout << "Clients can connect to this server and chat through it" << std::endl;
-        std::cout << "Press Ctrl+C to stop" << std::endl;
-        
+        RelayServer server(config);
+
+        logging::info("Simple P2P Chat Relay Server");
+        logging::info("Clients can connect to this server and chat through it");
+        logging::info("Press Ctrl+C to stop");
+
         server.start();
     } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
+        logging::error("Error: ", e.what());
         return 1;
     }
-    
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,841 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "buffer_pool.hpp"
+#include "event_loop.hpp"
+#include "protocol.hpp"
+
+// Reliable datagram transport for peer links, used next to the TCP connection
+// for frames small enough to fit in one datagram. Over TCP one lost segment
+// holds back every byte behind it; here a loss only delays frames that must
+// be delivered after the ones it carried. Frames are ordered within a stream
+// (one per sender, hashed) and independent across streams; UNORDERED frames
+// are handed over the moment they arrive.
+//
+// Every datagram names a session by the token its receiver chose; tokens are
+// exchanged over the TCP link (protocol::UdpOffer). The kinds of datagram,
+// big-endian like the frame protocol:
+//
+//   Data                                 Ack
+//   offset  size  field                  offset  size  field
+//   0       1     kind (1)               0       1     kind (2)
+//   1       1     record count n         1       1     range count n
+//   2       2     reserved               2       2     reserved
+//   4       4     token                  4       4     token
+//   8       8     packet number          8       16n   n (first, last) packet
+//   16      ...   n records                            ranges, newest first
+//
+//   Record
+//   0       1     stream
+//   1       4     order within the stream
+//   5       8     message number
+//   13      ...   one protocol frame
+//
+//   Challenge, Response
+//   0       1     kind (3, 4)
+//   1       3     reserved
+//   4       4     token
+//   8       8     nonce
+//
+// A session only takes datagrams from its peer's address. One from anywhere
+// else is dropped and that address is sent a Challenge; the session moves
+// there once the peer echoes the nonce from it in a Response, so a stray or
+// forged datagram cannot redirect a session. Now and then the sender skips
+// a packet number, and an acknowledgement that names a skipped one cannot
+// have come from the peer and is ignored.
+//
+// Frames waiting for the congestion window are packed into as few datagrams
+// as fit, so a burst of small messages costs a few datagrams rather than one
+// each. Packet numbers are never reused: the frames of a lost datagram are
+// sent again under a new one, so every acknowledgement gives an unambiguous
+// RTT sample. Message numbers identify a frame and let the receiver drop
+// duplicates.
+// Loss is detected from the acknowledgements (a packet three behind the
+// newest acknowledged one, or older than 9/8 RTT) and, when acknowledgements
+// stop, by a probe timeout of SRTT + 4 RTTVAR with exponential backoff. The
+// congestion window grows like NewReno and shrinks to 0.7 of itself once per
+// round trip with losses; sends are paced at 1.25 windows per SRTT.
+//
+// Not thread-safe: the owner serialises every call, and drives the timers by
+// calling tick() when the endpoint asks for it through on_deadline(). That
+// is at most every TICK while frames wait for pacing, and otherwise only
+// when a packet in flight could be declared lost or the probe timeout
+// expires; an idle endpoint asks for nothing.
+namespace reliable_udp {
+
+constexpr size_t MAX_DATAGRAM = 1200;   // below any path MTU worth worrying about
+constexpr size_t DATA_HEADER_SIZE = 16;
+constexpr size_t RECORD_HEADER_SIZE = 13;
+constexpr size_t ACK_HEADER_SIZE = 8;
+constexpr size_t CHALLENGE_SIZE = 16;
+constexpr size_t MAX_FRAME = MAX_DATAGRAM - DATA_HEADER_SIZE - RECORD_HEADER_SIZE;   // larger frames stay on TCP
+constexpr uint8_t STREAMS = 64;
+constexpr uint8_t UNORDERED = 0xff;
+constexpr auto TICK = std::chrono::milliseconds(1);
+
+enum class Kind : uint8_t { Data = 1, Ack = 2, Challenge = 3, Response = 4 };
+
+// The stream a sender's frames travel on: each sender's frames stay in order,
+// and different senders rarely wait for each other.
+inline uint8_t stream_for(uint64_t sender) {
+    return static_cast<uint8_t>(sender % STREAMS);
+}
+
+// Simulated bad network, applied to every datagram the endpoint sends, for
+// testing over loopback where the real link never loses anything.
+struct Impairment {
+    double loss = 0;                       // fraction of datagrams dropped
+    std::chrono::milliseconds delay{0};    // added to every datagram
+
+    bool active() const { return loss > 0 || delay.count() > 0; }
+};
+
+struct SessionStats {
+    std::chrono::microseconds srtt{0};
+    size_t window = 0;            // congestion window, bytes
+    size_t in_flight = 0;         // bytes sent and not yet acknowledged or lost
+    size_t backlog = 0;           // frame bytes waiting for the window
+    uint64_t sent = 0;            // frames sent, retransmissions included
+    uint64_t retransmitted = 0;
+};
+
+// A frame received on `session`, sliced from the datagram's pooled buffer.
+struct Received {
+    uint32_t session = 0;
+    protocol::SharedFrame frame;
+};
+
+class Endpoint {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Binds a UDP socket to `port` on every interface; 0 picks a free one.
+    Endpoint(BufferPool& pool, uint16_t port, const Impairment& impairment = {})
+        : pool_(pool), impairment_(impairment) {
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) throw std::runtime_error(std::string("Failed to create UDP socket: ") + strerror(errno));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        socklen_t len = sizeof(addr);
+        if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+            std::string error = strerror(errno);
+            ::close(fd_);
+            throw std::runtime_error("Failed to bind UDP port " + std::to_string(port) + ": " + error);
+        }
+        port_ = ntohs(addr.sin_port);
+
+        int buffer = SOCKET_BUFFER;
+        setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        EventLoop::set_nonblocking(fd_);
+    }
+
+    Endpoint(const Endpoint&) = delete;
+    Endpoint& operator=(const Endpoint&) = delete;
+
+    ~Endpoint() {
+        ::close(fd_);
+    }
+
+    int fd() const { return fd_; }
+    uint16_t port() const { return port_; }
+
+    // `arm(when)` is called whenever tick() is needed by `when` and no
+    // earlier call asked for it sooner; the owner then calls tick() at or
+    // after that time. Called from whichever call made the deadline.
+    void on_deadline(std::function<void(Clock::time_point)> arm) {
+        arm_ = std::move(arm);
+    }
+
+    // Creates a session and returns its token, for the peer to put in every
+    // datagram it sends. Nothing is sent until connect().
+    uint32_t open() {
+        uint32_t token;
+        do {
+            token = static_cast<uint32_t>(rng_());
+        } while (token == 0 || sessions_.contains(token));
+        sessions_[token].token = token;
+        return token;
+    }
+
+    // Points the session at the peer, which answered with its own token. A
+    // first datagram goes out at once so the peer learns our address even
+    // through a NAT; if it arrives from elsewhere than the peer was told,
+    // the peer challenges that address and moves the session there.
+    void connect(uint32_t token, const sockaddr_in& remote, uint32_t remote_token) {
+        auto it = sessions_.find(token);
+        if (it == sessions_.end() || remote_token == 0) return;
+        it->second.remote = remote;
+        it->second.remote_token = remote_token;
+        send_ack(it->second, Clock::now());
+    }
+
+    void close(uint32_t token) {
+        sessions_.erase(token);   // the active list notices on the next tick
+    }
+
+    bool ready(uint32_t token) const {
+        auto it = sessions_.find(token);
+        return it != sessions_.end() && it->second.remote_token != 0;
+    }
+
+    // Queues `frame`, at most MAX_FRAME bytes, and sends it if the congestion
+    // window and pacing allow. Returns false if the session is not connected
+    // or too far behind to take more.
+    bool send(uint32_t token, const BufferSlice& frame, uint8_t stream) {
+        auto it = sessions_.find(token);
+        if (it == sessions_.end() || it->second.remote_token == 0 || frame.size() > MAX_FRAME) return false;
+        Session& s = it->second;
+        if (s.backlog_bytes + s.in_flight + frame.size() > MAX_BACKLOG) return false;
+
+        Outgoing message{frame, s.next_message++, 0, stream < STREAMS ? stream : UNORDERED};
+        if (message.stream != UNORDERED) message.order = s.next_order[message.stream]++;
+        s.backlog.push_back(std::move(message));
+        s.backlog_bytes += frame.size();
+        pump(s, Clock::now());
+        return true;
+    }
+
+    // Reads every waiting datagram, appending the frames now deliverable to
+    // `out`, and answers with acknowledgements. Call when fd() is readable.
+    void receive(std::vector<Received>& out) {
+        auto now = Clock::now();
+        while (true) {
+            if (!rx_ || rx_->use_count() > 1) rx_ = pool_.acquire(MAX_DATAGRAM);
+            sockaddr_in from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = recvfrom(fd_, rx_->data(), rx_->capacity(), 0, reinterpret_cast<sockaddr*>(&from), &len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) break;
+            if (static_cast<size_t>(n) > MAX_DATAGRAM) continue;
+            on_datagram(BufferSlice{rx_, 0, static_cast<uint32_t>(n)}, from, now, out);
+        }
+
+        for (uint32_t token : touched_) {
+            auto it = sessions_.find(token);
+            if (it == sessions_.end()) continue;
+            Session& s = it->second;
+            s.touched = false;
+            if (s.ack_due) send_ack(s, now);
+            pump(s, now);
+        }
+        touched_.clear();
+    }
+
+    // Retransmits what was lost, sends what pacing held back and releases
+    // delayed datagrams. Only sessions with data outstanding are visited.
+    void tick() {
+        auto now = Clock::now();
+        wanted_ = Clock::time_point::max();
+        while (!delayed_.empty() && delayed_.front().due <= now) {
+            auto& datagram = delayed_.front();
+            iovec iov{const_cast<char*>(datagram.bytes.data()), datagram.bytes.size()};
+            send_datagram(datagram.to, &iov, 1);
+            delayed_.pop_front();
+        }
+        if (!delayed_.empty()) want_tick(delayed_.front().due);
+
+        for (size_t i = 0; i < active_.size();) {
+            auto it = sessions_.find(active_[i]);
+            if (it != sessions_.end() && check_timers(it->second, now)) {
+                ++i;
+                continue;
+            }
+            if (it != sessions_.end()) it->second.active = false;
+            active_[i] = active_.back();
+            active_.pop_back();
+        }
+    }
+
+    std::optional<SessionStats> stats(uint32_t token) const {
+        auto it = sessions_.find(token);
+        if (it == sessions_.end()) return std::nullopt;
+        const Session& s = it->second;
+        return SessionStats{
+            .srtt = std::chrono::duration_cast<std::chrono::microseconds>(s.srtt),
+            .window = s.cwnd,
+            .in_flight = s.in_flight,
+            .backlog = s.backlog_bytes,
+            .sent = s.sent_frames,
+            .retransmitted = s.retransmitted
+        };
+    }
+
+private:
+    static constexpr int SOCKET_BUFFER = 1024 * 1024;
+    static constexpr size_t MAX_BACKLOG = 4 * 1024 * 1024;     // frame bytes queued or in flight per session
+    static constexpr size_t INITIAL_WINDOW = 10 * MAX_DATAGRAM;
+    static constexpr size_t MIN_WINDOW = 2 * MAX_DATAGRAM;
+    static constexpr size_t MAX_ACK_RANGES = 16;
+    static constexpr size_t MAX_RANGES = 64;      // received packet ranges remembered for acknowledgements
+    static constexpr size_t MAX_HELD = 4096;      // frames waiting for an earlier one in their stream
+    static constexpr uint64_t MAX_AHEAD = 65536;  // messages taken beyond the first one still missing
+    static constexpr uint32_t SKIP_EVERY = 128;   // on average, one packet number in this many is skipped
+    static constexpr size_t MAX_RECORDS = 255;
+    static constexpr size_t MAX_SPARE = 256;
+    static constexpr uint64_t PACKET_THRESHOLD = 3;
+    static constexpr int MAX_BACKOFF = 6;         // probe timeout doubles at most this many times
+    static constexpr double LOSS_REDUCTION = 0.7;  // window kept after a loss, as in CUBIC
+    static constexpr double PACING_GAIN = 1.25;
+    static constexpr auto INITIAL_RTT = std::chrono::milliseconds(50);
+    static constexpr auto GRANULARITY = std::chrono::milliseconds(1);
+
+    struct Outgoing {
+        BufferSlice frame;
+        uint64_t message = 0;
+        uint32_t order = 0;
+        uint8_t stream = UNORDERED;
+    };
+
+    struct Sent {
+        std::vector<Outgoing> messages;
+        Clock::time_point time;
+        uint32_t bytes = 0;   // datagram size
+        bool done = false;    // acknowledged or declared lost
+    };
+
+    struct Session {
+        uint32_t token = 0;
+        uint32_t remote_token = 0;   // 0 until connect()
+        sockaddr_in remote{};
+
+        // Sending. `sent` holds every packet from `first_packet` on, so a
+        // packet number indexes it directly.
+        std::deque<Outgoing> backlog;
+        size_t backlog_bytes = 0;
+        std::deque<Sent> sent;
+        uint64_t first_packet = 1;
+        uint64_t next_packet = 1;
+        uint64_t next_message = 0;
+        std::array<uint32_t, STREAMS> next_order{};
+        uint64_t largest_acked = 0;
+        size_t in_flight = 0;
+        size_t cwnd = INITIAL_WINDOW;
+        size_t ssthresh = SIZE_MAX;
+        Clock::time_point recovery_start{};   // losses of packets sent before this were already counted
+        Clock::duration srtt = INITIAL_RTT;
+        Clock::duration rttvar = INITIAL_RTT / 2;
+        Clock::duration latest_rtt = INITIAL_RTT;
+        bool has_rtt = false;
+        Clock::time_point last_sent{};
+        int pto_count = 0;
+        bool probe = false;   // the next datagram may exceed the window
+        double credit = INITIAL_WINDOW;   // pacing allowance in bytes
+        Clock::time_point credit_at{};
+        uint64_t sent_frames = 0;
+        uint64_t retransmitted = 0;
+        std::set<uint64_t> skipped;   // packet numbers never sent, from `first_packet` on
+        bool active = false;    // listed in active_
+        bool touched = false;   // listed in touched_
+
+        // Path validation
+        sockaddr_in challenged{};
+        uint64_t challenge = 0;                  // nonce sent to `challenged`; 0 if none is outstanding
+        Clock::time_point challenged_at{};
+
+        // Receiving
+        std::map<uint64_t, uint64_t> received;   // packet ranges, first -> last
+        bool ack_due = false;
+        uint64_t delivered_floor = 0;            // every message below this arrived
+        std::set<uint64_t> delivered_above;      // fewer than MAX_AHEAD past the floor
+        std::array<uint32_t, STREAMS> expected_order{};
+        std::map<std::pair<uint8_t, uint32_t>, protocol::SharedFrame> held;
+    };
+
+    struct Delayed {
+        Clock::time_point due;
+        sockaddr_in to;
+        BufferSlice bytes;
+    };
+
+    BufferPool& pool_;
+    Impairment impairment_;
+    int fd_ = -1;
+    uint16_t port_ = 0;
+    std::unordered_map<uint32_t, Session> sessions_;
+    std::vector<uint32_t> active_;    // sessions with data queued or in flight
+    std::vector<uint32_t> touched_;   // sessions that received datagrams in this receive()
+    std::vector<Outgoing> lost_;      // scratch for detect_lost()
+    std::vector<std::vector<Outgoing>> spare_;   // emptied Sent::messages, reused
+    std::deque<Delayed> delayed_;
+    std::function<void(Clock::time_point)> arm_;
+    Clock::time_point wanted_ = Clock::time_point::max();   // earliest tick() asked of arm_
+    BufferRef rx_;
+    std::minstd_rand rng_{std::random_device{}()};
+    std::random_device entropy_;   // challenge nonces, which must not be guessable
+    std::uniform_real_distribution<double> chance_{0.0, 1.0};
+
+    void on_datagram(const BufferSlice& datagram, const sockaddr_in& from, Clock::time_point now,
+                     std::vector<Received>& out) {
+        const char* p = datagram.data();
+        if (datagram.size() < ACK_HEADER_SIZE) return;
+        auto it = sessions_.find(protocol::detail::get_u32(p + 4));
+        if (it == sessions_.end() || it->second.remote_token == 0) return;
+        Session& s = it->second;
+
+        auto kind = static_cast<Kind>(p[0]);
+        if (kind == Kind::Challenge || kind == Kind::Response) {
+            if (datagram.size() == CHALLENGE_SIZE) on_challenge(s, kind, protocol::detail::get_u64(p + 8), from, now);
+            return;
+        }
+        if (!same_address(from, s.remote)) {
+            challenge(s, from, now);
+            return;
+        }
+
+        switch (kind) {
+        case Kind::Data:
+            if (datagram.size() < DATA_HEADER_SIZE) return;
+            on_data(s, datagram, out);
+            break;
+        case Kind::Ack: {
+            size_t count = static_cast<uint8_t>(p[1]);
+            if (datagram.size() != ACK_HEADER_SIZE + 16 * count) return;
+            on_ack(s, p + ACK_HEADER_SIZE, count, now);
+            break;
+        }
+        default:
+            return;
+        }
+
+        if (!s.touched) {
+            s.touched = true;
+            touched_.push_back(s.token);
+        }
+    }
+
+    static bool same_address(const sockaddr_in& a, const sockaddr_in& b) {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    // Asks `from` to prove it is the peer, at most once per probe timeout
+    // without backoff, as what was sent to the old address may have backed
+    // that off a long way.
+    void challenge(Session& s, const sockaddr_in& from, Clock::time_point now) {
+        if (s.challenge != 0 && now - s.challenged_at < s.srtt + std::max<Clock::duration>(4 * s.rttvar, GRANULARITY)) {
+            return;
+        }
+        do {
+            s.challenge = static_cast<uint64_t>(entropy_()) << 32 | entropy_();
+        } while (s.challenge == 0);
+        s.challenged = from;
+        s.challenged_at = now;
+        send_challenge(s, Kind::Challenge, s.challenge, from, now);
+    }
+
+    // A Challenge is answered where it came from, without moving the
+    // session; a Response moves it if it echoes our nonce from the address
+    // that was challenged. Whatever was sent to the old address is probed
+    // for again without waiting out a backed-off timeout.
+    void on_challenge(Session& s, Kind kind, uint64_t nonce, const sockaddr_in& from, Clock::time_point now) {
+        if (kind == Kind::Challenge) {
+            send_challenge(s, Kind::Response, nonce, from, now);
+        } else if (s.challenge != 0 && nonce == s.challenge && same_address(from, s.challenged)) {
+            s.remote = from;
+            s.challenge = 0;
+            s.pto_count = 0;
+            if (s.in_flight > 0) want_tick(now);
+        }
+    }
+
+    void send_challenge(const Session& s, Kind kind, uint64_t nonce, const sockaddr_in& to, Clock::time_point now) {
+        char datagram[CHALLENGE_SIZE];
+        datagram[0] = static_cast<char>(kind);
+        datagram[1] = 0;
+        protocol::detail::put_u16(datagram + 2, 0);
+        protocol::detail::put_u32(datagram + 4, s.remote_token);
+        protocol::detail::put_u64(datagram + 8, nonce);
+        iovec iov{datagram, sizeof(datagram)};
+        transmit(to, &iov, 1, now);
+    }
+
+    void on_data(Session& s, const BufferSlice& datagram, std::vector<Received>& out) {
+        const char* p = datagram.data();
+        uint64_t packet = protocol::detail::get_u64(p + 8);
+        s.ack_due = true;
+        if (has_packet(s, packet)) return;   // a repeat: acknowledge it again, deliver nothing
+
+        // A malformed record ends the datagram; it is acknowledged all the
+        // same, since sending it again would not help.
+        bool stored = true;
+        size_t offset = DATA_HEADER_SIZE;
+        for (size_t i = 0, count = static_cast<uint8_t>(p[1]); i < count; ++i) {
+            size_t left = datagram.size() - offset;
+            if (left < RECORD_HEADER_SIZE + protocol::HEADER_SIZE) break;
+            const char* record = p + offset;
+            auto header = protocol::read_header(record + RECORD_HEADER_SIZE);
+            if (header.version != protocol::PROTOCOL_VERSION ||
+                header.length > left - RECORD_HEADER_SIZE - protocol::HEADER_SIZE) break;
+
+            size_t size = protocol::HEADER_SIZE + header.length;
+            protocol::SharedFrame frame{header, BufferSlice{datagram.buffer,
+                static_cast<uint32_t>(datagram.offset + offset + RECORD_HEADER_SIZE), static_cast<uint32_t>(size)}};
+            stored &= accept_frame(s, protocol::detail::get_u64(record + 5), static_cast<uint8_t>(record[0]),
+                                   protocol::detail::get_u32(record + 1), std::move(frame), out);
+            offset += RECORD_HEADER_SIZE + size;
+        }
+        // Not acknowledged if a frame found no room to wait; it comes again.
+        if (stored) record_packet(s, packet);
+    }
+
+    // Delivers the frame, with any that were waiting for it, or holds it
+    // until the frames before it in its stream arrive. Returns false if it
+    // had to be dropped.
+    bool accept_frame(Session& s, uint64_t message, uint8_t stream, uint32_t order,
+                      protocol::SharedFrame frame, std::vector<Received>& out) {
+        if (!first_arrival(s, message)) return true;
+        // Too far past a gap to remember; it comes again once the gap fills.
+        if (message - s.delivered_floor >= MAX_AHEAD) return false;
+        if (stream < STREAMS) {
+            auto ahead = static_cast<int32_t>(order - s.expected_order[stream]);
+            if (ahead > 0) {
+                if (s.held.size() >= MAX_HELD) return false;
+                s.held.emplace(std::pair{stream, order}, std::move(frame));
+            } else if (ahead == 0) {
+                out.push_back({s.token, std::move(frame)});
+                auto next = s.held.end();
+                while ((next = s.held.find({stream, ++s.expected_order[stream]})) != s.held.end()) {
+                    out.push_back({s.token, std::move(next->second)});
+                    s.held.erase(next);
+                }
+            }
+        } else {
+            out.push_back({s.token, std::move(frame)});
+        }
+        mark_arrived(s, message);
+        return true;
+    }
+
+    static bool first_arrival(const Session& s, uint64_t message) {
+        return message >= s.delivered_floor && !s.delivered_above.contains(message);
+    }
+
+    static void mark_arrived(Session& s, uint64_t message) {
+        if (!first_arrival(s, message)) return;
+        s.delivered_above.insert(message);
+        while (!s.delivered_above.empty() && *s.delivered_above.begin() == s.delivered_floor) {
+            s.delivered_above.erase(s.delivered_above.begin());
+            ++s.delivered_floor;
+        }
+    }
+
+    static bool has_packet(const Session& s, uint64_t packet) {
+        auto it = s.received.upper_bound(packet);
+        return it != s.received.begin() && std::prev(it)->second >= packet;
+    }
+
+    // Adds `packet` to the received ranges, merging neighbours. Only the
+    // newest ranges are kept; older ones were acknowledged many times over.
+    static void record_packet(Session& s, uint64_t packet) {
+        auto next = s.received.upper_bound(packet);
+        bool joins_next = next != s.received.end() && next->first == packet + 1;
+        if (next != s.received.begin()) {
+            auto prev = std::prev(next);
+            if (prev->second >= packet) return;
+            if (prev->second + 1 == packet) {
+                prev->second = joins_next ? next->second : packet;
+                if (joins_next) s.received.erase(next);
+                return;
+            }
+        }
+        uint64_t last = packet;
+        if (joins_next) {
+            last = next->second;
+            s.received.erase(next);
+        }
+        s.received.emplace(packet, last);
+        if (s.received.size() > MAX_RANGES) s.received.erase(s.received.begin());
+    }
+
+    void send_ack(Session& s, Clock::time_point now) {
+        char ack[ACK_HEADER_SIZE + 16 * MAX_ACK_RANGES];
+        size_t count = 0;
+        for (auto it = s.received.rbegin(); it != s.received.rend() && count < MAX_ACK_RANGES; ++it, ++count) {
+            protocol::detail::put_u64(ack + ACK_HEADER_SIZE + 16 * count, it->first);
+            protocol::detail::put_u64(ack + ACK_HEADER_SIZE + 16 * count + 8, it->second);
+        }
+        ack[0] = static_cast<char>(Kind::Ack);
+        ack[1] = static_cast<char>(count);
+        protocol::detail::put_u16(ack + 2, 0);
+        protocol::detail::put_u32(ack + 4, s.remote_token);
+        iovec iov{ack, ACK_HEADER_SIZE + 16 * count};
+        transmit(s.remote, &iov, 1, now);
+        s.ack_due = false;
+    }
+
+    void on_ack(Session& s, const char* ranges, size_t count, Clock::time_point now) {
+        if (count == 0) return;   // a connect() greeting
+        uint64_t largest = protocol::detail::get_u64(ranges + 8);
+        if (largest >= s.next_packet) return;
+        for (size_t i = 0; i < count; ++i) {
+            auto skipped = s.skipped.lower_bound(protocol::detail::get_u64(ranges + 16 * i));
+            if (skipped != s.skipped.end() && *skipped <= protocol::detail::get_u64(ranges + 16 * i + 8)) return;
+        }
+
+        size_t acked_bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t first = std::max(protocol::detail::get_u64(ranges + 16 * i), s.first_packet);
+            uint64_t last = std::min(protocol::detail::get_u64(ranges + 16 * i + 8), s.next_packet - 1);
+            for (uint64_t packet = first; packet <= last && first <= last; ++packet) {
+                Sent& sent = s.sent[packet - s.first_packet];
+                if (sent.done) continue;
+                sent.done = true;
+                s.in_flight -= sent.bytes;
+                if (packet == largest) update_rtt(s, now - sent.time);
+                if (sent.time > s.recovery_start) acked_bytes += sent.bytes;
+                recycle(sent.messages);
+            }
+        }
+
+        // Only a window that is actually in use may grow.
+        if (acked_bytes > 0 && s.in_flight + acked_bytes >= s.cwnd / 2) {
+            s.cwnd += s.cwnd < s.ssthresh ? acked_bytes : std::max<size_t>(1, MAX_DATAGRAM * acked_bytes / s.cwnd);
+        }
+        s.largest_acked = std::max(s.largest_acked, largest);
+        s.pto_count = 0;
+        detect_lost(s, now);
+        retire_sent(s);
+    }
+
+    static void update_rtt(Session& s, Clock::duration sample) {
+        s.latest_rtt = sample;
+        if (!s.has_rtt) {
+            s.srtt = sample;
+            s.rttvar = sample / 2;
+            s.has_rtt = true;
+            return;
+        }
+        auto deviation = s.srtt > sample ? s.srtt - sample : sample - s.srtt;
+        s.rttvar = (3 * s.rttvar + deviation) / 4;
+        s.srtt = (7 * s.srtt + sample) / 8;
+    }
+
+    // Declares lost every outstanding packet that is PACKET_THRESHOLD behind
+    // the newest acknowledged one or older than 9/8 RTT, and queues its frame
+    // to be sent again ahead of new ones.
+    void detect_lost(Session& s, Clock::time_point now) {
+        auto delay = loss_delay(s);
+        bool congested = false;
+        lost_.clear();
+        for (uint64_t packet = s.first_packet; packet < s.largest_acked; ++packet) {
+            Sent& sent = s.sent[packet - s.first_packet];
+            if (sent.done) continue;
+            if (packet + PACKET_THRESHOLD > s.largest_acked && now - sent.time < delay) continue;
+            congested |= sent.time > s.recovery_start;
+            declare_lost(s, sent);
+        }
+        if (congested) {
+            s.recovery_start = now;
+            s.cwnd = std::max(static_cast<size_t>(static_cast<double>(s.cwnd) * LOSS_REDUCTION), MIN_WINDOW);
+            s.ssthresh = s.cwnd;
+        }
+        requeue(s, lost_);
+    }
+
+    static Clock::duration loss_delay(const Session& s) {
+        return std::max<Clock::duration>(std::max(s.srtt, s.latest_rtt) * 9 / 8, GRANULARITY);
+    }
+
+    void declare_lost(Session& s, Sent& sent) {
+        sent.done = true;
+        s.in_flight -= sent.bytes;
+        std::ranges::move(sent.messages, std::back_inserter(lost_));
+        recycle(sent.messages);
+    }
+
+    void recycle(std::vector<Outgoing>& messages) {
+        messages.clear();
+        if (spare_.size() < MAX_SPARE && messages.capacity() > 0) spare_.push_back(std::move(messages));
+    }
+
+    static void requeue(Session& s, std::vector<Outgoing>& messages) {
+        for (const auto& message : messages) s.backlog_bytes += message.frame.size();
+        s.retransmitted += messages.size();
+        s.backlog.insert(s.backlog.begin(), std::make_move_iterator(messages.begin()),
+                         std::make_move_iterator(messages.end()));
+        messages.clear();
+    }
+
+    static void retire_sent(Session& s) {
+        while (!s.sent.empty() && s.sent.front().done) {
+            s.sent.pop_front();
+            ++s.first_packet;
+        }
+        while (!s.skipped.empty() && *s.skipped.begin() < s.first_packet) s.skipped.erase(s.skipped.begin());
+    }
+
+    Clock::duration probe_timeout(const Session& s) const {
+        return (s.srtt + std::max<Clock::duration>(4 * s.rttvar, GRANULARITY)) * (1 << s.pto_count);
+    }
+
+    // Runs from tick(). Returns false once the session has nothing left to do.
+    bool check_timers(Session& s, Clock::time_point now) {
+        if (s.in_flight > 0) {
+            detect_lost(s, now);
+            if (s.in_flight > 0 && now - s.last_sent >= probe_timeout(s)) {
+                // No acknowledgements for too long: send the oldest frame
+                // again as a probe, without treating it as congestion.
+                for (auto& sent : s.sent) {
+                    if (sent.done) continue;
+                    declare_lost(s, sent);
+                    break;
+                }
+                requeue(s, lost_);
+                s.pto_count = std::min(s.pto_count + 1, MAX_BACKOFF);
+                s.probe = true;
+            }
+            retire_sent(s);
+        }
+        pump(s, now);
+        return s.in_flight > 0 || !s.backlog.empty();
+    }
+
+    // Sends from the backlog while the congestion window and pacing allow,
+    // packing as many frames into each datagram as fit. Like a TCP segment, a
+    // datagram may start whenever the window is not full and is then filled
+    // up; otherwise a window opened a few bytes at a time by acknowledgements
+    // would keep every datagram small, and each small one risks a loss.
+    void pump(Session& s, Clock::time_point now) {
+        refill_credit(s, now);
+        char datagram[MAX_DATAGRAM];
+        while (!s.backlog.empty()) {
+            if (!s.probe && (s.in_flight >= s.cwnd || s.credit <= 0)) break;
+            if (rng_() % SKIP_EVERY == 0) {
+                s.skipped.insert(s.next_packet++);
+                s.sent.push_back(Sent{{}, now, 0, true});
+            }
+
+            Sent sent{take_spare(), now};
+            size_t used = DATA_HEADER_SIZE;
+            while (!s.backlog.empty() && sent.messages.size() < MAX_RECORDS) {
+                Outgoing& message = s.backlog.front();
+                size_t record = RECORD_HEADER_SIZE + message.frame.size();
+                if (used + record > MAX_DATAGRAM) break;
+                char* out = datagram + used;
+                out[0] = static_cast<char>(message.stream);
+                protocol::detail::put_u32(out + 1, message.order);
+                protocol::detail::put_u64(out + 5, message.message);
+                std::memcpy(out + RECORD_HEADER_SIZE, message.frame.data(), message.frame.size());
+                used += record;
+                s.backlog_bytes -= message.frame.size();
+                sent.messages.push_back(std::move(message));
+                s.backlog.pop_front();
+            }
+            datagram[0] = static_cast<char>(Kind::Data);
+            datagram[1] = static_cast<char>(sent.messages.size());
+            protocol::detail::put_u16(datagram + 2, 0);
+            protocol::detail::put_u32(datagram + 4, s.remote_token);
+            protocol::detail::put_u64(datagram + 8, s.next_packet++);
+            iovec iov{datagram, used};
+            transmit(s.remote, &iov, 1, now);
+
+            s.probe = false;
+            s.credit -= static_cast<double>(used);
+            s.in_flight += used;
+            s.last_sent = now;
+            s.sent_frames += sent.messages.size();
+            sent.bytes = static_cast<uint32_t>(used);
+            s.sent.push_back(std::move(sent));
+        }
+        if (s.in_flight == 0 && s.backlog.empty()) return;
+        if (!s.active) {
+            s.active = true;
+            active_.push_back(s.token);
+        }
+        want_tick(next_timer(s, now));
+    }
+
+    // When tick() must next look at the session: soon while pacing holds
+    // frames back, otherwise when the oldest packet in flight could be
+    // declared lost or the probe timeout expires.
+    Clock::time_point next_timer(const Session& s, Clock::time_point now) const {
+        auto due = Clock::time_point::max();
+        if (!s.backlog.empty() && (s.probe || s.in_flight < s.cwnd)) due = now + TICK;
+        if (s.in_flight > 0) {
+            due = std::min(due, s.last_sent + probe_timeout(s));
+            if (!s.sent.empty() && s.first_packet < s.largest_acked) {
+                due = std::min(due, s.sent.front().time + loss_delay(s));
+            }
+        }
+        return due;
+    }
+
+    void want_tick(Clock::time_point when) {
+        if (!arm_ || when >= wanted_) return;
+        wanted_ = when;
+        arm_(when);
+    }
+
+    std::vector<Outgoing> take_spare() {
+        if (spare_.empty()) return {};
+        auto messages = std::move(spare_.back());
+        spare_.pop_back();
+        return messages;
+    }
+
+    // Pacing: the allowance refills at PACING_GAIN windows per SRTT and may
+    // build up to a small burst, enough to cover the gap between two ticks.
+    static void refill_credit(Session& s, Clock::time_point now) {
+        double elapsed = std::chrono::duration<double>(now - s.credit_at).count();
+        s.credit_at = now;
+        double rate = PACING_GAIN * static_cast<double>(s.cwnd) / std::chrono::duration<double>(s.srtt).count();
+        double burst = std::max(static_cast<double>(INITIAL_WINDOW), rate * 2 * std::chrono::duration<double>(TICK).count());
+        s.credit = std::min(burst, s.credit + rate * elapsed);
+    }
+
+    void transmit(const sockaddr_in& to, const iovec* iov, int count, Clock::time_point now) {
+        if (impairment_.loss > 0 && chance_(rng_) < impairment_.loss) return;
+        if (impairment_.delay.count() > 0) {
+            size_t size = 0;
+            for (int i = 0; i < count; ++i) size += iov[i].iov_len;
+            BufferSlice copy{pool_.acquire(size), 0, static_cast<uint32_t>(size)};
+            size_t offset = 0;
+            for (int i = 0; i < count; ++i) {
+                std::memcpy(copy.buffer->data() + offset, iov[i].iov_base, iov[i].iov_len);
+                offset += iov[i].iov_len;
+            }
+            delayed_.push_back({now + impairment_.delay, to, std::move(copy)});
+            want_tick(delayed_.back().due);
+            return;
+        }
+        send_datagram(to, iov, count);
+    }
+
+    // A datagram the socket refuses is simply lost; recovery sends it again.
+    void send_datagram(const sockaddr_in& to, const iovec* iov, int count) {
+        msghdr msg{};
+        msg.msg_name = const_cast<sockaddr_in*>(&to);
+        msg.msg_namelen = sizeof(to);
+        msg.msg_iov = const_cast<iovec*>(iov);
+        msg.msg_iovlen = static_cast<decltype(msg.msg_iovlen)>(count);
+        while (sendmsg(fd_, &msg, 0) < 0 && errno == EINTR) {}
+    }
+};
+
+}  // namespace reliable_udp
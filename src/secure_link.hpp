@@ -0,0 +1,410 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/uio.h>
+
+#include "buffer_pool.hpp"
+#include "crypto.hpp"
+#include "protocol.hpp"
+
+// Encrypted links between chat nodes, on top of crypto.hpp.
+//
+// Each side of a new link first sends a KeyExchange frame with a fresh
+// X25519 public key and nothing else. Once it has the other side's, both
+// derive four keys from the shared secret: one per direction for the TCP
+// stream and one per direction for datagrams. From then on everything on the
+// stream travels in Record frames. A record is a batch of whole or partial
+// frames sealed in one pass with ChaCha20-Poly1305, its header as associated
+// data and its position on the link as the nonce, so records cannot be
+// replayed, reordered or cut. Datagrams carry one sealed frame each, and the
+// nonce in their sender field; a window of recent nonces turns away copies.
+//
+// The preshared secret (--secret) is mixed into the key derivation: two
+// nodes with different secrets derive different keys, and the first record
+// fails to open. Without it links are still encrypted, but a man in the
+// middle could pose as either side.
+//
+// Relays answer KeyExchange with an empty one: they take no part in link
+// encryption. Chat for a relay's clients is sealed end to end instead, under
+// a key all holders of the secret derive, in Sealed frames the relay can
+// route by room but not read.
+namespace secure_link {
+
+constexpr size_t MAX_RECORD = 64 * 1024;   // frame bytes sealed into one record
+constexpr size_t RECORD_OVERHEAD = protocol::HEADER_SIZE + crypto::TAG_SIZE;
+
+using PublicKey = crypto::X25519::Bytes;
+
+namespace detail {
+    inline std::span<const uint8_t> bytes(std::string_view text) {
+        return {reinterpret_cast<const uint8_t*>(text.data()), text.size()};
+    }
+
+    // 4 zero bytes, then the counter; the keys differ per direction, so a
+    // counter never repeats under one key.
+    inline crypto::Nonce counter_nonce(uint64_t counter) {
+        crypto::Nonce nonce{};
+        crypto::detail::store64(nonce.data() + 4, counter);
+        return nonce;
+    }
+
+    inline void write_record_header(char* out, uint32_t length, uint64_t sender) {
+        protocol::write_header(out, protocol::FrameHeader{
+            .length = length,
+            .version = protocol::PROTOCOL_VERSION,
+            .type = protocol::FrameType::Record,
+            .flags = protocol::FrameFlags::None,
+            .sender = sender
+        });
+    }
+
+    inline std::span<const uint8_t> header_of(std::string_view raw) {
+        return bytes(raw.substr(0, protocol::HEADER_SIZE));
+    }
+}
+
+// Counters of messages that may arrive out of order: the highest seen, and
+// one bit for each of the `Bits` before it. A counter seen before, or too
+// old to tell, is a replay. Each counter is cleared once as the window
+// moves past it, so accepting costs O(1) on average.
+template <size_t Bits>
+class ReplayWindow {
+    static_assert(Bits % 64 == 0);
+
+public:
+    // Whether `counter` is new, which it then no longer is. Call it only
+    // for messages that have been authenticated.
+    bool accept(uint64_t counter) {
+        if (!started_ || counter > highest_) {
+            if (!started_ || counter - highest_ >= Bits) {
+                seen_.fill(0);
+            } else {
+                for (uint64_t n = highest_ + 1; n < counter; ++n) seen_[n / 64 % WORDS] &= ~bit(n);
+            }
+            started_ = true;
+            highest_ = counter;
+        } else if (highest_ - counter >= Bits || (seen_[counter / 64 % WORDS] & bit(counter))) {
+            return false;
+        }
+        seen_[counter / 64 % WORDS] |= bit(counter);
+        return true;
+    }
+
+private:
+    static constexpr size_t WORDS = Bits / 64;
+    static uint64_t bit(uint64_t n) { return uint64_t{1} << (n % 64); }
+
+    std::array<uint64_t, WORDS> seen_{};
+    uint64_t highest_ = 0;
+    bool started_ = false;
+};
+
+// What the preshared secret turns into: a salt for link keys, and the key
+// chat through relays is sealed with. Both empty without a secret.
+struct Secret {
+    std::optional<crypto::Key> link_salt;
+    std::optional<crypto::Key> group;
+};
+
+inline Secret derive_secret(std::string_view passphrase) {
+    Secret secret;
+    if (passphrase.empty()) return secret;
+    const auto salt = detail::bytes("p2p_chat secret v1");
+    crypto::hkdf(secret.link_salt.emplace(), detail::bytes(passphrase), salt, detail::bytes("link"));
+    crypto::hkdf(secret.group.emplace(), detail::bytes(passphrase), salt, detail::bytes("group"));
+    return secret;
+}
+
+// A link's ephemeral key pair, used for its key exchange only.
+struct KeyPair {
+    crypto::X25519::Bytes secret{};
+    PublicKey public_key{};
+
+    static KeyPair generate() {
+        KeyPair pair;
+        crypto::random_bytes(pair.secret);
+        pair.public_key = crypto::X25519::public_key(pair.secret);
+        return pair;
+    }
+};
+
+struct LinkKeys {
+    crypto::Key send{};
+    crypto::Key receive{};
+    crypto::Key datagram_send{};
+    crypto::Key datagram_receive{};
+};
+
+inline std::string encode_key_exchange(uint64_t sender, const PublicKey& key) {
+    return protocol::encode_frame(protocol::FrameType::KeyExchange, sender,
+                                  std::string_view(reinterpret_cast<const char*>(key.data()), key.size()));
+}
+
+// The keys for a link, given our key pair and the peer's KeyExchange
+// payload. Nothing if the payload is not a usable public key: a key of the
+// wrong size, our own sent back, or one that yields the all-zero secret.
+inline std::optional<LinkKeys> agree(const KeyPair& ours, std::string_view theirs, const Secret& secret) {
+    if (theirs.size() != PublicKey{}.size()) return std::nullopt;
+    PublicKey peer;
+    std::memcpy(peer.data(), theirs.data(), peer.size());
+    if (crypto::equal(peer, ours.public_key)) return std::nullopt;
+    auto shared = crypto::X25519::multiply(ours.secret, peer);
+    if (crypto::equal(shared, crypto::X25519::Bytes{})) return std::nullopt;
+
+    // Both sides name the keys after the two public keys in sorted order.
+    bool first = std::lexicographical_compare(ours.public_key.begin(), ours.public_key.end(), peer.begin(), peer.end());
+    const PublicKey& low = first ? ours.public_key : peer;
+    const PublicKey& high = first ? peer : ours.public_key;
+    std::vector<uint8_t> info{'l', 'i', 'n', 'k'};
+    info.insert(info.end(), low.begin(), low.end());
+    info.insert(info.end(), high.begin(), high.end());
+
+    std::array<uint8_t, 4 * crypto::KEY_SIZE> okm;
+    std::span<const uint8_t> salt;
+    if (secret.link_salt) salt = *secret.link_salt;
+    crypto::hkdf(okm, shared, salt, info);
+
+    crypto::Key keys[4];
+    for (size_t i = 0; i < 4; ++i) std::memcpy(keys[i].data(), okm.data() + i * crypto::KEY_SIZE, crypto::KEY_SIZE);
+    // keys[0] and keys[2] run from the low key to the high one.
+    return first ? LinkKeys{keys[0], keys[1], keys[2], keys[3]} : LinkKeys{keys[1], keys[0], keys[3], keys[2]};
+}
+
+// Sending side of one direction of a link. Not thread-safe.
+class Sealer {
+public:
+    explicit Sealer(const crypto::Key& key) : key_(key) {}
+
+    // Seals up to MAX_RECORD bytes of `pieces`, in order, into one record
+    // that replaces the contents of `out`. Frames may be cut anywhere; the
+    // rest goes in the next record. Returns how many bytes were taken.
+    size_t seal(std::span<const iovec> pieces, std::vector<char>& out) {
+        size_t size = 0;
+        for (const iovec& piece : pieces) size += piece.iov_len;
+        size = std::min(size, MAX_RECORD);
+
+        out.resize(RECORD_OVERHEAD + size);
+        detail::write_record_header(out.data(), static_cast<uint32_t>(size + crypto::TAG_SIZE), 0);
+        crypto::Aead aead(crypto::Aead::Mode::Seal, key_, detail::counter_nonce(counter_++),
+                          detail::header_of(std::string_view(out.data(), out.size())), size);
+        auto* at = reinterpret_cast<uint8_t*>(out.data() + protocol::HEADER_SIZE);
+        size_t left = size;
+        for (const iovec& piece : pieces) {
+            if (left == 0) break;
+            size_t n = std::min(piece.iov_len, left);
+            aead.update(static_cast<const uint8_t*>(piece.iov_base), at, n);
+            at += n;
+            left -= n;
+        }
+        auto tag = aead.finish();
+        std::memcpy(at, tag.data(), tag.size());
+        return size;
+    }
+
+    // `frame` sealed on its own, for a datagram. The nonce travels in the
+    // record's sender field, since datagrams may be lost or reordered.
+    BufferSlice seal_datagram(std::string_view frame, BufferPool& pool) {
+        size_t size = RECORD_OVERHEAD + frame.size();
+        BufferRef buffer = pool.acquire(size);
+        uint64_t nonce = counter_++;
+        detail::write_record_header(buffer->data(), static_cast<uint32_t>(frame.size() + crypto::TAG_SIZE), nonce);
+        crypto::Aead aead(crypto::Aead::Mode::Seal, key_, detail::counter_nonce(nonce),
+                          detail::header_of(std::string_view(buffer->data(), size)), frame.size());
+        auto* at = reinterpret_cast<uint8_t*>(buffer->data() + protocol::HEADER_SIZE);
+        aead.update(reinterpret_cast<const uint8_t*>(frame.data()), at, frame.size());
+        auto tag = aead.finish();
+        std::memcpy(at + frame.size(), tag.data(), tag.size());
+        return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(size)};
+    }
+
+private:
+    crypto::Key key_;
+    uint64_t counter_ = 0;
+};
+
+// Receiving side of one direction of a link. Not thread-safe.
+class Opener {
+public:
+    explicit Opener(const crypto::Key& key) : key_(key) {}
+
+    // Decrypts `record` straight into `into`, whose frames are then read as
+    // usual. Returns false, adding nothing, if the record is not the next
+    // one sealed with the link's key.
+    bool open(const protocol::FrameView& record, protocol::FrameDecoder& into) {
+        if (record.header.type != protocol::FrameType::Record || record.payload.size() < crypto::TAG_SIZE) {
+            return false;
+        }
+        size_t size = record.payload.size() - crypto::TAG_SIZE;
+        auto space = into.prepare(size);
+        crypto::Aead aead(crypto::Aead::Mode::Open, key_, detail::counter_nonce(counter_),
+                          detail::header_of(record.raw), size);
+        aead.update(reinterpret_cast<const uint8_t*>(record.payload.data()), reinterpret_cast<uint8_t*>(space.data()), size);
+        if (!aead.verify(detail::bytes(record.payload.substr(size)))) return false;
+        ++counter_;
+        into.commit(size);
+        return true;
+    }
+
+private:
+    crypto::Key key_;
+    uint64_t counter_ = 0;
+};
+
+// Receiving side of a link's datagrams. Their nonces come with them, so
+// the window remembers which were opened already. Every frame the reliable
+// transport may have in flight fits in the window. Not thread-safe.
+class DatagramOpener {
+public:
+    static constexpr size_t WINDOW = 64 * 1024;
+
+    explicit DatagramOpener(const crypto::Key& key) : key_(key) {}
+
+    // The frame inside a datagram record, or nothing if it does not open or
+    // was opened before.
+    std::optional<BufferSlice> open(const protocol::FrameView& record, BufferPool& pool) {
+        if (record.header.type != protocol::FrameType::Record ||
+            record.payload.size() < crypto::TAG_SIZE + protocol::HEADER_SIZE) {
+            return std::nullopt;
+        }
+        size_t size = record.payload.size() - crypto::TAG_SIZE;
+        BufferRef buffer = pool.acquire(size);
+        crypto::Aead aead(crypto::Aead::Mode::Open, key_, detail::counter_nonce(record.header.sender),
+                          detail::header_of(record.raw), size);
+        aead.update(reinterpret_cast<const uint8_t*>(record.payload.data()), reinterpret_cast<uint8_t*>(buffer->data()), size);
+        if (!aead.verify(detail::bytes(record.payload.substr(size)))) return std::nullopt;
+        auto inner = protocol::read_header(buffer->data());
+        if (inner.version != protocol::PROTOCOL_VERSION || inner.length != size - protocol::HEADER_SIZE) return std::nullopt;
+        if (!window_.accept(record.header.sender)) return std::nullopt;
+        return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(size)};
+    }
+
+private:
+    crypto::Key key_;
+    ReplayWindow<WINDOW> window_;
+};
+
+// End-to-end sealing of chat frames that pass through relays, under the key
+// everyone with the same secret derives. The nonce is the sender's node id
+// and a per-node 32-bit counter, so nodes never reuse one between them; a
+// window per sender turns away copies of frames opened before. A node seals
+// at most 2^32 frames under one id; past that seal() refuses, and the node
+// needs a new id to go on. Safe to share between threads.
+class GroupCipher {
+public:
+    explicit GroupCipher(const crypto::Key& key) : key_(key) {}
+
+    // `frame`, a chat or room frame published by node `sender`, as a Sealed
+    // frame for relays to route to `room` (empty for everyone). Nothing once
+    // the counter is used up, rather than reuse a nonce.
+    std::optional<BufferSlice> seal(uint64_t sender, std::string_view room, std::string_view frame, BufferPool& pool) {
+        uint64_t counter = counter_.fetch_add(1, std::memory_order_relaxed);
+        if (counter > std::numeric_limits<uint32_t>::max()) return std::nullopt;
+
+        room = room.substr(0, protocol::MAX_ROOM_NAME);
+        size_t prefix = 1 + room.size();
+        size_t size = protocol::HEADER_SIZE + prefix + crypto::NONCE_SIZE + frame.size() + crypto::TAG_SIZE;
+        BufferRef buffer = pool.acquire(size);
+        char* out = buffer->data();
+        protocol::write_header(out, protocol::FrameHeader{
+            .length = static_cast<uint32_t>(size - protocol::HEADER_SIZE),
+            .version = protocol::PROTOCOL_VERSION,
+            .type = protocol::FrameType::Sealed,
+            .flags = protocol::FrameFlags::None,
+            .sender = sender
+        });
+        char* payload = out + protocol::HEADER_SIZE;
+        payload[0] = static_cast<char>(room.size());
+        std::memcpy(payload + 1, room.data(), room.size());
+
+        crypto::Nonce nonce;
+        crypto::detail::store64(nonce.data(), sender);
+        crypto::detail::store32(nonce.data() + 8, static_cast<uint32_t>(counter));
+        std::memcpy(payload + prefix, nonce.data(), nonce.size());
+
+        auto* at = reinterpret_cast<uint8_t*>(payload + prefix + nonce.size());
+        crypto::Aead aead(crypto::Aead::Mode::Seal, key_, nonce, associated(sender, std::string_view(payload, prefix)).view(),
+                          frame.size());
+        aead.update(reinterpret_cast<const uint8_t*>(frame.data()), at, frame.size());
+        auto tag = aead.finish();
+        std::memcpy(at + frame.size(), tag.data(), tag.size());
+        return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(size)};
+    }
+
+    // Whether open() turns away a frame it opened before. History replayed
+    // by a relay may have been seen live, so it is let through.
+    enum class Copies { Reject, Allow };
+
+    // The frame inside a Sealed frame, or nothing if it does not open.
+    std::optional<BufferSlice> open(const protocol::FrameView& sealed, BufferPool& pool, Copies copies = Copies::Reject) {
+        auto parts = protocol::decode_sealed(sealed.payload);
+        if (!parts || parts->data.size() < crypto::TAG_SIZE + protocol::HEADER_SIZE) return std::nullopt;
+        crypto::Nonce nonce;
+        std::memcpy(nonce.data(), parts->nonce.data(), nonce.size());
+        size_t size = parts->data.size() - crypto::TAG_SIZE;
+        BufferRef buffer = pool.acquire(size);
+        crypto::Aead aead(crypto::Aead::Mode::Open, key_, nonce,
+                          associated(sealed.header.sender, sealed.payload.substr(0, 1 + parts->room.size())).view(), size);
+        aead.update(reinterpret_cast<const uint8_t*>(parts->data.data()), reinterpret_cast<uint8_t*>(buffer->data()), size);
+        if (!aead.verify(detail::bytes(parts->data.substr(size)))) return std::nullopt;
+        auto inner = protocol::read_header(buffer->data());
+        if (inner.version != protocol::PROTOCOL_VERSION || inner.length != size - protocol::HEADER_SIZE) return std::nullopt;
+        if (copies == Copies::Reject && !fresh(sealed.header.sender, crypto::detail::load32(nonce.data() + 8))) return std::nullopt;
+        return BufferSlice{std::move(buffer), 0, static_cast<uint32_t>(size)};
+    }
+
+private:
+    static constexpr size_t WINDOW = 1024;         // a sender's frames may arrive this far out of order
+    static constexpr size_t MAX_SENDERS = 4096;    // windows kept; the oldest is forgotten beyond that
+
+    crypto::Key key_;
+    std::atomic<uint64_t> counter_{0};   // wider than the nonce's, so it cannot wrap
+    std::mutex windows_mutex_;
+    std::unordered_map<uint64_t, ReplayWindow<WINDOW>> windows_;   // by sender
+    std::deque<uint64_t> senders_;   // in the order their windows were made
+
+    bool fresh(uint64_t sender, uint32_t counter) {
+        std::lock_guard<std::mutex> lock(windows_mutex_);
+        auto [it, added] = windows_.try_emplace(sender);
+        if (added) {
+            senders_.push_back(sender);
+            if (senders_.size() > MAX_SENDERS) {
+                windows_.erase(senders_.front());
+                senders_.pop_front();
+            }
+        }
+        return it->second.accept(counter);
+    }
+
+    // The sender and the room are bound to the message, so a relay cannot
+    // pass it off as someone else's or move it to another room.
+    struct Associated {
+        std::array<uint8_t, 8 + 1 + protocol::MAX_ROOM_NAME> data{};
+        size_t size = 0;
+
+        std::span<const uint8_t> view() const { return {data.data(), size}; }
+    };
+
+    static Associated associated(uint64_t sender, std::string_view room_prefix) {
+        Associated aad;
+        crypto::detail::store64(aad.data.data(), sender);
+        std::memcpy(aad.data.data() + 8, room_prefix.data(), room_prefix.size());
+        aad.size = 8 + room_prefix.size();
+        return aad;
+    }
+};
+
+}  // namespace secure_link
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Generational slot map. insert() returns a handle that stays valid until
+// that element is erased; afterwards it is detected as stale, even if the
+// slot has been reused. Elements live in one dense array, so iteration only
+// ever sees live elements, and erase() swaps the last element into the hole.
+// Insert, erase and lookup are O(1); memory stays at the peak element count.
+//
+// Not thread-safe; callers hold their own lock.
+template <typename T>
+class SlotMap {
+public:
+    struct Handle {
+        uint32_t index = UINT32_MAX;
+        uint32_t generation = 0;
+
+        bool operator==(const Handle&) const = default;
+    };
+
+    Handle insert(T value) {
+        uint32_t index;
+        if (free_head_ != NONE) {
+            index = free_head_;
+            free_head_ = slots_[index].target;
+        } else {
+            index = static_cast<uint32_t>(slots_.size());
+            slots_.push_back({});
+        }
+        slots_[index].target = static_cast<uint32_t>(values_.size());
+        values_.push_back(std::move(value));
+        owners_.push_back(index);
+        return {index, slots_[index].generation};
+    }
+
+    // Returns false if `handle` was already erased.
+    bool erase(Handle handle) {
+        if (!contains(handle)) return false;
+        Slot& slot = slots_[handle.index];
+        uint32_t dense = slot.target;
+        uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+        if (dense != last) {
+            values_[dense] = std::move(values_[last]);
+            owners_[dense] = owners_[last];
+            slots_[owners_[dense]].target = dense;
+        }
+        values_.pop_back();
+        owners_.pop_back();
+
+        ++slot.generation;   // invalidates every outstanding handle to this slot
+        slot.target = free_head_;
+        free_head_ = handle.index;
+        return true;
+    }
+
+    // A slot's generation changes when its element is erased, so a matching
+    // generation means the element is still live.
+    bool contains(Handle handle) const {
+        return handle.index < slots_.size() && slots_[handle.index].generation == handle.generation;
+    }
+
+    // Null if `handle` is stale. The pointer is invalidated by the next insert or erase.
+    T* get(Handle handle) {
+        return contains(handle) ? &values_[slots_[handle.index].target] : nullptr;
+    }
+
+    // Handle of the element at position `dense` of the live array.
+    Handle handle_at(size_t dense) const {
+        uint32_t index = owners_[dense];
+        return {index, slots_[index].generation};
+    }
+
+    std::span<T> values() { return values_; }
+    std::span<const T> values() const { return values_; }
+    auto begin() { return values_.begin(); }
+    auto end() { return values_.end(); }
+    auto begin() const { return values_.begin(); }
+    auto end() const { return values_.end(); }
+    size_t size() const { return values_.size(); }
+    bool empty() const { return values_.empty(); }
+
+    void clear() {
+        while (!values_.empty()) erase(handle_at(values_.size() - 1));
+    }
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Slot {
+        uint32_t target = NONE;   // dense index while live, next free slot once erased
+        uint32_t generation = 0;
+    };
+
+    std::vector<Slot> slots_;
+    std::vector<T> values_;
+    std::vector<uint32_t> owners_;   // slot index of each dense element
+    uint32_t free_head_ = NONE;
+};
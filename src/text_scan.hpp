@@ -0,0 +1,364 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define TEXT_SCAN_X86 1
+    #include <immintrin.h>
+#endif
+
+// Checks on text that arrives from the network or the console, done in place
+// on string_views into the receive buffer so nothing is copied to check it.
+//
+// Chat text must be valid UTF-8, and names and rooms must also be free of
+// control characters; anything else is malformed and dropped before it is
+// forwarded. Control characters in chat text are allowed on the wire but
+// stripped before display, so a peer cannot move the cursor or change the
+// colours of someone else's terminal.
+//
+// Both scans run over 16 or 32 bytes at a time. UTF-8 validation uses the
+// lookup-table method (Keiser and Lemire, 2021) with AVX2: three nibble
+// lookups classify every pair of adjacent bytes at once, so there is no
+// branch per character. Without AVX2, runs of ASCII are skipped 16 bytes
+// at a time and only the rest is decoded byte by byte. The choice is made
+// once at run time from what the CPU supports.
+namespace text_scan {
+
+namespace detail {
+    // Decodes the sequence at `i`, which starts with a non-ASCII byte, and
+    // returns its length, or 0 if it is malformed: a stray continuation
+    // byte, a truncated sequence, an overlong form, a surrogate or a code
+    // point past U+10FFFF.
+    inline size_t sequence_length(const uint8_t* s, size_t i, size_t size) {
+        uint8_t lead = s[i];
+        size_t length;
+        uint8_t low = 0x80, high = 0xBF;   // bounds on the second byte
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            length = 2;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            length = 3;
+            if (lead == 0xE0) low = 0xA0;
+            if (lead == 0xED) high = 0x9F;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            length = 4;
+            if (lead == 0xF0) low = 0x90;
+            if (lead == 0xF4) high = 0x8F;
+        } else {
+            return 0;
+        }
+        if (size - i < length) return 0;
+        if (s[i + 1] < low || s[i + 1] > high) return 0;
+        for (size_t k = 2; k < length; ++k) {
+            if ((s[i + k] & 0xC0) != 0x80) return 0;
+        }
+        return length;
+    }
+
+    inline bool is_ascii_word(const uint8_t* s) {
+        uint64_t word;
+        std::memcpy(&word, s, sizeof(word));
+        return (word & 0x8080808080808080ULL) == 0;
+    }
+
+    inline bool utf8_scalar(const uint8_t* s, size_t size) {
+        size_t i = 0;
+        while (i < size) {
+            if (s[i] < 0x80) {
+                ++i;
+                while (i + 8 <= size && is_ascii_word(s + i)) i += 8;
+                continue;
+            }
+            size_t length = sequence_length(s, i, size);
+            if (length == 0) return false;
+            i += length;
+        }
+        return true;
+    }
+
+    // A C0 control, DEL, or the first byte of a C1 control (U+0080-U+009F,
+    // encoded as C2 80-C2 9F).
+    inline bool is_control(const uint8_t* s, size_t i, size_t size) {
+        uint8_t c = s[i];
+        if (c < 0x20 || c == 0x7F) return true;
+        return c == 0xC2 && i + 1 < size && s[i + 1] >= 0x80 && s[i + 1] <= 0x9F;
+    }
+
+    // Position of the first control character at or after `i`, or `size`.
+    inline size_t control_scalar(const uint8_t* s, size_t i, size_t size) {
+        for (; i < size; ++i) {
+            if (is_control(s, i, size)) return i;
+        }
+        return size;
+    }
+
+#ifdef TEXT_SCAN_X86
+    inline bool utf8_sse2(const uint8_t* s, size_t size) {
+        size_t i = 0;
+        while (i < size) {
+            if (i + 16 <= size &&
+                _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i))) == 0) {
+                i += 16;
+                continue;
+            }
+            if (s[i] < 0x80) {
+                ++i;
+                continue;
+            }
+            size_t length = sequence_length(s, i, size);
+            if (length == 0) return false;
+            i += length;
+        }
+        return true;
+    }
+
+    // Bytes that may be control characters set their bit in the mask; C2
+    // bytes are only candidates and are confirmed one by one.
+    inline size_t control_sse2(const uint8_t* s, size_t size) {
+        const __m128i c0_top = _mm_set1_epi8(0x1F);
+        const __m128i del = _mm_set1_epi8(0x7F);
+        const __m128i c2 = _mm_set1_epi8(static_cast<char>(0xC2));
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, c0_top), x),
+                                       _mm_or_si128(_mm_cmpeq_epi8(x, del), _mm_cmpeq_epi8(x, c2)));
+            for (auto mask = static_cast<unsigned>(_mm_movemask_epi8(hit)); mask != 0; mask &= mask - 1) {
+                size_t at = i + static_cast<size_t>(__builtin_ctz(mask));
+                if (is_control(s, at, size)) return at;
+            }
+        }
+        return control_scalar(s, i, size);
+    }
+
+    __attribute__((target("avx2"))) inline size_t control_avx2(const uint8_t* s, size_t size) {
+        const __m256i c0_top = _mm256_set1_epi8(0x1F);
+        const __m256i del = _mm256_set1_epi8(0x7F);
+        const __m256i c2 = _mm256_set1_epi8(static_cast<char>(0xC2));
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(x, c0_top), x),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(x, del), _mm256_cmpeq_epi8(x, c2)));
+            for (auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hit)); mask != 0; mask &= mask - 1) {
+                size_t at = i + static_cast<size_t>(__builtin_ctz(mask));
+                if (is_control(s, at, size)) return at;
+            }
+        }
+        return i + control_sse2(s + i, size - i);
+    }
+
+    // Error classes of a pair of adjacent bytes, one bit each. A pair is
+    // valid when the three lookups below, by the first byte's high and low
+    // nibble and the second byte's high nibble, share no bit.
+    constexpr uint8_t TOO_SHORT = 1 << 0;    // lead byte, then not a continuation
+    constexpr uint8_t TOO_LONG = 1 << 1;     // ASCII, then a continuation
+    constexpr uint8_t OVERLONG_3 = 1 << 2;   // E0 80-9F
+    constexpr uint8_t TOO_LARGE = 1 << 3;    // F4 90-BF, or F5-FF then a continuation
+    constexpr uint8_t SURROGATE = 1 << 4;    // ED A0-BF
+    constexpr uint8_t OVERLONG_2 = 1 << 5;   // C0-C1 then a continuation
+    constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+    constexpr uint8_t OVERLONG_4 = 1 << 6;   // F0 80-8F
+    constexpr uint8_t TWO_CONTS = 1 << 7;    // two continuations in a row
+    constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    __attribute__((target("avx2"))) inline __m256i table_avx2(uint8_t t0, uint8_t t1, uint8_t t2, uint8_t t3,
+                                                              uint8_t t4, uint8_t t5, uint8_t t6, uint8_t t7,
+                                                              uint8_t t8, uint8_t t9, uint8_t t10, uint8_t t11,
+                                                              uint8_t t12, uint8_t t13, uint8_t t14, uint8_t t15) {
+        return _mm256_setr_epi8(
+            static_cast<char>(t0), static_cast<char>(t1), static_cast<char>(t2), static_cast<char>(t3),
+            static_cast<char>(t4), static_cast<char>(t5), static_cast<char>(t6), static_cast<char>(t7),
+            static_cast<char>(t8), static_cast<char>(t9), static_cast<char>(t10), static_cast<char>(t11),
+            static_cast<char>(t12), static_cast<char>(t13), static_cast<char>(t14), static_cast<char>(t15),
+            static_cast<char>(t0), static_cast<char>(t1), static_cast<char>(t2), static_cast<char>(t3),
+            static_cast<char>(t4), static_cast<char>(t5), static_cast<char>(t6), static_cast<char>(t7),
+            static_cast<char>(t8), static_cast<char>(t9), static_cast<char>(t10), static_cast<char>(t11),
+            static_cast<char>(t12), static_cast<char>(t13), static_cast<char>(t14), static_cast<char>(t15));
+    }
+
+    // The 32 bytes ending `n` bytes before the start of `input`, where
+    // `previous` is the block before it.
+    template <int N>
+    __attribute__((target("avx2"))) inline __m256i shifted_avx2(__m256i input, __m256i previous) {
+        return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i high_nibbles_avx2(__m256i x) {
+        return _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi8(0x0F));
+    }
+
+    // Error bits for `input`, given the block before it.
+    __attribute__((target("avx2"))) inline __m256i check_block_avx2(__m256i input, __m256i previous) {
+        const __m256i byte_1_high = table_avx2(
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+        const __m256i byte_1_low = table_avx2(
+            CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+            CARRY | OVERLONG_2,
+            CARRY, CARRY,
+            CARRY | TOO_LARGE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+        const __m256i byte_2_high = table_avx2(
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+        __m256i prev1 = shifted_avx2<1>(input, previous);
+        __m256i special = _mm256_and_si256(
+            _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, high_nibbles_avx2(prev1)),
+                             _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)))),
+            _mm256_shuffle_epi8(byte_2_high, high_nibbles_avx2(input)));
+
+        // The third and fourth bytes of a sequence are the only places
+        // where two continuations in a row are allowed.
+        __m256i third = _mm256_subs_epu8(shifted_avx2<2>(input, previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+        __m256i fourth = _mm256_subs_epu8(shifted_avx2<3>(input, previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+        __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+        return _mm256_xor_si256(must_continue, special);
+    }
+
+    __attribute__((target("avx2"))) inline bool utf8_avx2(const uint8_t* s, size_t size) {
+        // A block may not end inside a sequence unless the next one
+        // finishes it: its last three bytes must not be leads that need
+        // more bytes than the block has left.
+        const __m256i last_lead = _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+        __m256i error = _mm256_setzero_si256();
+        __m256i previous = _mm256_setzero_si256();
+        __m256i incomplete = _mm256_setzero_si256();
+        // The tail is padded with zeros, which end any sequence cut short
+        // as TOO_SHORT; after a full final block, `incomplete` does.
+        for (size_t i = 0; i < size; i += 32) {
+            __m256i input;
+            if (i + 32 <= size) {
+                input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            } else {
+                alignas(32) uint8_t tail[32] = {};
+                std::memcpy(tail, s + i, size - i);
+                input = _mm256_load_si256(reinterpret_cast<const __m256i*>(tail));
+            }
+            if (_mm256_movemask_epi8(input) == 0) {
+                error = _mm256_or_si256(error, incomplete);
+            } else {
+                error = _mm256_or_si256(error, check_block_avx2(input, previous));
+                incomplete = _mm256_subs_epu8(input, last_lead);
+            }
+            previous = input;
+        }
+        error = _mm256_or_si256(error, incomplete);
+        return _mm256_testz_si256(error, error) != 0;
+    }
+#endif
+
+    inline bool has_avx2() {
+#ifdef TEXT_SCAN_X86
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+#else
+        return false;
+#endif
+    }
+
+    inline const uint8_t* bytes(std::string_view text) {
+        return reinterpret_cast<const uint8_t*>(text.data());
+    }
+}
+
+inline bool valid_utf8(std::string_view text) {
+#ifdef TEXT_SCAN_X86
+    if (detail::has_avx2()) return detail::utf8_avx2(detail::bytes(text), text.size());
+    return detail::utf8_sse2(detail::bytes(text), text.size());
+#else
+    return detail::utf8_scalar(detail::bytes(text), text.size());
+#endif
+}
+
+// Position of the first control character (C0, DEL or C1), or npos.
+inline size_t find_control(std::string_view text) {
+#ifdef TEXT_SCAN_X86
+    size_t at = detail::has_avx2() ? detail::control_avx2(detail::bytes(text), text.size())
+                                   : detail::control_sse2(detail::bytes(text), text.size());
+#else
+    size_t at = detail::control_scalar(detail::bytes(text), 0, text.size());
+#endif
+    return at == text.size() ? std::string_view::npos : at;
+}
+
+// A sender name or room: non-empty UTF-8 without control characters.
+inline bool valid_name(std::string_view name) {
+    return !name.empty() && valid_utf8(name) && find_control(name) == std::string_view::npos;
+}
+
+// `text` without its control characters. Text that has none, nearly all
+// of it, is returned as it is; otherwise the rest is copied to `scratch`.
+inline std::string_view strip_controls(std::string_view text, std::string& scratch) {
+    size_t at = find_control(text);
+    if (at == std::string_view::npos) return text;
+    scratch.assign(text.substr(0, at));
+    while (at < text.size()) {
+        at += text[at] == '\xC2' ? 2 : 1;
+        size_t next = find_control(text.substr(at));
+        size_t end = next == std::string_view::npos ? text.size() : at + next;
+        scratch.append(text.substr(at, end - at));
+        at = end;
+    }
+    return scratch;
+}
+
+// The longest prefix of `text` that is at most `max` bytes and does not end
+// inside a UTF-8 sequence.
+inline std::string_view truncate(std::string_view text, size_t max) {
+    if (text.size() <= max) return text;
+    while (max > 0 && (static_cast<uint8_t>(text[max]) & 0xC0) == 0x80) --max;
+    return text.substr(0, max);
+}
+
+// The next space-separated word of `rest`, which moves past it; empty when
+// none is left.
+inline std::string_view next_word(std::string_view& rest) {
+    size_t start = rest.find_first_not_of(' ');
+    if (start == std::string_view::npos) {
+        rest = {};
+        return {};
+    }
+    rest.remove_prefix(start);
+    size_t end = rest.find(' ');
+    std::string_view word = rest.substr(0, end);
+    rest.remove_prefix(end == std::string_view::npos ? rest.size() : end);
+    return word;
+}
+
+// A console line split in place: "/join dev" has name "join" and argument
+// "dev". Lines that are not commands have an empty name.
+struct Command {
+    std::string_view name;
+    std::string_view argument;   // the rest of the line after one space
+};
+
+inline Command parse_command(std::string_view line) {
+    if (line.empty() || line[0] != '/') return {};
+    line.remove_prefix(1);
+    size_t space = line.find(' ');
+    if (space == std::string_view::npos) return {line, {}};
+    return {line.substr(0, space), line.substr(space + 1)};
+}
+
+}  // namespace text_scan
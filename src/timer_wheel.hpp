@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel. Time advances in fixed ticks. Level 0 has one
+// slot per tick for the next 64 ticks, and each level above covers 64 times
+// the span of the one below. A timer is linked into the slot of the highest
+// 6-bit digit in which its expiry differs from the current tick. When the
+// wheel reaches that slot, the timer cascades one or more levels down, and
+// it fires from level 0 on its exact tick. Arming, re-arming and cancelling
+// are O(1) and never allocate once the wheel has grown to its peak size.
+// Advancing costs O(1) per tick plus O(1) per timer cascaded or fired, and
+// timers that are not due are never visited.
+//
+// Timers are rounded up to the next tick, so they fire no earlier than
+// asked and at most one tick late, plus however late advance() is called.
+// add() returns a generational handle. The handle stays valid until remove(),
+// and afterwards every call with it is a harmless no-op, so an owner can
+// re-arm a timer that may have been removed meanwhile.
+//
+// Not thread-safe; callers hold their own lock.
+template <typename T>
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Handle {
+        uint32_t index = UINT32_MAX;
+        uint32_t generation = 0;
+
+        bool operator==(const Handle&) const = default;
+    };
+
+    explicit TimerWheel(Clock::duration tick, Clock::time_point now = Clock::now())
+        : tick_(std::max(tick, Clock::duration(1))), origin_(now) {
+        heads_.fill(NONE);
+    }
+
+    // Adds a timer that carries `value` and is not armed yet.
+    Handle add(T value) {
+        uint32_t index;
+        if (free_head_ != NONE) {
+            index = free_head_;
+            free_head_ = nodes_[index].next;
+        } else {
+            index = static_cast<uint32_t>(nodes_.size());
+            nodes_.push_back({});
+        }
+        Node& node = nodes_[index];
+        node.value = std::move(value);
+        node.slot = NONE;
+        ++size_;
+        return {index, node.generation};
+    }
+
+    // Returns false if `handle` was already removed.
+    bool remove(Handle handle) {
+        if (!contains(handle)) return false;
+        unlink(handle.index);
+        Node& node = nodes_[handle.index];
+        node.value = T{};
+        ++node.generation;   // invalidates every outstanding handle to this timer
+        node.next = free_head_;
+        free_head_ = handle.index;
+        --size_;
+        return true;
+    }
+
+    // Arms the timer to fire at `when`, replacing any earlier deadline. A
+    // deadline already past fires on the next tick.
+    bool schedule(Handle handle, Clock::time_point when) {
+        if (!contains(handle)) return false;
+        unlink(handle.index);
+        nodes_[handle.index].expiry = std::max(tick_of(when), now_ + 1);
+        link(handle.index);
+        ++armed_;
+        return true;
+    }
+
+    bool cancel(Handle handle) {
+        if (!contains(handle)) return false;
+        unlink(handle.index);
+        return true;
+    }
+
+    bool contains(Handle handle) const {
+        return handle.index < nodes_.size() && nodes_[handle.index].generation == handle.generation;
+    }
+
+    // When the timer will fire, if it is armed.
+    std::optional<Clock::time_point> expiry(Handle handle) const {
+        if (!contains(handle) || nodes_[handle.index].slot == NONE) return std::nullopt;
+        return origin_ + tick_ * static_cast<Clock::rep>(nodes_[handle.index].expiry);
+    }
+
+    // Moves the wheel up to `now` and calls `expire(handle, value)` for each
+    // timer that came due, in order of expiry. A timer is disarmed before its
+    // callback runs. The callback may add, remove, schedule or cancel any
+    // timer, including its own. A due timer that an earlier callback cancels
+    // or re-arms does not fire.
+    template <typename F>
+    void advance(Clock::time_point now, F&& expire) {
+        uint64_t target = tick_of(now, false);
+        while (now_ < target) {
+            if (armed_ == 0) {
+                now_ = target;   // nothing to cascade or fire on the way
+                return;
+            }
+            ++now_;
+            // Higher levels first, so a timer cascading from level 2 lands in
+            // level 1 before that level's slot for this tick is cascaded too.
+            for (size_t level = LEVELS - 1; level > 0; --level) {
+                if ((now_ & ((uint64_t{1} << (level * BITS)) - 1)) == 0) {
+                    cascade(level * SLOTS + digit(now_, level));
+                }
+            }
+            fire(digit(now_, 0), expire);
+        }
+    }
+
+    size_t size() const { return size_; }
+    size_t armed() const { return armed_; }
+    Clock::duration tick() const { return tick_; }
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t FIRING = UINT32_MAX - 1;   // slot of a due timer whose callback has not run yet
+    static constexpr size_t BITS = 6;
+    static constexpr size_t SLOTS = size_t{1} << BITS;
+    static constexpr size_t LEVELS = 4;   // 2^24 ticks: over 19 days at 100 ms a tick
+
+    struct Node {
+        T value{};
+        uint64_t expiry = 0;     // in ticks since origin_
+        uint32_t prev = NONE;
+        uint32_t next = NONE;    // next in the slot, or in the free list once removed
+        uint32_t slot = NONE;    // NONE while not armed
+        uint32_t generation = 0;
+    };
+
+    Clock::duration tick_;
+    Clock::time_point origin_;
+    uint64_t now_ = 0;   // last tick processed
+    std::vector<Node> nodes_;
+    std::array<uint32_t, LEVELS * SLOTS> heads_;
+    std::vector<uint32_t> due_;   // scratch for fire(), reused
+    uint32_t free_head_ = NONE;
+    size_t size_ = 0;
+    size_t armed_ = 0;
+
+    static size_t digit(uint64_t tick, size_t level) {
+        return static_cast<size_t>(tick >> (level * BITS)) & (SLOTS - 1);
+    }
+
+    uint64_t tick_of(Clock::time_point when, bool round_up = true) const {
+        if (when <= origin_) return 0;
+        auto elapsed = (when - origin_).count();
+        auto ticks = elapsed / tick_.count();
+        if (round_up && elapsed % tick_.count() != 0) ++ticks;
+        return static_cast<uint64_t>(ticks);
+    }
+
+    // Slot for an expiry no earlier than now_. Timers beyond the top level's
+    // reach wait in the top slot visited next and are placed again from there.
+    size_t slot_for(uint64_t expiry) const {
+        if (expiry <= now_) return digit(now_, 0);
+        size_t level = (static_cast<size_t>(std::bit_width(expiry ^ now_)) - 1) / BITS;
+        if (level >= LEVELS) return (LEVELS - 1) * SLOTS + (digit(now_, LEVELS - 1) + 1) % SLOTS;
+        return level * SLOTS + digit(expiry, level);
+    }
+
+    void link(uint32_t index) {
+        Node& node = nodes_[index];
+        auto slot = static_cast<uint32_t>(slot_for(node.expiry));
+        node.slot = slot;
+        node.prev = NONE;
+        node.next = heads_[slot];
+        if (node.next != NONE) nodes_[node.next].prev = index;
+        heads_[slot] = index;
+    }
+
+    void unlink(uint32_t index) {
+        Node& node = nodes_[index];
+        if (node.slot == NONE) return;
+        if (node.slot != FIRING) {
+            if (node.prev != NONE) {
+                nodes_[node.prev].next = node.next;
+            } else {
+                heads_[node.slot] = node.next;
+            }
+            if (node.next != NONE) nodes_[node.next].prev = node.prev;
+        }
+        node.slot = NONE;
+        --armed_;
+    }
+
+    // Places every timer of a higher-level slot again, now that the wheel
+    // has reached it; each lands on a lower level.
+    void cascade(size_t slot) {
+        uint32_t index = std::exchange(heads_[slot], NONE);
+        while (index != NONE) {
+            uint32_t next = nodes_[index].next;
+            link(index);
+            index = next;
+        }
+    }
+
+    // Timers are taken out of the slot before any callback runs, so the
+    // callbacks are free to change the wheel.
+    template <typename F>
+    void fire(size_t slot, F& expire) {
+        due_.clear();
+        for (uint32_t index = std::exchange(heads_[slot], NONE); index != NONE; index = nodes_[index].next) {
+            nodes_[index].slot = FIRING;
+            due_.push_back(index);
+        }
+        for (uint32_t index : due_) {
+            Node& node = nodes_[index];
+            if (node.slot != FIRING) continue;   // cancelled or re-armed by an earlier callback
+            node.slot = NONE;
+            --armed_;
+            Handle handle{index, node.generation};
+            T value = node.value;   // the callback may add timers and move nodes_
+            expire(handle, value);
+        }
+    }
+};